@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "tap-ctl.h"
+
+static int
+tap_ctl_stats_image(const int id, const int minor, int image,
+		    tapdisk_message_stats_t *stats)
+{
+	int err;
+	tapdisk_message_t message;
+
+	memset(&message, 0, sizeof(message));
+	message.type = TAPDISK_MESSAGE_STATS;
+	message.cookie = minor;
+	message.u.stats.image = image;
+
+	err = tap_ctl_connect_send_and_receive(id, &message, 5);
+	if (err)
+		return err;
+
+	if (message.type == TAPDISK_MESSAGE_STATS_RSP) {
+		*stats = message.u.stats;
+		stats->text[sizeof(stats->text) - 1] = '\0';
+	} else if (message.type == TAPDISK_MESSAGE_ERROR)
+		err = message.u.response.error;
+	else {
+		err = EINVAL;
+		EPRINTF("got unexpected result '%s' from %d\n",
+			tapdisk_message_name(message.type), id);
+	}
+
+	return err;
+}
+
+int
+tap_ctl_stats(const int id, const int minor, FILE *stream)
+{
+	tapdisk_message_stats_t stats;
+	int image, err;
+
+	image = 0;
+	do {
+		err = tap_ctl_stats_image(id, minor, image, &stats);
+		if (err)
+			return err;
+
+		fprintf(stream, "%d: %s\n", image, stats.text);
+	} while (++image < stats.images);
+
+	return 0;
+}
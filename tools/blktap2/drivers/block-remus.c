@@ -14,7 +14,12 @@
  *
  * The driver determines whether it is the client or server by attempting
  * to bind to the replication address. If the address is not local,
- * the driver acts as client.
+ * the driver acts as client.  The address is given as host:port, with
+ * an optional ":lz4" to have the client compress what it sends.
+ *
+ * The client does not wait for the network on each write: it gathers
+ * writes into batches, and sends them from the event loop while the
+ * guest runs.  A checkpoint only has to wait for the last batch.
  *
  * The following messages are defined for the replication stream:
  * 1. write request
@@ -29,6 +34,14 @@
  * After a commit request, the client must wait for a competion message:
  * 4. completion
  *    "done"      4
+ * 5. batch of write requests
+ *    "wbat"      4
+ *    flags       4 (1: payload is an lz4 block)
+ *    raw_len     4
+ *    len         4
+ *    payload     (len), holding raw_len bytes of num_sectors, sector and
+ *                buffer records as in a write request
+ * Current clients only send batches; the server still accepts "wreq".
  */
 
 /* due to architectural choices in tapdisk, block-buffer is forced to
@@ -40,6 +53,7 @@
 #include "hashtable.h"
 #include "hashtable_itr.h"
 #include "hashtable_utility.h"
+#include "../../../xen/include/xen/lz4.h"
 
 #include <errno.h>
 #include <inttypes.h>
@@ -64,6 +78,16 @@
 /* connect retry timeout (seconds) */
 #define REMUS_CONNRETRY_TIMEOUT 10
 
+/* send timeout (seconds): event timeouts are whole seconds, so round up */
+#define REMUS_SEND_TIMEOUT ((HEARTBEAT_MS + 999) / 1000 + 1)
+
+/* a batch is queued for sending once it holds this much */
+#define REMUS_BATCH_SIZE (256 << 10)
+/* the largest batch a server accepts */
+#define REMUS_BATCH_MAX (16 << 20)
+/* past this much unsent data, writes wait for the network */
+#define REMUS_QUEUE_MAX (64 << 20)
+
 #define RPRINTF(_f, _a...) syslog (LOG_DEBUG, "remus: " _f, ## _a)
 
 enum tdremus_mode {
@@ -143,6 +167,34 @@ struct ramdisk_write_cbdata {
 
 typedef void (*queue_rw_t) (td_driver_t *driver, td_request_t treq);
 
+/* a message waiting to go out on the replication stream */
+struct remus_frame {
+	struct remus_frame *next;
+	size_t len;
+	size_t sent;
+	int commit;
+	char data[0];
+};
+
+/* the client's side of the replication stream */
+struct sendqueue {
+	/* write records gathered since the last batch was queued */
+	char* batch;
+	size_t batch_len;
+	size_t batch_size;
+
+	/* frames not yet sent in full, and the bytes left in them */
+	struct remus_frame *head;
+	struct remus_frame *tail;
+	size_t queued;
+
+	/* write event on the stream, registered while frames are queued */
+	event_id_t id;
+
+	int compress;
+	void* lz4_wrkmem;
+};
+
 /* poll_fd type for blktap2 fd system. taken from block_log.c */
 typedef struct poll_fd {
 	int        fd;
@@ -171,6 +223,9 @@ struct tdremus_state {
 	/* queue write requests, batch-replicate at submit */
 	struct req_ring write_ring;
 
+	/* replicated writes on their way to the backup */
+	struct sendqueue sendq;
+
 	/* ramdisk data*/
 	struct ramdisk ramdisk;
 
@@ -192,6 +247,12 @@ typedef struct tdremus_wire {
 #define TDREMUS_COMMIT "creq"
 #define TDREMUS_DONE "done"
 #define TDREMUS_FAIL "fail"
+#define TDREMUS_BATCH "wbat"
+
+#define TDREMUS_BATCH_LZ4 0x1
+
+/* num_sectors and sector, ahead of the data of a write request */
+#define TDREMUS_WREQ_HDR (sizeof(uint32_t) + sizeof(uint64_t))
 
 /* primary read/write functions */
 static void primary_queue_read(td_driver_t *driver, td_request_t treq);
@@ -728,8 +789,29 @@ static int mwrite(int fd, void* buf, size_t len)
 }
 
 
+/* drop whatever has not been sent */
+static void sendq_reset(struct sendqueue *q)
+{
+	struct remus_frame *f;
+
+	if (q->id >= 0) {
+		tapdisk_server_unregister_event(q->id);
+		q->id = -1;
+	}
+
+	while ((f = q->head)) {
+		q->head = f->next;
+		free(f);
+	}
+	q->tail = NULL;
+	q->queued = 0;
+	q->batch_len = 0;
+}
+
 static void inline close_stream_fd(struct tdremus_state *s)
 {
+	sendq_reset(&s->sendq);
+
 	/* XXX: -2 is magic. replace with macro perhaps? */
 	tapdisk_server_unregister_event(s->stream_fd.id);
 	close(s->stream_fd.fd);
@@ -740,6 +822,206 @@ static void inline close_stream_fd(struct tdremus_state *s)
 static void remus_client_event(event_id_t, char mode, void *private);
 static void remus_connect_event(event_id_t id, char mode, void *private);
 static void remus_retry_connect_event(event_id_t id, char mode, void *private);
+static void remus_send_event(event_id_t id, char mode, void *private);
+
+static void sendq_append(struct sendqueue *q, struct remus_frame *f)
+{
+	f->next = NULL;
+	f->sent = 0;
+	if (q->tail)
+		q->tail->next = f;
+	else
+		q->head = f;
+	q->tail = f;
+	q->queued += f->len;
+}
+
+/* add a write request to the batch being gathered */
+static int sendq_add_write(struct sendqueue *q, uint64_t sector,
+			   uint32_t sectors, const char *buf, size_t len)
+{
+	size_t need = q->batch_len + TDREMUS_WREQ_HDR + len;
+	char *p;
+
+	if (need > q->batch_size) {
+		size_t size = MAX(need, REMUS_BATCH_SIZE);
+
+		if (!(p = realloc(q->batch, size))) {
+			RPRINTF("error allocating batch of %zu bytes\n", size);
+			return -1;
+		}
+		q->batch = p;
+		q->batch_size = size;
+	}
+
+	p = q->batch + q->batch_len;
+	memcpy(p, &sectors, sizeof(sectors));
+	memcpy(p + sizeof(sectors), &sector, sizeof(sector));
+	memcpy(p + TDREMUS_WREQ_HDR, buf, len);
+	q->batch_len = need;
+
+	return 0;
+}
+
+/* queue the gathered writes as one batch, compressed if that helps */
+static int sendq_seal_batch(struct sendqueue *q)
+{
+	struct remus_frame *f;
+	uint32_t hdr[3];
+	size_t hlen = strlen(TDREMUS_BATCH) + sizeof(hdr);
+	size_t len = q->batch_len;
+	char *payload;
+
+	if (!q->batch_len)
+		return 0;
+
+	f = malloc(sizeof(*f) + hlen +
+		   (q->compress ? lz4_compressbound(len) : len));
+	if (!f) {
+		RPRINTF("error allocating batch frame\n");
+		return -1;
+	}
+	payload = f->data + hlen;
+
+	hdr[0] = 0;
+	if (q->compress &&
+	    !lz4_compress((unsigned char *)q->batch, q->batch_len,
+			  (unsigned char *)payload, &len, q->lz4_wrkmem) &&
+	    len < q->batch_len)
+		hdr[0] = TDREMUS_BATCH_LZ4;
+	else {
+		len = q->batch_len;
+		memcpy(payload, q->batch, len);
+	}
+	hdr[1] = q->batch_len;
+	hdr[2] = len;
+
+	memcpy(f->data, TDREMUS_BATCH, strlen(TDREMUS_BATCH));
+	memcpy(f->data + strlen(TDREMUS_BATCH), hdr, sizeof(hdr));
+	f->len = hlen + len;
+	f->commit = 0;
+	sendq_append(q, f);
+	q->batch_len = 0;
+
+	return 0;
+}
+
+static int sendq_add_commit(struct sendqueue *q)
+{
+	struct remus_frame *f;
+
+	if (!(f = malloc(sizeof(*f) + strlen(TDREMUS_COMMIT)))) {
+		RPRINTF("error allocating commit frame\n");
+		return -1;
+	}
+	memcpy(f->data, TDREMUS_COMMIT, strlen(TDREMUS_COMMIT));
+	f->len = strlen(TDREMUS_COMMIT);
+	f->commit = 1;
+	sendq_append(q, f);
+
+	return 0;
+}
+
+/* send what the socket takes now, and have the event loop send the rest */
+static int sendq_kick(struct tdremus_state *s)
+{
+	struct sendqueue *q = &s->sendq;
+	struct remus_frame *f;
+	event_id_t id;
+	ssize_t rc;
+
+	while ((f = q->head)) {
+		rc = write(s->stream_fd.fd, f->data + f->sent, f->len - f->sent);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			RPRINTF("error during write: %s\n", strerror(errno));
+			return -1;
+		}
+		f->sent += rc;
+		q->queued -= rc;
+		if (f->sent < f->len)
+			break;
+
+		q->head = f->next;
+		if (!q->head)
+			q->tail = NULL;
+		free(f);
+	}
+
+	if (q->head && q->id < 0) {
+		id = tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD |
+						   SCHEDULER_POLL_TIMEOUT,
+						   s->stream_fd.fd,
+						   REMUS_SEND_TIMEOUT,
+						   remus_send_event, s);
+		if (id < 0) {
+			RPRINTF("error registering send event handler: %s\n",
+				strerror(-id));
+			return -1;
+		}
+		q->id = id;
+	} else if (!q->head && q->id >= 0) {
+		tapdisk_server_unregister_event(q->id);
+		q->id = -1;
+	}
+
+	return 0;
+}
+
+/* too much is waiting for the network: wait for it, as mwrite() would */
+static int sendq_drain(struct tdremus_state *s)
+{
+	struct sendqueue *q = &s->sendq;
+	struct remus_frame *f;
+
+	while ((f = q->head)) {
+		if (mwrite(s->stream_fd.fd, f->data + f->sent,
+			   f->len - f->sent) < 0)
+			return -1;
+		q->queued -= f->len - f->sent;
+		q->head = f->next;
+		if (!q->head)
+			q->tail = NULL;
+		free(f);
+	}
+
+	return sendq_kick(s);
+}
+
+/* the stream is broken: give up on replication */
+static void remus_send_failed(struct tdremus_state *s)
+{
+	struct remus_frame *f;
+	int commit = 0;
+
+	for (f = s->sendq.head; f; f = f->next)
+		commit |= f->commit;
+
+	RPRINTF("replication failed, switching to unprotected mode\n");
+	close_stream_fd(s);
+	switch_mode(s->tdremus_driver, mode_unprotected);
+
+	/* tell whoever asked for the checkpoint that it did not make it */
+	if (commit)
+		ctl_respond(s, TDREMUS_FAIL);
+}
+
+static void remus_send_event(event_id_t id, char mode, void *private)
+{
+	struct tdremus_state *s = (struct tdremus_state *)private;
+
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		RPRINTF("time out during write\n");
+		remus_send_failed(s);
+		return;
+	}
+
+	if (sendq_kick(s))
+		remus_send_failed(s);
+}
 
 static int primary_do_connect(struct tdremus_state *state)
 {
@@ -834,20 +1116,16 @@ static void primary_queue_read(td_driver_t *driver, td_request_t treq)
 	td_forward_request(treq);
 }
 
-/* TODO:
- * The primary uses mwrite() to write the contents of a write request to the
- * backup. This effectively blocks until all data has been copied into a system
- * buffer or a timeout has occured. We may wish to instead use tapdisk's
- * nonblocking i/o interface, tapdisk_server_register_event(), to set timeouts
- * and write data in an asynchronous fashion.
+/* The primary copies the contents of a write request into the current batch
+ * and passes the request on straight away: the backup only applies writes at
+ * a checkpoint, so they do not need to reach it any sooner. Full batches are
+ * sent by the event loop as the socket allows; only when too much is queued
+ * does a write wait for the network.
  */
 static void primary_queue_write(td_driver_t *driver, td_request_t treq)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
-
-	char header[sizeof(uint32_t) + sizeof(uint64_t)];
-	uint32_t *sectors = (uint32_t *)header;
-	uint64_t *sector = (uint64_t *)(header + sizeof(uint32_t));
+	struct sendqueue *q = &s->sendq;
 
 	// RPRINTF("write: stream_fd.fd: %d\n", s->stream_fd.fd);
 
@@ -856,16 +1134,18 @@ static void primary_queue_write(td_driver_t *driver, td_request_t treq)
 		RPRINTF("connecting to backup...\n");
 		primary_blocking_connect(s);
 	}
-
-	*sectors = treq.secs;
-	*sector = treq.sec;
-
-	if (mwrite(s->stream_fd.fd, TDREMUS_WRITE, strlen(TDREMUS_WRITE)) < 0)
+	if (s->stream_fd.fd < 0)
 		goto fail;
-	if (mwrite(s->stream_fd.fd, header, sizeof(header)) < 0)
+
+	if (sendq_add_write(q, treq.sec, treq.secs, treq.buf,
+			    treq.secs * driver->info.sector_size) < 0)
 		goto fail;
 
-	if (mwrite(s->stream_fd.fd, treq.buf, treq.secs * driver->info.sector_size) < 0)
+	if (q->batch_len >= REMUS_BATCH_SIZE)
+		if (sendq_seal_batch(q) < 0 || sendq_kick(s) < 0)
+			goto fail;
+
+	if (q->queued > REMUS_QUEUE_MAX && sendq_drain(s) < 0)
 		goto fail;
 
 	td_forward_request(treq);
@@ -889,8 +1169,14 @@ static int client_flush(td_driver_t *driver)
 	if (s->stream_fd.fd == -1)
 		/* connection not yet established, nothing to flush */
 		return 0;
+	if (s->stream_fd.fd < 0)
+		/* connection lost, the checkpoint cannot be replicated */
+		return -1;
 
-	if (mwrite(s->stream_fd.fd, TDREMUS_COMMIT, strlen(TDREMUS_COMMIT)) < 0) {
+	/* the checkpoint is acknowledged once the backup has everything */
+	if (sendq_seal_batch(&s->sendq) < 0 ||
+	    sendq_add_commit(&s->sendq) < 0 ||
+	    sendq_kick(s) < 0) {
 		RPRINTF("error flushing output");
 		close_stream_fd(s);
 		return -1;
@@ -917,6 +1203,12 @@ static int primary_start(td_driver_t *driver)
 
 	RPRINTF("activating client mode\n");
 
+	if (s->sendq.compress && !s->sendq.lz4_wrkmem &&
+	    !(s->sendq.lz4_wrkmem = malloc(LZ4_MEM_COMPRESS))) {
+		RPRINTF("error allocating compression state\n");
+		return -1;
+	}
+
 	tapdisk_remus.td_queue_read = primary_queue_read;
 	tapdisk_remus.td_queue_write = primary_queue_write;
 	s->queue_flush = client_flush;
@@ -1237,6 +1529,84 @@ static int server_do_wreq(td_driver_t *driver)
 	return -1;
 }
 
+static int server_do_bwreq(td_driver_t *driver)
+{
+	struct tdremus_state *s = (struct tdremus_state *)driver->data;
+	char *payload = NULL, *batch = NULL;
+	size_t raw_len, len, out_len, off, rec_len;
+	uint32_t hdr[3], sectors;
+	uint64_t sector;
+
+	if (mread(s->stream_fd.fd, hdr, sizeof(hdr)) < 0)
+		goto err;
+
+	raw_len = hdr[1];
+	len = hdr[2];
+	if ((hdr[0] & ~TDREMUS_BATCH_LZ4) || raw_len > REMUS_BATCH_MAX ||
+	    len > (hdr[0] ? lz4_compressbound(raw_len) : raw_len) ||
+	    (!hdr[0] && len != raw_len)) {
+		RPRINTF("bad batch: flags %#x, %zu bytes in %zu\n",
+			hdr[0], raw_len, len);
+		goto err;
+	}
+
+	if (!(payload = malloc(len))) {
+		RPRINTF("error allocating batch of %zu bytes\n", len);
+		goto err;
+	}
+	if (mread(s->stream_fd.fd, payload, len) < 0)
+		goto err;
+
+	if (hdr[0] & TDREMUS_BATCH_LZ4) {
+		if (!(batch = malloc(raw_len))) {
+			RPRINTF("error allocating batch of %zu bytes\n", raw_len);
+			goto err;
+		}
+		out_len = raw_len;
+		if (lz4_decompress_unknownoutputsize((unsigned char *)payload,
+						     len, (unsigned char *)batch,
+						     &out_len) ||
+		    out_len != raw_len) {
+			RPRINTF("corrupt compressed batch\n");
+			goto err;
+		}
+		free(payload);
+		payload = NULL;
+	} else {
+		batch = payload;
+		payload = NULL;
+	}
+
+	for (off = 0; off < raw_len; off += rec_len) {
+		if (raw_len - off < TDREMUS_WREQ_HDR)
+			goto short_batch;
+		memcpy(&sectors, batch + off, sizeof(sectors));
+		memcpy(&sector, batch + off + sizeof(sectors), sizeof(sector));
+		rec_len = TDREMUS_WREQ_HDR +
+			(size_t)sectors * driver->info.sector_size;
+		if (rec_len > raw_len - off)
+			goto short_batch;
+
+		if (ramdisk_write(&s->ramdisk, sector, sectors,
+				  batch + off + TDREMUS_WREQ_HDR) < 0)
+			goto err;
+	}
+
+	free(batch);
+	return 0;
+
+ short_batch:
+	RPRINTF("batch ends inside a write request at %zu/%zu\n", off, raw_len);
+ err:
+	/* should start failover */
+	RPRINTF("backup batch request error\n");
+	free(payload);
+	free(batch);
+	close_stream_fd(s);
+
+	return -1;
+}
+
 static int server_do_sreq(td_driver_t *driver)
 {
 	/*
@@ -1284,7 +1654,9 @@ static void remus_server_event(event_id_t id, char mode, void *private)
 
 	req[4] = '\0';
 
-	if (!strcmp(req, TDREMUS_WRITE))
+	if (!strcmp(req, TDREMUS_BATCH))
+		server_do_bwreq(driver);
+	else if (!strcmp(req, TDREMUS_WRITE))
 		server_do_wreq(driver);
 	else if (!strcmp(req, TDREMUS_SUBMIT))
 		server_do_sreq(driver);
@@ -1392,6 +1764,7 @@ static int get_args(td_driver_t *driver, const char* name)
 	struct tdremus_state *state = (struct tdremus_state *)driver->data;
 	char* host;
 	char* port;
+	char* opt;
 //  char* driver_str;
 //  char* parent;
 //  int type;
@@ -1420,7 +1793,22 @@ static int get_args(td_driver_t *driver, const char* name)
 	}
 	port++;
 
-	if ((gai_status = getaddrinfo(host, port, &gai_hints, &servinfo)) != 0) {
+	if ((opt = strchr(port, ':'))) {
+		if (strcmp(opt + 1, "lz4")) {
+			RPRINTF("unknown option %s\n", opt + 1);
+			return -EINVAL;
+		}
+		state->sendq.compress = 1;
+		if (!(port = strndup(port, opt - port))) {
+			RPRINTF("unable to allocate port\n");
+			return -ENOMEM;
+		}
+	}
+
+	gai_status = getaddrinfo(host, port, &gai_hints, &servinfo);
+	if (opt)
+		free(port);
+	if (gai_status != 0) {
 		RPRINTF("getaddrinfo error: %s\n", gai_strerror(gai_status));
 		return -ENOENT;
 	}
@@ -1650,6 +2038,7 @@ static int tdremus_open(td_driver_t *driver, const char *name,
 	s->stream_fd.fd = -1;
 	s->ctl_fd.fd = -1;
 	s->msg_fd.fd = -1;
+	s->sendq.id = -1;
 
 	/* TODO: this is only needed so that the server can send writes down
 	 * the driver stack from the stream_fd event handler */
@@ -1702,6 +2091,13 @@ static int tdremus_close(td_driver_t *driver)
 	if (s->stream_fd.fd >= 0)
 		close_stream_fd(s);
 
+	sendq_reset(&s->sendq);
+	free(s->sendq.batch);
+	s->sendq.batch = NULL;
+	s->sendq.batch_size = 0;
+	free(s->sendq.lz4_wrkmem);
+	s->sendq.lz4_wrkmem = NULL;
+
 	ctl_close(driver);
 
 	return 0;
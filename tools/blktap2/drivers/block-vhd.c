@@ -59,6 +59,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
+#include "tapdisk-shmcache.h"
 
 unsigned int SPB;
 
@@ -109,11 +110,10 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               32        /* minimum, in bitmaps */
+#define VHD_CACHE_MEM                (8 << 20) /* default bitmap cache size */
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
-#define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
 #define VHD_OP_BAT_WRITE             0
 #define VHD_OP_DATA_READ             1
@@ -148,6 +148,7 @@ unsigned int SPB;
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
 #define VHD_FLAG_REQ_QUEUED          4
 #define VHD_FLAG_REQ_FINISHED        8
+#define VHD_FLAG_REQ_SHMCACHE        16
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
@@ -191,13 +192,18 @@ struct vhd_bat_state {
 	struct vhd_request        req;         /* for writing bat table */
 	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
+	char                     *fullmap;     /* blocks seen to be full, for
+						* read-only images without a
+						* batmap */
 };
 
 struct vhd_bitmap {
 	u32                       blk;
-	u64                       seqno;       /* lru sequence number */
 	vhd_flag_t                status;
 
+	struct vhd_bitmap        *hnext;       /* bitmap hash chain */
+	struct list_head          lru;         /* on bm_lru or bm_free */
+
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
 	char                     *shadow;      /* in-memory bitmap changes are 
@@ -227,13 +233,35 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
 
-	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	/*
+	 * Bitmap cache: cached bitmaps are hashed by block and kept on
+	 * bm_lru, least recently used first.  Bitmaps are allocated on
+	 * demand, up to bm_max; bm_free holds ones not caching a block.
+	 */
+	struct vhd_bitmap       **bm_hash;
+	u32                       bm_hash_mask;
+	struct list_head          bm_lru;
+	struct list_head          bm_free;
+	u32                       bm_count;
+	u32                       bm_max;
+
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_full_hits;
+	uint64_t                  bm_evictions;
+
+	/*
+	 * Read-only images share data pages with other tapdisks through
+	 * the host-wide shmcache, keyed by footer uuid, the file's
+	 * identity and mtime, and its write generation.
+	 */
+	int                       shm;
+	tapdisk_shmcache_key_t    shm_key;
+	uint64_t                  shm_hits;
+	uint64_t                  shm_misses;
+	uint64_t                  shm_fills;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -318,15 +346,18 @@ set_batmap(struct vhd_state *s, uint32_t blk)
 	if (s->bat.batmap.map) {
 		vhd_batmap_set(&s->vhd, &s->bat.batmap, blk);
 		DBG(TLOG_DBG, "block 0x%x completely full\n", blk);
-	}
+	} else if (s->bat.fullmap)
+		s->bat.fullmap[blk >> 3] |= 1 << (blk & 7);
 }
 
 static inline int
 test_batmap(struct vhd_state *s, uint32_t blk)
 {
-	if (!s->bat.batmap.map)
-		return 0;
-	return vhd_batmap_test(&s->vhd, &s->bat.batmap, blk);
+	if (s->bat.batmap.map)
+		return vhd_batmap_test(&s->vhd, &s->bat.batmap, blk);
+	if (s->bat.fullmap)
+		return s->bat.fullmap[blk >> 3] & (1 << (blk & 7));
+	return 0;
 }
 
 static int
@@ -392,6 +423,7 @@ vhd_free_bat(struct vhd_state *s)
 	free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
 	free(s->bat.bat_buf);
+	free(s->bat.fullmap);
 	memset(&s->bat, 0, sizeof(struct vhd_bat));
 }
 
@@ -436,6 +468,20 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
+	/*
+	 * Nothing can be written to a read-only image, so a block once
+	 * seen full stays full.  Remember them when there is no batmap,
+	 * so that their bitmaps need not be cached or read again.
+	 */
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) &&
+	    !s->bat.batmap.map) {
+		s->bat.fullmap = calloc(1, (s->bat.bat.entries + 7) >> 3);
+		if (!s->bat.fullmap) {
+			err = -ENOMEM;
+			goto fail;
+		}
+	}
+
 	err = posix_memalign((void **)&s->bat.bat_buf,
 			     VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
 	if (err) {
@@ -450,59 +496,81 @@ fail:
 	return err;
 }
 
+static void
+__free_vhd_bitmap(struct vhd_bitmap *bm)
+{
+	free(bm->map);
+	free(bm->shadow);
+	free(bm);
+}
+
 static void
 vhd_free_bitmap_cache(struct vhd_state *s)
 {
-	int i;
-	struct vhd_bitmap *bm;
+	struct vhd_bitmap *bm, *tmp;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
-	}
+	if (!s->bm_hash)
+		return;
+
+	list_for_each_entry_safe(bm, tmp, &s->bm_lru, lru)
+		__free_vhd_bitmap(bm);
+	list_for_each_entry_safe(bm, tmp, &s->bm_free, lru)
+		__free_vhd_bitmap(bm);
+
+	free(s->bm_hash);
+	s->bm_hash  = NULL;
+	s->bm_count = 0;
+}
+
+/*
+ * The cache holds as many bitmaps as fit in TAPDISK2_VHD_CACHE_MB
+ * megabytes (VHD_CACHE_MEM by default), but no more than the image
+ * has blocks and no fewer than VHD_CACHE_SIZE.
+ */
+static u32
+vhd_bitmap_cache_size(struct vhd_state *s)
+{
+	const char *env;
+	uint64_t mem, per_bm;
+	u32 max;
+
+	mem = VHD_CACHE_MEM;
+	env = getenv("TAPDISK2_VHD_CACHE_MB");
+	if (env)
+		mem = strtoull(env, NULL, 10) << 20;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	per_bm = sizeof(struct vhd_bitmap) + sizeof(struct vhd_bitmap *) +
+		2 * vhd_sectors_to_bytes(s->bm_secs);
+	max    = MIN(mem / per_bm, s->bat.bat.entries);
+
+	return MAX(max, VHD_CACHE_SIZE);
 }
 
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
-	int i, err, map_size;
-	struct vhd_bitmap *bm;
-
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	u32 size;
 
-	s->bm_lru        = 0;
-	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	INIT_LIST_HEAD(&s->bm_lru);
+	INIT_LIST_HEAD(&s->bm_free);
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
+	s->bm_count     = 0;
+	s->bm_max       = vhd_bitmap_cache_size(s);
+	s->bm_hits      = 0;
+	s->bm_misses    = 0;
+	s->bm_full_hits = 0;
+	s->bm_evictions = 0;
 
-		err = posix_memalign((void **)&bm->map, 512, map_size);
-		if (err) {
-			bm->map = NULL;
-			goto fail;
-		}
+	for (size = 1; size < s->bm_max; size <<= 1)
+		;
 
-		err = posix_memalign((void **)&bm->shadow, 512, map_size);
-		if (err) {
-			bm->shadow = NULL;
-			goto fail;
-		}
+	s->bm_hash = calloc(size, sizeof(struct vhd_bitmap *));
+	if (!s->bm_hash)
+		return -ENOMEM;
 
-		memset(bm->map, 0, map_size);
-		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
-	}
+	s->bm_hash_mask = size - 1;
 
 	return 0;
-
-fail:
-	vhd_free_bitmap_cache(s);
-	return err;
 }
 
 static int
@@ -593,6 +661,33 @@ vhd_log_open(struct vhd_state *s)
 		allocated, full, s->next_db);
 }
 
+
+/*
+ * The key must change whenever the image may have: the footer timestamp
+ * only records creation, so add the file's identity and mtime, and the
+ * generation libvhd bumps on every read-write open and close.
+ */
+static void
+vhd_shmcache_open(struct vhd_state *s)
+{
+	struct stat st;
+
+	if (fstat(s->vhd.fd, &st))
+		return;
+
+	if (tapdisk_shmcache_attach())
+		return;
+
+	memset(&s->shm_key, 0, sizeof(s->shm_key));
+	memcpy(s->shm_key.id, &s->vhd.footer.uuid, sizeof(s->shm_key.id));
+	s->shm_key.dev   = st.st_dev;
+	s->shm_key.ino   = st.st_ino;
+	s->shm_key.mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL +
+		st.st_mtim.tv_nsec;
+	s->shm_key.gen   = vhd_generation(&s->vhd);
+	s->shm           = 1;
+}
+
 static int
 __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 {
@@ -642,6 +737,10 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 
 	SPB = s->spb;
 
+	if (test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY) &&
+	    !test_vhd_flag(flags, VHD_FLAG_OPEN_QUERY))
+		vhd_shmcache_open(s);
+
 	s->vreq_free_count = VHD_REQS_DATA;
 	for (i = 0; i < VHD_REQS_DATA; i++)
 		s->vreq_free[i] = s->vreq_list + i;
@@ -757,6 +856,8 @@ _vhd_close(td_driver_t *driver)
 	}
 
  free:
+	if (s->shm)
+		tapdisk_shmcache_detach();
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
@@ -958,8 +1059,8 @@ static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
+	bm->hnext  = NULL;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
 	clear_req_list(&bm->waiting);
@@ -968,17 +1069,20 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline struct vhd_bitmap **
+bitmap_bucket(struct vhd_state *s, uint32_t block)
+{
+	return &s->bm_hash[block & s->bm_hash_mask];
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	for (bm = *bitmap_bucket(s, block); bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
@@ -1030,40 +1134,80 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 	return 1;
 }
 
+static void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pprev;
+
+	for (pprev = bitmap_bucket(s, bm->blk); *pprev; pprev = &(*pprev)->hnext)
+		if (*pprev == bm) {
+			*pprev = bm->hnext;
+			break;
+		}
+
+	bm->hnext = NULL;
+	list_del(&bm->lru);
+}
+
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	u64 seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
+	list_for_each_entry(bm, &s->bm_lru, lru)
+		if (!bitmap_locked(bm)) {
+			ASSERT(!bitmap_in_use(bm));
+			unhash_bitmap(s, bm);
+			s->bm_evictions++;
+			return bm;
 		}
-	}
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
-	}
+	return NULL;
+}
 
-	return  lru;
+static struct vhd_bitmap *
+new_vhd_bitmap(struct vhd_state *s)
+{
+	struct vhd_bitmap *bm;
+	int map_size;
+
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
+
+	bm = calloc(1, sizeof(*bm));
+	if (!bm)
+		return NULL;
+
+	if (posix_memalign((void **)&bm->map, 512, map_size))
+		goto fail;
+
+	if (posix_memalign((void **)&bm->shadow, 512, map_size))
+		goto fail;
+
+	INIT_LIST_HEAD(&bm->lru);
+	s->bm_count++;
+
+	return bm;
+
+fail:
+	free(bm->map);
+	free(bm);
+	return NULL;
 }
 
 static int
 alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 {
-	struct vhd_bitmap *bm;
+	struct vhd_bitmap *bm = NULL;
 	
 	*bitmap = NULL;
 
-	if (s->bm_free_count > 0) {
-		bm = s->bitmap_free[--s->bm_free_count];
-	} else {
+	if (!list_empty(&s->bm_free)) {
+		bm = list_entry(s->bm_free.next, struct vhd_bitmap, lru);
+		list_del(&bm->lru);
+	} else if (s->bm_count < s->bm_max)
+		bm = new_vhd_bitmap(s);
+
+	if (!bm) {
 		bm = remove_lru_bitmap(s);
 		if (!bm)
 			return -EBUSY;
@@ -1076,63 +1220,34 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_del(&bm->lru);
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **bucket = bitmap_bucket(s, bm->blk);
+
+	ASSERT(!get_bitmap(s, bm->blk));
 
-	ASSERT(0);
+	bm->hnext = *bucket;
+	*bucket   = bm;
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(get_bitmap(s, bm->blk) == bm);
 
-	s->bitmap[i] = NULL;
-	s->bitmap_free[s->bm_free_count++] = bm;
+	unhash_bitmap(s, bm);
+	list_add_tail(&bm->lru, &s->bm_free);
 }
 
 static int
@@ -1164,14 +1279,17 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 
 	if (test_batmap(s, blk)) {
 		DBG(TLOG_DBG, "batmap set for 0x%04x\n", blk);
+		s->bm_full_hits++;
 		return VHD_BM_BIT_SET;
 	}
 
 	bm = get_bitmap(s, blk);
-	if (!bm)
+	if (!bm) {
+		s->bm_misses++;
 		return VHD_BM_NOT_CACHED;
+	}
 
-	/* bump lru count */
+	s->bm_hits++;
 	touch_bitmap(s, bm);
 
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
@@ -1670,6 +1788,50 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	return 0;
 }
 
+#define VHD_SHM_SECS (TAPDISK_SHMCACHE_PAGE_SIZE >> VHD_SECTOR_SHIFT)
+
+/*
+ * The caller has checked that @treq is allocated in this image: the
+ * cache is shared between layers, and a sector that is clear here must
+ * still be forwarded to the parent.  Returns the number of leading
+ * sectors of @treq copied from the cache.
+ */
+static int
+vhd_shmcache_read(struct vhd_state *s, td_request_t treq)
+{
+	int secs;
+
+	if (!s->shm || treq.sec % VHD_SHM_SECS)
+		return 0;
+
+	for (secs = 0; secs + VHD_SHM_SECS <= treq.secs; secs += VHD_SHM_SECS)
+		if (tapdisk_shmcache_read(&s->shm_key,
+					  (treq.sec + secs) / VHD_SHM_SECS,
+					  treq.buf + vhd_sectors_to_bytes(secs)))
+			break;
+
+	s->shm_hits += secs / VHD_SHM_SECS;
+	if (secs + VHD_SHM_SECS <= treq.secs)
+		s->shm_misses++;
+	return secs;
+}
+
+static void
+vhd_shmcache_write(struct vhd_state *s, td_request_t treq)
+{
+	uint64_t sec, end;
+
+	sec = (treq.sec + VHD_SHM_SECS - 1) / VHD_SHM_SECS * VHD_SHM_SECS;
+	end = treq.sec + treq.secs;
+
+	for (; sec + VHD_SHM_SECS <= end; sec += VHD_SHM_SECS) {
+		s->shm_fills++;
+		tapdisk_shmcache_write(&s->shm_key, sec / VHD_SHM_SECS,
+				       treq.buf +
+				       vhd_sectors_to_bytes(sec - treq.sec));
+	}
+}
+
 static void
 vhd_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -1679,7 +1841,7 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
 	while (treq.secs) {
-		int err;
+		int err, secs;
 		td_request_t clone;
 
 		err   = 0;
@@ -1702,7 +1864,15 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 
 		case VHD_BM_BIT_SET:
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 1);
-			err = schedule_data_read(s, clone, 0);
+			secs = vhd_shmcache_read(s, clone);
+			if (secs) {
+				clone.secs = secs;
+				td_complete_request(clone, 0);
+				break;
+			}
+
+			err = schedule_data_read(s, clone, s->shm ?
+						 VHD_FLAG_REQ_SHMCACHE : 0);
 			if (err)
 				goto fail;
 			break;
@@ -2082,6 +2252,10 @@ finish_bitmap_read(struct vhd_request *req)
 	if (!req->error) {
 		memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
 
+		if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) &&
+		    bitmap_full(s, bm))
+			set_batmap(s, blk);
+
 		while (r) {
 			struct vhd_request tmp;
 
@@ -2143,6 +2317,10 @@ finish_data_read(struct vhd_request *req)
 
 	DBG(TLOG_DBG, "lsec 0x%08"PRIx64", blk: 0x%04"PRIx64"\n", 
 	    req->treq.sec, req->treq.sec / s->spb);
+
+	if (!req->error && test_vhd_flag(req->flags, VHD_FLAG_REQ_SHMCACHE))
+		vhd_shmcache_write(s, req->treq);
+
 	signal_completion(req, 0);
 }
 
@@ -2240,6 +2418,7 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2261,16 +2440,16 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: %u of %u, hits: %"PRIu64", misses: "
+	    "%"PRIu64", full: %"PRIu64", evictions: %"PRIu64"\n",
+	    s->bm_count, s->bm_max, s->bm_hits, s->bm_misses,
+	    s->bm_full_hits, s->bm_evictions);
+	i = 0;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -2290,10 +2469,16 @@ vhd_debug(td_driver_t *driver)
 			r = r->next;
 		}
 
+		/* only the interesting ones */
+		if (!bitmap_locked(bm) && !bitmap_in_use(bm)) {
+			i++;
+			continue;
+		}
+
 		DBG(TLOG_WARN, "%d: blk: 0x%04x, status: 0x%08x, q: %p, qnum: %d, w: %p, "
 		    "wnum: %d, locked: %d, in use: %d, tx: %p, tx_error: %d, "
 		    "started: %d, finished: %d, status: %u, reqs: %p, nreqs: %d\n",
-		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
+		    i++, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
 		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 	}
@@ -2308,6 +2493,31 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+int
+vhd_stats(td_driver_t *driver, char *buf, size_t size)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+	uint64_t lookups;
+	int n;
+
+	lookups = s->bm_hits + s->bm_misses + s->bm_full_hits;
+
+	n = snprintf(buf, size, "reads=%"PRIu64" writes=%"PRIu64" "
+			"bitmaps=%u/%u bm_hits=%"PRIu64" bm_misses=%"PRIu64" "
+			"bm_full=%"PRIu64" bm_evictions=%"PRIu64" "
+			"bm_hit_rate=%.1f%%",
+			s->reads, s->writes, s->bm_count, s->bm_max,
+			s->bm_hits, s->bm_misses, s->bm_full_hits,
+			s->bm_evictions, lookups ?
+			100.0 * (lookups - s->bm_misses) / lookups : 0.0);
+	if (s->shm && n >= 0 && n < size)
+		n += snprintf(buf + n, size - n, " shm_hits=%"PRIu64" "
+			      "shm_misses=%"PRIu64" shm_fills=%"PRIu64,
+			      s->shm_hits, s->shm_misses, s->shm_fills);
+
+	return n;
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2319,4 +2529,5 @@ struct tap_disk tapdisk_vhd = {
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
 };
@@ -56,6 +56,9 @@ opio_free(struct opioctx *ctx)
 	free(ctx->free_opios);
 	ctx->free_opios = NULL;
 
+	free(ctx->iovs);
+	ctx->iovs = NULL;
+
 	free(ctx->iocb_queue);
 	ctx->iocb_queue = NULL;
 
@@ -74,10 +77,11 @@ opio_init(struct opioctx *ctx, int num_iocbs)
 	ctx->free_opio_cnt = num_iocbs;
 	ctx->opios         = calloc(1, sizeof(struct opio) * num_iocbs);
 	ctx->free_opios    = calloc(1, sizeof(struct opio *) * num_iocbs);
+	ctx->iovs          = calloc(num_iocbs, sizeof(struct iovec) * OPIO_MAX_IOV);
 	ctx->iocb_queue    = calloc(1, sizeof(struct iocb *) * num_iocbs);
 	ctx->event_queue   = calloc(1, sizeof(struct io_event) * num_iocbs);
 
-	if (!ctx->opios || !ctx->free_opios ||
+	if (!ctx->opios || !ctx->free_opios || !ctx->iovs ||
 	    !ctx->iocb_queue || !ctx->event_queue)
 		goto fail;
 
@@ -111,9 +115,10 @@ restore_iocb(struct opio *op)
 {
 	struct iocb *io = op->iocb;
 
-	io->data        = op->data;
-	io->u.c.buf     = op->buf;
-	io->u.c.nbytes  = op->nbytes;
+	io->data           = op->data;
+	io->aio_lio_opcode = op->opcode;
+	io->u.c.buf        = op->buf;
+	io->u.c.nbytes     = op->nbytes;
 }
 
 static inline int
@@ -127,23 +132,30 @@ iocb_optimized(struct opioctx *ctx, struct iocb *io)
 }
 
 static inline int
-contiguous_sectors(struct iocb *l, struct iocb *r)
+iocb_vectored(struct opioctx *ctx, struct iocb *io)
+{
+	return (iocb_optimized(ctx, io) && ((struct opio *)io->data)->iov);
+}
+
+static inline unsigned long
+iocb_bytes(struct opioctx *ctx, struct iocb *io)
 {
-	return (l->u.c.offset + l->u.c.nbytes == r->u.c.offset);
+	if (iocb_vectored(ctx, io))
+		return ((struct opio *)io->data)->vbytes;
+
+	return io->u.c.nbytes;
 }
 
 static inline int
-contiguous_buffers(struct iocb *l, struct iocb *r)
+contiguous_sectors(struct opioctx *ctx, struct iocb *l, struct iocb *r)
 {
-	return (l->u.c.buf + l->u.c.nbytes == r->u.c.buf);
+	return (l->u.c.offset + iocb_bytes(ctx, l) == r->u.c.offset);
 }
 
 static inline int
-contiguous_iocbs(struct iocb *l, struct iocb *r)
+contiguous_buffers(struct iocb *l, struct iocb *r)
 {
-	return ((l->aio_fildes == r->aio_fildes) &&
-		contiguous_sectors(l, r) &&
-		contiguous_buffers(l, r));
+	return (l->u.c.buf + l->u.c.nbytes == r->u.c.buf);
 }
 
 static inline void
@@ -165,6 +177,7 @@ opio_iocb_init(struct opioctx *ctx, struct iocb *io)
 	op->nbytes = io->u.c.nbytes;
 	op->offset = io->u.c.offset;
 	op->data   = io->data;
+	op->opcode = io->aio_lio_opcode;
 	op->iocb   = io;
 	io->data   = op;
 
@@ -198,20 +211,98 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 	opio->head        = ophead;
 	head->u.c.nbytes += io->u.c.nbytes;
 	ophead->list.tail = ophead->list.tail->next = opio;
+	ctx->merges++;
 	
 	return 0;
 }
 
+/*
+ * turn @head into a vectored iocb, its buffer being the first iovec
+ */
+static int
+vectorize(struct opioctx *ctx, struct iocb *head)
+{
+	struct opio *ophead;
+
+	ophead = opio_get(ctx, head);
+	if (!ophead)
+		return -ENOMEM;
+
+	ophead->iov    = ctx->iovs + (ophead - ctx->opios) * OPIO_MAX_IOV;
+	ophead->iov[0].iov_base = head->u.c.buf;
+	ophead->iov[0].iov_len  = head->u.c.nbytes;
+	ophead->niov   = 1;
+	ophead->vbytes = head->u.c.nbytes;
+
+	head->aio_lio_opcode = (ophead->opcode == IO_CMD_PWRITE ?
+				IO_CMD_PWRITEV : IO_CMD_PREADV);
+	head->u.c.buf        = ophead->iov;
+	head->u.c.nbytes     = 1;
+
+	return 0;
+}
+
+static int
+merge_vector(struct opioctx *ctx, struct iocb *head, struct iocb *io)
+{
+	int err;
+	struct iovec *last;
+	struct opio *ophead, *opio;
+
+	if (!iocb_vectored(ctx, head)) {
+		err = vectorize(ctx, head);
+		if (err)
+			return err;
+	}
+
+	ophead = (struct opio *)head->data;
+	last   = ophead->iov + ophead->niov - 1;
+
+	if ((char *)last->iov_base + last->iov_len != io->u.c.buf &&
+	    ophead->niov == OPIO_MAX_IOV)
+		return -EINVAL;
+
+	opio = opio_get(ctx, io);
+	if (!opio)
+		return -ENOMEM;
+
+	if ((char *)last->iov_base + last->iov_len != io->u.c.buf) {
+		last++;
+		last->iov_base = io->u.c.buf;
+		last->iov_len  = 0;
+		ophead->niov++;
+	}
+
+	last->iov_len    += io->u.c.nbytes;
+	ophead->vbytes   += io->u.c.nbytes;
+	head->u.c.nbytes  = ophead->niov;
+
+	opio->head        = ophead;
+	ophead->list.tail = ophead->list.tail->next = opio;
+	ctx->merges++;
+	ctx->vmerges++;
+
+	return 0;
+}
+
 static int
 merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
-	if (head->aio_lio_opcode != io->aio_lio_opcode)
+	short op;
+
+	op = (iocb_optimized(ctx, head) ?
+	      ((struct opio *)head->data)->opcode : head->aio_lio_opcode);
+	if (op != io->aio_lio_opcode)
 		return -EINVAL;
 
-	if (!contiguous_iocbs(head, io))
+	if (head->aio_fildes != io->aio_fildes ||
+	    !contiguous_sectors(ctx, head, io))
 		return -EINVAL;
 
-	return merge_tail(ctx, head, io);		
+	if (!iocb_vectored(ctx, head) && contiguous_buffers(head, io))
+		return merge_tail(ctx, head, io);
+
+	return merge_vector(ctx, head, io);
 }
 
 int
@@ -297,7 +388,7 @@ expand_event(struct opioctx *ctx,
 	ophead = (struct opio *)io->data;
 	op     = ophead;
 
-	if (event->res == io->u.c.nbytes)
+	if (event->res == iocb_bytes(ctx, io))
 		err = 0;
 	else if ((int)event->res < 0)
 		err = (int)event->res;
@@ -350,7 +441,8 @@ __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 {
 	char *type;
 
-	type = (io->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write");
+	type = (io->aio_lio_opcode == IO_CMD_PREAD ||
+		io->aio_lio_opcode == IO_CMD_PREADV ? "read" : "write");
 
 	DBG(ctx, "%soff: %08llx, nbytes: %04lx, buf: %p, type: %s, data: %08lx,"
 	    " optimized: %d\n", prefix, io->u.c.offset, io->u.c.nbytes, 
@@ -516,7 +608,8 @@ randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs)
 }
 
 static int
-simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
+simulate_io(struct opioctx *ctx,
+	    struct iocb **iocbs, struct io_event *events, int num_iocbs)
 {
 	int i, done;
 	struct iocb *io;
@@ -531,7 +624,7 @@ simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 		io      = iocbs[i];
 		ep      = &events[i];
 		ep->obj = io;
-		ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
+		ep->res = (random() % 10 < 8 ? iocb_bytes(ctx, io) : 0);
 	}
 
 	return done;
@@ -639,7 +732,7 @@ main(int argc, char **argv)
 			DBG(&ctx, "optimized remaining: %d\n", op_rem);
 
 			DBG(&ctx, "simulating\n");
-			num_events = simulate_io(ioqueue + op_done, events, op_rem);
+			num_events = simulate_io(&ctx, ioqueue + op_done, events, op_rem);
 			print_events(&ctx, events, num_events);
 
 			DBG(&ctx, "splitting %d\n", num_events);
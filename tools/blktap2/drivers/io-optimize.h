@@ -30,6 +30,14 @@
 #define __IO_OPTIMIZE_H__
 
 #include <libaio.h>
+#include <inttypes.h>
+#include <sys/uio.h>
+
+/*
+ * iocbs that are contiguous on disk but not in memory are merged into
+ * a vectored iocb of up to OPIO_MAX_IOV buffers.
+ */
+#define OPIO_MAX_IOV        64
 
 struct opio;
 
@@ -43,7 +51,11 @@ struct opio {
 	unsigned long       nbytes;
 	long long           offset;
 	void               *data;
+	short               opcode;
 	struct iocb        *iocb;
+	struct iovec       *iov;     /* head of a vectored merge */
+	int                 niov;
+	unsigned long       vbytes;
 	struct io_event     event;
 	struct opio        *head;
 	struct opio        *next;
@@ -55,6 +67,9 @@ struct opioctx {
 	int                 free_opio_cnt;
 	struct opio        *opios;
 	struct opio       **free_opios;
+	struct iovec       *iovs;
+	uint64_t            merges;   /* iocbs merged into another */
+	uint64_t            vmerges;  /* of which needed a vector */
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
 };
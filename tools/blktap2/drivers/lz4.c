@@ -0,0 +1,158 @@
+/* lz4.c
+ *
+ * LZ4 block compression for the Remus replication stream.
+ *
+ * Decompression is Xen's own decoder, built here the same way libxc builds
+ * it for kernel images.  Xen carries no compressor, so lz4_compress() is a
+ * small single pass greedy encoder writing the same block format: it trades
+ * some ratio for speed, which is the right way round for disk writes that
+ * have to go out before the next checkpoint.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define likely(a) a
+#define unlikely(a) a
+
+static inline uint_fast16_t le16_to_cpup(const unsigned char *buf)
+{
+	return buf[0] | (buf[1] << 8);
+}
+
+static inline uint_fast32_t le32_to_cpup(const unsigned char *buf)
+{
+	return le16_to_cpup(buf) | ((uint32_t)le16_to_cpup(buf + 2) << 16);
+}
+
+#include "../../../xen/include/xen/lz4.h"
+#include "../../../xen/common/decompress.h"
+#include "../../../xen/common/lz4/decompress.c"
+
+#define LZ4_HASH_LOG	12
+#define LZ4_SKIP	6
+/*
+ * The decoder's overflow check rejects a match shorter than its copy step,
+ * so never emit one.
+ */
+#define LZ4_MIN_MATCH	STEPSIZE
+
+static inline u32 read32(const u8 *p)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned int lz4_hash(u32 v)
+{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static u8 *lz4_put_length(u8 *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+/* Emit @lit literals from @anchor, then a match of @len at @offset if any. */
+static u8 *lz4_put_sequence(u8 *op, const u8 *anchor, size_t lit,
+			    unsigned int offset, size_t len)
+{
+	u8 *token = op++;
+
+	if (lit >= RUN_MASK) {
+		*token = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, lit - RUN_MASK);
+	} else
+		*token = lit << ML_BITS;
+
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	if (!len)
+		return op;
+
+	*op++ = offset;
+	*op++ = offset >> 8;
+
+	len -= MINMATCH;
+	if (len >= ML_MASK) {
+		*token |= ML_MASK;
+		op = lz4_put_length(op, len - ML_MASK);
+	} else
+		*token |= len;
+
+	return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		 unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	const u8 **table = wrkmem;
+	const u8 *ip = src, *anchor = src, *start, *ref;
+	const u8 *const iend = src + src_len;
+	/* the format wants the last match to start and end this far out */
+	const u8 *const mflimit = iend - MFLIMIT;
+	const u8 *const matchlimit = iend - LASTLITERALS;
+	u8 *op = dst;
+	size_t len;
+	u32 seq;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+
+	if (src_len < MINLENGTH)
+		goto last_literals;
+
+	while (ip < mflimit) {
+		unsigned int h;
+
+		seq = read32(ip);
+		h = lz4_hash(seq);
+		ref = table[h];
+		table[h] = ip;
+
+		if (!ref || ip - ref > MAX_DISTANCE || read32(ref) != seq) {
+			/* step up through incompressible data */
+			ip += 1 + ((ip - anchor) >> LZ4_SKIP);
+			continue;
+		}
+
+		start = ip;
+		len = MINMATCH;
+		while (ip + len < matchlimit && ip[len] == ref[len])
+			len++;
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+			len++;
+		}
+
+		if (len < LZ4_MIN_MATCH) {
+			ip = start + 1;
+			continue;
+		}
+
+		op = lz4_put_sequence(op, anchor, ip - anchor, ip - ref, len);
+		ip += len;
+		anchor = ip;
+	}
+
+ last_literals:
+	op = lz4_put_sequence(op, anchor, iend - anchor, 0, 0);
+	*dst_len = op - dst;
+
+	return 0;
+}
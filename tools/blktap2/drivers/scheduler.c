@@ -30,6 +30,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include "scheduler.h"
 #include "tapdisk-log.h"
@@ -37,6 +40,7 @@
 #define DBG(_f, _a...)               tlog_write(TLOG_DBG, _f, ##_a)
 
 #define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_EPOLL_EVENTS       64
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
@@ -44,11 +48,17 @@
 #define MIN(a, b)                   ((a) <= (b) ? (a) : (b))
 #define MAX(a, b)                   ((a) >= (b) ? (a) : (b))
 
-#define scheduler_for_each_event(s, event, tmp)	\
-	list_for_each_entry_safe(event, tmp, &(s)->events, next)
+/*
+ * Every event is on the list of all events, on the list of its fd if it
+ * polls one, and on the list of timers if it has a timeout.  A backend
+ * only reports which fds are ready; the events they wake are queued on
+ * s->ready, and run from there.  Unregistering an event takes it off
+ * s->ready as well, so callbacks may unregister any event.
+ */
 
 typedef struct event {
 	char                         mode;
+	char                         pending;
 	event_id_t                   id;
 
 	int                          fd;
@@ -59,50 +69,395 @@ typedef struct event {
 	void                        *private;
 
 	struct list_head             next;
+	struct list_head             fd_next;
+	struct list_head             timer_next;
+	struct list_head             ready_next;
 } event_t;
 
+struct scheduler_fd {
+	int                          fd;
+	char                         mode;    /* of all its events */
+	char                         polled;
+	struct list_head             events;
+};
+
+struct scheduler_backend {
+	const char                  *name;
+	int  (*init)                (scheduler_t *);
+	int  (*update)              (scheduler_t *, struct scheduler_fd *,
+				     char mode);
+	int  (*wait)                (scheduler_t *, int timeout_ms);
+};
+
 static void
-scheduler_prepare_events(scheduler_t *s)
+scheduler_queue_event(scheduler_t *s, event_t *event, char mode)
 {
-	int diff;
-	struct timeval now;
-	event_t *event, *tmp;
+	if (event->pending)
+		return;
+
+	event->pending = mode;
+	list_add_tail(&event->ready_next, &s->ready);
+}
+
+static void
+scheduler_fd_ready(scheduler_t *s, struct scheduler_fd *sfd, char revents)
+{
+	event_t *event;
+	char mode;
+
+	list_for_each_entry(event, &sfd->events, fd_next) {
+		mode = event->mode & revents;
+
+		if (mode & SCHEDULER_POLL_READ_FD)
+			mode = SCHEDULER_POLL_READ_FD;
+		else if (mode & SCHEDULER_POLL_WRITE_FD)
+			mode = SCHEDULER_POLL_WRITE_FD;
+		else if (mode & SCHEDULER_POLL_EXCEPT_FD)
+			mode = SCHEDULER_POLL_EXCEPT_FD;
+		else
+			continue;
+
+		scheduler_queue_event(s, event, mode);
+	}
+}
+
+/*
+ * select
+ */
+
+static int
+scheduler_select_wait(scheduler_t *s, int timeout_ms)
+{
+	struct scheduler_fd *sfd;
+	struct timeval tv;
+	int fd, ret;
+	char revents;
 
 	FD_ZERO(&s->read_fds);
 	FD_ZERO(&s->write_fds);
 	FD_ZERO(&s->except_fds);
 
-	s->max_fd  = 0;
-	s->timeout = SCHEDULER_MAX_TIMEOUT;
+	s->max_fd = 0;
 
-	gettimeofday(&now, NULL);
+	for (fd = 0; fd < s->nr_fds; fd++) {
+		sfd = s->fds[fd];
+		if (!sfd)
+			continue;
 
-	scheduler_for_each_event(s, event, tmp) {
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+		if (sfd->mode & SCHEDULER_POLL_READ_FD)
+			FD_SET(fd, &s->read_fds);
+		if (sfd->mode & SCHEDULER_POLL_WRITE_FD)
+			FD_SET(fd, &s->write_fds);
+		if (sfd->mode & SCHEDULER_POLL_EXCEPT_FD)
+			FD_SET(fd, &s->except_fds);
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+		s->max_fd = fd;
+	}
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	tv.tv_sec  = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+	ret = select(s->max_fd + 1, &s->read_fds,
+		     &s->write_fds, &s->except_fds, &tv);
+	if (ret <= 0)
+		return ret < 0 ? -errno : 0;
+
+	for (fd = 0; fd <= s->max_fd; fd++) {
+		sfd = s->fds[fd];
+		if (!sfd)
+			continue;
+
+		revents = 0;
+		if (FD_ISSET(fd, &s->read_fds))
+			revents |= SCHEDULER_POLL_READ_FD;
+		if (FD_ISSET(fd, &s->write_fds))
+			revents |= SCHEDULER_POLL_WRITE_FD;
+		if (FD_ISSET(fd, &s->except_fds))
+			revents |= SCHEDULER_POLL_EXCEPT_FD;
+
+		if (revents)
+			scheduler_fd_ready(s, sfd, revents);
+	}
+
+	return ret;
+}
+
+static const struct scheduler_backend scheduler_select = {
+	.name        = "select",
+	.init        = NULL,
+	.update      = NULL,
+	.wait        = scheduler_select_wait,
+};
+
+/*
+ * epoll: the kernel keeps the interest set, and only ready fds are
+ * returned, so a wait costs the same however many fds are registered.
+ */
+
+#ifdef __linux__
+
+static int
+scheduler_epoll_init(scheduler_t *s)
+{
+	int err;
+
+	s->epoll_events = calloc(SCHEDULER_EPOLL_EVENTS,
+				 sizeof(struct epoll_event));
+	if (!s->epoll_events)
+		return -ENOMEM;
+
+	s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epoll_fd < 0) {
+		err = -errno;
+		free(s->epoll_events);
+		s->epoll_events = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
+static int
+scheduler_epoll_update(scheduler_t *s, struct scheduler_fd *sfd, char mode)
+{
+	struct epoll_event ev;
+	int op, err;
+
+	if (!sfd->polled) {
+		if (!mode)
+			s->nr_unpolled--;
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	if (mode & SCHEDULER_POLL_READ_FD)
+		ev.events |= EPOLLIN;
+	if (mode & SCHEDULER_POLL_WRITE_FD)
+		ev.events |= EPOLLOUT;
+	if (mode & SCHEDULER_POLL_EXCEPT_FD)
+		ev.events |= EPOLLPRI;
+	ev.data.ptr = sfd;
+
+	if (!mode)
+		op = EPOLL_CTL_DEL;
+	else if (sfd->mode)
+		op = EPOLL_CTL_MOD;
+	else
+		op = EPOLL_CTL_ADD;
+
+	err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+
+	/* the fd may have been closed and reopened under its events */
+	if (err && errno == ENOENT && op == EPOLL_CTL_MOD) {
+		op  = EPOLL_CTL_ADD;
+		err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+	}
+
+	if (!err || op == EPOLL_CTL_DEL)
+		return 0;
+
+	/*
+	 * Regular files can't be polled.  select() reports them
+	 * ready all the time, so do the same.
+	 */
+	if (errno == EPERM && op == EPOLL_CTL_ADD) {
+		sfd->polled = 0;
+		s->nr_unpolled++;
+		return 0;
+	}
+
+	return -errno;
+}
+
+static int
+scheduler_epoll_wait(scheduler_t *s, int timeout_ms)
+{
+	struct epoll_event *ev;
+	struct scheduler_fd *sfd;
+	int i, fd, ret;
+	char revents;
+
+	if (s->nr_unpolled)
+		timeout_ms = 0;
+
+	ret = epoll_wait(s->epoll_fd, s->epoll_events,
+			 SCHEDULER_EPOLL_EVENTS, timeout_ms);
+	if (ret < 0)
+		return -errno;
+
+	for (i = 0; i < ret; i++) {
+		ev = &s->epoll_events[i];
+
+		revents = 0;
+		if (ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			revents |= SCHEDULER_POLL_READ_FD;
+		if (ev->events & (EPOLLOUT | EPOLLERR))
+			revents |= SCHEDULER_POLL_WRITE_FD;
+		if (ev->events & EPOLLPRI)
+			revents |= SCHEDULER_POLL_EXCEPT_FD;
+
+		scheduler_fd_ready(s, ev->data.ptr, revents);
+	}
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
+	if (s->nr_unpolled)
+		for (fd = 0; fd < s->nr_fds; fd++) {
+			sfd = s->fds[fd];
+			if (sfd && !sfd->polled) {
+				scheduler_fd_ready(s, sfd, sfd->mode);
+				ret++;
+			}
 		}
+
+	return ret;
+}
+
+static const struct scheduler_backend scheduler_epoll = {
+	.name        = "epoll",
+	.init        = scheduler_epoll_init,
+	.update      = scheduler_epoll_update,
+	.wait        = scheduler_epoll_wait,
+};
+
+#endif /* __linux__ */
+
+/* in order of preference */
+static const struct scheduler_backend *scheduler_backends[] = {
+#ifdef __linux__
+	&scheduler_epoll,
+#endif
+	&scheduler_select,
+};
+
+#define SCHEDULER_NR_BACKENDS					\
+	(sizeof(scheduler_backends) / sizeof(scheduler_backends[0]))
+
+static struct scheduler_fd *
+scheduler_get_fd(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *sfd, **fds;
+	int nr;
+
+	if (fd >= s->nr_fds) {
+		nr  = MAX(fd + 1, s->nr_fds * 2);
+		fds = realloc(s->fds, nr * sizeof(*fds));
+		if (!fds)
+			return NULL;
+
+		memset(fds + s->nr_fds, 0,
+		       (nr - s->nr_fds) * sizeof(*fds));
+		s->fds    = fds;
+		s->nr_fds = nr;
+	}
+
+	sfd = s->fds[fd];
+	if (!sfd) {
+		sfd = calloc(1, sizeof(*sfd));
+		if (!sfd)
+			return NULL;
+
+		sfd->fd     = fd;
+		sfd->polled = 1;
+		INIT_LIST_HEAD(&sfd->events);
+		s->fds[fd]  = sfd;
+	}
+
+	return sfd;
+}
+
+static void
+scheduler_put_fd(scheduler_t *s, struct scheduler_fd *sfd)
+{
+	if (!list_empty(&sfd->events))
+		return;
+
+	s->fds[sfd->fd] = NULL;
+	free(sfd);
+}
+
+static int
+scheduler_update_fd(scheduler_t *s, struct scheduler_fd *sfd, char mode)
+{
+	int err = 0;
+
+	if (s->backend->update)
+		err = s->backend->update(s, sfd, mode);
+	if (!err)
+		sfd->mode = mode;
+
+	return err;
+}
+
+static int
+scheduler_attach_fd(scheduler_t *s, event_t *event)
+{
+	struct scheduler_fd *sfd;
+	int err;
+
+	sfd = scheduler_get_fd(s, event->fd);
+	if (!sfd)
+		return -ENOMEM;
+
+	err = scheduler_update_fd(s, sfd,
+				  sfd->mode | (event->mode & SCHEDULER_POLL_FD));
+	if (err) {
+		scheduler_put_fd(s, sfd);
+		return err;
+	}
+
+	list_add_tail(&event->fd_next, &sfd->events);
+
+	return 0;
+}
+
+static void
+scheduler_detach_fd(scheduler_t *s, event_t *event)
+{
+	struct scheduler_fd *sfd = s->fds[event->fd];
+	event_t *e;
+	char mode = 0;
+
+	list_del(&event->fd_next);
+
+	list_for_each_entry(e, &sfd->events, fd_next)
+		mode |= e->mode & SCHEDULER_POLL_FD;
+
+	if (mode != sfd->mode)
+		scheduler_update_fd(s, sfd, mode);
+
+	scheduler_put_fd(s, sfd);
+}
+
+static int
+scheduler_prepare_timeout(scheduler_t *s)
+{
+	int diff, timeout;
+	struct timeval now;
+	event_t *event;
+
+	timeout = SCHEDULER_MAX_TIMEOUT;
+
+	gettimeofday(&now, NULL);
+
+	list_for_each_entry(event, &s->timers, timer_next) {
+		diff = event->deadline - now.tv_sec;
+		timeout = MIN(timeout, MAX(diff, 0));
 	}
 
-	s->timeout = MIN(s->timeout, s->max_timeout);
+	return MIN(timeout, s->max_timeout);
+}
+
+static void
+scheduler_queue_timers(scheduler_t *s)
+{
+	struct timeval now;
+	event_t *event;
+
+	gettimeofday(&now, NULL);
+
+	list_for_each_entry(event, &s->timers, timer_next)
+		if (event->deadline <= now.tv_sec)
+			scheduler_queue_event(s, event,
+					      SCHEDULER_POLL_TIMEOUT);
 }
 
 static void
@@ -120,43 +475,17 @@ scheduler_event_callback(event_t *event, char mode)
 static void
 scheduler_run_events(scheduler_t *s)
 {
-	struct timeval now;
-	event_t *event, *tmp;
-
-	gettimeofday(&now, NULL);
-
- again:
-	s->restart = 0;
-
-	scheduler_for_each_event(s, event, tmp) {
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_READ_FD);
-			goto next;
-		}
-
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_WRITE_FD);
-			goto next;
-		}
+	event_t *event;
+	char mode;
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_EXCEPT_FD);
-			goto next;
-		}
+	while (!list_empty(&s->ready)) {
+		event = list_entry(s->ready.next, event_t, ready_next);
+		list_del(&event->ready_next);
 
-		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
-		    (event->deadline <= now.tv_sec))
-		    scheduler_event_callback(event, SCHEDULER_POLL_TIMEOUT);
+		mode           = event->pending;
+		event->pending = 0;
 
-	next:
-		if (s->restart)
-			goto again;
+		scheduler_event_callback(event, mode);
 	}
 }
 
@@ -166,6 +495,7 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 {
 	event_t *event;
 	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -173,6 +503,9 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
 		return -EINVAL;
 
+	if ((mode & SCHEDULER_POLL_FD) && fd < 0)
+		return -EINVAL;
+
 	event = calloc(1, sizeof(event_t));
 	if (!event)
 		return -ENOMEM;
@@ -187,29 +520,50 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	event->deadline = now.tv_sec + timeout;
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = s->uuid++;
+
+	if (mode & SCHEDULER_POLL_FD) {
+		err = scheduler_attach_fd(s, event);
+		if (err) {
+			free(event);
+			return err;
+		}
+	}
+
+	event->id = s->uuid++;
 
 	if (!s->uuid)
 		s->uuid++;
 
 	list_add_tail(&event->next, &s->events);
 
+	if (mode & SCHEDULER_POLL_TIMEOUT)
+		list_add_tail(&event->timer_next, &s->timers);
+
 	return event->id;
 }
 
 void
 scheduler_unregister_event(scheduler_t *s, event_id_t id)
 {
-	event_t *event, *tmp;
+	event_t *event;
 
 	if (!id)
 		return;
 
-	scheduler_for_each_event(s, event, tmp)
+	list_for_each_entry(event, &s->events, next)
 		if (event->id == id) {
 			list_del(&event->next);
+
+			if (event->mode & SCHEDULER_POLL_TIMEOUT)
+				list_del(&event->timer_next);
+
+			if (event->mode & SCHEDULER_POLL_FD)
+				scheduler_detach_fd(s, event);
+
+			if (event->pending)
+				list_del(&event->ready_next);
+
 			free(event);
-			s->restart = 1;
 			break;
 		}
 }
@@ -221,45 +575,84 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 		s->max_timeout = MIN(s->max_timeout, timeout);
 }
 
+/*
+ * For sub-second deadlines; event timeouts stay in seconds.
+ */
+void
+scheduler_set_max_timeout_ms(scheduler_t *s, int timeout_ms)
+{
+	if (timeout_ms >= 0)
+		s->max_timeout_ms = MIN(s->max_timeout_ms, timeout_ms);
+}
+
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
 	int ret;
-	struct timeval tv;
 
-	scheduler_prepare_events(s);
+	s->timeout = scheduler_prepare_timeout(s);
 
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
+	DBG("timeout: %d, max_timeout: %d, max_timeout_ms: %d\n",
+	    s->timeout, s->max_timeout, s->max_timeout_ms);
 
-	DBG("timeout: %d, max_timeout: %d\n",
-	    s->timeout, s->max_timeout);
+	ret = s->backend->wait(s, MIN(s->timeout * 1000, s->max_timeout_ms));
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
-
-	s->restart     = 0;
-	s->timeout     = SCHEDULER_MAX_TIMEOUT;
-	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
+	s->timeout        = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout    = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout_ms = SCHEDULER_MAX_TIMEOUT * 1000;
 
 	if (ret < 0)
 		return ret;
 
+	scheduler_queue_timers(s);
 	scheduler_run_events(s);
 
 	return ret;
 }
 
+const char *
+scheduler_backend_name(scheduler_t *s)
+{
+	return s->backend->name;
+}
+
+/*
+ * The backend may be forced with TAPDISK2_SCHEDULER=<name>, e.g. to
+ * compare them; otherwise the first one which initializes is used.
+ */
 void
 scheduler_initialize(scheduler_t *s)
 {
+	const struct scheduler_backend *backend;
+	const char *name;
+	int i;
+
 	memset(s, 0, sizeof(scheduler_t));
 
-	s->uuid = 1;
+	s->uuid           = 1;
+	s->epoll_fd       = -1;
+	s->max_timeout_ms = SCHEDULER_MAX_TIMEOUT * 1000;
 
 	FD_ZERO(&s->read_fds);
 	FD_ZERO(&s->write_fds);
 	FD_ZERO(&s->except_fds);
 
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->timers);
+	INIT_LIST_HEAD(&s->ready);
+
+	s->backend = &scheduler_select;
+	name       = getenv("TAPDISK2_SCHEDULER");
+
+	for (i = 0; i < SCHEDULER_NR_BACKENDS; i++) {
+		backend = scheduler_backends[i];
+
+		if (name && strcmp(name, backend->name))
+			continue;
+
+		if (!backend->init || !backend->init(s)) {
+			s->backend = backend;
+			break;
+		}
+	}
 }
@@ -40,18 +40,34 @@
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct scheduler_fd;
+struct scheduler_backend;
+struct epoll_event;
+
 typedef struct scheduler {
+	const struct scheduler_backend *backend;
+
 	fd_set                       read_fds;
 	fd_set                       write_fds;
 	fd_set                       except_fds;
 
+	int                          epoll_fd;
+	struct epoll_event          *epoll_events;
+
+	/* per-fd state, indexed by fd */
+	struct scheduler_fd        **fds;
+	int                          nr_fds;
+	int                          nr_unpolled;
+
 	struct list_head             events;
+	struct list_head             timers;
+	struct list_head             ready;
 
 	int                          uuid;
 	int                          max_fd;
 	int                          timeout;
-	int                          restart;
 	int                          max_timeout;
+	int                          max_timeout_ms;
 } scheduler_t;
 
 void scheduler_initialize(scheduler_t *);
@@ -60,6 +76,8 @@ event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    event_cb_t cb, void *private);
 void scheduler_unregister_event(scheduler_t *,  event_id_t);
 void scheduler_set_max_timeout(scheduler_t *, int);
+void scheduler_set_max_timeout_ms(scheduler_t *, int);
 int scheduler_wait_for_events(scheduler_t *);
+const char *scheduler_backend_name(scheduler_t *);
 
 #endif
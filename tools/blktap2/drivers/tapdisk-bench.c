@@ -0,0 +1,422 @@
+/* tapdisk-bench.c
+ *
+ * Drive many VBDs in one tapdisk server and time the dataplane.
+ *
+ * Each VBD gets a pipe standing in for its blktap ring.  A few tokens
+ * hop between randomly chosen VBDs: a VBD woken by a token issues a
+ * batch of one page requests, and hands the token on when the batch
+ * completes.  Most VBDs are therefore idle at any time, as on a host
+ * with many quiet guests, and the time per request covers scheduler
+ * wake ups, request queueing and completion.
+ *
+ * Use a ram image to leave the disk out of it.  To compare backends, run
+ * it again with TAPDISK2_SCHEDULER=select|epoll or TAPDISK2_IO=uring.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "list.h"
+#include "scheduler.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-utils.h"
+
+#define POLL_READ                        0
+#define POLL_WRITE                       1
+
+struct tapdisk_bench;
+
+struct tapdisk_bench_vbd {
+	struct tapdisk_bench            *bench;
+	td_vbd_t                        *vbd;
+	int                              id;
+	int                              pipe[2];
+	event_id_t                       event_id;
+
+	int                              tokens;
+	int                              pending;
+	int                              set;
+};
+
+struct tapdisk_bench {
+	struct tapdisk_bench_vbd        *vbds;
+	int                              nr_vbds;
+	int                              depth;
+	int                              write;
+
+	uint64_t                         sectors;
+	uint64_t                         requests;
+	uint64_t                         issued;
+	uint64_t                         completed;
+	int                              tokens;
+	int                              live_tokens;
+	int                              err;
+
+	unsigned int                     seed;
+	void                            *buffers;
+	int                              stop_pipe[2];
+	event_id_t                       stop_event_id;
+};
+
+static void
+usage(const char *app, int err)
+{
+	printf("usage: %s <-n type:/path/to/image> [-v vbds] [-k tokens] "
+	       "[-d depth] [-r requests] [-w]\n", app);
+	exit(err);
+}
+
+static unsigned int
+tapdisk_bench_random(struct tapdisk_bench *b)
+{
+	b->seed = b->seed * 1103515245 + 12345;
+	return b->seed >> 8;
+}
+
+static void
+tapdisk_bench_poll_set(struct tapdisk_bench_vbd *v)
+{
+	char dummy = 0;
+
+	if (!v->set) {
+		write_exact(v->pipe[POLL_WRITE], &dummy, sizeof(dummy));
+		v->set = 1;
+	}
+}
+
+static void
+tapdisk_bench_kick(struct tapdisk_bench_vbd *v)
+{
+	v->tokens++;
+	tapdisk_bench_poll_set(v);
+}
+
+static void
+tapdisk_bench_issue(struct tapdisk_bench_vbd *v)
+{
+	struct tapdisk_bench *b = v->bench;
+	td_vbd_t *vbd = v->vbd;
+	int i, psize = getpagesize();
+	int secs = psize >> SECTOR_SHIFT;
+
+	v->tokens--;
+	v->pending = b->depth;
+
+	for (i = 0; i < b->depth; i++) {
+		td_vbd_request_t *vreq = vbd->request_list + i;
+		blkif_request_t *breq = &vreq->req;
+
+		assert(list_empty(&vreq->next));
+
+		memset(breq, 0, sizeof(*breq));
+		breq->id            = i;
+		breq->operation     = b->write ? BLKIF_OP_WRITE : BLKIF_OP_READ;
+		breq->sector_number = (tapdisk_bench_random(b) %
+				       (b->sectors / secs)) * secs;
+		breq->nr_segments   = 1;
+		breq->seg[0].first_sect = 0;
+		breq->seg[0].last_sect  = secs - 1;
+
+		vbd->received++;
+		vreq->vbd = vbd;
+		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
+	}
+
+	b->issued += b->depth;
+	tapdisk_vbd_issue_requests(vbd);
+}
+
+static void
+tapdisk_bench_event(event_id_t id, char mode, void *arg)
+{
+	struct tapdisk_bench_vbd *v = arg;
+	char dummy;
+
+	read_exact(v->pipe[POLL_READ], &dummy, sizeof(dummy));
+	v->set = 0;
+
+	if (!v->pending && v->tokens)
+		tapdisk_bench_issue(v);
+}
+
+static void
+tapdisk_bench_dequeue(void *arg, blkif_response_t *rsp)
+{
+	struct tapdisk_bench_vbd *v = arg;
+	struct tapdisk_bench *b = v->bench;
+	char dummy = 0;
+
+	if (rsp->status != BLKIF_RSP_OKAY)
+		b->err = EIO;
+
+	b->completed++;
+	if (--v->pending)
+		return;
+
+	/* pass the token on, or retire it */
+	if (b->issued < b->requests && !b->err)
+		tapdisk_bench_kick(b->vbds +
+				   tapdisk_bench_random(b) % b->nr_vbds);
+	else if (!--b->live_tokens)
+		write_exact(b->stop_pipe[POLL_WRITE], &dummy, sizeof(dummy));
+
+	/* the requests are only free once this callback returns */
+	if (v->tokens)
+		tapdisk_bench_poll_set(v);
+}
+
+static void
+tapdisk_bench_close_vbd(struct tapdisk_bench_vbd *v)
+{
+	if (v->event_id) {
+		tapdisk_server_unregister_event(v->event_id);
+		v->event_id = 0;
+	}
+
+	if (v->vbd) {
+		tapdisk_vbd_close_vdi(v->vbd);
+		tapdisk_server_remove_vbd(v->vbd);
+		free(v->vbd->name);
+		free(v->vbd);
+		v->vbd = NULL;
+	}
+
+	if (v->pipe[POLL_READ] != -1)
+		close(v->pipe[POLL_READ]);
+	if (v->pipe[POLL_WRITE] != -1)
+		close(v->pipe[POLL_WRITE]);
+	v->pipe[POLL_READ] = v->pipe[POLL_WRITE] = -1;
+}
+
+static void
+tapdisk_bench_close(struct tapdisk_bench *b)
+{
+	int i;
+
+	if (b->stop_event_id) {
+		tapdisk_server_unregister_event(b->stop_event_id);
+		b->stop_event_id = 0;
+	}
+
+	for (i = 0; i < b->nr_vbds; i++)
+		tapdisk_bench_close_vbd(b->vbds + i);
+}
+
+static void
+tapdisk_bench_stop(event_id_t id, char mode, void *arg)
+{
+	tapdisk_bench_close(arg);
+}
+
+static int
+tapdisk_bench_open_vbd(struct tapdisk_bench *b, struct tapdisk_bench_vbd *v,
+		       const char *params)
+{
+	image_t image;
+	int err;
+
+	v->bench = b;
+
+	err = pipe(v->pipe);
+	if (err)
+		return -errno;
+
+	err = tapdisk_vbd_initialize(v->id);
+	if (err)
+		return err;
+
+	v->vbd = tapdisk_server_get_vbd(v->id);
+	if (!v->vbd)
+		return -ENODEV;
+
+	tapdisk_vbd_set_callback(v->vbd, tapdisk_bench_dequeue, v);
+
+	/* open the image the way tapdisk-control does */
+	v->vbd->name = strdup(params);
+	if (!v->vbd->name)
+		return -ENOMEM;
+
+	err = tapdisk_vbd_parse_stack(v->vbd, params);
+	if (err)
+		return err;
+
+	err = tapdisk_vbd_open_stack(v->vbd, TAPDISK_STORAGE_TYPE_DEFAULT,
+				     b->write ? 0 : TD_OPEN_RDONLY);
+	if (err)
+		return err;
+
+	v->vbd->reopened = 1;
+	/* all VBDs share one set of buffers; their contents don't matter */
+	v->vbd->ring.vstart = (unsigned long)b->buffers;
+
+	err = tapdisk_vbd_get_image_info(v->vbd, &image);
+	if (err)
+		return err;
+	b->sectors = image.size;
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    v->pipe[POLL_READ], 0,
+					    tapdisk_bench_event, v);
+	if (err < 0)
+		return err;
+	v->event_id = err;
+
+	return 0;
+}
+
+static int
+tapdisk_bench_open(struct tapdisk_bench *b, const char *params)
+{
+	int i, err, psize = getpagesize();
+
+	if (b->depth > MAX_REQUESTS)
+		b->depth = MAX_REQUESTS;
+
+	b->vbds = calloc(b->nr_vbds, sizeof(*b->vbds));
+	if (!b->vbds)
+		return -ENOMEM;
+
+	for (i = 0; i < b->nr_vbds; i++) {
+		b->vbds[i].id = i;
+		b->vbds[i].pipe[POLL_READ] = b->vbds[i].pipe[POLL_WRITE] = -1;
+	}
+
+	err = posix_memalign(&b->buffers, psize,
+			     psize * BLKTAP_MMAP_REGION_SIZE);
+	if (err) {
+		b->buffers = NULL;
+		return -err;
+	}
+
+	err = tapdisk_server_initialize();
+	if (err)
+		return err;
+
+	for (i = 0; i < b->nr_vbds; i++) {
+		err = tapdisk_bench_open_vbd(b, b->vbds + i, params);
+		if (err) {
+			fprintf(stderr, "failed to open vbd %d: %d\n", i, err);
+			return err;
+		}
+	}
+
+	if (b->sectors < psize >> SECTOR_SHIFT) {
+		fprintf(stderr, "image too small\n");
+		return -EINVAL;
+	}
+
+	err = pipe(b->stop_pipe);
+	if (err)
+		return -errno;
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    b->stop_pipe[POLL_READ], 0,
+					    tapdisk_bench_stop, b);
+	if (err < 0)
+		return err;
+	b->stop_event_id = err;
+
+	return 0;
+}
+
+static double
+tapdisk_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, i, err;
+	const char *params;
+	struct tapdisk_bench bench;
+	double start, secs;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.nr_vbds  = 64;
+	bench.tokens   = 8;
+	bench.depth    = 8;
+	bench.requests = 1000000;
+	bench.seed     = 1;
+	bench.stop_pipe[POLL_READ] = bench.stop_pipe[POLL_WRITE] = -1;
+
+	err    = 0;
+	params = NULL;
+
+	while ((c = getopt(argc, argv, "n:v:k:d:r:wh")) != -1) {
+		switch (c) {
+		case 'n':
+			params = optarg;
+			break;
+		case 'v':
+			bench.nr_vbds = atoi(optarg);
+			break;
+		case 'k':
+			bench.tokens = atoi(optarg);
+			break;
+		case 'd':
+			bench.depth = atoi(optarg);
+			break;
+		case 'r':
+			bench.requests = strtoull(optarg, NULL, 10);
+			break;
+		case 'w':
+			bench.write = 1;
+			break;
+		default:
+			err = EINVAL;
+		case 'h':
+			usage(argv[0], err);
+		}
+	}
+
+	if (!params || bench.nr_vbds < 1 || bench.tokens < 1 ||
+	    bench.depth < 1)
+		usage(argv[0], EINVAL);
+
+	tapdisk_start_logging("tapdisk-bench");
+
+	err = tapdisk_bench_open(&bench, params);
+	if (err)
+		goto out;
+
+	start = tapdisk_bench_now();
+
+	bench.live_tokens = bench.tokens;
+	for (i = 0; i < bench.tokens; i++)
+		tapdisk_bench_kick(bench.vbds + i % bench.nr_vbds);
+
+	err = tapdisk_server_run();
+	if (err) {
+		fprintf(stderr, "failed to run server: %d\n", err);
+		goto out;
+	}
+
+	secs = tapdisk_bench_now() - start;
+	err  = bench.err;
+
+	printf("%d vbds, %d tokens, depth %d: %"PRIu64" requests in %.3fs, "
+	       "%.0f requests/s, %.2fus per request\n",
+	       bench.nr_vbds, bench.tokens, bench.depth, bench.completed, secs,
+	       bench.completed / secs, secs * 1e6 / bench.completed);
+
+out:
+	tapdisk_bench_close(&bench);
+	close(bench.stop_pipe[POLL_READ]);
+	close(bench.stop_pipe[POLL_WRITE]);
+	free(bench.vbds);
+	free(bench.buffers);
+	tapdisk_stop_logging();
+	return err;
+}
@@ -47,6 +47,7 @@
 #include "tapdisk-server.h"
 #include "tapdisk-message.h"
 #include "tapdisk-disktype.h"
+#include "tapdisk-driver.h"
 
 struct tapdisk_control {
 	char              *path;
@@ -576,6 +577,52 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
+static void
+tapdisk_control_stats(struct tapdisk_control_connection *connection,
+		      tapdisk_message_t *request)
+{
+	int n, err;
+	td_vbd_t *vbd;
+	td_image_t *image, *tmp, *found;
+	tapdisk_message_t response;
+
+	memset(&response, 0, sizeof(response));
+
+	response.type = TAPDISK_MESSAGE_STATS_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	n     = 0;
+	found = NULL;
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (n++ == request->u.stats.image)
+			found = image;
+
+	if (!found) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	response.u.stats.image  = request->u.stats.image;
+	response.u.stats.images = n;
+	tapdisk_driver_stats(found->driver, response.u.stats.text,
+			     sizeof(response.u.stats.text));
+	err = 0;
+
+out:
+	if (err) {
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.u.response.error = -err;
+	}
+	response.cookie = request->cookie;
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
 static void
 tapdisk_control_resume_vbd(struct tapdisk_control_connection *connection,
 			   tapdisk_message_t *request)
@@ -664,6 +711,8 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 		return tapdisk_control_resume_vbd(connection, &message);
 	case TAPDISK_MESSAGE_CLOSE:
 		return tapdisk_control_close_image(connection, &message);
+	case TAPDISK_MESSAGE_STATS:
+		return tapdisk_control_stats(connection, &message);
 	default: {
 		tapdisk_message_t response;
 	fail:
@@ -99,3 +99,12 @@ tapdisk_driver_debug(td_driver_t *driver)
 	if (driver->ops->td_debug)
 		driver->ops->td_debug(driver);
 }
+
+int
+tapdisk_driver_stats(td_driver_t *driver, char *buf, size_t size)
+{
+	if (!driver->ops->td_stats)
+		return snprintf(buf, size, "%s", driver->ops->disk_type);
+
+	return driver->ops->td_stats(driver, buf, size);
+}
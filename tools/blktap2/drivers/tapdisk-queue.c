@@ -44,6 +44,18 @@
 #include "libaio-compat.h"
 #include "atomicio.h"
 
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/* IORING_OP_READ/WRITE and IORING_REGISTER_PROBE came with Linux 5.6 */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+	defined(IO_URING_OP_SUPPORTED)
+#define TAPDISK_URING
+#endif
+
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
@@ -212,6 +224,16 @@ tapdisk_rwio_rw(const struct iocb *iocb)
 	size_t size   = iocb->u.c.nbytes;
 	ssize_t (*func)(int, void *, size_t) = 
 		(iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
+	ssize_t ret;
+
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_PREADV:
+		ret = preadv(fd, (struct iovec *)buf, size, off);
+		return (ret < 0 ? -errno : ret);
+	case IO_CMD_PWRITEV:
+		ret = pwritev(fd, (struct iovec *)buf, size, off);
+		return (ret < 0 ? -errno : ret);
+	}
 
 	if (lseek(fd, off, SEEK_SET) == (off_t)-1)
 		return -errno;
@@ -262,9 +284,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
 	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = NULL,
-	.tio_destroy = NULL,
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
 	.tio_submit  = tapdisk_rwio_submit
 };
 
@@ -547,6 +569,371 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef TAPDISK_URING
+/*
+ * io_uring: requests are written straight into a ring shared with the
+ * kernel and submitted with a single io_uring_enter() per batch.
+ * Completions are reaped from the completion ring, without a syscall;
+ * the eventfd only wakes up the scheduler.
+ */
+
+struct uring {
+	int                   ring_fd;
+
+	void                 *sq_ring;
+	size_t                sq_ring_size;
+	void                 *cq_ring;
+	size_t                cq_ring_size;
+	struct io_uring_sqe  *sqes;
+	size_t                sqes_size;
+
+	unsigned             *sq_head;
+	unsigned             *sq_tail;
+	unsigned             *sq_mask;
+	unsigned             *sq_array;
+	unsigned             *cq_head;
+	unsigned             *cq_tail;
+	unsigned             *cq_mask;
+	struct io_uring_cqe  *cqes;
+
+	struct io_event      *aio_events;
+
+	int                   event_fd;
+	int                   event_id;
+};
+
+static inline int
+__uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+__uring_enter(int fd, unsigned to_submit)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static inline int
+__uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *ring = queue->tio_data;
+
+	if (!ring)
+		return;
+
+	if (ring->event_id >= 0) {
+		tapdisk_server_unregister_event(ring->event_id);
+		ring->event_id = -1;
+	}
+
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+		ring->sqes = NULL;
+	}
+
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	ring->cq_ring = NULL;
+
+	if (ring->sq_ring) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		ring->sq_ring = NULL;
+	}
+
+	if (ring->ring_fd >= 0) {
+		close(ring->ring_fd);
+		ring->ring_fd = -1;
+	}
+
+	if (ring->event_fd >= 0) {
+		close(ring->event_fd);
+		ring->event_fd = -1;
+	}
+
+	free(ring->aio_events);
+	ring->aio_events = NULL;
+}
+
+static void *
+tapdisk_uring_mmap(struct uring *ring, size_t size, off_t off)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, ring->ring_fd, off);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static int
+tapdisk_uring_probe(struct uring *ring)
+{
+	struct io_uring_probe *probe;
+	size_t size;
+	int err;
+
+	size  = sizeof(*probe) + IORING_OP_LAST * sizeof(probe->ops[0]);
+	probe = calloc(1, size);
+	if (!probe)
+		return -ENOMEM;
+
+	err = __uring_register(ring->ring_fd, IORING_REGISTER_PROBE,
+			       probe, IORING_OP_LAST);
+	if (err)
+		err = -errno;
+	else if (probe->last_op < IORING_OP_WRITE ||
+		 !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+		 !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+		err = -EOPNOTSUPP;
+
+	free(probe);
+	return err;
+}
+
+static void tapdisk_uring_event(event_id_t, char, void *);
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *ring = queue->tio_data;
+	struct io_uring_params p;
+	int err;
+
+	ring->event_fd = -1;
+	ring->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+	ring->ring_fd = __uring_setup(qlen, &p);
+	if (ring->ring_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size    = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = tapdisk_uring_mmap(ring, ring->sq_ring_size,
+					   IORING_OFF_SQ_RING);
+	if (!ring->sq_ring) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = tapdisk_uring_mmap(ring, ring->cq_ring_size,
+						   IORING_OFF_CQ_RING);
+	if (!ring->cq_ring) {
+		err = -errno;
+		goto fail;
+	}
+
+	ring->sqes = tapdisk_uring_mmap(ring, ring->sqes_size,
+					IORING_OFF_SQES);
+	if (!ring->sqes) {
+		err = -errno;
+		goto fail;
+	}
+
+	ring->sq_head  = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail  = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask  = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head  = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail  = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask  = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes     = ring->cq_ring + p.cq_off.cqes;
+
+	err = tapdisk_uring_probe(ring);
+	if (err)
+		goto fail;
+
+	ring->event_fd = tapdisk_sys_eventfd(0);
+	if (ring->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = __uring_register(ring->ring_fd, IORING_REGISTER_EVENTFD,
+			       &ring->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	ring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      ring->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = ring->event_id;
+	if (err < 0)
+		goto fail;
+
+	ring->aio_events = calloc(p.cq_entries, sizeof(struct io_event));
+	if (!ring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *ring = queue->tio_data;
+	struct io_uring_cqe *cqe;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+	unsigned head, tail;
+	int i, ret, split;
+	uint64_t val;
+
+	read_exact(ring->event_fd, &val, sizeof(val));
+
+	ret  = 0;
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		cqe     = &ring->cqes[head & *ring->cq_mask];
+		ep      = ring->aio_events + ret++;
+		ep->obj = (struct iocb *)(unsigned long)cqe->user_data;
+		ep->res = cqe->res;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	split = io_split(&queue->opioctx, ring->aio_events, ret);
+	tapdisk_filter_events(queue->filter, ring->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = ring->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static inline int
+__uring_opcode(short opcode)
+{
+	switch (opcode) {
+	case IO_CMD_PWRITE:
+		return IORING_OP_WRITE;
+	case IO_CMD_PREADV:
+		return IORING_OP_READV;
+	case IO_CMD_PWRITEV:
+		return IORING_OP_WRITEV;
+	default:
+		return IORING_OP_READ;
+	}
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *ring = queue->tio_data;
+	struct io_uring_sqe *sqe;
+	struct iocb *iocb;
+	unsigned tail, idx;
+	int i, merged, submitted, err = 0;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	tail = *ring->sq_tail;
+
+	for (i = 0; i < merged; i++) {
+		iocb = queue->iocbs[i];
+		idx  = tail++ & *ring->sq_mask;
+		sqe  = &ring->sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode    = __uring_opcode(iocb->aio_lio_opcode);
+		sqe->fd        = iocb->aio_fildes;
+		sqe->addr      = (unsigned long)iocb->u.c.buf;
+		sqe->len       = iocb->u.c.nbytes;
+		sqe->off       = iocb->u.c.offset;
+		sqe->user_data = (unsigned long)iocb;
+
+		ring->sq_array[idx] = idx;
+	}
+
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	submitted = __uring_enter(ring->ring_fd, merged);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	/*
+	 * Without SQPOLL the kernel only consumes entries in
+	 * io_uring_enter(), so take back the ones it didn't: they
+	 * are failed below and must not be submitted later.
+	 */
+	if (submitted < merged)
+		__atomic_store_n(ring->sq_tail, tail - (merged - submitted),
+				 __ATOMIC_RELEASE);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static const struct tio td_tio_uring = {
+	.name        = "uring",
+	.data_size   = sizeof(struct uring),
+	.tio_setup   = tapdisk_uring_setup,
+	.tio_destroy = tapdisk_uring_destroy,
+	.tio_submit  = tapdisk_uring_submit,
+};
+#endif /* TAPDISK_URING */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +962,11 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef TAPDISK_URING
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -660,6 +1052,8 @@ tapdisk_debug_queue(struct tqueue *queue)
 	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64"\n",
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
+	WARN("merged: %"PRIu64", vectored: %"PRIu64"\n",
+	     queue->opioctx.merges, queue->opioctx.vmerges);
 
 	if (tiocb) {
 		WARN("deferred:\n");
@@ -96,6 +96,7 @@ struct tio {
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
 };
 
 /*
@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <signal.h>
 
@@ -45,6 +46,9 @@
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
 	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
 
+#define tapdisk_server_for_each_active_vbd(vbd, tmp)		        \
+	list_for_each_entry_safe(vbd, tmp, &server.active_vbds, active)
+
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
 {
@@ -92,9 +96,22 @@ tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	list_del_init(&vbd->active);
 	tapdisk_server_check_state();
 }
 
+/*
+ * The per-iteration passes below only visit vbds on the active list, so
+ * anything that gives an idle vbd work must put it there.  It comes off
+ * again once tapdisk_vbd_idle() says so.
+ */
+void
+tapdisk_server_activate_vbd(td_vbd_t *vbd)
+{
+	if (list_empty(&vbd->active))
+		list_add_tail(&vbd->active, &server.active_vbds);
+}
+
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
@@ -141,6 +158,12 @@ tapdisk_server_set_max_timeout(int seconds)
 	scheduler_set_max_timeout(&server.scheduler, seconds);
 }
 
+void
+tapdisk_server_set_max_timeout_ms(int ms)
+{
+	scheduler_set_max_timeout_ms(&server.scheduler, ms);
+}
+
 static void
 tapdisk_server_assert_locks(void)
 {
@@ -152,7 +175,7 @@ tapdisk_server_set_retry_timeout(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_server_for_each_active_vbd(vbd, tmp)
 		if (tapdisk_vbd_retry_needed(vbd)) {
 			tapdisk_server_set_max_timeout(TD_VBD_RETRY_INTERVAL);
 			return;
@@ -167,7 +190,7 @@ tapdisk_server_check_progress(void)
 
 	gettimeofday(&now, NULL);
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_server_for_each_active_vbd(vbd, tmp)
 		tapdisk_vbd_check_progress(vbd);
 }
 
@@ -183,17 +206,27 @@ tapdisk_server_kick_responses(void)
 	int n;
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_server_for_each_active_vbd(vbd, tmp)
 		tapdisk_vbd_kick(vbd);
 }
 
+/*
+ * Idle vbds are dropped here rather than in tapdisk_server_kick_responses(),
+ * where the kick may have closed and freed them.
+ */
 static void
 tapdisk_server_check_vbds(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_server_for_each_active_vbd(vbd, tmp) {
+		if (tapdisk_vbd_idle(vbd)) {
+			list_del_init(&vbd->active);
+			continue;
+		}
+
 		tapdisk_vbd_check_state(vbd);
+	}
 }
 
 static void
@@ -205,9 +238,25 @@ tapdisk_server_stop_vbds(void)
 		tapdisk_vbd_kill_queue(vbd);
 }
 
+/*
+ * TAPDISK2_IO=uring selects io_uring, where the kernel supports it;
+ * libaio remains the default.
+ */
 static int
 tapdisk_server_init_aio(void)
 {
+	const char *io = getenv("TAPDISK2_IO");
+	int err;
+
+	if (io && !strcmp(io, "uring")) {
+		err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_URING, NULL);
+		if (!err)
+			return 0;
+
+		DPRINTF("io_uring unavailable (%d), using libaio\n", err);
+	}
+
 	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
 				  TIO_DRV_LIO, NULL);
 }
@@ -282,8 +331,10 @@ tapdisk_server_init(void)
 {
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
+	INIT_LIST_HEAD(&server.active_vbds);
 
 	scheduler_initialize(&server.scheduler);
+	DPRINTF("scheduler: %s\n", scheduler_backend_name(&server.scheduler));
 
 	return 0;
 }
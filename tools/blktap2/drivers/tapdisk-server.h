@@ -40,6 +40,7 @@ struct list_head *tapdisk_server_get_all_vbds(void);
 td_vbd_t *tapdisk_server_get_vbd(td_uuid_t);
 void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
+void tapdisk_server_activate_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
 
@@ -48,6 +49,7 @@ void tapdisk_server_check_state(void);
 event_id_t tapdisk_server_register_event(char, int, int, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_set_max_timeout(int);
+void tapdisk_server_set_max_timeout_ms(int);
 
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(void);
@@ -60,6 +62,7 @@ void tapdisk_server_iterate(void);
 typedef struct tapdisk_server {
 	int                          run;
 	struct list_head             vbds;
+	struct list_head             active_vbds;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
 } tapdisk_server_t;
@@ -0,0 +1,345 @@
+/* 
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tapdisk.h"
+#include "tapdisk-shmcache.h"
+
+#define SHMCACHE_NAME                "/tapdisk2-shmcache"
+#define SHMCACHE_MAGIC               0x7464736d
+#define SHMCACHE_VERSION             2
+#define SHMCACHE_WAYS                8
+#define SHMCACHE_ATTACH_WAIT         1000 /* ms */
+
+/*
+ * Each slot is guarded by a sequence count: writers make it odd while
+ * they update the key and data; readers copy optimistically and treat
+ * a slot that changed under them as a miss.  A writer dying mid-update
+ * leaves its slot odd, which only costs that slot.
+ */
+struct shmcache_slot {
+	uint32_t                     seq;
+	uint32_t                     stamp;
+	uint32_t                     valid;
+	uint64_t                     page;
+	tapdisk_shmcache_key_t       key;
+};
+
+struct shmcache_header {
+	uint32_t                     magic;
+	uint32_t                     version;
+	uint64_t                     size;
+	uint32_t                     sets;
+	uint32_t                     ways;
+	uint64_t                     data;        /* offset of page array */
+	uint32_t                     clock;
+	uint32_t                     pad;
+	struct shmcache_slot         slots[0];
+};
+
+static struct {
+	int                          refs;
+	size_t                       size;
+	struct shmcache_header      *hdr;
+} shmcache;
+
+static inline char *
+shmcache_page(struct shmcache_header *hdr, uint32_t slot)
+{
+	return (char *)hdr + hdr->data +
+		((uint64_t)slot << TAPDISK_SHMCACHE_PAGE_SHIFT);
+}
+
+static inline struct shmcache_slot *
+shmcache_set(struct shmcache_header *hdr,
+	     const tapdisk_shmcache_key_t *key, uint64_t page)
+{
+	uint64_t h;
+	int i;
+
+	h = page * 0x9e3779b97f4a7c15ULL ^ key->gen;
+	for (i = 0; i < TAPDISK_SHMCACHE_ID_SIZE; i++)
+		h = (h ^ key->id[i]) * 0x100000001b3ULL;
+	h = (h ^ key->dev) * 0x100000001b3ULL;
+	h = (h ^ key->ino) * 0x100000001b3ULL;
+	h = (h ^ key->mtime) * 0x100000001b3ULL;
+	h ^= h >> 29;
+
+	return hdr->slots + (h & (hdr->sets - 1)) * hdr->ways;
+}
+
+static inline int
+shmcache_match(struct shmcache_slot *slot,
+	       const tapdisk_shmcache_key_t *key, uint64_t page)
+{
+	return (slot->valid && slot->page == page &&
+		slot->key.gen == key->gen && slot->key.ino == key->ino &&
+		slot->key.dev == key->dev && slot->key.mtime == key->mtime &&
+		!memcmp(slot->key.id, key->id, TAPDISK_SHMCACHE_ID_SIZE));
+}
+
+static void
+shmcache_init(struct shmcache_header *hdr, size_t size)
+{
+	uint64_t slots, sets;
+
+	slots = (size - sizeof(*hdr)) /
+		(sizeof(struct shmcache_slot) + TAPDISK_SHMCACHE_PAGE_SIZE);
+
+	sets = 1;
+	while (sets << 1 <= slots / SHMCACHE_WAYS)
+		sets <<= 1;
+
+	hdr->version = SHMCACHE_VERSION;
+	hdr->size    = size;
+	hdr->sets    = sets;
+	hdr->ways    = SHMCACHE_WAYS;
+	hdr->data    = sizeof(*hdr) +
+		sets * SHMCACHE_WAYS * sizeof(struct shmcache_slot);
+	hdr->data    = (hdr->data + TAPDISK_SHMCACHE_PAGE_SIZE - 1) &
+		~((uint64_t)TAPDISK_SHMCACHE_PAGE_SIZE - 1);
+
+	__atomic_store_n(&hdr->magic, SHMCACHE_MAGIC, __ATOMIC_RELEASE);
+}
+
+static int
+shmcache_wait(int fd, struct stat *st)
+{
+	int i;
+
+	for (i = 0; i < SHMCACHE_ATTACH_WAIT; i++) {
+		if (fstat(fd, st))
+			return -errno;
+		if (st->st_size)
+			return 0;
+		usleep(1000);
+	}
+
+	return -ETIMEDOUT;
+}
+
+int
+tapdisk_shmcache_attach(void)
+{
+	int i, fd, err, created;
+	struct shmcache_header *hdr;
+	struct stat st;
+	size_t size;
+	char *env;
+
+	if (shmcache.refs) {
+		shmcache.refs++;
+		return 0;
+	}
+
+	env = getenv("TAPDISK2_SHMCACHE_MB");
+	if (!env || atoi(env) <= 0)
+		return -ENOENT;
+
+	size    = (size_t)atoi(env) << 20;
+	created = 1;
+
+	fd = shm_open(SHMCACHE_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1 && errno == EEXIST) {
+		created = 0;
+		fd = shm_open(SHMCACHE_NAME, O_RDWR, 0);
+	}
+	if (fd == -1) {
+		err = -errno;
+		EPRINTF("opening %s: %d\n", SHMCACHE_NAME, err);
+		return err;
+	}
+
+	if (created) {
+		if (size < sizeof(*hdr) + SHMCACHE_WAYS *
+		    (sizeof(struct shmcache_slot) + TAPDISK_SHMCACHE_PAGE_SIZE) ||
+		    ftruncate(fd, size)) {
+			err = -EINVAL;
+			shm_unlink(SHMCACHE_NAME);
+			goto out;
+		}
+	} else {
+		err = shmcache_wait(fd, &st);
+		if (err)
+			goto out;
+		size = st.st_size;
+	}
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		err = -errno;
+		goto out;
+	}
+
+	if (created)
+		shmcache_init(hdr, size);
+	else {
+		for (i = 0; i < SHMCACHE_ATTACH_WAIT; i++) {
+			if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) ==
+			    SHMCACHE_MAGIC)
+				break;
+			usleep(1000);
+		}
+
+		if (hdr->magic != SHMCACHE_MAGIC ||
+		    hdr->version != SHMCACHE_VERSION || hdr->size != size) {
+			EPRINTF("%s: bad or stale segment\n", SHMCACHE_NAME);
+			/* let the next tapdisk start a new one */
+			if (hdr->magic == SHMCACHE_MAGIC &&
+			    hdr->version != SHMCACHE_VERSION)
+				shm_unlink(SHMCACHE_NAME);
+			munmap(hdr, size);
+			err = -EINVAL;
+			goto out;
+		}
+	}
+
+	DPRINTF("%s %s: %"PRIu64"MB, %u sets of %u pages\n",
+		created ? "created" : "attached to", SHMCACHE_NAME,
+		(uint64_t)size >> 20, hdr->sets, hdr->ways);
+
+	shmcache.hdr  = hdr;
+	shmcache.size = size;
+	shmcache.refs = 1;
+	err           = 0;
+
+out:
+	if (err)
+		EPRINTF("%s: shared cache disabled: %d\n", SHMCACHE_NAME, err);
+	close(fd);
+	return err;
+}
+
+void
+tapdisk_shmcache_detach(void)
+{
+	if (!shmcache.refs || --shmcache.refs)
+		return;
+
+	munmap(shmcache.hdr, shmcache.size);
+	shmcache.hdr  = NULL;
+	shmcache.size = 0;
+}
+
+int
+tapdisk_shmcache_read(const tapdisk_shmcache_key_t *key,
+		      uint64_t page, char *buf)
+{
+	struct shmcache_header *hdr = shmcache.hdr;
+	struct shmcache_slot *slot;
+	uint32_t seq;
+	int i;
+
+	if (!hdr)
+		return -ENOENT;
+
+	slot = shmcache_set(hdr, key, page);
+
+	for (i = 0; i < hdr->ways; i++, slot++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1 || !shmcache_match(slot, key, page))
+			continue;
+
+		memcpy(buf, shmcache_page(hdr, slot - hdr->slots),
+		       TAPDISK_SHMCACHE_PAGE_SIZE);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			return -ENOENT;
+
+		__atomic_store_n(&slot->stamp,
+				 __atomic_add_fetch(&hdr->clock, 1,
+						    __ATOMIC_RELAXED),
+				 __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+void
+tapdisk_shmcache_write(const tapdisk_shmcache_key_t *key,
+		       uint64_t page, const char *buf)
+{
+	struct shmcache_header *hdr = shmcache.hdr;
+	struct shmcache_slot *set, *slot, *victim;
+	uint32_t seq, now, age, oldest;
+	int i;
+
+	if (!hdr)
+		return;
+
+	set    = shmcache_set(hdr, key, page);
+	now    = __atomic_load_n(&hdr->clock, __ATOMIC_RELAXED);
+	victim = NULL;
+	oldest = 0;
+
+	for (i = 0; i < hdr->ways; i++) {
+		slot = set + i;
+
+		if (shmcache_match(slot, key, page))
+			return;
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) & 1)
+			continue;
+
+		age = slot->valid ? now - slot->stamp : ~0U;
+		if (!victim || age > oldest) {
+			victim = slot;
+			oldest = age;
+		}
+	}
+
+	if (!victim)
+		return;
+
+	seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+	if (seq & 1 ||
+	    !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	victim->valid = 0;
+
+	memcpy(shmcache_page(hdr, victim - hdr->slots), buf,
+	       TAPDISK_SHMCACHE_PAGE_SIZE);
+	victim->key   = *key;
+	victim->page  = page;
+	victim->stamp = __atomic_add_fetch(&hdr->clock, 1, __ATOMIC_RELAXED);
+	victim->valid = 1;
+
+	__atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,70 @@
+/* 
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef _TAPDISK_SHMCACHE_H_
+#define _TAPDISK_SHMCACHE_H_
+
+#include <inttypes.h>
+
+/*
+ * Host-wide page cache for immutable images, shared by all tapdisk
+ * processes through a POSIX shared memory segment.  Pages are keyed by
+ * the image: an id (e.g. the vhd uuid), the device, inode and
+ * modification time of its file, and a write generation bumped by every
+ * read-write open (see vhd_generation()), so that a changed image never
+ * matches pages cached before the change.  The page index within the
+ * image completes the key.
+ *
+ * The cache is disabled unless TAPDISK2_SHMCACHE_MB is set; the first
+ * tapdisk to attach creates the segment with that size, later ones
+ * attach to the segment as is.
+ */
+
+#define TAPDISK_SHMCACHE_PAGE_SHIFT  12
+#define TAPDISK_SHMCACHE_PAGE_SIZE   (1 << TAPDISK_SHMCACHE_PAGE_SHIFT)
+#define TAPDISK_SHMCACHE_ID_SIZE     16
+
+typedef struct tapdisk_shmcache_key {
+	uint8_t                      id[TAPDISK_SHMCACHE_ID_SIZE];
+	uint64_t                     dev;
+	uint64_t                     ino;
+	uint64_t                     mtime;       /* in ns */
+	uint32_t                     gen;
+} tapdisk_shmcache_key_t;
+
+int tapdisk_shmcache_attach(void);
+void tapdisk_shmcache_detach(void);
+
+/* returns 0 and fills @buf on a hit, -ENOENT on a miss */
+int tapdisk_shmcache_read(const tapdisk_shmcache_key_t *,
+			  uint64_t page, char *buf);
+void tapdisk_shmcache_write(const tapdisk_shmcache_key_t *,
+			    uint64_t page, const char *buf);
+
+#endif
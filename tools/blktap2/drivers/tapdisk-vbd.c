@@ -74,6 +74,27 @@ static void tapdisk_vbd_callback(void *, blkif_response_t *);
  * initialization
  */
 
+/*
+ * The elevator is off unless TAPDISK2_ELEVATOR_US gives the longest a
+ * request may be held; TAPDISK2_ELEVATOR_DEPTH sets how many requests
+ * must be in flight before new ones are held at all.
+ */
+static void
+tapdisk_vbd_elevator_init(td_vbd_t *vbd)
+{
+	char *env;
+
+	env = getenv("TAPDISK2_ELEVATOR_US");
+	vbd->elv_window = (env ? atoi(env) : 0);
+	if (vbd->elv_window < 0)
+		vbd->elv_window = 0;
+
+	env = getenv("TAPDISK2_ELEVATOR_DEPTH");
+	vbd->elv_depth = (env ? atoi(env) : TD_VBD_ELEVATOR_DEPTH);
+	if (vbd->elv_depth < 1)
+		vbd->elv_depth = 1;
+}
+
 static inline void
 tapdisk_vbd_initialize_vreq(td_vbd_request_t *vreq)
 {
@@ -87,6 +108,7 @@ tapdisk_vbd_free(td_vbd_t *vbd)
 	if (vbd) {
 		tapdisk_vbd_free_stack(vbd);
 		list_del_init(&vbd->next);
+		list_del_init(&vbd->active);
 		free(vbd->name);
 		free(vbd);
 	}
@@ -111,6 +133,8 @@ tapdisk_vbd_create(uint16_t uuid)
 	/* default blktap ring completion */
 	vbd->callback = tapdisk_vbd_callback;
 	vbd->argument = vbd;
+
+	tapdisk_vbd_elevator_init(vbd);
     
 #ifdef MEMSHR
 	memshr_vbd_initialize();
@@ -123,6 +147,7 @@ tapdisk_vbd_create(uint16_t uuid)
 	INIT_LIST_HEAD(&vbd->failed_requests);
 	INIT_LIST_HEAD(&vbd->completed_requests);
 	INIT_LIST_HEAD(&vbd->next);
+	INIT_LIST_HEAD(&vbd->active);
 	gettimeofday(&vbd->ts, NULL);
 
 	for (i = 0; i < MAX_REQUESTS; i++)
@@ -799,6 +824,7 @@ tapdisk_vbd_close(td_vbd_t *vbd)
 
 fail:
 	td_flag_set(vbd->state, TD_VBD_SHUTDOWN_REQUESTED);
+	tapdisk_server_activate_vbd(vbd);
 	DBG(TLOG_WARN, "%s: requests pending\n", vbd->name);
 	return -EAGAIN;
 }
@@ -824,6 +850,14 @@ tapdisk_vbd_debug(td_vbd_t *vbd)
 	    vbd->errors, vbd->retries,
 	    vbd->received, vbd->returned, vbd->kicked);
 
+	if (vbd->elv_window)
+		DBG(TLOG_WARN, "%s: elevator: window: %dus, depth: %d, "
+		    "batches: %"PRIu64", requests: %"PRIu64", contiguous: "
+		    "%"PRIu64", expired: %"PRIu64", max wait: %"PRIu64"us\n",
+		    vbd->name, vbd->elv_window, vbd->elv_depth,
+		    vbd->elv_batches, vbd->elv_requests, vbd->elv_contiguous,
+		    vbd->elv_expired, vbd->elv_max_wait);
+
 	tapdisk_vbd_for_each_image(vbd, image, tmp)
 		td_debug(image);
 }
@@ -872,6 +906,34 @@ tapdisk_vbd_retry_needed(td_vbd_t *vbd)
 	return td_flag_test(vbd->state, TD_VBD_RETRY_NEEDED);
 }
 
+/*
+ * Nothing for the server to do until a request arrives or completes, or
+ * a state change is requested (see tapdisk_server_activate_vbd()).
+ */
+int
+tapdisk_vbd_idle(td_vbd_t *vbd)
+{
+	td_ring_t *ring = &vbd->ring;
+
+	if (!list_empty(&vbd->new_requests) ||
+	    !list_empty(&vbd->pending_requests) ||
+	    !list_empty(&vbd->failed_requests) ||
+	    !list_empty(&vbd->completed_requests))
+		return 0;
+
+	if (td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED |
+			 TD_VBD_PAUSE_REQUESTED |
+			 TD_VBD_SHUTDOWN_REQUESTED |
+			 TD_VBD_RETRY_NEEDED))
+		return 0;
+
+	if (ring->sring &&
+	    ring->fe_ring.rsp_prod_pvt != ring->fe_ring.sring->rsp_prod)
+		return 0;
+
+	return 1;
+}
+
 int
 tapdisk_vbd_lock(td_vbd_t *vbd)
 {
@@ -883,6 +945,7 @@ tapdisk_vbd_quiesce_queue(td_vbd_t *vbd)
 {
 	if (!list_empty(&vbd->pending_requests)) {
 		td_flag_set(vbd->state, TD_VBD_QUIESCE_REQUESTED);
+		tapdisk_server_activate_vbd(vbd);
 		return -EAGAIN;
 	}
 
@@ -956,6 +1019,7 @@ tapdisk_vbd_pause(td_vbd_t *vbd)
 	int err;
 
 	td_flag_set(vbd->state, TD_VBD_PAUSE_REQUESTED);
+	tapdisk_server_activate_vbd(vbd);
 
 	err = tapdisk_vbd_quiesce_queue(vbd);
 	if (err)
@@ -1167,6 +1231,8 @@ void
 tapdisk_vbd_complete_vbd_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
 	if (!vreq->submitting && !vreq->secs_pending) {
+		tapdisk_server_activate_vbd(vbd);
+
 		if (vreq->status == BLKIF_RSP_ERROR &&
 		    vreq->num_retries < TD_VBD_MAX_RETRIES &&
 		    !td_flag_test(vbd->state, TD_VBD_DEAD) &&
@@ -1498,12 +1564,161 @@ tapdisk_vbd_reissue_failed_requests(td_vbd_t *vbd)
 	return err;
 }
 
+static inline long
+tapdisk_vbd_elapsed_us(struct timeval *then, struct timeval *now)
+{
+	return (now->tv_sec - then->tv_sec) * 1000000L +
+		(now->tv_usec - then->tv_usec);
+}
+
+static inline uint64_t
+tapdisk_vbd_request_secs(td_vbd_request_t *vreq)
+{
+	int i;
+	uint64_t secs = 0;
+
+	for (i = 0; i < vreq->req.nr_segments; i++)
+		secs += vreq->req.seg[i].last_sect -
+			vreq->req.seg[i].first_sect + 1;
+
+	return secs;
+}
+
+/*
+ * @b may only be moved ahead of @a if they cannot observe each other:
+ * both are reads, or they are a read and a write to disjoint sectors.
+ */
+static int
+tapdisk_vbd_requests_conflict(td_vbd_request_t *a, td_vbd_request_t *b)
+{
+	uint64_t a_end, b_end;
+	int a_op = a->req.operation, b_op = b->req.operation;
+
+	if ((a_op != BLKIF_OP_READ && a_op != BLKIF_OP_WRITE) ||
+	    (b_op != BLKIF_OP_READ && b_op != BLKIF_OP_WRITE))
+		return 1;
+
+	if (a_op == BLKIF_OP_READ && b_op == BLKIF_OP_READ)
+		return 0;
+
+	a_end = a->req.sector_number + tapdisk_vbd_request_secs(a);
+	b_end = b->req.sector_number + tapdisk_vbd_request_secs(b);
+
+	return (a->req.sector_number < b_end && b->req.sector_number < a_end);
+}
+
+static inline int
+tapdisk_vbd_request_before(td_vbd_request_t *a, td_vbd_request_t *b)
+{
+	if (a->req.operation != b->req.operation)
+		return a->req.operation < b->req.operation;
+
+	return a->req.sector_number < b->req.sector_number;
+}
+
+/*
+ * Hold new requests while the queue is busy, until the oldest one has
+ * waited elv_window us.  Completions of the requests in flight wake us
+ * up earlier, and may drop the queue below elv_depth.
+ */
+static int
+tapdisk_vbd_elevator_hold(td_vbd_t *vbd)
+{
+	int inflight;
+	long waited;
+	struct timeval now;
+	td_vbd_request_t *vreq, *tmp;
+
+	if (!vbd->elv_window || list_empty(&vbd->new_requests))
+		return 0;
+
+	if (td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED) ||
+	    td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED) ||
+	    td_flag_test(vbd->state, TD_VBD_SHUTDOWN_REQUESTED))
+		return 0;
+
+	inflight = 0;
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->pending_requests)
+		inflight++;
+
+	if (inflight < vbd->elv_depth)
+		return 0;
+
+	gettimeofday(&now, NULL);
+	vreq   = list_entry(vbd->new_requests.next, td_vbd_request_t, next);
+	waited = tapdisk_vbd_elapsed_us(&vreq->received, &now);
+
+	if (waited >= vbd->elv_window) {
+		vbd->elv_expired++;
+		return 0;
+	}
+
+	tapdisk_server_set_max_timeout_ms((vbd->elv_window - waited + 999) /
+					  1000);
+	return 1;
+}
+
+/*
+ * Stable insertion sort of new_requests by operation and sector, never
+ * moving a request ahead of one it conflicts with.
+ */
+static void
+tapdisk_vbd_elevator_sort(td_vbd_t *vbd)
+{
+	struct list_head sorted, *pos;
+	td_vbd_request_t *vreq, *tmp, *prev, *last;
+	struct timeval now;
+	uint64_t end;
+	long waited;
+
+	INIT_LIST_HEAD(&sorted);
+	gettimeofday(&now, NULL);
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
+		waited = tapdisk_vbd_elapsed_us(&vreq->received, &now);
+		if (waited > 0 && waited > vbd->elv_max_wait)
+			vbd->elv_max_wait = waited;
+
+		list_del(&vreq->next);
+
+		for (pos = sorted.prev; pos != &sorted; pos = pos->prev) {
+			prev = list_entry(pos, td_vbd_request_t, next);
+			if (!tapdisk_vbd_request_before(vreq, prev) ||
+			    tapdisk_vbd_requests_conflict(prev, vreq))
+				break;
+		}
+
+		list_add(&vreq->next, pos);
+	}
+
+	last = NULL;
+	end  = 0;
+	list_for_each_entry(vreq, &sorted, next) {
+		if (last && last->req.operation == vreq->req.operation &&
+		    vreq->req.sector_number == end)
+			vbd->elv_contiguous++;
+
+		end  = vreq->req.sector_number + tapdisk_vbd_request_secs(vreq);
+		last = vreq;
+		vbd->elv_requests++;
+	}
+
+	vbd->elv_batches++;
+	list_splice(&sorted, &vbd->new_requests);
+}
+
 static int
 tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
 {
 	int err;
 	td_vbd_request_t *vreq, *tmp;
 
+	if (tapdisk_vbd_elevator_hold(vbd))
+		return 0;
+
+	if (vbd->elv_window && !list_empty(&vbd->new_requests))
+		tapdisk_vbd_elevator_sort(vbd);
+
 	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
 		err = tapdisk_vbd_issue_request(vbd, vreq);
 		if (err)
@@ -1536,6 +1751,8 @@ tapdisk_vbd_issue_requests(td_vbd_t *vbd)
 {
 	int err;
 
+	tapdisk_server_activate_vbd(vbd);
+
 	if (td_flag_test(vbd->state, TD_VBD_DEAD))
 		return tapdisk_vbd_kill_requests(vbd);
 
@@ -1578,6 +1795,7 @@ tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 		memcpy(&vreq->req, req, sizeof(blkif_request_t));
 		vbd->received++;
 		vreq->vbd = vbd;
+		gettimeofday(&vreq->received, NULL);
 
 		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
 
@@ -1594,6 +1812,7 @@ tapdisk_vbd_pause_ring(td_vbd_t *vbd)
 		return 0;
 
 	td_flag_set(vbd->state, TD_VBD_PAUSE_REQUESTED);
+	tapdisk_server_activate_vbd(vbd);
 
 	err = tapdisk_vbd_quiesce_queue(vbd);
 	if (err) {
@@ -39,6 +39,8 @@
 #define TD_VBD_MAX_RETRIES          100
 #define TD_VBD_RETRY_INTERVAL       1
 
+#define TD_VBD_ELEVATOR_DEPTH       2
+
 #define TD_VBD_DEAD                 0x0001
 #define TD_VBD_CLOSED               0x0002
 #define TD_VBD_QUIESCE_REQUESTED    0x0004
@@ -74,6 +76,7 @@ struct td_vbd_request {
 	int                         secs_pending;
 	int                         num_retries;
 	struct timeval              last_try;
+	struct timeval              received;
 
 	td_vbd_t                   *vbd;
 	struct list_head            next;
@@ -116,6 +119,7 @@ struct td_vbd_handle {
 	void                       *argument;
 
 	struct list_head            next;
+	struct list_head            active;     /* server's active vbds */
 
 	struct timeval              ts;
 
@@ -125,6 +129,19 @@ struct td_vbd_handle {
 	uint64_t                    secs_pending;
 	uint64_t                    retries;
 	uint64_t                    errors;
+
+	/*
+	 * Elevator: while at least elv_depth requests are in flight, new
+	 * ones are held for up to elv_window us, then issued sorted by
+	 * sector so that adjacent ones merge in the aio queue.
+	 */
+	int                         elv_window;
+	int                         elv_depth;
+	uint64_t                    elv_batches;
+	uint64_t                    elv_requests;
+	uint64_t                    elv_contiguous;
+	uint64_t                    elv_expired;
+	uint64_t                    elv_max_wait;
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
@@ -191,6 +208,7 @@ void tapdisk_vbd_forward_request(td_request_t);
 int tapdisk_vbd_get_image_info(td_vbd_t *, image_t *);
 int tapdisk_vbd_queue_ready(td_vbd_t *);
 int tapdisk_vbd_retry_needed(td_vbd_t *);
+int tapdisk_vbd_idle(td_vbd_t *);
 int tapdisk_vbd_quiesce_queue(td_vbd_t *);
 int tapdisk_vbd_start_queue(td_vbd_t *);
 int tapdisk_vbd_issue_requests(td_vbd_t *);
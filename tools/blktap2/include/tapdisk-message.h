@@ -50,6 +50,7 @@ typedef struct tapdisk_message_string    tapdisk_message_string_t;
 typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
+typedef struct tapdisk_message_stats     tapdisk_message_stats_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -88,6 +89,12 @@ struct tapdisk_message_list {
 	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
 };
 
+struct tapdisk_message_stats {
+	uint16_t                         image;   /* 0 is the leaf */
+	uint16_t                         images;
+	char                             text[TAPDISK_MESSAGE_STRING_LENGTH];
+};
+
 struct tapdisk_message {
 	uint16_t                         type;
 	uint16_t                         cookie;
@@ -100,6 +107,7 @@ struct tapdisk_message {
 		tapdisk_message_minors_t minors;
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
+		tapdisk_message_stats_t  stats;
 	} u;
 };
 
@@ -126,6 +134,8 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_LIST_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_STATS,
+	TAPDISK_MESSAGE_STATS_RSP,
 };
 
 static inline char *
@@ -195,6 +205,12 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_STATS:
+		return "stats";
+
+	case TAPDISK_MESSAGE_STATS_RSP:
+		return "stats response";
+
 	default:
 		return "unknown";
 	}
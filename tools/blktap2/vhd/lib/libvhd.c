@@ -2351,6 +2351,78 @@ out:
 	return err;
 }
 
+/*
+ * Write generations of image files, shared host-wide so that caches of
+ * image contents (tapdisk's shmcache) can tell when a file may have
+ * changed: every read-write open and close of a file bumps its counter.
+ * Counters are indexed by a hash of the file's device and inode, so a
+ * collision only costs an unneeded invalidation.
+ */
+#define VHD_GEN_SHM_NAME           "/tapdisk2-shmcache-gen"
+#define VHD_GEN_SLOTS              4096
+
+static uint32_t *
+vhd_generation_slot(vhd_context_t *ctx, uint32_t **map)
+{
+	int fd;
+	uint64_t h;
+	struct stat st;
+	size_t size = VHD_GEN_SLOTS * sizeof(uint32_t);
+
+	*map = NULL;
+
+	if (fstat(ctx->fd, &st))
+		return NULL;
+
+	fd = shm_open(VHD_GEN_SHM_NAME, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		return NULL;
+
+	if (ftruncate(fd, size) == 0) {
+		*map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0);
+		if (*map == MAP_FAILED)
+			*map = NULL;
+	}
+	close(fd);
+
+	if (!*map) {
+		VHDLOG("%s: no write generations: %d\n", ctx->file, errno);
+		return NULL;
+	}
+
+	h = ((uint64_t)st.st_dev * 0x9e3779b97f4a7c15ULL) ^ st.st_ino;
+	h = (h ^ (h >> 29)) * 0x100000001b3ULL;
+
+	return *map + (h >> 32) % VHD_GEN_SLOTS;
+}
+
+static void
+vhd_bump_generation(vhd_context_t *ctx)
+{
+	uint32_t *map, *gen;
+
+	gen = vhd_generation_slot(ctx, &map);
+	if (gen)
+		__atomic_add_fetch(gen, 1, __ATOMIC_SEQ_CST);
+	if (map)
+		munmap(map, VHD_GEN_SLOTS * sizeof(uint32_t));
+}
+
+uint32_t
+vhd_generation(vhd_context_t *ctx)
+{
+	uint32_t *map, *gen, ret = 0;
+
+	gen = vhd_generation_slot(ctx, &map);
+	if (gen)
+		ret = __atomic_load_n(gen, __ATOMIC_SEQ_CST);
+	if (map)
+		munmap(map, VHD_GEN_SLOTS * sizeof(uint32_t));
+
+	return ret;
+}
+
 int
 vhd_open(vhd_context_t *ctx, const char *file, int flags)
 {
@@ -2384,6 +2456,9 @@ vhd_open(vhd_context_t *ctx, const char *file, int flags)
 	if (err)
 		goto fail;
 
+	if (flags & VHD_OPEN_RDWR)
+		vhd_bump_generation(ctx);
+
 	if (flags & VHD_OPEN_FAST) {
 		err = vhd_open_fast(ctx);
 		if (err)
@@ -2423,8 +2498,11 @@ fail:
 void
 vhd_close(vhd_context_t *ctx)
 {
-	if (ctx->file)
+	if (ctx->file) {
+		if (ctx->oflags & VHD_OPEN_RDWR)
+			vhd_bump_generation(ctx);
 		close(ctx->fd);
+	}
 	free(ctx->file);
 	free(ctx->bat.bat);
 	free(ctx->batmap.map);
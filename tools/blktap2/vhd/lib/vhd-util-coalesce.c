@@ -28,71 +28,137 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "libvhd.h"
 
+#define COALESCE_MAX_THREADS    16
+
+/*
+ * Blocks are copied in order of their offset in the child, so reads
+ * stream through the child file.  Reader threads fill a ring of block
+ * buffers ahead of the (single) writer, which applies them to the
+ * parent in plan order: writes to a vhd parent go through libvhd, whose
+ * bitmap and bat updates are not thread safe.
+ */
+struct coalesce_slot {
+	uint32_t                turn;     /* plan index this slot serves next */
+	int                     full;
+	int                     err;
+	char                   *buf;
+	char                   *map;
+};
+
+struct coalesce_ctx {
+	vhd_context_t          *vhd;
+	vhd_context_t          *parent;
+	int                     parent_fd;
+
+	uint32_t               *plan;
+	uint32_t                blocks;
+	uint32_t                next;     /* next plan index to read */
+
+	int                     depth;
+	struct coalesce_slot   *slots;
+
+	int                     stop;
+	pthread_mutex_t         lock;
+	pthread_cond_t          filled;
+	pthread_cond_t          drained;
+};
+
 static int
 __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 {
-	off_t off;
-	size_t ret;
+	ssize_t ret;
 
 	errno = 0;
-	off = lseek(fd, vhd_sectors_to_bytes(sec), SEEK_SET);
-	if (off == (off_t)-1) {
-		printf("raw parent: seek(0x%08"PRIx64") failed: %d\n",
-		       vhd_sectors_to_bytes(sec), -errno);
-		return -errno;
-	}
-
-	ret = write(fd, buf, vhd_sectors_to_bytes(secs));
+	ret = pwrite(fd, buf, vhd_sectors_to_bytes(secs),
+		     vhd_sectors_to_bytes(sec));
 	if (ret == vhd_sectors_to_bytes(secs))
 		return 0;
 
-	printf("raw parent: write of 0x%"PRIx64" returned %zd, errno: %d\n",
-	       vhd_sectors_to_bytes(secs), ret, -errno);
+	printf("raw parent: write of 0x%"PRIx64" at 0x%08"PRIx64" returned "
+	       "%zd, errno: %d\n", vhd_sectors_to_bytes(secs),
+	       vhd_sectors_to_bytes(sec), ret, -errno);
 	return (errno ? -errno : -EIO);
 }
 
+static int
+__pread_exact(int fd, char *buf, size_t size, off_t off)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = pread(fd, buf, size, off);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return (ret ? -errno : -EIO);
+
+		buf  += ret;
+		off  += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int
+vhd_util_coalesce_full(vhd_context_t *vhd, uint32_t block)
+{
+	return (vhd_has_batmap(vhd) &&
+		vhd_batmap_test(vhd, &vhd->batmap, block));
+}
+
 /*
- * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
+ * Read a child block and its bitmap with positioned i/o; safe to call
+ * from several threads as it does not touch the context's file offset.
  */
 static int
-vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-		int parent_fd, uint64_t block)
+vhd_util_coalesce_read(vhd_context_t *vhd, uint32_t block,
+		       char *buf, char *map)
 {
-	int i, err;
-	char *buf, *map;
-	uint64_t sec, secs;
+	int err;
+	off_t off;
 
-	buf = NULL;
-	map = NULL;
-	sec = block * vhd->spb;
+	off = vhd_sectors_to_bytes(vhd->bat.bat[block]);
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
-		return 0;
+	if (!vhd_util_coalesce_full(vhd, block)) {
+		err = __pread_exact(vhd->fd, map,
+				    vhd_bytes_padded(vhd->spb >> 3), off);
+		if (err)
+			return err;
+	}
 
-	err = posix_memalign((void **)&buf, 4096, vhd->header.block_size);
-	if (err)
-		return -err;
+	return __pread_exact(vhd->fd, buf, vhd->header.block_size,
+			     off + vhd_sectors_to_bytes(vhd->bm_secs));
+}
 
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
-	if (err)
-		goto done;
+/*
+ * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
+ */
+static int
+vhd_util_coalesce_write(vhd_context_t *vhd, vhd_context_t *parent,
+			int parent_fd, uint32_t block, char *buf, char *map,
+			uint64_t *written)
+{
+	int i, err;
+	uint64_t sec, secs;
+
+	sec = (uint64_t)block * vhd->spb;
 
-	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
+	if (vhd_util_coalesce_full(vhd, block)) {
+		*written += vhd->spb;
 		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
+			return vhd_io_write(parent, buf, sec, vhd->spb);
 		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
-		goto done;
+			return __raw_io_write(parent_fd, buf, sec, vhd->spb);
 	}
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto done;
-
 	for (i = 0; i < vhd->spb; i++) {
 		if (!vhd_bitmap_test(vhd, map, i))
 			continue;
@@ -110,48 +176,270 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 					     buf + vhd_sectors_to_bytes(i),
 					     sec + i, secs);
 		if (err)
-			goto done;
+			return err;
 
+		*written += secs;
 		i += secs;
 	}
 
+	return 0;
+}
+
+static void *
+vhd_util_coalesce_reader(void *arg)
+{
+	int err;
+	uint32_t i;
+	struct coalesce_slot *slot;
+	struct coalesce_ctx *ctx = arg;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	while (!ctx->stop && ctx->next < ctx->blocks) {
+		i    = ctx->next++;
+		slot = ctx->slots + i % ctx->depth;
+
+		while (!ctx->stop && (slot->full || slot->turn != i))
+			pthread_cond_wait(&ctx->drained, &ctx->lock);
+		if (ctx->stop)
+			break;
+
+		pthread_mutex_unlock(&ctx->lock);
+		err = vhd_util_coalesce_read(ctx->vhd, ctx->plan[i],
+					     slot->buf, slot->map);
+		pthread_mutex_lock(&ctx->lock);
+
+		slot->err  = err;
+		slot->full = 1;
+		pthread_cond_broadcast(&ctx->filled);
+	}
+
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+static vhd_context_t *__plan_vhd;
+
+static int
+__plan_cmp(const void *a, const void *b)
+{
+	uint32_t x = __plan_vhd->bat.bat[*(const uint32_t *)a];
+	uint32_t y = __plan_vhd->bat.bat[*(const uint32_t *)b];
+
+	return (x > y) - (x < y);
+}
+
+static int
+vhd_util_coalesce_plan(struct coalesce_ctx *ctx)
+{
+	uint32_t i;
+	vhd_context_t *vhd = ctx->vhd;
+
+	ctx->plan = malloc(vhd->bat.entries * sizeof(uint32_t));
+	if (!ctx->plan)
+		return -ENOMEM;
+
+	ctx->blocks = 0;
+	for (i = 0; i < vhd->bat.entries; i++)
+		if (vhd->bat.bat[i] != DD_BLK_UNUSED)
+			ctx->plan[ctx->blocks++] = i;
+
+	__plan_vhd = vhd;
+	qsort(ctx->plan, ctx->blocks, sizeof(uint32_t), __plan_cmp);
+
+	return 0;
+}
+
+static inline double
+__elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void
+vhd_util_coalesce_progress(uint32_t done, uint32_t blocks,
+			   uint64_t secs, double elapsed, int final)
+{
+	double mb = vhd_sectors_to_bytes(secs) / (double)(1 << 20);
+
+	printf("%s%u/%u blocks, %.1f MB in %.1fs, %.1f MB/s\n",
+	       final ? "coalesced " : "coalescing: ", done, blocks,
+	       mb, elapsed, elapsed > 0 ? mb / elapsed : 0.0);
+	fflush(stdout);
+}
+
+static int
+vhd_util_coalesce_blocks(vhd_context_t *vhd, vhd_context_t *parent,
+			 int parent_fd, int threads, int progress)
+{
+	int err, n, started;
+	uint32_t i;
+	uint64_t written;
+	double elapsed, last;
+	struct timeval start;
+	struct coalesce_slot *slot;
+	struct coalesce_ctx ctx;
+	pthread_t tids[COALESCE_MAX_THREADS];
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.vhd       = vhd;
+	ctx.parent    = parent;
+	ctx.parent_fd = parent_fd;
+	ctx.depth     = 2 * threads;
+	started       = 0;
+	written       = 0;
+	last          = 0;
+
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.filled, NULL);
+	pthread_cond_init(&ctx.drained, NULL);
+
+	err = vhd_util_coalesce_plan(&ctx);
+	if (err)
+		goto out;
+
+	ctx.slots = calloc(ctx.depth, sizeof(struct coalesce_slot));
+	if (!ctx.slots) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (n = 0; n < ctx.depth; n++) {
+		slot       = ctx.slots + n;
+		slot->turn = n;
+
+		err = posix_memalign((void **)&slot->buf, 4096,
+				     vhd->header.block_size);
+		if (err) {
+			err = -err;
+			goto out;
+		}
+
+		err = posix_memalign((void **)&slot->map, 4096,
+				     vhd_bytes_padded(vhd->spb >> 3));
+		if (err) {
+			err = -err;
+			goto out;
+		}
+	}
+
+	gettimeofday(&start, NULL);
+
+	for (started = 0; started < threads; started++) {
+		err = pthread_create(tids + started, NULL,
+				     vhd_util_coalesce_reader, &ctx);
+		if (err) {
+			err = -err;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < ctx.blocks; i++) {
+		slot = ctx.slots + i % ctx.depth;
+
+		pthread_mutex_lock(&ctx.lock);
+		while (!slot->full)
+			pthread_cond_wait(&ctx.filled, &ctx.lock);
+		pthread_mutex_unlock(&ctx.lock);
+
+		err = slot->err;
+		if (err) {
+			printf("error reading block %u: %d\n",
+			       ctx.plan[i], err);
+			goto out;
+		}
+
+		err = vhd_util_coalesce_write(vhd, parent, parent_fd,
+					      ctx.plan[i], slot->buf,
+					      slot->map, &written);
+		if (err)
+			goto out;
+
+		pthread_mutex_lock(&ctx.lock);
+		slot->full  = 0;
+		slot->turn += ctx.depth;
+		pthread_cond_broadcast(&ctx.drained);
+		pthread_mutex_unlock(&ctx.lock);
+
+		if (progress) {
+			elapsed = __elapsed(&start);
+			if (elapsed - last >= 1) {
+				vhd_util_coalesce_progress(i + 1, ctx.blocks,
+							   written, elapsed, 0);
+				last = elapsed;
+			}
+		}
+	}
+
+	if (progress)
+		vhd_util_coalesce_progress(ctx.blocks, ctx.blocks, written,
+					   __elapsed(&start), 1);
 	err = 0;
 
-done:
-	free(buf);
-	free(map);
+out:
+	pthread_mutex_lock(&ctx.lock);
+	ctx.stop = 1;
+	pthread_cond_broadcast(&ctx.drained);
+	pthread_mutex_unlock(&ctx.lock);
+
+	while (started--)
+		pthread_join(tids[started], NULL);
+
+	if (ctx.slots)
+		for (n = 0; n < ctx.depth; n++) {
+			free(ctx.slots[n].buf);
+			free(ctx.slots[n].map);
+		}
+	free(ctx.slots);
+	free(ctx.plan);
+
+	pthread_cond_destroy(&ctx.drained);
+	pthread_cond_destroy(&ctx.filled);
+	pthread_mutex_destroy(&ctx.lock);
 	return err;
 }
 
 int
 vhd_util_coalesce(int argc, char **argv)
 {
-	int err, c;
-	uint64_t i;
+	int err, c, threads, progress;
 	char *name, *pname;
 	vhd_context_t vhd, parent;
 	int parent_fd = -1;
 
-	name  = NULL;
-	pname = NULL;
+	name     = NULL;
+	pname    = NULL;
+	threads  = 1;
+	progress = 0;
 	parent.file = NULL;
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:t:ph")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
 			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'p':
+			progress = 1;
+			break;
 		case 'h':
 		default:
 			goto usage;
 		}
 	}
 
-	if (!name || optind != argc)
+	if (!name || optind != argc ||
+	    threads < 1 || threads > COALESCE_MAX_THREADS)
 		goto usage;
 
 	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
@@ -195,13 +483,8 @@ vhd_util_coalesce(int argc, char **argv)
 			goto done;
 	}
 
-	for (i = 0; i < vhd.bat.entries; i++) {
-		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd, i);
-		if (err)
-			goto done;
-	}
-
-	err = 0;
+	err = vhd_util_coalesce_blocks(&vhd, &parent, parent_fd,
+				       threads, progress);
 
  done:
 	free(pname);
@@ -213,6 +496,7 @@ vhd_util_coalesce(int argc, char **argv)
 	return err;
 
 usage:
-	printf("options: <-n name> [-h help]\n");
+	printf("options: <-n name> [-t threads (1-%d)] [-p progress] "
+	       "[-h help]\n", COALESCE_MAX_THREADS);
 	return -EINVAL;
 }
@@ -43,6 +43,7 @@
 #include <util.h>
 #elif defined(__linux__)
 #include <pty.h>
+#include <sys/epoll.h>
 #elif defined(__sun__)
 #include <stropts.h>
 #elif defined(__FreeBSD__)
@@ -75,12 +76,42 @@ static int log_hv_fd = -1;
 
 static xengnttab_handle *xgt_handle = NULL;
 
-static struct pollfd  *fds;
-static unsigned int current_array_size;
-static unsigned int nr_fds;
+/* One event channel handle for the consoles of all domains */
+static xenevtchn_handle *xce_handle_dom = NULL;
 
 #define ROUNDUP(_x,_w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
 
+/* Ports read from the event channel handle per wakeup */
+#define EVTCHN_BATCH 256
+
+/*
+ * File descriptors stay registered for as long as they are open, with the
+ * events wanted updated as they change, so a wakeup costs O(ready fds)
+ * rather than O(domains).
+ */
+enum fd_watch_type {
+	WATCH_XS,
+	WATCH_HV,
+	WATCH_EVTCHN,
+	WATCH_TTY,
+};
+
+struct fd_watch {
+	enum fd_watch_type type;
+	int fd;				/* -1 if not registered */
+	short events;			/* POLL* events wanted */
+	unsigned int idx;		/* in fds[], without epoll */
+	struct domain *dom;		/* for WATCH_TTY */
+};
+
+struct fd_watch_event {
+	struct fd_watch *watch;
+	short revents;
+};
+
+static struct fd_watch_event *ready_events;
+static unsigned int nr_ready_events;
+
 struct buffer {
 	char *data;
 	size_t consumed;
@@ -92,7 +123,7 @@ struct buffer {
 struct domain {
 	int domid;
 	int master_fd;
-	int master_pollfd_idx;
+	struct fd_watch tty_watch;
 	int slave_fd;
 	int log_fd;
 	bool is_dead;
@@ -103,15 +134,262 @@ struct domain {
 	int ring_ref;
 	xenevtchn_port_or_error_t local_port;
 	xenevtchn_port_or_error_t remote_port;
-	xenevtchn_handle *xce_handle;
-	int xce_pollfd_idx;
 	struct xencons_interface *interface;
 	int event_count;
 	long long next_period;
+	struct domain *next_limited;	/* in limited_head, if rate_limited */
+	bool rate_limited;		/* port left masked until next_period */
+	bool ring_stalled;		/* port left masked until buffer drains */
 };
 
 static struct domain *dom_head;
 
+/* Domains over their event allowance for this period */
+static struct domain *limited_head;
+
+/* Domain of each local port of xce_handle_dom */
+static struct domain **port_doms;
+static unsigned int nr_port_doms;
+
+/* Some domain may need shutting down or cleaning up */
+static bool domains_changed;
+
+#if defined(__linux__)
+
+/* Ready fds handled per wakeup */
+#define WATCH_BATCH 64
+
+static int epoll_fd = -1;
+
+static int watch_init(void)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		dolog(LOG_ERR, "Failed to create epoll fd: %d (%s)",
+		      errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void watch_fini(void)
+{
+	if (epoll_fd != -1)
+		close(epoll_fd);
+	epoll_fd = -1;
+	free(ready_events);
+	ready_events = NULL;
+	nr_ready_events = 0;
+}
+
+static uint32_t watch_epoll_events(short events)
+{
+	return ((events & POLLIN) ? EPOLLIN : 0) |
+	       ((events & POLLOUT) ? EPOLLOUT : 0) |
+	       ((events & POLLPRI) ? EPOLLPRI : 0);
+}
+
+static int watch_add(struct fd_watch *w, int fd, short events)
+{
+	struct epoll_event ev = {
+		.events = watch_epoll_events(events),
+		.data.ptr = w,
+	};
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		dolog(LOG_ERR, "Failed to watch fd %d: %d (%s)",
+		      fd, errno, strerror(errno));
+		return -1;
+	}
+	w->fd = fd;
+	w->events = events;
+	return 0;
+}
+
+static void watch_mod(struct fd_watch *w, short events)
+{
+	struct epoll_event ev = {
+		.events = watch_epoll_events(events),
+		.data.ptr = w,
+	};
+
+	if (w->fd == -1 || w->events == events)
+		return;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, w->fd, &ev) == -1)
+		dolog(LOG_ERR, "Failed to modify watch on fd %d: %d (%s)",
+		      w->fd, errno, strerror(errno));
+	w->events = events;
+}
+
+static void watch_del(struct fd_watch *w)
+{
+	if (w->fd == -1)
+		return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+	w->fd = -1;
+}
+
+/* Fills ready_events, returns how many or -1 */
+static int watch_wait(int timeout)
+{
+	struct epoll_event evs[WATCH_BATCH];
+	int i, n;
+
+	if (!ready_events) {
+		ready_events = calloc(WATCH_BATCH, sizeof(*ready_events));
+		if (!ready_events)
+			return -1;
+		nr_ready_events = WATCH_BATCH;
+	}
+
+	n = epoll_wait(epoll_fd, evs, WATCH_BATCH, timeout);
+
+	for (i = 0; i < n; i++) {
+		short revents = 0;
+
+		if (evs[i].events & EPOLLIN)
+			revents |= POLLIN;
+		if (evs[i].events & EPOLLOUT)
+			revents |= POLLOUT;
+		if (evs[i].events & EPOLLPRI)
+			revents |= POLLPRI;
+		if (evs[i].events & EPOLLERR)
+			revents |= POLLERR;
+		if (evs[i].events & EPOLLHUP)
+			revents |= POLLHUP;
+		ready_events[i].watch = evs[i].data.ptr;
+		ready_events[i].revents = revents;
+	}
+
+	return n;
+}
+
+#else /* !__linux__ */
+
+/* Without epoll, keep a pollfd array which is only updated on changes. */
+static struct pollfd  *fds;
+static struct fd_watch **fd_watches;
+static unsigned int current_array_size;
+static unsigned int nr_fds;
+
+static int watch_init(void)
+{
+	return 0;
+}
+
+static void watch_fini(void)
+{
+	free(fds);
+	fds = NULL;
+	free(fd_watches);
+	fd_watches = NULL;
+	current_array_size = nr_fds = 0;
+	free(ready_events);
+	ready_events = NULL;
+	nr_ready_events = 0;
+}
+
+static int watch_add(struct fd_watch *w, int fd, short events)
+{
+	if (current_array_size < nr_fds + 1) {
+		struct pollfd  *new_fds = NULL;
+		struct fd_watch **new_watches = NULL;
+		unsigned long newsize;
+
+		/* Round up to 2^8 boundary, in practice this just
+		 * make newsize larger than current_array_size.
+		 */
+		newsize = ROUNDUP(nr_fds + 1, 8);
+
+		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
+		if (!new_fds)
+			goto fail;
+		fds = new_fds;
+
+		new_watches = realloc(fd_watches,
+				      sizeof(struct fd_watch *)*newsize);
+		if (!new_watches)
+			goto fail;
+		fd_watches = new_watches;
+
+		memset(&fds[0] + current_array_size, 0,
+		       sizeof(struct pollfd) * (newsize-current_array_size));
+		current_array_size = newsize;
+	}
+
+	fds[nr_fds].fd = fd;
+	fds[nr_fds].events = events;
+	fd_watches[nr_fds] = w;
+	w->idx = nr_fds++;
+	w->fd = fd;
+	w->events = events;
+
+	return 0;
+fail:
+	dolog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
+	return -1;
+}
+
+static void watch_mod(struct fd_watch *w, short events)
+{
+	if (w->fd == -1)
+		return;
+	fds[w->idx].events = w->events = events;
+}
+
+static void watch_del(struct fd_watch *w)
+{
+	if (w->fd == -1)
+		return;
+	/* Move the last entry into the hole */
+	nr_fds--;
+	fds[w->idx] = fds[nr_fds];
+	fd_watches[w->idx] = fd_watches[nr_fds];
+	fd_watches[w->idx]->idx = w->idx;
+	w->fd = -1;
+}
+
+/* Fills ready_events, returns how many or -1 */
+static int watch_wait(int timeout)
+{
+	unsigned int i;
+	int n, ret;
+
+	if (nr_ready_events < nr_fds) {
+		struct fd_watch_event *new_events;
+
+		new_events = realloc(ready_events,
+				     sizeof(*ready_events) * current_array_size);
+		if (!new_events)
+			return -1;
+		ready_events = new_events;
+		nr_ready_events = current_array_size;
+	}
+
+	ret = poll(fds, nr_fds, timeout);
+
+	for (i = 0, n = 0; ret > 0 && i < nr_fds; i++) {
+		if (!fds[i].revents)
+			continue;
+		ready_events[n].watch = fd_watches[i];
+		ready_events[n].revents = fds[i].revents;
+		n++;
+	}
+
+	return ret < 0 ? ret : n;
+}
+
+#endif /* __linux__ */
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return -1;
+	return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
 static int write_all(int fd, const char* buf, size_t len)
 {
 	while (len) {
@@ -127,6 +405,23 @@ static int write_all(int fd, const char* buf, size_t len)
 	return 0;
 }
 
+/* Appends to out[] of size cap, writing it out to fd when full. */
+static int write_buffered(int fd, char *out, size_t *len, size_t cap,
+			  const char *data, size_t sz)
+{
+	if (*len + sz > cap) {
+		if (write_all(fd, out, *len))
+			return -1;
+		*len = 0;
+		if (sz > cap)
+			return write_all(fd, data, sz);
+	}
+
+	memcpy(out + *len, data, sz);
+	*len += sz;
+	return 0;
+}
+
 static int write_with_timestamp(int fd, const char *data, size_t sz,
 				int *needts)
 {
@@ -135,6 +430,9 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 	const struct tm *tmnow = localtime(&now);
 	size_t tslen = strftime(ts, sizeof(ts), "[%Y-%m-%d %H:%M:%S] ", tmnow);
 	const char *last_byte = data + sz - 1;
+	/* Lines and their timestamps are coalesced into few writes. */
+	char out[4096];
+	size_t len = 0;
 
 	while (data <= last_byte) {
 		const char *nl = memchr(data, '\n', last_byte + 1 - data);
@@ -142,8 +440,10 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 		if (!found_nl)
 			nl = last_byte;
 
-		if ((*needts && write_all(fd, ts, tslen))
-		    || write_all(fd, data, nl + 1 - data))
+		if ((*needts &&
+		     write_buffered(fd, out, &len, sizeof(out), ts, tslen))
+		    || write_buffered(fd, out, &len, sizeof(out),
+				      data, nl + 1 - data))
 			return -1;
 
 		*needts = found_nl;
@@ -155,7 +455,7 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 		}
 	}
 
-	return 0;
+	return len ? write_all(fd, out, len) : 0;
 }
 
 static void buffer_append(struct domain *dom)
@@ -187,7 +487,7 @@ static void buffer_append(struct domain *dom)
 
 	xen_mb();
 	intf->out_cons = cons;
-	xenevtchn_notify(dom->xce_handle, dom->local_port);
+	xenevtchn_notify(xce_handle_dom, dom->local_port);
 
 	/* Get the data to the logfile as early as possible because if
 	 * no one is listening on the console pty then it will fill up
@@ -336,8 +636,43 @@ static int create_domain_log(struct domain *dom)
 	return fd;
 }
 
+static int ring_free_bytes(struct domain *dom)
+{
+	struct xencons_interface *intf = dom->interface;
+	XENCONS_RING_IDX cons, prod, space;
+
+	cons = intf->in_cons;
+	prod = intf->in_prod;
+	xen_mb();
+
+	space = prod - cons;
+	if (space > sizeof(intf->in))
+		return 0; /* ring is screwed: ignore it */
+
+	return (sizeof(intf->in) - space);
+}
+
+/* Poll the tty for what can be done with it now. */
+static void domain_update_tty_events(struct domain *dom)
+{
+	short events = 0;
+
+	if (dom->master_fd == -1)
+		return;
+
+	if (!dom->is_dead && ring_free_bytes(dom))
+		events |= POLLIN;
+
+	if (!buffer_empty(&dom->buffer))
+		events |= POLLOUT;
+
+	watch_mod(&dom->tty_watch, events ? events|POLLPRI : 0);
+}
+
 static void domain_close_tty(struct domain *dom)
 {
+	watch_del(&dom->tty_watch);
+
 	if (dom->master_fd != -1) {
 		close(dom->master_fd);
 		dom->master_fd = -1;
@@ -476,6 +811,10 @@ static int domain_create_tty(struct domain *dom)
 	if (fcntl(dom->master_fd, F_SETFL, O_NONBLOCK) == -1)
 		goto out;
 
+	if (watch_add(&dom->tty_watch, dom->master_fd, 0))
+		goto out;
+	domain_update_tty_events(dom);
+
 	return 1;
 out:
 	domain_close_tty(dom);
@@ -517,6 +856,43 @@ static int xs_gather(struct xs_handle *xs, const char *dir, ...)
 	return ret;
 }
 
+static int set_port_domain(xenevtchn_port_or_error_t port, struct domain *dom)
+{
+	if (port >= nr_port_doms) {
+		unsigned int nr = ROUNDUP(port + 1, 8);
+		struct domain **p = realloc(port_doms, nr * sizeof(*p));
+
+		if (!p) {
+			dolog(LOG_ERR, "Out of memory %s:%s():L%d",
+			      __FILE__, __FUNCTION__, __LINE__);
+			return -1;
+		}
+		memset(p + nr_port_doms, 0, (nr - nr_port_doms) * sizeof(*p));
+		port_doms = p;
+		nr_port_doms = nr;
+	}
+
+	port_doms[port] = dom;
+	return 0;
+}
+
+static struct domain *lookup_port_domain(xenevtchn_port_or_error_t port)
+{
+	return port < nr_port_doms ? port_doms[port] : NULL;
+}
+
+static void domain_unbind_port(struct domain *dom)
+{
+	if (dom->local_port != -1) {
+		if (lookup_port_domain(dom->local_port) == dom)
+			port_doms[dom->local_port] = NULL;
+		(void)xenevtchn_unbind(xce_handle_dom, dom->local_port);
+	}
+	dom->local_port = -1;
+	dom->remote_port = -1;
+	dom->ring_stalled = false;
+}
+
 static void domain_unmap_interface(struct domain *dom)
 {
 	if (dom->interface == NULL)
@@ -583,41 +959,31 @@ static int domain_create_ring(struct domain *dom)
 			goto out;
 	}
 
-	dom->local_port = -1;
-	dom->remote_port = -1;
-	if (dom->xce_handle != NULL)
-		xenevtchn_close(dom->xce_handle);
+	domain_unbind_port(dom);
 
-	/* Opening evtchn independently for each console is a bit
-	 * wasteful, but that's how the code is structured... */
-	dom->xce_handle = xenevtchn_open(NULL, 0);
-	if (dom->xce_handle == NULL) {
-		err = errno;
-		goto out;
-	}
- 
-	rc = xenevtchn_bind_interdomain(dom->xce_handle,
+	rc = xenevtchn_bind_interdomain(xce_handle_dom,
 		dom->domid, remote_port);
 
 	if (rc == -1) {
 		err = errno;
-		xenevtchn_close(dom->xce_handle);
-		dom->xce_handle = NULL;
 		goto out;
 	}
 	dom->local_port = rc;
 	dom->remote_port = remote_port;
+	if (set_port_domain(dom->local_port, dom)) {
+		err = ENOMEM;
+		domain_unbind_port(dom);
+		goto out;
+	}
 
 	if (dom->master_fd == -1) {
 		if (!domain_create_tty(dom)) {
 			err = errno;
-			xenevtchn_close(dom->xce_handle);
-			dom->xce_handle = NULL;
-			dom->local_port = -1;
-			dom->remote_port = -1;
+			domain_unbind_port(dom);
 			goto out;
 		}
 	}
+	domain_update_tty_events(dom);
 
 	if (log_guest && (dom->log_fd == -1))
 		dom->log_fd = create_domain_log(dom);
@@ -650,9 +1016,9 @@ static struct domain *create_domain(int domid)
 {
 	struct domain *dom;
 	char *s;
-	struct timespec ts;
+	long long now = now_ms();
 
-	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+	if (now < 0) {
 		dolog(LOG_ERR, "Cannot get time of day %s:%s:L%d",
 		      __FILE__, __FUNCTION__, __LINE__);
 		return NULL;
@@ -676,12 +1042,13 @@ static struct domain *create_domain(int domid)
 	strcat(dom->conspath, "/console");
 
 	dom->master_fd = -1;
-	dom->master_pollfd_idx = -1;
+	dom->tty_watch.type = WATCH_TTY;
+	dom->tty_watch.fd = -1;
+	dom->tty_watch.dom = dom;
 	dom->slave_fd = -1;
 	dom->log_fd = -1;
-	dom->xce_pollfd_idx = -1;
 
-	dom->next_period = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + RATE_LIMIT_PERIOD;
+	dom->next_period = now + RATE_LIMIT_PERIOD;
 
 	dom->ring_ref = -1;
 	dom->local_port = -1;
@@ -727,8 +1094,26 @@ static void remove_domain(struct domain *dom)
 	}
 }
 
+static void domain_unlimit(struct domain *d)
+{
+	struct domain **pp;
+
+	if (!d->rate_limited)
+		return;
+
+	for (pp = &limited_head; *pp; pp = &(*pp)->next_limited) {
+		if (d == *pp) {
+			*pp = d->next_limited;
+			break;
+		}
+	}
+	d->next_limited = NULL;
+	d->rate_limited = false;
+}
+
 static void cleanup_domain(struct domain *d)
 {
+	domain_unlimit(d);
 	domain_close_tty(d);
 
 	if (d->log_fd != -1) {
@@ -750,9 +1135,8 @@ static void shutdown_domain(struct domain *d)
 	d->is_dead = true;
 	watch_domain(d, false);
 	domain_unmap_interface(d);
-	if (d->xce_handle != NULL)
-		xenevtchn_close(d->xce_handle);
-	d->xce_handle = NULL;
+	domain_unbind_port(d);
+	domains_changed = true;
 }
 
 static unsigned enum_pass = 0;
@@ -778,22 +1162,8 @@ static void enum_domains(void)
 			dom->last_seen = enum_pass;
 		domid = dominfo.domid + 1;
 	}
-}
-
-static int ring_free_bytes(struct domain *dom)
-{
-	struct xencons_interface *intf = dom->interface;
-	XENCONS_RING_IDX cons, prod, space;
-
-	cons = intf->in_cons;
-	prod = intf->in_prod;
-	xen_mb();
-
-	space = prod - cons;
-	if (space > sizeof(intf->in))
-		return 0; /* ring is screwed: ignore it */
 
-	return (sizeof(intf->in) - space);
+	domains_changed = true;
 }
 
 static void domain_handle_broken_tty(struct domain *dom, int recreate)
@@ -807,6 +1177,19 @@ static void domain_handle_broken_tty(struct domain *dom, int recreate)
 	}
 }
 
+static bool domain_can_read_ring(struct domain *dom)
+{
+	return discard_overflowed_data ||
+	       !dom->buffer.max_capacity ||
+	       dom->buffer.size < dom->buffer.max_capacity;
+}
+
+static void domain_unmask(struct domain *dom)
+{
+	if (dom->local_port != -1 && !dom->rate_limited && !dom->ring_stalled)
+		(void)xenevtchn_unmask(xce_handle_dom, dom->local_port);
+}
+
 static void handle_tty_read(struct domain *dom)
 {
 	ssize_t len = 0;
@@ -841,7 +1224,8 @@ static void handle_tty_read(struct domain *dom)
 		}
 		xen_wmb();
 		intf->in_prod = prod;
-		xenevtchn_notify(dom->xce_handle, dom->local_port);
+		xenevtchn_notify(xce_handle_dom, dom->local_port);
+		domain_update_tty_events(dom);
 	} else {
 		domain_close_tty(dom);
 		shutdown_domain(dom);
@@ -863,25 +1247,69 @@ static void handle_tty_write(struct domain *dom)
 		domain_handle_broken_tty(dom, domain_is_valid(dom->domid));
 	} else {
 		buffer_advance(&dom->buffer, len);
+		/* Catch up with the ring if it was left for lack of room. */
+		if (dom->ring_stalled && domain_can_read_ring(dom)) {
+			dom->ring_stalled = false;
+			buffer_append(dom);
+			domain_unmask(dom);
+		}
+		domain_update_tty_events(dom);
 	}
 }
 
-static void handle_ring_read(struct domain *dom)
+static void handle_ring_read(struct domain *dom, long long now)
 {
-	xenevtchn_port_or_error_t port;
-
 	if (dom->is_dead)
 		return;
 
-	if ((port = xenevtchn_pending(dom->xce_handle)) == -1)
+	/* CS 16257:955ee4fa1345 introduces a 5ms fuzz
+	 * for select(), it is not clear poll() has
+	 * similar behavior (returning a couple of ms
+	 * sooner than requested) as well. Just leave
+	 * the fuzz here. Remove it with a separate
+	 * patch if necessary */
+	if ((now+5) > dom->next_period) {
+		dom->next_period = now + RATE_LIMIT_PERIOD;
+		dom->event_count = 0;
+	}
+
+	/* Leave the port masked until the tty drains the buffer. */
+	if (!domain_can_read_ring(dom)) {
+		dom->ring_stalled = true;
 		return;
+	}
 
 	dom->event_count++;
 
 	buffer_append(dom);
+	domain_update_tty_events(dom);
+
+	/* Leave the port masked until the next period. */
+	if (dom->event_count >= RATE_LIMIT_ALLOWANCE && !dom->rate_limited) {
+		dom->rate_limited = true;
+		dom->next_limited = limited_head;
+		limited_head = dom;
+	}
 
-	if (dom->event_count < RATE_LIMIT_ALLOWANCE)
-		(void)xenevtchn_unmask(dom->xce_handle, port);
+	domain_unmask(dom);
+}
+
+static void handle_ring_events(long long now)
+{
+	xenevtchn_port_or_error_t port;
+	struct domain *dom;
+	unsigned int i;
+
+	/* The fd is non-blocking: drain what is pending, up to a batch. */
+	for (i = 0; i < EVTCHN_BATCH; i++) {
+		port = xenevtchn_pending(xce_handle_dom);
+		if (port == -1)
+			break;
+
+		dom = lookup_port_domain(port);
+		if (dom)
+			handle_ring_read(dom, now);
+	}
 }
 
 static void handle_xs(void)
@@ -961,54 +1389,43 @@ static void handle_log_reload(void)
 	}
 }
 
-/* Returns index inside fds array if succees, -1 if fail */
-static int set_fds(int fd, short events)
+static bool watch_failed(short revents, const char *what)
 {
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd  *new_fds = NULL;
-		unsigned long newsize;
-
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 8);
-
-		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
-		fds = new_fds;
-
-		memset(&fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd) * (newsize-current_array_size));
-		current_array_size = newsize;
+	if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+		dolog(LOG_ERR, "Failure in poll %s: %d (%s)",
+		      what, errno, strerror(errno));
+		return true;
 	}
-
-	fds[nr_fds].fd = fd;
-	fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
-
-	return ret;
-fail:
-	dolog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
-}
-
-static void reset_fds(void)
-{
-	nr_fds = 0;
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
+	return false;
 }
 
 void handle_io(void)
 {
-	int ret;
+	int ret, fd;
 	xenevtchn_port_or_error_t log_hv_evtchn = -1;
-	int xce_pollfd_idx = -1;
-	int xs_pollfd_idx = -1;
 	xenevtchn_handle *xce_handle = NULL;
+	struct fd_watch xs_watch = { .type = WATCH_XS, .fd = -1 };
+	struct fd_watch hv_watch = { .type = WATCH_HV, .fd = -1 };
+	struct fd_watch evtchn_watch = { .type = WATCH_EVTCHN, .fd = -1 };
+
+	if (watch_init())
+		return;
+
+	xce_handle_dom = xenevtchn_open(NULL, 0);
+	if (xce_handle_dom == NULL) {
+		dolog(LOG_ERR, "Failed to open xce handle: %d (%s)",
+		      errno, strerror(errno));
+		goto out;
+	}
+	fd = xenevtchn_fd(xce_handle_dom);
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+		dolog(LOG_ERR, "Failed to set xce handle non-blocking: %d (%s)",
+		      errno, strerror(errno));
+		goto out;
+	}
+	if (watch_add(&evtchn_watch, fd, POLLIN|POLLPRI) ||
+	    watch_add(&xs_watch, xs_fileno(xs), POLLIN|POLLPRI))
+		goto out;
 
 	if (log_hv) {
 		xce_handle = xenevtchn_open(NULL, 0);
@@ -1026,6 +1443,9 @@ void handle_io(void)
 			      "%d (%s)", errno, strerror(errno));
 			goto out;
 		}
+		if (watch_add(&hv_watch, xenevtchn_fd(xce_handle),
+			      POLLIN|POLLPRI))
+			goto out;
 		/* Log the boot dmesg even if VIRQ_CON_RING isn't pending. */
 		handle_hv_logs(xce_handle, true);
 	}
@@ -1039,74 +1459,33 @@ void handle_io(void)
 	enum_domains();
 
 	for (;;) {
-		struct domain *d, *n;
-		int poll_timeout; /* timeout in milliseconds */
-		struct timespec ts;
+		struct domain *d, *n, **pp;
+		int i, poll_timeout = -1; /* timeout in milliseconds */
 		long long now, next_timeout = 0;
+		bool failed = false;
 
-		reset_fds();
-
-		xs_pollfd_idx = set_fds(xs_fileno(xs), POLLIN|POLLPRI);
-
-		if (log_hv)
-			xce_pollfd_idx = set_fds(xenevtchn_fd(xce_handle),
-						 POLLIN|POLLPRI);
-
-		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		if ((now = now_ms()) < 0)
 			break;
-		now = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 
-		/* Re-calculate any event counter allowances & unblock
-		   domains with new allowance */
-		for (d = dom_head; d; d = d->next) {
-			/* CS 16257:955ee4fa1345 introduces a 5ms fuzz
-			 * for select(), it is not clear poll() has
-			 * similar behavior (returning a couple of ms
-			 * sooner than requested) as well. Just leave
-			 * the fuzz here. Remove it with a separate
-			 * patch if necessary */
+		/* Unblock rate limited domains with a new allowance, and
+		   work out when the next of them gets one. */
+		for (pp = &limited_head; (d = *pp) != NULL; ) {
 			if ((now+5) > d->next_period) {
+				*pp = d->next_limited;
+				d->next_limited = NULL;
+				d->rate_limited = false;
 				d->next_period = now + RATE_LIMIT_PERIOD;
-				if (d->event_count >= RATE_LIMIT_ALLOWANCE) {
-					(void)xenevtchn_unmask(d->xce_handle, d->local_port);
-				}
 				d->event_count = 0;
-			}
-		}
-
-		for (d = dom_head; d; d = d->next) {
-			if (d->event_count >= RATE_LIMIT_ALLOWANCE) {
-				/* Determine if we're going to be the next time slice to expire */
+				domain_unmask(d);
+				domain_update_tty_events(d);
+			} else {
 				if (!next_timeout ||
 				    d->next_period < next_timeout)
 					next_timeout = d->next_period;
-			} else if (d->xce_handle != NULL) {
-				if (discard_overflowed_data ||
-				    !d->buffer.max_capacity ||
-				    d->buffer.size < d->buffer.max_capacity) {
-					int evtchn_fd = xenevtchn_fd(d->xce_handle);
-					d->xce_pollfd_idx = set_fds(evtchn_fd,
-								    POLLIN|POLLPRI);
-				}
-			}
-
-			if (d->master_fd != -1) {
-				short events = 0;
-				if (!d->is_dead && ring_free_bytes(d))
-					events |= POLLIN;
-
-				if (!buffer_empty(&d->buffer))
-					events |= POLLOUT;
-
-				if (events)
-					d->master_pollfd_idx =
-						set_fds(d->master_fd,
-							events|POLLPRI);
+				pp = &d->next_limited;
 			}
 		}
 
-		/* If any domain has been rate limited, we need to work
-		   out what timeout to supply to poll */
 		if (next_timeout) {
 			long long duration = (next_timeout - now);
 			if (duration <= 0) /* sanity check */
@@ -1114,7 +1493,7 @@ void handle_io(void)
 			poll_timeout = (int)duration;
 		}
 
-		ret = poll(fds, nr_fds, next_timeout ? poll_timeout : -1);
+		ret = watch_wait(poll_timeout);
 
 		if (log_reload) {
 			int saved_errno = errno;
@@ -1135,61 +1514,63 @@ void handle_io(void)
 			break;
 		}
 
-		if (log_hv && xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
-				dolog(LOG_ERR,
-				      "Failure in poll xce_handle: %d (%s)",
-				      errno, strerror(errno));
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN)
-				handle_hv_logs(xce_handle, false);
+		if ((now = now_ms()) < 0)
+			break;
 
-			xce_pollfd_idx = -1;
-		}
+		/*
+		 * Domains are only freed after the batch, so the watches
+		 * are valid throughout it; a tty closed earlier in the
+		 * batch is skipped.
+		 */
+		for (i = 0; i < ret && !failed; i++) {
+			struct fd_watch *w = ready_events[i].watch;
+			short revents = ready_events[i].revents;
 
-		if (ret <= 0)
-			continue;
+			if (w->fd == -1)
+				continue;
 
-		if (xs_pollfd_idx != -1) {
-			if (fds[xs_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
-				dolog(LOG_ERR,
-				      "Failure in poll xs_handle: %d (%s)",
-				      errno, strerror(errno));
+			switch (w->type) {
+			case WATCH_XS:
+				failed = watch_failed(revents, "xs_handle");
+				if (!failed && (revents & POLLIN))
+					handle_xs();
 				break;
-			} else if (fds[xs_pollfd_idx].revents & POLLIN)
-				handle_xs();
 
-			xs_pollfd_idx = -1;
-		}
+			case WATCH_HV:
+				failed = watch_failed(revents, "xce_handle");
+				if (!failed && (revents & POLLIN))
+					handle_hv_logs(xce_handle, false);
+				break;
 
-		for (d = dom_head; d; d = n) {
-			n = d->next;
-			if (d->event_count < RATE_LIMIT_ALLOWANCE) {
-				if (d->xce_handle != NULL &&
-				    d->xce_pollfd_idx != -1 &&
-				    !(fds[d->xce_pollfd_idx].revents &
-				      ~(POLLIN|POLLOUT|POLLPRI)) &&
-				      (fds[d->xce_pollfd_idx].revents &
-				       POLLIN))
-				    handle_ring_read(d);
-			}
+			case WATCH_EVTCHN:
+				failed = watch_failed(revents, "xce_handle_dom");
+				if (!failed && (revents & POLLIN))
+					handle_ring_events(now);
+				break;
 
-			if (d->master_fd != -1 && d->master_pollfd_idx != -1) {
-				if (fds[d->master_pollfd_idx].revents &
-				    ~(POLLIN|POLLOUT|POLLPRI))
+			case WATCH_TTY:
+				d = w->dom;
+				if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
 					domain_handle_broken_tty(d,
 						   domain_is_valid(d->domid));
-				else {
-					if (fds[d->master_pollfd_idx].revents &
-					    POLLIN)
-						handle_tty_read(d);
-					if (fds[d->master_pollfd_idx].revents &
-					    POLLOUT)
-						handle_tty_write(d);
+					break;
 				}
+				if (revents & POLLIN)
+					handle_tty_read(d);
+				if ((revents & POLLOUT) && d->master_fd != -1)
+					handle_tty_write(d);
+				break;
 			}
+		}
 
-			d->xce_pollfd_idx = d->master_pollfd_idx = -1;
+		if (failed)
+			break;
+
+		if (!domains_changed)
+			continue;
+
+		for (d = dom_head; d; d = n) {
+			n = d->next;
 
 			if (d->last_seen != enum_pass)
 				shutdown_domain(d);
@@ -1197,12 +1578,11 @@ void handle_io(void)
 			if (d->is_dead)
 				cleanup_domain(d);
 		}
+		domains_changed = false;
 	}
 
-	free(fds);
-	current_array_size = 0;
-
  out:
+	watch_fini();
 	if (log_hv_fd != -1) {
 		close(log_hv_fd);
 		log_hv_fd = -1;
@@ -1211,6 +1591,13 @@ void handle_io(void)
 		xenevtchn_close(xce_handle);
 		xce_handle = NULL;
 	}
+	if (xce_handle_dom != NULL) {
+		xenevtchn_close(xce_handle_dom);
+		xce_handle_dom = NULL;
+	}
+	free(port_doms);
+	port_doms = NULL;
+	nr_port_doms = 0;
 	if (xgt_handle != NULL) {
 		xengnttab_close(xgt_handle);
 		xgt_handle = NULL;
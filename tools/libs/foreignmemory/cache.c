@@ -0,0 +1,468 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "private.h"
+
+#define DBGPRINTF(_m...) \
+    xtl_log(fmem->logger, XTL_DEBUG, -1, "xenforeignmemory:cache", _m)
+
+/*
+ * Contiguous runs are mapped exactly as requested and nothing more:
+ * foreign mapping a frame can populate it or page it back in, which a
+ * cache lookup must not do to frames the caller never asked for.  Runs
+ * are hashed by the CACHE_BUCKET_PAGES aligned block their first frame
+ * is in, and a lookup searches back far enough to find any cached run
+ * covering the request.
+ */
+#define CACHE_BUCKET_SHIFT   9
+#define CACHE_BUCKET_PAGES   (1UL << CACHE_BUCKET_SHIFT)
+#define CACHE_HASH_SIZE      256
+
+struct cache_entry {
+    xen_pfn_t gfn;              /* first frame */
+    size_t nr;                  /* frames mapped */
+    void *addr;
+    int cached;                 /* a run, counted in the stats */
+    unsigned int refs;
+    int hashed;                 /* 0 once invalidated or uncached */
+    struct cache_entry *hnext;
+    struct cache_entry *prev, *next;
+};
+
+struct cache_list {
+    struct cache_entry *head, *tail;
+};
+
+struct xenforeignmemory_cache {
+    xenforeignmemory_handle *fmem;
+    uint32_t dom;
+    int prot;
+    size_t max_pages;
+    size_t max_run;             /* longest run ever cached */
+
+    pthread_mutex_t lock;
+
+    struct cache_entry *hash[CACHE_HASH_SIZE];
+    struct cache_list active;   /* referenced entries */
+    struct cache_list lru;      /* unreferenced, least recent first */
+
+    xenforeignmemory_cache_stats stats;
+};
+
+static void list_add_tail(struct cache_list *list, struct cache_entry *e)
+{
+    e->next = NULL;
+    e->prev = list->tail;
+    if ( list->tail )
+        list->tail->next = e;
+    else
+        list->head = e;
+    list->tail = e;
+}
+
+static void list_del(struct cache_list *list, struct cache_entry *e)
+{
+    if ( e->prev )
+        e->prev->next = e->next;
+    else
+        list->head = e->next;
+    if ( e->next )
+        e->next->prev = e->prev;
+    else
+        list->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static unsigned int cache_hash(xen_pfn_t gfn)
+{
+    return (gfn >> CACHE_BUCKET_SHIFT) % CACHE_HASH_SIZE;
+}
+
+static void cache_unhash(xenforeignmemory_cache *cache,
+                         struct cache_entry *e)
+{
+    struct cache_entry **pp;
+
+    if ( !e->hashed )
+        return;
+
+    for ( pp = &cache->hash[cache_hash(e->gfn)]; *pp; pp = &(*pp)->hnext )
+    {
+        if ( *pp == e )
+        {
+            *pp = e->hnext;
+            break;
+        }
+    }
+
+    e->hnext = NULL;
+    e->hashed = 0;
+}
+
+static void cache_free_entry(xenforeignmemory_cache *cache,
+                             struct cache_entry *e)
+{
+    xenforeignmemory_handle *fmem = cache->fmem;
+    int saved_errno = errno;
+
+    if ( osdep_xenforeignmemory_unmap(fmem, e->addr, e->nr) )
+        PERROR("cache: unmap of %zu frames at gfn %#lx failed",
+               e->nr, (unsigned long)e->gfn);
+
+    if ( e->cached )
+    {
+        cache->stats.pages_mapped -= e->nr;
+        cache->stats.entries--;
+    }
+
+    free(e);
+    errno = saved_errno;
+}
+
+/* Drop unreferenced mappings until @pages more would fit. */
+static void cache_evict(xenforeignmemory_cache *cache, size_t pages)
+{
+    struct cache_entry *e;
+
+    while ( cache->stats.pages_mapped + pages > cache->max_pages &&
+            (e = cache->lru.head) != NULL )
+    {
+        list_del(&cache->lru, e);
+        cache_unhash(cache, e);
+        cache_free_entry(cache, e);
+        cache->stats.evictions++;
+    }
+}
+
+static int run_is_contiguous(size_t pages, const xen_pfn_t arr[])
+{
+    size_t i;
+
+    for ( i = 1; i < pages; i++ )
+        if ( arr[i] != arr[0] + i )
+            return 0;
+
+    return 1;
+}
+
+static struct cache_entry *cache_lookup(xenforeignmemory_cache *cache,
+                                        xen_pfn_t gfn, size_t pages)
+{
+    xen_pfn_t base = gfn >> CACHE_BUCKET_SHIFT;
+    xen_pfn_t first = cache->max_run > gfn ? 0 :
+        (gfn - cache->max_run + 1) >> CACHE_BUCKET_SHIFT;
+    struct cache_entry *e;
+    unsigned int i;
+
+    /* Runs starting up to max_run frames back may cover gfn. */
+    for ( i = 0; i < CACHE_HASH_SIZE && base - i >= first; i++ )
+    {
+        for ( e = cache->hash[(base - i) % CACHE_HASH_SIZE]; e; e = e->hnext )
+            if ( e->gfn <= gfn && gfn + pages <= e->gfn + e->nr )
+                return e;
+        if ( base == i )
+            break;
+    }
+
+    return NULL;
+}
+
+static void *cache_map_run(xenforeignmemory_cache *cache,
+                           xen_pfn_t gfn, size_t pages)
+{
+    xenforeignmemory_handle *fmem = cache->fmem;
+    struct cache_entry *e;
+    xen_pfn_t *arr;
+    int *err = NULL;
+    size_t i;
+
+    e = cache_lookup(cache, gfn, pages);
+    if ( e )
+    {
+        if ( !e->refs++ )
+        {
+            list_del(&cache->lru, e);
+            list_add_tail(&cache->active, e);
+        }
+        cache->stats.hits++;
+        return (char *)e->addr + ((gfn - e->gfn) << PAGE_SHIFT);
+    }
+
+    cache->stats.misses++;
+
+    e = calloc(1, sizeof(*e));
+    arr = malloc(pages * sizeof(*arr));
+    err = malloc(pages * sizeof(*err));
+    if ( !e || !arr || !err )
+        goto fail;
+
+    for ( i = 0; i < pages; i++ )
+        arr[i] = gfn + i;
+
+    cache_evict(cache, pages);
+
+    e->addr = osdep_xenforeignmemory_map(fmem, cache->dom, cache->prot,
+                                         pages, arr, err);
+    if ( !e->addr )
+        goto fail;
+
+    e->gfn = gfn;
+    e->nr = pages;
+    e->cached = 1;
+    cache->stats.pages_mapped += pages;
+    cache->stats.entries++;
+
+    for ( i = 0; i < pages; i++ )
+    {
+        if ( err[i] )
+        {
+            /* Not cached: the frame may be there on the next attempt. */
+            cache_free_entry(cache, e);
+            errno = err[i] < 0 ? -err[i] : err[i];
+            e = NULL;
+            goto fail;
+        }
+    }
+
+    free(arr);
+    free(err);
+
+    e->refs = 1;
+    e->hashed = 1;
+    e->hnext = cache->hash[cache_hash(e->gfn)];
+    cache->hash[cache_hash(e->gfn)] = e;
+    list_add_tail(&cache->active, e);
+    if ( pages > cache->max_run )
+        cache->max_run = pages;
+
+    DBGPRINTF("cache: mapped gfn %#lx-%#lx for dom%u",
+              (unsigned long)e->gfn, (unsigned long)(e->gfn + e->nr - 1),
+              cache->dom);
+
+    return e->addr;
+
+ fail:
+    free(arr);
+    free(err);
+    free(e);
+    return NULL;
+}
+
+/*
+ * A scattered pfn array cannot be served from a cached run, since the
+ * caller expects the frames linearly in its address space.  Map it
+ * directly, but track it so xenforeignmemory_cache_unmap() can tell
+ * the two kinds of mapping apart.
+ */
+static void *cache_map_scattered(xenforeignmemory_cache *cache,
+                                 size_t pages, const xen_pfn_t arr[])
+{
+    struct cache_entry *e = calloc(1, sizeof(*e));
+
+    if ( !e )
+        return NULL;
+
+    e->addr = xenforeignmemory_map(cache->fmem, cache->dom, cache->prot,
+                                   pages, arr, NULL);
+    if ( !e->addr )
+    {
+        free(e);
+        return NULL;
+    }
+
+    e->gfn = arr[0];
+    e->nr = pages;
+    e->refs = 1;
+    list_add_tail(&cache->active, e);
+    cache->stats.uncached++;
+
+    return e->addr;
+}
+
+xenforeignmemory_cache *xenforeignmemory_cache_create(
+    xenforeignmemory_handle *fmem, uint32_t dom, int prot, size_t max_pages)
+{
+    xenforeignmemory_cache *cache = calloc(1, sizeof(*cache));
+
+    if ( !cache )
+        return NULL;
+
+    cache->fmem = fmem;
+    cache->dom = dom;
+    cache->prot = prot;
+    cache->max_pages = max_pages ? max_pages :
+        XENFOREIGNMEMORY_CACHE_DEFAULT_PAGES;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+int xenforeignmemory_cache_destroy(xenforeignmemory_cache *cache)
+{
+    xenforeignmemory_handle *fmem;
+    struct cache_entry *e;
+    int busy = 0;
+
+    if ( !cache )
+        return 0;
+
+    fmem = cache->fmem;
+
+    DBGPRINTF("cache: dom%u hits:%"PRIu64" misses:%"PRIu64
+              " uncached:%"PRIu64" evictions:%"PRIu64
+              " invalidations:%"PRIu64,
+              cache->dom, cache->stats.hits, cache->stats.misses,
+              cache->stats.uncached, cache->stats.evictions,
+              cache->stats.invalidations);
+
+    while ( (e = cache->lru.head) != NULL )
+    {
+        list_del(&cache->lru, e);
+        cache_free_entry(cache, e);
+    }
+
+    while ( (e = cache->active.head) != NULL )
+    {
+        list_del(&cache->active, e);
+        cache_free_entry(cache, e);
+        busy++;
+    }
+
+    if ( busy )
+        DBGPRINTF("cache: %d mappings still in use at destroy", busy);
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+
+    return 0;
+}
+
+void *xenforeignmemory_cache_map(xenforeignmemory_cache *cache,
+                                 size_t pages, const xen_pfn_t arr[])
+{
+    void *addr;
+
+    if ( !pages )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    if ( run_is_contiguous(pages, arr) )
+        addr = cache_map_run(cache, arr[0], pages);
+    else
+        addr = cache_map_scattered(cache, pages, arr);
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return addr;
+}
+
+int xenforeignmemory_cache_unmap(xenforeignmemory_cache *cache,
+                                 void *addr, size_t pages)
+{
+    struct cache_entry *e;
+    char *p = addr;
+    int rc = 0;
+
+    pthread_mutex_lock(&cache->lock);
+
+    for ( e = cache->active.tail; e; e = e->prev )
+        if ( p >= (char *)e->addr &&
+             p + (pages << PAGE_SHIFT) <= (char *)e->addr + (e->nr << PAGE_SHIFT) )
+            break;
+
+    if ( !e )
+    {
+        errno = EINVAL;
+        rc = -1;
+        goto out;
+    }
+
+    if ( --e->refs )
+        goto out;
+
+    list_del(&cache->active, e);
+
+    if ( e->hashed )
+    {
+        list_add_tail(&cache->lru, e);
+        cache_evict(cache, 0);
+    }
+    else
+        cache_free_entry(cache, e);
+
+ out:
+    pthread_mutex_unlock(&cache->lock);
+    return rc;
+}
+
+void xenforeignmemory_cache_invalidate(xenforeignmemory_cache *cache,
+                                       xen_pfn_t gfn, size_t pages)
+{
+    struct cache_entry *e, *next;
+    unsigned int i;
+
+    pthread_mutex_lock(&cache->lock);
+
+    for ( i = 0; i < CACHE_HASH_SIZE; i++ )
+    {
+        for ( e = cache->hash[i]; e; e = next )
+        {
+            next = e->hnext;
+
+            if ( pages && (e->gfn + e->nr <= gfn || e->gfn >= gfn + pages) )
+                continue;
+
+            cache_unhash(cache, e);
+            cache->stats.invalidations++;
+
+            /* In-use mappings are dropped on their last unmap. */
+            if ( e->refs )
+                continue;
+
+            list_del(&cache->lru, e);
+            cache_free_entry(cache, e);
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void xenforeignmemory_cache_get_stats(xenforeignmemory_cache *cache,
+                                      xenforeignmemory_cache_stats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
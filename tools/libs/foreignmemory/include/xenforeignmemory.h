@@ -126,6 +126,87 @@ int xenforeignmemory_unmap(xenforeignmemory_handle *fmem,
 int xenforeignmemory_restrict(xenforeignmemory_handle *fmem,
                               domid_t domid);
 
+/*
+ * A mapping cache keeps recently used mappings of one domain alive
+ * across xenforeignmemory_cache_map() calls, so that callers which
+ * repeatedly map the same frames do not pay for a fresh mmap and
+ * hypercall each time.
+ *
+ * Contiguous runs of gfns are mapped as requested and kept, so that a
+ * later request for the same frames, or for part of them, shares the
+ * mapping.  Frames the caller did not ask for are never mapped, since
+ * mapping a frame can populate it or page it in.  Scattered gfn arrays
+ * are mapped directly and released on unmap, as with
+ * xenforeignmemory_map().
+ *
+ * The cache does not track changes to the guest's physmap.  Callers
+ * which know frames have been removed, exchanged or populated (e.g.
+ * on a ballooning or memory exchange notification) must call
+ * xenforeignmemory_cache_invalidate().
+ *
+ * A cache may be shared between threads.  It must be destroyed before
+ * the handle it was created on is closed.
+ */
+typedef struct xenforeignmemory_cache xenforeignmemory_cache;
+
+typedef struct xenforeignmemory_cache_stats {
+    uint64_t hits;          /* served from an existing mapping */
+    uint64_t misses;        /* needed a new mapping */
+    uint64_t uncached;      /* scattered requests mapped directly */
+    uint64_t evictions;     /* mappings dropped to stay within size */
+    uint64_t invalidations; /* mappings dropped by invalidate */
+    uint64_t entries;       /* run mappings currently held */
+    uint64_t pages_mapped;  /* frames covered by those mappings */
+} xenforeignmemory_cache_stats;
+
+/* Upper bound on cached frames used when 0 is passed to create. */
+#define XENFOREIGNMEMORY_CACHE_DEFAULT_PAGES (64UL << 8) /* 64MB */
+
+/*
+ * Create a mapping cache for domain @dom on @fmem.  All mappings are
+ * made with @prot, as for xenforeignmemory_map().  Unreferenced
+ * mappings are dropped, least recently used first, once more than
+ * @max_pages frames are mapped.  Returns NULL and sets errno on
+ * failure.
+ */
+xenforeignmemory_cache *xenforeignmemory_cache_create(
+    xenforeignmemory_handle *fmem, uint32_t dom, int prot, size_t max_pages);
+
+/*
+ * Destroy a cache and unmap everything it holds, including mappings
+ * which have not been released with xenforeignmemory_cache_unmap().
+ */
+int xenforeignmemory_cache_destroy(xenforeignmemory_cache *cache);
+
+/*
+ * Map @pages gfns from @arr linearly, as xenforeignmemory_map() does
+ * with a NULL @err: on failure to map any frame NULL is returned and
+ * errno is set.  The result must be released with
+ * xenforeignmemory_cache_unmap().
+ */
+void *xenforeignmemory_cache_map(xenforeignmemory_cache *cache,
+                                 size_t pages, const xen_pfn_t arr[/*pages*/]);
+
+/*
+ * Release a mapping returned by xenforeignmemory_cache_map().  The
+ * underlying mapping may stay cached.  Returns 0 on success, on
+ * failure sets errno and returns -1.
+ */
+int xenforeignmemory_cache_unmap(xenforeignmemory_cache *cache,
+                                 void *addr, size_t pages);
+
+/*
+ * Drop cached mappings overlapping [@gfn, @gfn + @pages), or all of
+ * them if @pages is 0.  Mappings still in use remain valid for their
+ * current users but are no longer handed out.
+ */
+void xenforeignmemory_cache_invalidate(xenforeignmemory_cache *cache,
+                                       xen_pfn_t gfn, size_t pages);
+
+/* Retrieve a snapshot of the cache's counters. */
+void xenforeignmemory_cache_get_stats(xenforeignmemory_cache *cache,
+                                      xenforeignmemory_cache_stats *stats);
+
 #endif
 
 /*
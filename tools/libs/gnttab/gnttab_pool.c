@@ -0,0 +1,398 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Persistent grant mappings for user space backends.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "private.h"
+
+#define GTDEBUG(_l, _f...) xtl_log(_l, XTL_DEBUG, -1, "gnttab:pool", _f)
+
+#define POOL_HASH_SIZE 1024
+#define POOL_PAGE_SHIFT 12
+
+struct pool_entry {
+    uint32_t domid;
+    uint32_t ref;
+    void *addr;
+    unsigned int users;
+    int persistent;             /* 0 once released, or if never pooled */
+    struct pool_entry *hnext;   /* by (domid, ref), while persistent */
+    struct pool_entry *anext;   /* by address, while mapped */
+    struct pool_entry *prev, *next;
+};
+
+struct pool_list {
+    struct pool_entry *head, *tail;
+};
+
+struct xengnttab_pool {
+    xengnttab_handle *xgt;
+    uint32_t max_grants;
+    int prot;
+
+    pthread_mutex_t lock;
+
+    struct pool_entry *hash[POOL_HASH_SIZE];
+    struct pool_entry *addr_hash[POOL_HASH_SIZE];
+    struct pool_list busy;      /* entries with users */
+    struct pool_list idle;      /* mapped but unused, least recent first */
+    struct pool_list transient; /* mapped past max_grants, in use */
+
+    xengnttab_pool_stats stats;
+};
+
+static void list_add_tail(struct pool_list *list, struct pool_entry *e)
+{
+    e->next = NULL;
+    e->prev = list->tail;
+    if ( list->tail )
+        list->tail->next = e;
+    else
+        list->head = e;
+    list->tail = e;
+}
+
+static void list_del(struct pool_list *list, struct pool_entry *e)
+{
+    if ( e->prev )
+        e->prev->next = e->next;
+    else
+        list->head = e->next;
+    if ( e->next )
+        e->next->prev = e->prev;
+    else
+        list->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static unsigned int pool_hash(uint32_t domid, uint32_t ref)
+{
+    return (ref ^ (domid * 2654435761u)) % POOL_HASH_SIZE;
+}
+
+static struct pool_entry *pool_lookup(xengnttab_pool *pool,
+                                      uint32_t domid, uint32_t ref)
+{
+    struct pool_entry *e;
+
+    for ( e = pool->hash[pool_hash(domid, ref)]; e; e = e->hnext )
+        if ( e->domid == domid && e->ref == ref )
+            return e;
+
+    return NULL;
+}
+
+static unsigned int pool_addr_hash(void *addr)
+{
+    return ((uintptr_t)addr >> POOL_PAGE_SHIFT) % POOL_HASH_SIZE;
+}
+
+/*
+ * Several mappings of one grant can be live at once (transient ones, or
+ * one released by its domain and one mapped since), so puts find their
+ * mapping by the address their get returned.
+ */
+static struct pool_entry *pool_lookup_addr(xengnttab_pool *pool, void *addr)
+{
+    struct pool_entry *e;
+
+    for ( e = pool->addr_hash[pool_addr_hash(addr)]; e; e = e->anext )
+        if ( e->addr == addr )
+            return e;
+
+    return NULL;
+}
+
+static void pool_unhash(xengnttab_pool *pool, struct pool_entry *e)
+{
+    struct pool_entry **pp;
+
+    if ( !e->persistent )
+        return;
+
+    for ( pp = &pool->hash[pool_hash(e->domid, e->ref)]; *pp;
+          pp = &(*pp)->hnext )
+    {
+        if ( *pp == e )
+        {
+            *pp = e->hnext;
+            break;
+        }
+    }
+
+    e->hnext = NULL;
+    e->persistent = 0;
+    pool->stats.persistent--;
+}
+
+static void pool_free_entry(xengnttab_pool *pool, struct pool_entry *e)
+{
+    int saved_errno = errno;
+    struct pool_entry **pp;
+
+    for ( pp = &pool->addr_hash[pool_addr_hash(e->addr)]; *pp;
+          pp = &(*pp)->anext )
+    {
+        if ( *pp == e )
+        {
+            *pp = e->anext;
+            break;
+        }
+    }
+
+    if ( osdep_gnttab_unmap(pool->xgt, e->addr, 1) )
+        GTERROR(pool->xgt->logger, "pool: unmap of dom%u gref %u failed",
+                e->domid, e->ref);
+
+    pool->stats.mapped--;
+    free(e);
+    errno = saved_errno;
+}
+
+/* Unmap the least recently used idle grant.  Returns 0 if none. */
+static int pool_evict_one(xengnttab_pool *pool)
+{
+    struct pool_entry *e = pool->idle.head;
+
+    if ( !e )
+        return 0;
+
+    list_del(&pool->idle, e);
+    pool_unhash(pool, e);
+    pool_free_entry(pool, e);
+    pool->stats.evictions++;
+
+    return 1;
+}
+
+xengnttab_pool *xengnttab_pool_create(xengnttab_handle *xgt,
+                                      uint32_t max_grants, int prot)
+{
+    xengnttab_pool *pool;
+
+    if ( !max_grants )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if ( !pool )
+        return NULL;
+
+    pool->xgt = xgt;
+    pool->max_grants = max_grants;
+    pool->prot = prot;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return pool;
+}
+
+static void pool_drain(xengnttab_pool *pool, struct pool_list *list)
+{
+    struct pool_entry *e;
+
+    while ( (e = list->head) != NULL )
+    {
+        list_del(list, e);
+        pool_unhash(pool, e);
+        pool_free_entry(pool, e);
+    }
+}
+
+int xengnttab_pool_destroy(xengnttab_pool *pool)
+{
+    if ( !pool )
+        return 0;
+
+    GTDEBUG(pool->xgt->logger,
+            "pool: hits:%"PRIu64" misses:%"PRIu64" transient:%"PRIu64
+            " evictions:%"PRIu64, pool->stats.hits, pool->stats.misses,
+            pool->stats.transient, pool->stats.evictions);
+
+    pool_drain(pool, &pool->idle);
+    pool_drain(pool, &pool->busy);
+    pool_drain(pool, &pool->transient);
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+
+    return 0;
+}
+
+void *xengnttab_pool_get(xengnttab_pool *pool, uint32_t domid, uint32_t ref)
+{
+    struct pool_entry *e;
+    void *addr = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    e = pool_lookup(pool, domid, ref);
+    if ( e )
+    {
+        if ( !e->users++ )
+        {
+            list_del(&pool->idle, e);
+            list_add_tail(&pool->busy, e);
+        }
+        pool->stats.hits++;
+        addr = e->addr;
+        goto out;
+    }
+
+    pool->stats.misses++;
+
+    e = calloc(1, sizeof(*e));
+    if ( !e )
+        goto out;
+
+    if ( pool->stats.persistent >= pool->max_grants )
+        pool_evict_one(pool);
+
+    e->addr = osdep_gnttab_grant_map(pool->xgt, 1, 0, pool->prot,
+                                     &domid, &ref, -1, -1);
+    if ( !e->addr )
+    {
+        free(e);
+        goto out;
+    }
+
+    e->domid = domid;
+    e->ref = ref;
+    e->users = 1;
+    e->anext = pool->addr_hash[pool_addr_hash(e->addr)];
+    pool->addr_hash[pool_addr_hash(e->addr)] = e;
+    pool->stats.mapped++;
+
+    if ( pool->stats.persistent < pool->max_grants )
+    {
+        unsigned int h = pool_hash(domid, ref);
+
+        e->persistent = 1;
+        e->hnext = pool->hash[h];
+        pool->hash[h] = e;
+        list_add_tail(&pool->busy, e);
+        pool->stats.persistent++;
+    }
+    else
+    {
+        /* Every pooled grant is in use: map this one for this use only. */
+        list_add_tail(&pool->transient, e);
+        pool->stats.transient++;
+    }
+
+    addr = e->addr;
+
+ out:
+    pthread_mutex_unlock(&pool->lock);
+    return addr;
+}
+
+int xengnttab_pool_put(xengnttab_pool *pool, void *addr)
+{
+    struct pool_entry *e;
+    int rc = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    e = pool_lookup_addr(pool, addr);
+    if ( !e || !e->users )
+    {
+        errno = ENOENT;
+        rc = -1;
+        goto out;
+    }
+
+    if ( --e->users )
+        goto out;
+
+    if ( e->persistent )
+    {
+        list_del(&pool->busy, e);
+        list_add_tail(&pool->idle, e);
+    }
+    else
+    {
+        list_del(&pool->transient, e);
+        pool_free_entry(pool, e);
+    }
+
+ out:
+    pthread_mutex_unlock(&pool->lock);
+    return rc;
+}
+
+int xengnttab_pool_release_domain(xengnttab_pool *pool, uint32_t domid)
+{
+    struct pool_entry *e, *next;
+    int busy = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for ( e = pool->idle.head; e; e = next )
+    {
+        next = e->next;
+        if ( e->domid != domid )
+            continue;
+        list_del(&pool->idle, e);
+        pool_unhash(pool, e);
+        pool_free_entry(pool, e);
+    }
+
+    /*
+     * Grants still in use are unmapped by their last put, as if they
+     * had been mapped transiently.
+     */
+    for ( e = pool->busy.head; e; e = next )
+    {
+        next = e->next;
+        if ( e->domid != domid )
+            continue;
+        list_del(&pool->busy, e);
+        pool_unhash(pool, e);
+        list_add_tail(&pool->transient, e);
+    }
+
+    for ( e = pool->transient.head; e; e = e->next )
+        if ( e->domid == domid )
+            busy++;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return busy;
+}
+
+void xengnttab_pool_get_stats(xengnttab_pool *pool,
+                              xengnttab_pool_stats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
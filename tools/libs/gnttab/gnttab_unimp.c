@@ -84,6 +84,38 @@ int xengnttab_grant_copy(xengnttab_handle *xgt,
 {
     abort();
 }
+
+xengnttab_pool *xengnttab_pool_create(xengnttab_handle *xgt,
+                                      uint32_t max_grants, int prot)
+{
+    abort();
+}
+
+int xengnttab_pool_destroy(xengnttab_pool *pool)
+{
+    return 0;
+}
+
+void *xengnttab_pool_get(xengnttab_pool *pool, uint32_t domid, uint32_t ref)
+{
+    abort();
+}
+
+int xengnttab_pool_put(xengnttab_pool *pool, void *addr)
+{
+    abort();
+}
+
+int xengnttab_pool_release_domain(xengnttab_pool *pool, uint32_t domid)
+{
+    abort();
+}
+
+void xengnttab_pool_get_stats(xengnttab_pool *pool,
+                              xengnttab_pool_stats *stats)
+{
+    abort();
+}
 /*
  * Local variables:
  * mode: C
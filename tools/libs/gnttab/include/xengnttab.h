@@ -286,6 +286,72 @@ int xengnttab_grant_copy(xengnttab_handle *xgt,
                          uint32_t count,
                          xengnttab_grant_copy_segment_t *segs);
 
+/*
+ * Persistent grant pool.
+ *
+ * A pool keeps single page grant mappings alive after use, so that a
+ * backend whose frontend reuses a fixed set of grant references (as
+ * blkif does with feature-persistent) maps each reference once rather
+ * than mapping and unmapping it around every request.
+ *
+ * At most @max_grants mappings are kept.  When the pool is full the
+ * least recently used idle mapping is unmapped; if every pooled grant
+ * is in use the new grant is mapped for the duration of that use only.
+ *
+ * A pool may be shared between threads.  It must be destroyed before
+ * the handle it was created on is closed.
+ */
+typedef struct xengnttab_pool xengnttab_pool;
+
+typedef struct xengnttab_pool_stats {
+    uint64_t hits;          /* served from an existing mapping */
+    uint64_t misses;        /* needed a new mapping */
+    uint64_t transient;     /* mapped outside the pool, pool full */
+    uint64_t evictions;     /* idle mappings dropped to make room */
+    uint64_t persistent;    /* mappings currently held by the pool */
+    uint64_t mapped;        /* all mappings currently made by the pool */
+} xengnttab_pool_stats;
+
+/**
+ * Create a pool of at most @max_grants persistent mappings on @xgt.
+ * Grants are mapped with @prot, as for xengnttab_map_grant_ref().
+ * Returns NULL and sets errno on failure.
+ */
+xengnttab_pool *xengnttab_pool_create(xengnttab_handle *xgt,
+                                      uint32_t max_grants, int prot);
+
+/**
+ * Unmap every grant held by @pool, in use or not, and free it.
+ */
+int xengnttab_pool_destroy(xengnttab_pool *pool);
+
+/**
+ * Return the mapping of @ref from @domid, mapping it if it is not
+ * already pooled.  Each successful call must be paired with
+ * xengnttab_pool_put().  Returns NULL and sets errno on failure.
+ */
+void *xengnttab_pool_get(xengnttab_pool *pool, uint32_t domid, uint32_t ref);
+
+/**
+ * Drop the use of the mapping at @addr, as returned by
+ * xengnttab_pool_get().  The mapping stays pooled for later reuse.
+ * Returns 0 on success, on failure sets errno and returns -1.
+ */
+int xengnttab_pool_put(xengnttab_pool *pool, void *addr);
+
+/**
+ * Unmap all pooled grants of @domid, e.g. when its frontend
+ * disconnects.  Grants still in use are unmapped by their last put.
+ * Returns the number of such grants.
+ */
+int xengnttab_pool_release_domain(xengnttab_pool *pool, uint32_t domid);
+
+/**
+ * Retrieve a snapshot of the pool's counters.
+ */
+void xengnttab_pool_get_stats(xengnttab_pool *pool,
+                              xengnttab_pool_stats *stats);
+
 /*
  * Grant Sharing Interface (allocating and granting pages to others)
  */
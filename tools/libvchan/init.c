@@ -45,25 +45,7 @@
 #include <xen/sys/gntdev.h>
 #include <libxenvchan.h>
 
-#ifndef PAGE_SHIFT
-#define PAGE_SHIFT 12
-#endif
-
-#ifndef PAGE_SIZE
-#define PAGE_SIZE 4096
-#endif
-
-#define SMALL_RING_SHIFT 10
-#define LARGE_RING_SHIFT 11
-
-#define MAX_SMALL_RING (1 << SMALL_RING_SHIFT)
-#define SMALL_RING_OFFSET 1024
-#define MAX_LARGE_RING (1 << LARGE_RING_SHIFT)
-#define LARGE_RING_OFFSET 2048
-
-// if you go over this size, you'll have too many grants to fit in the shared page.
-#define MAX_RING_SHIFT 20
-#define MAX_RING_SIZE (1 << MAX_RING_SHIFT)
+#include "private.h"
 
 #ifndef offsetof
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
@@ -286,7 +268,7 @@ static int init_xs_srv(struct libxenvchan *ctrl, int domain, const char* xs_base
 	return ret;
 }
 
-static int min_order(size_t siz)
+int vchan_min_order(size_t siz)
 {
 	int rv = PAGE_SHIFT;
 	while (siz > (1 << rv))
@@ -311,9 +293,14 @@ struct libxenvchan *libxenvchan_server_init(struct xentoollog_logger *logger,
 	ctrl->event = NULL;
 	ctrl->is_server = 1;
 	ctrl->server_persist = 0;
+	ctrl->poll_max_us = ctrl->poll_us = 0;
+	ctrl->domain = domain;
+	ctrl->write_reserved = 0;
+	ctrl->resize = 0;
+	ctrl->resize_page = NULL;
 
-	ctrl->read.order = min_order(left_min);
-	ctrl->write.order = min_order(right_min);
+	ctrl->read.order = vchan_min_order(left_min);
+	ctrl->write.order = vchan_min_order(right_min);
 
 	// if we can avoid allocating extra pages by using in-page rings, do so
 	if (left_min <= MAX_SMALL_RING && right_min <= MAX_LARGE_RING) {
@@ -393,6 +380,11 @@ struct libxenvchan *libxenvchan_client_init(struct xentoollog_logger *logger,
 	ctrl->gnttab = NULL;
 	ctrl->write.order = ctrl->read.order = 0;
 	ctrl->is_server = 0;
+	ctrl->poll_max_us = ctrl->poll_us = 0;
+	ctrl->domain = domain;
+	ctrl->write_reserved = 0;
+	ctrl->resize = 0;
+	ctrl->resize_page = NULL;
 
 	xs = xs_daemon_open();
 	if (!xs)
@@ -431,7 +423,7 @@ struct libxenvchan *libxenvchan_client_init(struct xentoollog_logger *logger,
 		goto fail;
 
 	ctrl->ring->cli_live = 1;
-	ctrl->ring->srv_notify = VCHAN_NOTIFY_WRITE;
+	ctrl->ring->srv_notify = VCHAN_NOTIFY_WRITE | VCHAN_RESIZE_CAPABLE;
 
  out:
 	if (xs)
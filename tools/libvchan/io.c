@@ -35,19 +35,13 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <xenctrl.h>
 #include <libxenvchan.h>
 
-#ifndef PAGE_SHIFT
-#define PAGE_SHIFT 12
-#endif
-
-#ifndef PAGE_SIZE
-#define PAGE_SIZE 4096
-#endif
-
+#include "private.h"
 
 static inline uint32_t rd_prod(struct libxenvchan *ctrl)
 {
@@ -118,6 +112,12 @@ static inline int raw_get_data_ready(struct libxenvchan *ctrl)
 {
 	uint32_t ready = rd_prod(ctrl) - rd_cons(ctrl);
 	xen_mb(); /* Ensure 'ready' is read only once. */
+	/*
+	 * If the writer has moved to a resized ring, data past our consumer
+	 * index is in the new ring: follow it before anything is read.
+	 */
+	if (vchan_resize_pending(ctrl))
+		vchan_resize_progress(ctrl);
 	if (ready > rd_ring_size(ctrl))
 		/* We have no way to return errors.  Locking up the ring is
 		 * better than the alternatives. */
@@ -125,12 +125,53 @@ static inline int raw_get_data_ready(struct libxenvchan *ctrl)
 	return ready;
 }
 
+/**
+ * Busy-wait for the peer to move the ring indexes before asking it for a
+ * notification.  If the peer is active on another CPU this saves it the
+ * event channel send, and us the wakeup.  The time spent is adapted to how
+ * often it pays off: it doubles (up to poll_max_us) after a successful poll
+ * and halves after one that timed out.
+ *
+ * Returns the new value of get(), or 0 if the poll timed out.
+ */
+static int poll_ring(struct libxenvchan *ctrl,
+                     int (*get)(struct libxenvchan *))
+{
+	struct timespec start, now;
+	unsigned int min_us = ctrl->poll_max_us / 16 ? : 1;
+	long elapsed;
+	int ready;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		ready = get(ctrl);
+		if (ready) {
+			ctrl->poll_us *= 2;
+			if (ctrl->poll_us > ctrl->poll_max_us)
+				ctrl->poll_us = ctrl->poll_max_us;
+			return ready;
+		}
+		if (!libxenvchan_is_open(ctrl))
+			return 0;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000000 +
+			(now.tv_nsec - start.tv_nsec) / 1000;
+	} while (elapsed < ctrl->poll_us);
+
+	ctrl->poll_us /= 2;
+	if (ctrl->poll_us < min_us)
+		ctrl->poll_us = min_us;
+	return 0;
+}
+
 /**
  * Get the amount of buffer space available and enable notifications if needed.
  */
 static inline int fast_get_data_ready(struct libxenvchan *ctrl, size_t request)
 {
 	int ready = raw_get_data_ready(ctrl);
+	if (!ready && ctrl->blocking && ctrl->poll_max_us)
+		ready = poll_ring(ctrl, raw_get_data_ready);
 	if (ready >= request)
 		return ready;
 	/* We plan to consume all data; please tell us if you send more */
@@ -143,6 +184,16 @@ static inline int fast_get_data_ready(struct libxenvchan *ctrl, size_t request)
 	return raw_get_data_ready(ctrl);
 }
 
+/**
+ * Stream reads take whatever data is there.  In blocking mode they only need
+ * a notification when about to wait for more, so do not ask for one while
+ * any data is ready; a later call that finds the ring empty will.
+ */
+static inline int stream_get_data_ready(struct libxenvchan *ctrl, size_t request)
+{
+	return fast_get_data_ready(ctrl, ctrl->blocking ? 1 : request);
+}
+
 int libxenvchan_data_ready(struct libxenvchan *ctrl)
 {
 	/* Since this value is being used outside libxenvchan, request notification
@@ -167,12 +218,33 @@ static inline int raw_get_buffer_space(struct libxenvchan *ctrl)
 	return ready;
 }
 
+/**
+ * While a resize is pending, stop filling the old send ring and wait for the
+ * reader to drain it, so our writes can move to the new one.  Returns 0 if
+ * we have to wait.
+ */
+static int resize_write_ready(struct libxenvchan *ctrl)
+{
+	vchan_resize_progress(ctrl);
+	if (!(ctrl->resize & VCHAN_RESIZING) || (ctrl->resize & VCHAN_RESIZED_WRITE))
+		return 1;
+	/* Please tell us when the old ring is empty */
+	request_notify(ctrl, VCHAN_NOTIFY_READ);
+	vchan_resize_progress(ctrl);
+	return (ctrl->resize & VCHAN_RESIZED_WRITE) || !(ctrl->resize & VCHAN_RESIZING);
+}
+
 /**
  * Get the amount of buffer space available and enable notifications if needed.
  */
 static inline int fast_get_buffer_space(struct libxenvchan *ctrl, size_t request)
 {
-	int ready = raw_get_buffer_space(ctrl);
+	int ready;
+	if (vchan_resize_pending(ctrl) && !resize_write_ready(ctrl))
+		return 0;
+	ready = raw_get_buffer_space(ctrl);
+	if (!ready && ctrl->blocking && ctrl->poll_max_us)
+		ready = poll_ring(ctrl, raw_get_buffer_space);
 	if (ready >= request)
 		return ready;
 	/* We plan to fill the buffer; please tell us when you've read it */
@@ -185,6 +257,12 @@ static inline int fast_get_buffer_space(struct libxenvchan *ctrl, size_t request
 	return raw_get_buffer_space(ctrl);
 }
 
+/* As stream_get_data_ready, for stream writes. */
+static inline int stream_get_buffer_space(struct libxenvchan *ctrl, size_t request)
+{
+	return fast_get_buffer_space(ctrl, ctrl->blocking ? 1 : request);
+}
+
 int libxenvchan_buffer_space(struct libxenvchan *ctrl)
 {
 	/* Since this value is being used outside libxenvchan, request notification
@@ -200,6 +278,8 @@ int libxenvchan_wait(struct libxenvchan *ctrl)
 	if (ret < 0)
 		return -1;
 	xenevtchn_unmask(ctrl->event, ret);
+	if (vchan_resize_pending(ctrl))
+		vchan_resize_progress(ctrl);
 	return 0;
 }
 
@@ -208,19 +288,27 @@ int libxenvchan_wait(struct libxenvchan *ctrl)
  *
  * caller must have checked that enough space is available
  */
-static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
+/**
+ * Copy size bytes into the send ring, offset bytes past the producer index.
+ * The data is not visible to the peer until commit_send().
+ */
+static void ring_put(struct libxenvchan *ctrl, uint32_t offset,
+                     const void *data, size_t size)
 {
-	int real_idx = wr_prod(ctrl) & (wr_ring_size(ctrl) - 1);
+	int real_idx = (wr_prod(ctrl) + offset) & (wr_ring_size(ctrl) - 1);
 	int avail_contig = wr_ring_size(ctrl) - real_idx;
 	if (avail_contig > size)
 		avail_contig = size;
-	xen_mb(); /* read indexes /then/ write data */
 	memcpy(wr_ring(ctrl) + real_idx, data, avail_contig);
 	if (avail_contig < size)
 	{
 		// we rolled across the end of the ring
 		memcpy(wr_ring(ctrl), data + avail_contig, size - avail_contig);
 	}
+}
+
+static int commit_send(struct libxenvchan *ctrl, size_t size)
+{
 	xen_wmb(); /* write data /then/ notify */
 	wr_prod(ctrl) += size;
 	if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
@@ -228,6 +316,39 @@ static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
 	return size;
 }
 
+static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
+{
+	xen_mb(); /* read indexes /then/ write data */
+	ring_put(ctrl, 0, data, size);
+	return commit_send(ctrl, size);
+}
+
+/**
+ * Like do_send, but gathers size bytes from iov starting skip bytes in,
+ * and notifies the peer once for the lot.
+ */
+static int do_sendv(struct libxenvchan *ctrl, const struct iovec *iov,
+                    int iovcnt, size_t skip, size_t size)
+{
+	size_t done = 0, len;
+	int i;
+
+	xen_mb(); /* read indexes /then/ write data */
+	for (i = 0; i < iovcnt && done < size; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		len = iov[i].iov_len - skip;
+		if (len > size - done)
+			len = size - done;
+		ring_put(ctrl, done, iov[i].iov_base + skip, len);
+		done += len;
+		skip = 0;
+	}
+	return commit_send(ctrl, size);
+}
+
 /**
  * returns 0 if no buffer space is available, -1 on error, or size on success
  */
@@ -257,7 +378,7 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
 	if (ctrl->blocking) {
 		size_t pos = 0;
 		while (1) {
-			avail = fast_get_buffer_space(ctrl, size - pos);
+			avail = stream_get_buffer_space(ctrl, size - pos);
 			if (pos + avail > size)
 				avail = size - pos;
 			if (avail)
@@ -270,7 +391,7 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
 				return -1;
 		}
 	} else {
-		avail = fast_get_buffer_space(ctrl, size);
+		avail = stream_get_buffer_space(ctrl, size);
 		if (size > avail)
 			size = avail;
 		if (size == 0)
@@ -279,24 +400,111 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
 	}
 }
 
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t size = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+	return size;
+}
+
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov,
+                       int iovcnt)
+{
+	size_t size = iov_length(iov, iovcnt);
+	int avail;
+	if (!libxenvchan_is_open(ctrl))
+		return -1;
+	if (ctrl->blocking) {
+		size_t pos = 0;
+		while (1) {
+			avail = stream_get_buffer_space(ctrl, size - pos);
+			if (pos + avail > size)
+				avail = size - pos;
+			if (avail) {
+				if (do_sendv(ctrl, iov, iovcnt, pos, avail) < 0)
+					return -1;
+				pos += avail;
+			}
+			if (pos == size)
+				return pos;
+			if (libxenvchan_wait(ctrl))
+				return -1;
+			if (!libxenvchan_is_open(ctrl))
+				return -1;
+		}
+	} else {
+		avail = stream_get_buffer_space(ctrl, size);
+		if (size > avail)
+			size = avail;
+		if (size == 0)
+			return 0;
+		return do_sendv(ctrl, iov, iovcnt, 0, size);
+	}
+}
+
+int libxenvchan_write_reserve(struct libxenvchan *ctrl, void **data,
+                              size_t size)
+{
+	while (1) {
+		int avail, real_idx, avail_contig;
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		avail = stream_get_buffer_space(ctrl, size);
+		if (avail) {
+			real_idx = wr_prod(ctrl) & (wr_ring_size(ctrl) - 1);
+			avail_contig = wr_ring_size(ctrl) - real_idx;
+			if (avail > avail_contig)
+				avail = avail_contig;
+			if (avail > size)
+				avail = size;
+			xen_mb(); /* read indexes /then/ caller writes data */
+			*data = wr_ring(ctrl) + real_idx;
+			ctrl->write_reserved = 1;
+			return avail;
+		}
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size)
+{
+	ctrl->write_reserved = 0;
+	if (size > raw_get_buffer_space(ctrl))
+		return -1;
+	return commit_send(ctrl, size);
+}
+
 /**
  * returns -1 on error, or size on success
  *
  * caller must have checked that enough data is available
  */
-static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
+/**
+ * Copy size bytes out of the receive ring, offset bytes past the consumer
+ * index.  The space is not released to the peer until commit_recv().
+ */
+static void ring_get(struct libxenvchan *ctrl, uint32_t offset,
+                     void *data, size_t size)
 {
-	int real_idx = rd_cons(ctrl) & (rd_ring_size(ctrl) - 1);
+	int real_idx = (rd_cons(ctrl) + offset) & (rd_ring_size(ctrl) - 1);
 	int avail_contig = rd_ring_size(ctrl) - real_idx;
 	if (avail_contig > size)
 		avail_contig = size;
-	xen_rmb(); /* data read must happen /after/ rd_cons read */
 	memcpy(data, rd_ring(ctrl) + real_idx, avail_contig);
 	if (avail_contig < size)
 	{
 		// we rolled across the end of the ring
 		memcpy(data + avail_contig, rd_ring(ctrl), size - avail_contig);
 	}
+}
+
+static int commit_recv(struct libxenvchan *ctrl, size_t size)
+{
 	xen_mb(); /* consume /then/ notify */
 	rd_cons(ctrl) += size;
 	if (send_notify(ctrl, VCHAN_NOTIFY_READ))
@@ -304,6 +512,30 @@ static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
 	return size;
 }
 
+static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
+{
+	xen_rmb(); /* data read must happen /after/ rd_cons read */
+	ring_get(ctrl, 0, data, size);
+	return commit_recv(ctrl, size);
+}
+
+static int do_recvv(struct libxenvchan *ctrl, const struct iovec *iov,
+                    int iovcnt, size_t size)
+{
+	size_t done = 0, len;
+	int i;
+
+	xen_rmb(); /* data read must happen /after/ rd_cons read */
+	for (i = 0; i < iovcnt && done < size; i++) {
+		len = iov[i].iov_len;
+		if (len > size - done)
+			len = size - done;
+		ring_get(ctrl, done, iov[i].iov_base, len);
+		done += len;
+	}
+	return commit_recv(ctrl, size);
+}
+
 /**
  * reads exactly size bytes from the vchan.
  * returns 0 if insufficient data is available, -1 on error, or size on success
@@ -328,7 +560,7 @@ int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
 int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
 {
 	while (1) {
-		int avail = fast_get_data_ready(ctrl, size);
+		int avail = stream_get_data_ready(ctrl, size);
 		if (avail && size > avail)
 			size = avail;
 		if (avail)
@@ -342,6 +574,62 @@ int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
 	}
 }
 
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov,
+                      int iovcnt)
+{
+	size_t size = iov_length(iov, iovcnt);
+	while (1) {
+		int avail = stream_get_data_ready(ctrl, size);
+		if (avail && size > avail)
+			size = avail;
+		if (avail)
+			return do_recvv(ctrl, iov, iovcnt, size);
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_read_peek(struct libxenvchan *ctrl, const void **data,
+                          size_t size)
+{
+	while (1) {
+		int avail = stream_get_data_ready(ctrl, size);
+		if (avail) {
+			int real_idx = rd_cons(ctrl) & (rd_ring_size(ctrl) - 1);
+			int avail_contig = rd_ring_size(ctrl) - real_idx;
+			if (avail > avail_contig)
+				avail = avail_contig;
+			if (avail > size)
+				avail = size;
+			xen_rmb(); /* data read must happen /after/ rd_cons read */
+			*data = rd_ring(ctrl) + real_idx;
+			return avail;
+		}
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return 0;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_read_consume(struct libxenvchan *ctrl, size_t size)
+{
+	if (size > raw_get_data_ready(ctrl))
+		return -1;
+	return commit_recv(ctrl, size);
+}
+
+void libxenvchan_set_poll(struct libxenvchan *ctrl, unsigned int max_us)
+{
+	ctrl->poll_max_us = ctrl->poll_us = max_us;
+}
+
 int libxenvchan_is_open(struct libxenvchan* ctrl)
 {
 	if (ctrl->is_server)
@@ -359,6 +647,7 @@ void libxenvchan_close(struct libxenvchan *ctrl)
 {
 	if (!ctrl)
 		return;
+	vchan_resize_release(ctrl);
 	if (ctrl->read.order >= PAGE_SHIFT)
 		munmap(ctrl->read.buffer, 1 << ctrl->read.order);
 	if (ctrl->write.order >= PAGE_SHIFT)
@@ -42,6 +42,7 @@
  *  compile time, so the macros in ring.h cannot be used to access the rings.
  */
 
+#include <sys/uio.h>
 #include <xen/io/libxenvchan.h>
 #include <xen/sys/evtchn.h>
 #include <xenevtchn.h>
@@ -85,6 +86,17 @@ struct libxenvchan {
 	int blocking:1;
 	/* communication rings */
 	struct libxenvchan_ring read, write;
+	/* busy-wait limit and current budget before blocking, in microseconds */
+	unsigned int poll_max_us, poll_us;
+	/* peer domain, to grant or map rings on resize */
+	int domain;
+	/* true between libxenvchan_write_reserve() and _commit() */
+	int write_reserved;
+	/* ring resize in progress: local state and the rings to move to */
+	int resize;
+	struct libxenvchan_ring next_read, next_write;
+	/* server: granted page describing the new rings */
+	struct vchan_resize *resize_page;
 };
 
 /**
@@ -152,6 +164,88 @@ int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size);
  *         the vchan is nonblocking)
  */
 int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size);
+/**
+ * Vectored stream-based receive: reads as much data as possible into the
+ * buffers of iov, filling each in turn.  The peer is notified once.
+ * @param ctrl The vchan control structure
+ * @param iov Buffers for data that was read
+ * @param iovcnt Number of buffers
+ * @return -1 on error, otherwise the amount of data read (which may be zero if
+ *         the vchan is nonblocking)
+ */
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Vectored stream-based send: send as much data as possible from the buffers
+ * of iov, in order.  The peer is notified once per batch of data that fits in
+ * the ring, rather than once per buffer.
+ * @param ctrl The vchan control structure
+ * @param iov Buffers of data to send
+ * @param iovcnt Number of buffers
+ * @return -1 on error, otherwise the amount of data sent (which may be zero if
+ *         the vchan is nonblocking)
+ */
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Zero-copy send, first step: find free space in the send ring to build data
+ * in place.  The space is contiguous, so may be less than requested when it
+ * would wrap around the end of the ring.  Nothing is sent until
+ * libxenvchan_write_commit() is called.
+ * @param ctrl The vchan control structure
+ * @param data Set to the start of the free space
+ * @param size Amount of space wanted
+ * @return -1 on error, otherwise the amount of space at *data, at most $size
+ *         (which may be zero if the vchan is nonblocking)
+ */
+int libxenvchan_write_reserve(struct libxenvchan *ctrl, void **data, size_t size);
+/**
+ * Zero-copy send, second step: send the first $size bytes written at the
+ * location returned by libxenvchan_write_reserve().
+ * @return -1 on error, or $size
+ */
+int libxenvchan_write_commit(struct libxenvchan *ctrl, size_t size);
+/**
+ * Zero-copy receive, first step: find data in the receive ring to use in
+ * place.  The data is contiguous, so may be less than is ready when it wraps
+ * around the end of the ring.  It remains valid until consumed.
+ * @param ctrl The vchan control structure
+ * @param data Set to the start of the data
+ * @param size Largest amount of data wanted
+ * @return -1 on error, otherwise the amount of data at *data, at most $size
+ *         (which may be zero if the vchan is nonblocking)
+ */
+int libxenvchan_read_peek(struct libxenvchan *ctrl, const void **data, size_t size);
+/**
+ * Zero-copy receive, second step: release the first $size bytes returned by
+ * libxenvchan_read_peek() back to the sender.
+ * @return -1 on error, or $size
+ */
+int libxenvchan_read_consume(struct libxenvchan *ctrl, size_t size);
+/**
+ * Allow blocking operations to busy-wait up to max_us microseconds for the
+ * peer when the ring is empty (or full) before asking it for an event.  When
+ * the peer keeps up, this avoids an event channel notification per message.
+ * The wait is shortened automatically while it is not paying off.  Disabled
+ * (0) by default.
+ */
+void libxenvchan_set_poll(struct libxenvchan *ctrl, unsigned int max_us);
+/**
+ * Resize both rings of a connected vchan without interrupting it [server
+ * only].  New rings of at least the given sizes (up to 1MB each, and at least
+ * one page) are granted to the client, and each side moves over to them once
+ * it has drained the old ones.  Writes wait for the old ring to drain rather
+ * than queue more data behind it.  The resize completes as both ends keep
+ * using the vchan, or call libxenvchan_wait(); the client must have been built
+ * with resize support.
+ * @param ctrl The vchan control structure
+ * @param read_min The minimum size (in bytes) of the new receive ring (left)
+ * @param write_min The minimum size (in bytes) of the new send ring (right)
+ * @return -1 on error (EBUSY if a resize is in progress), or 0 once started
+ */
+int libxenvchan_resize(struct libxenvchan *ctrl, size_t read_min, size_t write_min);
+/**
+ * Returns 1 while a ring resize is in progress on this end, otherwise 0.
+ */
+int libxenvchan_resize_pending(struct libxenvchan *ctrl);
 /**
  * Waits for reads or writes to unblock, or for a close
  */
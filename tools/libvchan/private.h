@@ -0,0 +1,69 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ *
+ *  Definitions shared between the setup, ring and resize code.
+ */
+
+#ifndef LIBVCHAN_PRIVATE_H
+#define LIBVCHAN_PRIVATE_H
+
+/* Include after <libxenvchan.h>, which cannot be included twice. */
+
+#ifndef PAGE_SHIFT
+#define PAGE_SHIFT 12
+#endif
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+#define SMALL_RING_SHIFT 10
+#define LARGE_RING_SHIFT 11
+
+#define MAX_SMALL_RING (1 << SMALL_RING_SHIFT)
+#define SMALL_RING_OFFSET 1024
+#define MAX_LARGE_RING (1 << LARGE_RING_SHIFT)
+#define LARGE_RING_OFFSET 2048
+
+// if you go over this size, you'll have too many grants to fit in the shared page.
+#define MAX_RING_SHIFT 20
+#define MAX_RING_SIZE (1 << MAX_RING_SHIFT)
+
+/* ctrl->resize: local progress of a ring resize */
+#define VCHAN_RESIZING 0x1
+#define VCHAN_RESIZED_READ 0x2
+#define VCHAN_RESIZED_WRITE 0x4
+
+int vchan_min_order(size_t siz);
+
+/**
+ * Advance a ring resize the peer or we started, as far as possible without
+ * waiting.  Only called while VCHAN_RESIZE_PENDING is set.
+ */
+void vchan_resize_progress(struct libxenvchan *ctrl);
+
+/* Release the rings of a resize still in progress, on close. */
+void vchan_resize_release(struct libxenvchan *ctrl);
+
+static inline int vchan_resize_pending(struct libxenvchan *ctrl)
+{
+	return ctrl->ring->srv_notify & VCHAN_RESIZE_PENDING;
+}
+
+#endif
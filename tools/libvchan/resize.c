@@ -0,0 +1,295 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains the online ring resize, following the handshake
+ *  described in xen/io/libxenvchan.h.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <xenctrl.h>
+#include <libxenvchan.h>
+
+#include "private.h"
+
+static inline uint8_t *resize_bits(struct libxenvchan *ctrl)
+{
+	return &ctrl->ring->srv_notify;
+}
+
+static int ring_pages(int order)
+{
+	return order >= PAGE_SHIFT ? 1 << (order - PAGE_SHIFT) : 0;
+}
+
+/*
+ * Index of the grants[] slot holding the vchan_resize page, just after the
+ * grants of the current rings.
+ */
+static int resize_slot(struct libxenvchan *ctrl)
+{
+	return ring_pages(ctrl->read.order) + ring_pages(ctrl->write.order);
+}
+
+/* Release the pages of a ring we no longer use; in-page rings have none. */
+static void release_ring(struct libxenvchan *ctrl, struct libxenvchan_ring *r)
+{
+	int pages = ring_pages(r->order);
+
+	if (!pages)
+		return;
+	if (ctrl->is_server)
+		xengntshr_unshare(ctrl->gntshr, r->buffer, pages);
+	else
+		xengnttab_unmap(ctrl->gnttab, r->buffer, pages);
+}
+
+/* Client: map the rings described by the server's vchan_resize page. */
+static int resize_map(struct libxenvchan *ctrl)
+{
+	struct vchan_resize *desc;
+	int pages_left, pages_right;
+	uint32_t ref = ctrl->ring->grants[resize_slot(ctrl)];
+
+	xen_rmb(); /* read the slot /after/ seeing VCHAN_RESIZE_PENDING */
+	desc = xengnttab_map_grant_ref(ctrl->gnttab, ctrl->domain, ref, PROT_READ);
+	if (!desc)
+		return -1;
+
+	ctrl->next_write.order = desc->left_order;
+	ctrl->next_read.order = desc->right_order;
+	if (ctrl->next_write.order < PAGE_SHIFT || ctrl->next_write.order > MAX_RING_SHIFT ||
+	    ctrl->next_read.order < PAGE_SHIFT || ctrl->next_read.order > MAX_RING_SHIFT)
+		goto out_unmap_desc;
+
+	pages_left = ring_pages(ctrl->next_write.order);
+	pages_right = ring_pages(ctrl->next_read.order);
+	if ((pages_left + pages_right) * sizeof(uint32_t) >
+	    PAGE_SIZE - sizeof(struct vchan_resize))
+		goto out_unmap_desc;
+
+	ctrl->next_write.buffer = xengnttab_map_domain_grant_refs(ctrl->gnttab,
+		pages_left, ctrl->domain, desc->grants, PROT_READ|PROT_WRITE);
+	if (!ctrl->next_write.buffer)
+		goto out_unmap_desc;
+	ctrl->next_read.buffer = xengnttab_map_domain_grant_refs(ctrl->gnttab,
+		pages_right, ctrl->domain, desc->grants + pages_left, PROT_READ);
+	if (!ctrl->next_read.buffer)
+		goto out_unmap_left;
+
+	ctrl->next_write.shr = ctrl->write.shr;
+	ctrl->next_read.shr = ctrl->read.shr;
+	xengnttab_unmap(ctrl->gnttab, desc, 1);
+	ctrl->resize = VCHAN_RESIZING;
+	return 0;
+
+ out_unmap_left:
+	xengnttab_unmap(ctrl->gnttab, ctrl->next_write.buffer, pages_left);
+ out_unmap_desc:
+	xengnttab_unmap(ctrl->gnttab, desc, 1);
+	return -1;
+}
+
+/* Server: describe the new rings in the shared page and forget the old. */
+static void resize_finish(struct libxenvchan *ctrl)
+{
+	struct vchan_resize *desc = ctrl->resize_page;
+	int pages = ring_pages(ctrl->read.order) + ring_pages(ctrl->write.order);
+
+	/* Both sides have left the old rings, so in-page ones are free too. */
+	ctrl->ring->left_order = ctrl->read.order;
+	ctrl->ring->right_order = ctrl->write.order;
+	memcpy(ctrl->ring->grants, desc->grants, pages * sizeof(uint32_t));
+	xengntshr_unshare(ctrl->gntshr, desc, 1);
+	ctrl->resize_page = NULL;
+	ctrl->resize = 0;
+
+	xen_mb(); /* publish the new layout /then/ end the resize */
+	__sync_and_and_fetch(resize_bits(ctrl), ~(VCHAN_RESIZE_PENDING |
+		VCHAN_RESIZE_LEFT | VCHAN_RESIZE_RIGHT | VCHAN_RESIZE_ACK));
+}
+
+void vchan_resize_progress(struct libxenvchan *ctrl)
+{
+	uint8_t bits = *resize_bits(ctrl);
+	uint8_t peer_bit = ctrl->is_server ? VCHAN_RESIZE_LEFT : VCHAN_RESIZE_RIGHT;
+	uint8_t our_bit = ctrl->is_server ? VCHAN_RESIZE_RIGHT : VCHAN_RESIZE_LEFT;
+
+	if (!(ctrl->resize & VCHAN_RESIZING)) {
+		/* Only a client can get here with a resize to start. */
+		if (ctrl->is_server || (bits & VCHAN_RESIZE_ACK))
+			return;
+		if (resize_map(ctrl)) {
+			/*
+			 * The server is about to move its writes to rings we
+			 * cannot see; better to shut down than lose data.
+			 */
+			ctrl->ring->cli_live = 0;
+			xenevtchn_notify(ctrl->event, ctrl->event_port);
+			return;
+		}
+	}
+
+	/*
+	 * The peer only moved once our reader had consumed everything in the
+	 * old ring, so we can follow it straight away.
+	 */
+	if (!(ctrl->resize & VCHAN_RESIZED_READ) && (bits & peer_bit)) {
+		struct libxenvchan_ring old = ctrl->read;
+		xen_mb(); /* see the peer's bit /then/ read the new ring */
+		ctrl->read = ctrl->next_read;
+		ctrl->resize |= VCHAN_RESIZED_READ;
+		release_ring(ctrl, &old);
+	}
+
+	/*
+	 * Move our writes once the peer has drained the old ring; not while a
+	 * reservation in it has yet to be committed.
+	 */
+	if (!(ctrl->resize & VCHAN_RESIZED_WRITE) && !ctrl->write_reserved &&
+	    ctrl->write.shr->cons == ctrl->write.shr->prod) {
+		struct libxenvchan_ring old = ctrl->write;
+		xen_mb(); /* the reader is done with the old ring */
+		ctrl->write = ctrl->next_write;
+		__sync_or_and_fetch(resize_bits(ctrl), our_bit);
+		ctrl->resize |= VCHAN_RESIZED_WRITE;
+		release_ring(ctrl, &old);
+	}
+
+	if ((ctrl->resize & (VCHAN_RESIZED_READ | VCHAN_RESIZED_WRITE)) !=
+	    (VCHAN_RESIZED_READ | VCHAN_RESIZED_WRITE))
+		return;
+
+	if (!ctrl->is_server) {
+		ctrl->resize = 0;
+		__sync_or_and_fetch(resize_bits(ctrl), VCHAN_RESIZE_ACK);
+		xenevtchn_notify(ctrl->event, ctrl->event_port);
+	} else if (*resize_bits(ctrl) & VCHAN_RESIZE_ACK) {
+		resize_finish(ctrl);
+	}
+}
+
+int libxenvchan_resize(struct libxenvchan *ctrl, size_t read_min,
+                       size_t write_min)
+{
+	struct vchan_resize *desc;
+	uint32_t desc_ref = -1;
+	int slot, limit, pages_left, pages_right;
+	int read_order = vchan_min_order(read_min);
+	int write_order = vchan_min_order(write_min);
+
+	if (!ctrl->is_server) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (read_min > MAX_RING_SIZE || write_min > MAX_RING_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!(*resize_bits(ctrl) & VCHAN_RESIZE_CAPABLE) ||
+	    libxenvchan_is_open(ctrl) != 1) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	if (ctrl->resize || vchan_resize_pending(ctrl)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* The descriptor's slot must not run into an in-page ring. */
+	slot = resize_slot(ctrl);
+	limit = PAGE_SIZE;
+	if (ctrl->read.order < PAGE_SHIFT || ctrl->write.order < PAGE_SHIFT)
+		limit = (ctrl->read.order == SMALL_RING_SHIFT ||
+			 ctrl->write.order == SMALL_RING_SHIFT) ?
+			SMALL_RING_OFFSET : LARGE_RING_OFFSET;
+	if (sizeof(struct vchan_interface) + (slot + 1) * sizeof(uint32_t) > limit) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	desc = xengntshr_share_pages(ctrl->gntshr, ctrl->domain, 1, &desc_ref, 0);
+	if (!desc)
+		return -1;
+	desc->left_order = read_order;
+	desc->right_order = write_order;
+	pages_left = ring_pages(read_order);
+	pages_right = ring_pages(write_order);
+
+	ctrl->next_read.order = read_order;
+	ctrl->next_read.shr = ctrl->read.shr;
+	ctrl->next_read.buffer = xengntshr_share_pages(ctrl->gntshr,
+		ctrl->domain, pages_left, desc->grants, 1);
+	if (!ctrl->next_read.buffer)
+		goto out_desc;
+
+	ctrl->next_write.order = write_order;
+	ctrl->next_write.shr = ctrl->write.shr;
+	ctrl->next_write.buffer = xengntshr_share_pages(ctrl->gntshr,
+		ctrl->domain, pages_right, desc->grants + pages_left, 1);
+	if (!ctrl->next_write.buffer)
+		goto out_read;
+
+	ctrl->resize_page = desc;
+	ctrl->resize = VCHAN_RESIZING;
+	ctrl->ring->grants[slot] = desc_ref;
+	xen_wmb(); /* describe the rings /then/ offer them */
+	__sync_or_and_fetch(resize_bits(ctrl), VCHAN_RESIZE_PENDING);
+	xenevtchn_notify(ctrl->event, ctrl->event_port);
+
+	vchan_resize_progress(ctrl);
+	return 0;
+
+ out_read:
+	xengntshr_unshare(ctrl->gntshr, ctrl->next_read.buffer, pages_left);
+ out_desc:
+	xengntshr_unshare(ctrl->gntshr, desc, 1);
+	return -1;
+}
+
+int libxenvchan_resize_pending(struct libxenvchan *ctrl)
+{
+	if (!vchan_resize_pending(ctrl))
+		return 0;
+	vchan_resize_progress(ctrl);
+	if (ctrl->resize)
+		return 1;
+	/* A client is done once it has acknowledged. */
+	return !ctrl->is_server && vchan_resize_pending(ctrl) &&
+		!(*resize_bits(ctrl) & VCHAN_RESIZE_ACK);
+}
+
+void vchan_resize_release(struct libxenvchan *ctrl)
+{
+	if (!(ctrl->resize & VCHAN_RESIZING))
+		return;
+	if (!(ctrl->resize & VCHAN_RESIZED_READ))
+		release_ring(ctrl, &ctrl->next_read);
+	if (!(ctrl->resize & VCHAN_RESIZED_WRITE))
+		release_ring(ctrl, &ctrl->next_write);
+	if (ctrl->resize_page)
+		xengntshr_unshare(ctrl->gntshr, ctrl->resize_page, 1);
+	ctrl->resize_page = NULL;
+	ctrl->resize = 0;
+}
@@ -0,0 +1,222 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ *
+ * Latency and throughput benchmark for libxenvchan.  Start the server side
+ * first, then the client in the peer domain with the same test and sizes:
+ *
+ *  pingpong: the client sends a message of the given size and waits for the
+ *            server to echo it back, and reports the round trip time.
+ *  stream:   the server sends messages as fast as it can using in-ring
+ *            reservation, resizing the rings from 4KB to 1MB between runs;
+ *            the client drains them with readv and reports the throughput
+ *            for each ring size.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include <libxenvchan.h>
+
+static void usage(char **argv)
+{
+	fprintf(stderr, "usage:\n"
+		"%s [client|server] [pingpong|stream] domid nodepath"
+		" [msgsize [count [poll_us]]]\n", argv[0]);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(struct libxenvchan *ctrl, const char *what)
+{
+	perror(what);
+	libxenvchan_close(ctrl);
+	exit(1);
+}
+
+static void pingpong_client(struct libxenvchan *ctrl, char *buf,
+			    size_t size, long count)
+{
+	double start, rtt;
+	long i;
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		if (libxenvchan_send(ctrl, buf, size) != size)
+			fail(ctrl, "send");
+		if (libxenvchan_recv(ctrl, buf, size) != size)
+			fail(ctrl, "recv");
+	}
+	rtt = (now() - start) / count;
+	printf("pingpong: %zu bytes x %ld: %.2f us round trip\n",
+	       size, count, rtt * 1e6);
+}
+
+static void pingpong_server(struct libxenvchan *ctrl, char *buf,
+			    size_t size, long count)
+{
+	long i;
+
+	for (i = 0; i < count; i++) {
+		if (libxenvchan_recv(ctrl, buf, size) != size)
+			fail(ctrl, "recv");
+		if (libxenvchan_send(ctrl, buf, size) != size)
+			fail(ctrl, "send");
+	}
+}
+
+#define MIN_STREAM_RING 4096
+#define MAX_STREAM_RING (1 << 20)
+
+static void stream_server(struct libxenvchan *ctrl, size_t size, long count)
+{
+	size_t ring, total = size * count, done, len;
+	struct timespec delay = { 0, 1000000 };
+	void *data;
+	int ret;
+
+	/* Resizing needs the client to be there */
+	while (libxenvchan_is_open(ctrl) == 2)
+		nanosleep(&delay, NULL);
+
+	for (ring = MIN_STREAM_RING; ring <= MAX_STREAM_RING; ring *= 4) {
+		if (libxenvchan_resize(ctrl, ring, ring))
+			fail(ctrl, "resize");
+		for (done = 0; done < total; done += ret) {
+			len = total - done;
+			if (len > size)
+				len = size;
+			ret = libxenvchan_write_reserve(ctrl, &data, len);
+			if (ret <= 0)
+				fail(ctrl, "write_reserve");
+			memset(data, (char)done, ret);
+			if (libxenvchan_write_commit(ctrl, ret) != ret)
+				fail(ctrl, "write_commit");
+		}
+		/* Let the client switch too before the next resize */
+		while (libxenvchan_resize_pending(ctrl))
+			if (libxenvchan_wait(ctrl))
+				fail(ctrl, "wait");
+	}
+}
+
+static void stream_client(struct libxenvchan *ctrl, char *buf,
+			  size_t size, long count)
+{
+	size_t ring, total = size * count, done;
+	struct iovec iov[2];
+	double start = 0, secs;
+	int ret;
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = size / 2;
+	iov[1].iov_base = buf + size / 2;
+	iov[1].iov_len = size - size / 2;
+
+	for (ring = MIN_STREAM_RING; ring <= MAX_STREAM_RING; ring *= 4) {
+		for (done = 0; done < total; done += ret) {
+			ret = libxenvchan_readv(ctrl, iov, 2);
+			if (ret <= 0)
+				fail(ctrl, "readv");
+			if (!done)
+				start = now();
+		}
+		secs = now() - start;
+		printf("stream: %4d KB ring: %zu bytes in %.3f s: %.1f MB/s\n",
+		       1 << (ctrl->read.order - 10), total, secs,
+		       total / secs / (1 << 20));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct libxenvchan *ctrl = NULL;
+	size_t size = 64;
+	long count = 100000;
+	unsigned int poll_us = 0;
+	int server, pingpong;
+	char *buf;
+
+	if (argc < 5 || argc > 8)
+		usage(argv);
+	if (argc > 5)
+		size = atol(argv[5]);
+	if (argc > 6)
+		count = atol(argv[6]);
+	if (argc > 7)
+		poll_us = atoi(argv[7]);
+	if (!size || count <= 0)
+		usage(argv);
+
+	if (!strcmp(argv[1], "server"))
+		server = 1;
+	else if (!strcmp(argv[1], "client"))
+		server = 0;
+	else
+		usage(argv);
+
+	if (!strcmp(argv[2], "pingpong"))
+		pingpong = 1;
+	else if (!strcmp(argv[2], "stream"))
+		pingpong = 0;
+	else
+		usage(argv);
+
+	buf = calloc(1, size);
+	if (!buf) {
+		perror("calloc");
+		exit(1);
+	}
+
+	if (server)
+		ctrl = libxenvchan_server_init(NULL, atoi(argv[3]), argv[4],
+					       size, size);
+	else
+		ctrl = libxenvchan_client_init(NULL, atoi(argv[3]), argv[4]);
+	if (!ctrl) {
+		perror("libxenvchan_*_init");
+		exit(1);
+	}
+	ctrl->blocking = 1;
+	libxenvchan_set_poll(ctrl, poll_us);
+
+	if (pingpong) {
+		if (server)
+			pingpong_server(ctrl, buf, size, count);
+		else
+			pingpong_client(ctrl, buf, size, count);
+	} else {
+		if (server)
+			stream_server(ctrl, size, count);
+		else
+			stream_client(ctrl, buf, size, count);
+	}
+
+	libxenvchan_close(ctrl);
+	free(buf);
+	return 0;
+}
@@ -801,6 +801,25 @@ int xc_domain_getinfolist(xc_interface *xch,
                           unsigned int max_domains,
                           xc_domaininfo_t *info);
 
+typedef xen_sysctl_vcpuinfo_t xc_vcpuinfo_list_t;
+/**
+ * This function returns information about the vcpus of a set of domains,
+ * as xc_vcpu_getinfo() does for one vcpu, in a single hypercall.  Only
+ * whole domains are returned.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm first_domain the first domain to enumerate information from
+ * @parm max_vcpus the number of elements in info
+ * @parm info an array of max_vcpus size that will contain the information
+ * @parm next_domain the first domain not returned, or DOMID_INVALID
+ * @return the number of vcpus enumerated or -1 on error
+ */
+int xc_vcpu_getinfolist(xc_interface *xch,
+                        uint32_t first_domain,
+                        unsigned int max_vcpus,
+                        xc_vcpuinfo_list_t *info,
+                        uint32_t *next_domain);
+
 /**
  * This function set p2m for broken page
  * &parm xch a handle to an open hypervisor interface
@@ -1449,7 +1468,10 @@ int xc_perfc_query(xc_interface *xch,
                    xc_hypercall_buffer_t *val);
 
 typedef xen_sysctl_lockprof_data_t xc_lockprof_data_t;
+typedef xen_sysctl_lockprof_caller_t xc_lockprof_caller_t;
 int xc_lockprof_reset(xc_interface *xch);
+/* Start or stop lock profiling, without resetting the data. */
+int xc_lockprof_enable(xc_interface *xch, bool enable);
 int xc_lockprof_query_number(xc_interface *xch,
                              uint32_t *n_elems);
 int xc_lockprof_query(xc_interface *xch,
@@ -1457,6 +1479,40 @@ int xc_lockprof_query(xc_interface *xch,
                       uint64_t *time,
                       xc_hypercall_buffer_t *data);
 
+/*
+ * Hypercall and vmexit latency histograms.  cmd is one of
+ * XEN_SYSCTL_LAT_HIST_{reset,enable,disable}, or _query to do nothing;
+ * enabled, if not NULL, is set to whether recording is on afterwards.
+ */
+int xc_lat_hist_control(xc_interface *xch, uint32_t cmd, bool *enabled);
+/*
+ * Fill hist with up to *nr_hists histograms of XEN_LAT_HIST_BUCKETS counts
+ * each, for domid or for DOMID_XEN.  *nr_hists is set to the number
+ * available.
+ */
+int xc_lat_hist_query(xc_interface *xch, uint32_t domid,
+                      uint32_t *nr_hists, uint64_t *hist);
+
+/*
+ * Sampling profiler.  Start sampling the PMU event (0 for unhalted cycles)
+ * every period events, into buffers of buf_samples per pcpu; a period or
+ * buf_samples of 0 picks a default.
+ */
+int xc_sampler_start(xc_interface *xch, uint32_t event, uint32_t unit_mask,
+                     uint32_t period, uint32_t buf_samples);
+int xc_sampler_stop(xc_interface *xch);
+typedef xen_sysctl_sample_t xc_sample_t;
+/*
+ * Move up to *nr samples into samples, setting *nr to how many were moved.
+ * lost and running, if not NULL, are set to the number of samples dropped
+ * on full buffers and to whether sampling is on.
+ */
+int xc_sampler_read(xc_interface *xch, xc_sample_t *samples, uint32_t *nr,
+                    uint64_t *lost, bool *running);
+/* Name the Xen symbol at addr, or set name to "" if there is none. */
+int xc_sampler_symbol(xc_interface *xch, uint64_t addr,
+                      char *name, size_t len);
+
 void *xc_memalign(xc_interface *xch, size_t alignment, size_t size);
 
 /**
@@ -1989,6 +2045,19 @@ int xc_get_mem_access(xc_interface *xch, domid_t domain_id,
  * Caller has to unmap this page when done.
  */
 void *xc_monitor_enable(xc_interface *xch, domid_t domain_id, uint32_t *port);
+/*
+ * Alternative to xc_monitor_enable(): set up per-vCPU channels instead of
+ * the ring, and return the mapped slot frames, *nr_frames of them, holding
+ * one struct vm_event_slot per vCPU (see xen/vm_event.h).  Each slot's port
+ * field is the Xen end of that vCPU's event channel.  xc_monitor_disable()
+ * tears the channels down, and xc_monitor_resume() resumes every answered
+ * slot in one go.
+ *
+ * Will return NULL on error.
+ * Caller has to unmap the frames when done.
+ */
+void *xc_monitor_enable_channels(xc_interface *xch, domid_t domain_id,
+                                 unsigned int *nr_frames);
 int xc_monitor_disable(xc_interface *xch, domid_t domain_id);
 int xc_monitor_resume(xc_interface *xch, domid_t domain_id);
 /*
@@ -2058,6 +2127,26 @@ int xc_memshr_control(xc_interface *xch,
                       domid_t domid,
                       int enable);
 
+/* Turn domid into a copy-on-write fork of parent_domid.
+ *
+ * domid must be a freshly created HVM domain with no memory and the same
+ * number of vcpus as the parent; the parent must be paused and stay paused
+ * for as long as it has forks.  The fork's vcpu and HVM context are copied
+ * from the parent, and its memory is populated lazily from the parent as
+ * the fork touches it.  Device model and xenstore setup for the fork are
+ * left to the caller.
+ */
+int xc_memshr_fork(xc_interface *xch,
+                   domid_t parent_domid,
+                   domid_t domid);
+
+/* Discard all memory a fork has populated privately and reload its vcpu
+ * and HVM context from the parent, i.e. return it to the state it had right
+ * after xc_memshr_fork().  The fork is paused for the duration of the call.
+ */
+int xc_memshr_fork_reset(xc_interface *xch,
+                         domid_t domid);
+
 /* Create a communication ring in which the hypervisor will place ENOMEM
  * notifications.
  *
@@ -2200,6 +2289,23 @@ int xc_memshr_range_share(xc_interface *xch,
                           uint64_t first_gfn,
                           uint64_t last_gfn);
 
+/* Nominates, shares or hashes an array of gfns of source_domain in a single
+ * call, according to flags (XENMEM_SHARING_BATCH_*, see public/memory.h).
+ * Each entry's rc field reports its own outcome; the call as a whole only
+ * fails for errors affecting all entries (EFAULT, EINVAL for bad flags, or
+ * ENOMEM, in which case entries past the failing one are left untouched).
+ *
+ * With XENMEM_SHARING_BATCH_HASH only a hash of each page's contents is
+ * returned, which is meant to help find candidate pairs without mapping
+ * guest memory; use XENMEM_SHARING_BATCH_VERIFY when sharing such pairs,
+ * as equal hashes don't guarantee equal contents.
+ */
+int xc_memshr_batch(xc_interface *xch,
+                    domid_t source_domain,
+                    xen_mem_sharing_batch_entry_t *entries,
+                    unsigned int nr_entries,
+                    uint32_t flags);
+
 /* Debug calls: return the number of pages referencing the shared frame backing
  * the input argument. Should be one or greater. 
  *
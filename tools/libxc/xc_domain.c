@@ -435,6 +435,37 @@ int xc_domain_getinfolist(xc_interface *xch,
     return ret;
 }
 
+int xc_vcpu_getinfolist(xc_interface *xch,
+                        uint32_t first_domain,
+                        unsigned int max_vcpus,
+                        xc_vcpuinfo_list_t *info,
+                        uint32_t *next_domain)
+{
+    int ret = 0;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(info, max_vcpus*sizeof(*info), XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, info) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_getvcpuinfolist;
+    sysctl.u.getvcpuinfolist.first_domain = first_domain;
+    sysctl.u.getvcpuinfolist.max_vcpus    = max_vcpus;
+    set_xen_guest_handle(sysctl.u.getvcpuinfolist.buffer, info);
+
+    if ( xc_sysctl(xch, &sysctl) < 0 )
+        ret = -1;
+    else
+    {
+        ret = sysctl.u.getvcpuinfolist.num_vcpus;
+        *next_domain = sysctl.u.getvcpuinfolist.next_domain;
+    }
+
+    xc_hypercall_bounce_post(xch, info);
+
+    return ret;
+}
+
 /* set broken page p2m */
 int xc_set_broken_page_p2m(xc_interface *xch,
                            uint32_t domid,
@@ -41,6 +41,38 @@ int xc_memshr_control(xc_interface *xch,
     return do_domctl(xch, &domctl);
 }
 
+int xc_memshr_fork(xc_interface *xch,
+                   domid_t parent_domid,
+                   domid_t domid)
+{
+    DECLARE_DOMCTL;
+    struct xen_domctl_mem_sharing_op *op;
+
+    domctl.cmd = XEN_DOMCTL_mem_sharing_op;
+    domctl.interface_version = XEN_DOMCTL_INTERFACE_VERSION;
+    domctl.domain = domid;
+    op = &(domctl.u.mem_sharing_op);
+    op->op = XEN_DOMCTL_MEM_SHARING_FORK;
+    op->u.fork.parent_domain = parent_domid;
+
+    return do_domctl(xch, &domctl);
+}
+
+int xc_memshr_fork_reset(xc_interface *xch,
+                         domid_t domid)
+{
+    DECLARE_DOMCTL;
+    struct xen_domctl_mem_sharing_op *op;
+
+    domctl.cmd = XEN_DOMCTL_mem_sharing_op;
+    domctl.interface_version = XEN_DOMCTL_INTERFACE_VERSION;
+    domctl.domain = domid;
+    op = &(domctl.u.mem_sharing_op);
+    op->op = XEN_DOMCTL_MEM_SHARING_FORK_RESET;
+
+    return do_domctl(xch, &domctl);
+}
+
 int xc_memshr_ring_enable(xc_interface *xch, 
                           domid_t domid, 
                           uint32_t *port)
@@ -200,6 +232,37 @@ int xc_memshr_range_share(xc_interface *xch,
     return xc_memshr_memop(xch, source_domain, &mso);
 }
 
+int xc_memshr_batch(xc_interface *xch,
+                    domid_t source_domain,
+                    xen_mem_sharing_batch_entry_t *entries,
+                    unsigned int nr_entries,
+                    uint32_t flags)
+{
+    DECLARE_HYPERCALL_BOUNCE(entries, nr_entries * sizeof(*entries),
+                             XC_HYPERCALL_BUFFER_BOUNCE_BOTH);
+    xen_mem_sharing_op_t mso;
+    int rc;
+
+    if ( xc_hypercall_bounce_pre(xch, entries) )
+    {
+        PERROR("Could not bounce memory for XENMEM_sharing_op_batch");
+        return -1;
+    }
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = XENMEM_sharing_op_batch;
+    set_xen_guest_handle(mso.u.batch.entries, entries);
+    mso.u.batch.nr_entries = nr_entries;
+    mso.u.batch.flags = flags;
+
+    rc = xc_memshr_memop(xch, source_domain, &mso);
+
+    xc_hypercall_bounce_post(xch, entries);
+
+    return rc;
+}
+
 int xc_memshr_domain_resume(xc_interface *xch,
                             domid_t domid)
 {
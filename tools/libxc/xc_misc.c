@@ -404,6 +404,18 @@ int xc_lockprof_reset(xc_interface *xch)
     return do_sysctl(xch, &sysctl);
 }
 
+int xc_lockprof_enable(xc_interface *xch, bool enable)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_lockprof_op;
+    sysctl.u.lockprof_op.cmd = enable ? XEN_SYSCTL_LOCKPROF_enable
+                                      : XEN_SYSCTL_LOCKPROF_disable;
+    set_xen_guest_handle(sysctl.u.lockprof_op.data, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
 int xc_lockprof_query_number(xc_interface *xch,
                              uint32_t *n_elems)
 {
@@ -443,6 +455,135 @@ int xc_lockprof_query(xc_interface *xch,
     return rc;
 }
 
+int xc_lat_hist_control(xc_interface *xch, uint32_t cmd, bool *enabled)
+{
+    int rc;
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_lat_hist_op;
+    sysctl.u.lat_hist.cmd = cmd;
+    sysctl.u.lat_hist.domid = DOMID_XEN;
+    sysctl.u.lat_hist.nr_hists = 0;
+    set_xen_guest_handle(sysctl.u.lat_hist.hist, HYPERCALL_BUFFER_NULL);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    if ( !rc && enabled )
+        *enabled = sysctl.u.lat_hist.enabled;
+
+    return rc;
+}
+
+int xc_lat_hist_query(xc_interface *xch, uint32_t domid,
+                      uint32_t *nr_hists, uint64_t *hist)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(hist, *nr_hists * XEN_LAT_HIST_BUCKETS *
+                             sizeof(*hist), XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, hist) )
+        return -1;
+
+    sysctl.cmd = XEN_SYSCTL_lat_hist_op;
+    sysctl.u.lat_hist.cmd = XEN_SYSCTL_LAT_HIST_query;
+    sysctl.u.lat_hist.domid = domid;
+    sysctl.u.lat_hist.nr_hists = *nr_hists;
+    set_xen_guest_handle(sysctl.u.lat_hist.hist, hist);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, hist);
+
+    if ( !rc )
+        *nr_hists = sysctl.u.lat_hist.nr_hists;
+
+    return rc;
+}
+
+int xc_sampler_start(xc_interface *xch, uint32_t event, uint32_t unit_mask,
+                     uint32_t period, uint32_t buf_samples)
+{
+    DECLARE_SYSCTL;
+
+    memset(&sysctl.u.sampler, 0, sizeof(sysctl.u.sampler));
+    sysctl.cmd = XEN_SYSCTL_sampler_op;
+    sysctl.u.sampler.cmd = XEN_SYSCTL_SAMPLER_start;
+    sysctl.u.sampler.event = event;
+    sysctl.u.sampler.unit_mask = unit_mask;
+    sysctl.u.sampler.period = period;
+    sysctl.u.sampler.buf_samples = buf_samples;
+    set_xen_guest_handle(sysctl.u.sampler.samples, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_sampler_stop(xc_interface *xch)
+{
+    DECLARE_SYSCTL;
+
+    memset(&sysctl.u.sampler, 0, sizeof(sysctl.u.sampler));
+    sysctl.cmd = XEN_SYSCTL_sampler_op;
+    sysctl.u.sampler.cmd = XEN_SYSCTL_SAMPLER_stop;
+    set_xen_guest_handle(sysctl.u.sampler.samples, HYPERCALL_BUFFER_NULL);
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_sampler_read(xc_interface *xch, xc_sample_t *samples, uint32_t *nr,
+                    uint64_t *lost, bool *running)
+{
+    int rc;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(samples, *nr * sizeof(*samples),
+                             XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, samples) )
+        return -1;
+
+    memset(&sysctl.u.sampler, 0, sizeof(sysctl.u.sampler));
+    sysctl.cmd = XEN_SYSCTL_sampler_op;
+    sysctl.u.sampler.cmd = XEN_SYSCTL_SAMPLER_read;
+    sysctl.u.sampler.nr_samples = *nr;
+    set_xen_guest_handle(sysctl.u.sampler.samples, samples);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    xc_hypercall_bounce_post(xch, samples);
+
+    if ( !rc )
+    {
+        *nr = sysctl.u.sampler.nr_samples;
+        if ( lost )
+            *lost = sysctl.u.sampler.lost;
+        if ( running )
+            *running = sysctl.u.sampler.running;
+    }
+
+    return rc;
+}
+
+int xc_sampler_symbol(xc_interface *xch, uint64_t addr,
+                      char *name, size_t len)
+{
+    int rc;
+    DECLARE_SYSCTL;
+
+    memset(&sysctl.u.sampler, 0, sizeof(sysctl.u.sampler));
+    sysctl.cmd = XEN_SYSCTL_sampler_op;
+    sysctl.u.sampler.cmd = XEN_SYSCTL_SAMPLER_symbol;
+    sysctl.u.sampler.addr = addr;
+    set_xen_guest_handle(sysctl.u.sampler.samples, HYPERCALL_BUFFER_NULL);
+
+    rc = do_sysctl(xch, &sysctl);
+
+    if ( !rc && len )
+        snprintf(name, len, "%.*s", (int)sizeof(sysctl.u.sampler.name),
+                 sysctl.u.sampler.name);
+
+    return rc;
+}
+
 int xc_getcpuinfo(xc_interface *xch, int max_cpus,
                   xc_cpuinfo_t *info, int *nr_cpus)
 {
@@ -21,6 +21,7 @@
  */
 
 #include "xc_private.h"
+#include <xen/vm_event.h>
 
 void *xc_monitor_enable(xc_interface *xch, domid_t domain_id, uint32_t *port)
 {
@@ -28,6 +29,121 @@ void *xc_monitor_enable(xc_interface *xch, domid_t domain_id, uint32_t *port)
                               port);
 }
 
+void *xc_monitor_enable_channels(xc_interface *xch, domid_t domain_id,
+                                 unsigned int *nr_frames)
+{
+    DECLARE_DOMCTL;
+    xc_dominfo_t info;
+    xen_pfn_t max_gpfn, *pfns = NULL;
+    void *slots = NULL;
+    unsigned int i, nr;
+    bool populated = false;
+    int rc1, rc2, saved_errno;
+
+    if ( !nr_frames )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ( xc_domain_getinfo(xch, domain_id, 1, &info) != 1 ||
+         info.domid != domain_id )
+    {
+        PERROR("Could not get info for domain");
+        return NULL;
+    }
+
+    nr = (info.max_vcpu_id + VM_EVENT_SLOTS_PER_FRAME) /
+         VM_EVENT_SLOTS_PER_FRAME;
+
+    /* Pause the domain for slot frame setup */
+    rc1 = xc_domain_pause(xch, domain_id);
+    if ( rc1 != 0 )
+    {
+        PERROR("Unable to pause domain\n");
+        return NULL;
+    }
+
+    /*
+     * Borrow frames just past the end of the guest's physmap; Xen takes
+     * its own reference, so they are removed from the physmap again below.
+     */
+    rc1 = xc_domain_maximum_gpfn(xch, domain_id, &max_gpfn);
+    if ( rc1 != 0 )
+    {
+        PERROR("Failed to get max gpfn");
+        goto out;
+    }
+
+    pfns = malloc(nr * sizeof(*pfns));
+    if ( !pfns )
+    {
+        rc1 = -1;
+        goto out;
+    }
+
+    for ( i = 0; i < nr; i++ )
+        pfns[i] = max_gpfn + 1 + i;
+
+    rc1 = xc_domain_populate_physmap_exact(xch, domain_id, nr, 0, 0, pfns);
+    if ( rc1 != 0 )
+    {
+        PERROR("Failed to populate slot frames");
+        goto out;
+    }
+    populated = true;
+
+    slots = xc_map_foreign_pages(xch, domain_id, PROT_READ | PROT_WRITE,
+                                 pfns, nr);
+    if ( !slots )
+    {
+        rc1 = -1;
+        PERROR("Could not map the slot frames");
+        goto out;
+    }
+
+    domctl.cmd = XEN_DOMCTL_vm_event_op;
+    domctl.domain = domain_id;
+    domctl.u.vm_event_op.op = XEN_VM_EVENT_ENABLE_CHANNELS;
+    domctl.u.vm_event_op.mode = XEN_DOMCTL_VM_EVENT_OP_MONITOR;
+    domctl.u.vm_event_op.nr_frames = nr;
+    domctl.u.vm_event_op.gfn = pfns[0];
+
+    rc1 = do_domctl(xch, &domctl);
+    if ( rc1 != 0 )
+        PERROR("Failed to enable vm_event channels");
+
+ out:
+    saved_errno = errno;
+
+    /* Remove the slot frames from the guest's physmap */
+    if ( populated &&
+         xc_domain_decrease_reservation_exact(xch, domain_id, nr, 0, pfns) )
+        PERROR("Failed to remove slot frames from guest physmap");
+
+    rc2 = xc_domain_unpause(xch, domain_id);
+    if ( rc1 != 0 || rc2 != 0 )
+    {
+        if ( rc2 != 0 )
+        {
+            if ( rc1 == 0 )
+                saved_errno = errno;
+            PERROR("Unable to unpause domain");
+        }
+
+        if ( slots )
+            xenforeignmemory_unmap(xch->fmem, slots, nr);
+        slots = NULL;
+    }
+    else
+        *nr_frames = nr;
+
+    free(pfns);
+    errno = saved_errno;
+
+    return slots;
+}
+
 int xc_monitor_disable(xc_interface *xch, domid_t domain_id)
 {
     return xc_vm_event_control(xch, domain_id,
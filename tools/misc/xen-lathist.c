@@ -0,0 +1,419 @@
+/*
+ * xen-lathist: show how long Xen takes to handle hypercalls and vmexits
+ *
+ * Like xentop, prints a table every few seconds: per domain, the rate of
+ * hypercalls and of vmexits and their latency percentiles over the last
+ * interval, from the histograms kept by Xen (XEN_SYSCTL_lat_hist_op).
+ * Optionally also the host-wide histograms per hypercall and exit reason.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xenctrl.h>
+
+#define MAX_DOMAINS     1024
+#define NR_XEN_HISTS    (XEN_LAT_HIST_HYPERCALLS + XEN_LAT_HIST_EXITS)
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(*a))
+
+typedef uint64_t hist_t[XEN_LAT_HIST_BUCKETS];
+
+struct dom_sample {
+    uint32_t domid;
+    hist_t hist[XEN_LAT_HIST_NR_KINDS];
+};
+
+struct sample {
+    unsigned int nr_doms;
+    struct dom_sample dom[MAX_DOMAINS];
+    hist_t xen[NR_XEN_HISTS];
+};
+
+static xc_interface *xch;
+
+static const char *const hypercall_name[XEN_LAT_HIST_HYPERCALLS] = {
+    [__HYPERVISOR_set_trap_table]         = "set_trap_table",
+    [__HYPERVISOR_mmu_update]             = "mmu_update",
+    [__HYPERVISOR_set_gdt]                = "set_gdt",
+    [__HYPERVISOR_stack_switch]           = "stack_switch",
+    [__HYPERVISOR_set_callbacks]          = "set_callbacks",
+    [__HYPERVISOR_fpu_taskswitch]         = "fpu_taskswitch",
+    [__HYPERVISOR_sched_op_compat]        = "sched_op_compat",
+    [__HYPERVISOR_platform_op]            = "platform_op",
+    [__HYPERVISOR_set_debugreg]           = "set_debugreg",
+    [__HYPERVISOR_get_debugreg]           = "get_debugreg",
+    [__HYPERVISOR_update_descriptor]      = "update_descriptor",
+    [__HYPERVISOR_memory_op]              = "memory_op",
+    [__HYPERVISOR_multicall]              = "multicall",
+    [__HYPERVISOR_update_va_mapping]      = "update_va_mapping",
+    [__HYPERVISOR_set_timer_op]           = "set_timer_op",
+    [__HYPERVISOR_event_channel_op_compat] = "evtchn_op_compat",
+    [__HYPERVISOR_xen_version]            = "xen_version",
+    [__HYPERVISOR_console_io]             = "console_io",
+    [__HYPERVISOR_physdev_op_compat]      = "physdev_op_compat",
+    [__HYPERVISOR_grant_table_op]         = "grant_table_op",
+    [__HYPERVISOR_vm_assist]              = "vm_assist",
+    [__HYPERVISOR_update_va_mapping_otherdomain] = "update_va_mapping_otherdomain",
+    [__HYPERVISOR_iret]                   = "iret",
+    [__HYPERVISOR_vcpu_op]                = "vcpu_op",
+    [__HYPERVISOR_set_segment_base]       = "set_segment_base",
+    [__HYPERVISOR_mmuext_op]              = "mmuext_op",
+    [__HYPERVISOR_xsm_op]                 = "xsm_op",
+    [__HYPERVISOR_nmi_op]                 = "nmi_op",
+    [__HYPERVISOR_sched_op]               = "sched_op",
+    [__HYPERVISOR_callback_op]            = "callback_op",
+    [__HYPERVISOR_xenoprof_op]            = "xenoprof_op",
+    [__HYPERVISOR_event_channel_op]       = "event_channel_op",
+    [__HYPERVISOR_physdev_op]             = "physdev_op",
+    [__HYPERVISOR_hvm_op]                 = "hvm_op",
+    [__HYPERVISOR_sysctl]                 = "sysctl",
+    [__HYPERVISOR_domctl]                 = "domctl",
+    [__HYPERVISOR_kexec_op]               = "kexec_op",
+    [__HYPERVISOR_tmem_op]                = "tmem_op",
+    [__HYPERVISOR_xenpmu_op]              = "xenpmu_op",
+    [__HYPERVISOR_dm_op]                  = "dm_op",
+    [__HYPERVISOR_mca]                    = "mca",
+};
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: xen-lathist [options]\n"
+            "Show the time Xen spends handling hypercalls and vmexits.\n"
+            "\n"
+            "  -d SECS   seconds between updates (default 3)\n"
+            "  -n N      stop after N updates\n"
+            "  -b        batch mode: don't clear the screen between updates\n"
+            "  -a        print totals since the last reset once, and exit\n"
+            "  -c        also show host-wide histograms per hypercall\n"
+            "  -x        also show host-wide histograms per exit reason\n"
+            "  -e        start recording\n"
+            "  -D        stop recording\n"
+            "  -r        reset all histograms\n");
+    exit(1);
+}
+
+static void take_sample(struct sample *s)
+{
+    xc_domaininfo_t info[MAX_DOMAINS];
+    uint32_t nr;
+    int i, n;
+
+    n = xc_domain_getinfolist(xch, 0, MAX_DOMAINS, info);
+    if ( n < 0 )
+    {
+        perror("xc_domain_getinfolist");
+        exit(1);
+    }
+
+    s->nr_doms = 0;
+    for ( i = 0; i < n; i++ )
+    {
+        struct dom_sample *d = &s->dom[s->nr_doms];
+
+        nr = XEN_LAT_HIST_NR_KINDS;
+        d->domid = info[i].domain;
+        if ( xc_lat_hist_query(xch, d->domid, &nr, &d->hist[0][0]) )
+        {
+            if ( errno == ESRCH )
+                continue;       /* Died in the meantime. */
+            perror("xc_lat_hist_query");
+            exit(1);
+        }
+        s->nr_doms++;
+    }
+
+    nr = NR_XEN_HISTS;
+    if ( xc_lat_hist_query(xch, DOMID_XEN, &nr, &s->xen[0][0]) )
+    {
+        perror("xc_lat_hist_query");
+        exit(1);
+    }
+}
+
+static const struct dom_sample *find_dom(const struct sample *s,
+                                         uint32_t domid)
+{
+    unsigned int i;
+
+    for ( i = 0; i < s->nr_doms; i++ )
+        if ( s->dom[i].domid == domid )
+            return &s->dom[i];
+
+    return NULL;
+}
+
+/* d = a - b, where b may be missing; returns the number of events. */
+static uint64_t hist_sub(hist_t d, const hist_t a, const uint64_t *b)
+{
+    uint64_t n = 0;
+    int i;
+
+    for ( i = 0; i < XEN_LAT_HIST_BUCKETS; i++ )
+    {
+        d[i] = a[i] - (b ? b[i] : 0);
+        n += d[i];
+    }
+
+    return n;
+}
+
+/* The bucket below which the given fraction of events fall */
+static int hist_percentile(const hist_t h, uint64_t n, double fraction)
+{
+    uint64_t want = n * fraction, seen = 0;
+    int b;
+
+    for ( b = 0; b < XEN_LAT_HIST_BUCKETS - 1; b++ )
+    {
+        seen += h[b];
+        if ( seen > want )
+            break;
+    }
+
+    return b;
+}
+
+static int hist_max(const hist_t h)
+{
+    int b;
+
+    for ( b = XEN_LAT_HIST_BUCKETS - 1; b > 0; b-- )
+        if ( h[b] )
+            break;
+
+    return b;
+}
+
+/* The upper bound of bucket b, as "<2us" */
+static const char *bucket_str(int b, char *buf)
+{
+    static const char *const unit[] = { "ns", "us", "ms", "s" };
+    uint64_t ns = 2ULL << b;
+    unsigned int u = 0;
+
+    if ( b == XEN_LAT_HIST_BUCKETS - 1 )
+    {
+        sprintf(buf, ">=%" PRIu64 "s", (ns / 2) / 1000000000);
+        return buf;
+    }
+
+    while ( ns >= 1000 && u < ARRAY_SIZE(unit) - 1 )
+    {
+        ns /= 1000;
+        u++;
+    }
+    sprintf(buf, "<%" PRIu64 "%s", ns, unit[u]);
+
+    return buf;
+}
+
+static void print_stats(const hist_t h, uint64_t n, double secs)
+{
+    char b1[16], b2[16], b3[16];
+
+    if ( secs )
+        printf(" %10.0f", n / secs);
+    else
+        printf(" %10" PRIu64, n);
+
+    if ( n )
+        printf(" %7s %7s %7s", bucket_str(hist_percentile(h, n, 0.5), b1),
+               bucket_str(hist_percentile(h, n, 0.99), b2),
+               bucket_str(hist_max(h), b3));
+    else
+        printf(" %7s %7s %7s", "-", "-", "-");
+}
+
+static void print_xen(const struct sample *cur, const struct sample *prev,
+                      unsigned int first, unsigned int nr, const char *what,
+                      double secs)
+{
+    unsigned int i;
+    hist_t h;
+    uint64_t n;
+    char num[16];
+
+    printf("\n%-30s %10s %7s %7s %7s\n", what, secs ? "per sec" : "count",
+           "p50", "p99", "max");
+
+    for ( i = first; i < first + nr; i++ )
+    {
+        n = hist_sub(h, cur->xen[i], prev ? prev->xen[i] : NULL);
+        if ( !n )
+            continue;
+
+        if ( first == 0 && hypercall_name[i] )
+            printf("%-30s", hypercall_name[i]);
+        else
+        {
+            snprintf(num, sizeof(num), "%u", i - first);
+            printf("%-30s", num);
+        }
+        print_stats(h, n, secs);
+        printf("\n");
+    }
+}
+
+static void print_sample(const struct sample *cur, const struct sample *prev,
+                         double secs, bool hypercalls, bool exits)
+{
+    unsigned int i, k;
+    bool enabled = false;
+
+    xc_lat_hist_control(xch, XEN_SYSCTL_LAT_HIST_query, &enabled);
+
+    printf("xen-lathist: %s%s\n",
+           secs ? "rates over the last interval" : "totals since reset",
+           enabled ? "" : " (recording is off)");
+    printf("%5s %10s %7s %7s %7s %10s %7s %7s %7s\n", "DOMID",
+           "HCALLS", "p50", "p99", "max", "EXITS", "p50", "p99", "max");
+
+    for ( i = 0; i < cur->nr_doms; i++ )
+    {
+        const struct dom_sample *d = &cur->dom[i];
+        const struct dom_sample *p = prev ? find_dom(prev, d->domid) : NULL;
+
+        printf("%5u", d->domid);
+        for ( k = 0; k < XEN_LAT_HIST_NR_KINDS; k++ )
+        {
+            hist_t h;
+            uint64_t n = hist_sub(h, d->hist[k], p ? p->hist[k] : NULL);
+
+            print_stats(h, n, secs);
+        }
+        printf("\n");
+    }
+
+    if ( hypercalls )
+        print_xen(cur, prev, 0, XEN_LAT_HIST_HYPERCALLS, "HYPERCALL", secs);
+    if ( exits )
+        print_xen(cur, prev, XEN_LAT_HIST_HYPERCALLS, XEN_LAT_HIST_EXITS,
+                  "EXIT REASON", secs);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sample *cur, *prev, *tmp;
+    unsigned int delay = 3, iterations = 0, i;
+    bool batch = false, totals = false, hypercalls = false, exits = false;
+    int ctl = -1, opt;
+
+    while ( (opt = getopt(argc, argv, "d:n:bacxeDrh")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'd':
+            delay = strtoul(optarg, NULL, 0);
+            if ( !delay )
+                usage();
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch = true;
+            break;
+        case 'a':
+            totals = true;
+            break;
+        case 'c':
+            hypercalls = true;
+            break;
+        case 'x':
+            exits = true;
+            break;
+        case 'e':
+            ctl = XEN_SYSCTL_LAT_HIST_enable;
+            break;
+        case 'D':
+            ctl = XEN_SYSCTL_LAT_HIST_disable;
+            break;
+        case 'r':
+            ctl = XEN_SYSCTL_LAT_HIST_reset;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if ( optind != argc )
+        usage();
+
+    xch = xc_interface_open(0, 0, 0);
+    if ( !xch )
+    {
+        fprintf(stderr, "Error opening xc interface: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    if ( ctl >= 0 )
+    {
+        if ( xc_lat_hist_control(xch, ctl, NULL) )
+        {
+            perror("xc_lat_hist_control");
+            return 1;
+        }
+        return 0;
+    }
+
+    cur = malloc(sizeof(*cur));
+    prev = malloc(sizeof(*prev));
+    if ( !cur || !prev )
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    take_sample(prev);
+
+    if ( totals )
+    {
+        print_sample(prev, NULL, 0, hypercalls, exits);
+        return 0;
+    }
+
+    if ( !isatty(STDOUT_FILENO) )
+        batch = true;
+
+    for ( i = 0; !iterations || i < iterations; i++ )
+    {
+        sleep(delay);
+        take_sample(cur);
+
+        if ( !batch )
+            printf("\033[H\033[2J");
+        else if ( i )
+            printf("\n");
+        print_sample(cur, prev, delay, hypercalls, exits);
+        fflush(stdout);
+
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    xc_interface_close(xch);
+    free(cur);
+    free(prev);
+
+    return 0;
+}
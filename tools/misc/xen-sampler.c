@@ -0,0 +1,356 @@
+/*
+ * xen-sampler: statistical profile of Xen and its guests
+ *
+ * Samples the pcpus with a performance counter NMI for a while
+ * (XEN_SYSCTL_sampler_op), then prints the hottest Xen functions and how
+ * the samples split between domains and between Xen, guest kernels and
+ * guest user space.  Needs no profiling domain and no reboot.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <xenctrl.h>
+
+#define READ_SAMPLES    4096
+#define READ_INTERVAL   100     /* ms */
+#define NR_MODES        3
+
+struct symbol {
+    uint64_t addr;
+    uint64_t count;
+};
+
+struct domain {
+    uint32_t domid;
+    uint64_t count[NR_MODES];
+};
+
+static xc_interface *xch;
+static volatile sig_atomic_t interrupted;
+
+static uint64_t *xen_pcs;               /* symbol, or pc if unknown */
+static size_t nr_xen_pcs, max_xen_pcs;
+static struct domain *doms;
+static size_t nr_doms;
+static uint64_t mode_count[NR_MODES], total;
+
+static void usage(void)
+{
+    fprintf(stderr,
+"Usage: xen-sampler [OPTION]...\n"
+"Profile Xen and its guests for a while, then print the hottest Xen\n"
+"functions and the samples of each domain.\n"
+"\n"
+"  -d SECS    sample for SECS seconds (default 10), or until interrupted\n"
+"  -n N       print the N hottest Xen functions (default 30)\n"
+"  -p EVENTS  take a sample every EVENTS PMU events (default: Xen's)\n"
+"  -e EVENT   PMU event number (default: unhalted cycles)\n"
+"  -u MASK    PMU event unit mask\n"
+"  -b N       buffer N samples per pcpu (default: Xen's)\n"
+"  -s         stop sampling, e.g. after a previous run was killed\n"
+"  -h         print this help\n");
+    exit(2);
+}
+
+static void sigint(int sig)
+{
+    interrupted = 1;
+}
+
+static void add_xen_pc(uint64_t pc)
+{
+    if ( nr_xen_pcs == max_xen_pcs )
+    {
+        size_t max = max_xen_pcs ? max_xen_pcs * 2 : 65536;
+        uint64_t *p = realloc(xen_pcs, max * sizeof(*p));
+
+        if ( !p )
+        {
+            perror("realloc");
+            exit(1);
+        }
+        xen_pcs = p;
+        max_xen_pcs = max;
+    }
+
+    xen_pcs[nr_xen_pcs++] = pc;
+}
+
+static struct domain *find_domain(uint32_t domid)
+{
+    struct domain *d;
+    size_t i;
+
+    for ( i = 0; i < nr_doms; i++ )
+        if ( doms[i].domid == domid )
+            return &doms[i];
+
+    d = realloc(doms, (nr_doms + 1) * sizeof(*d));
+    if ( !d )
+    {
+        perror("realloc");
+        exit(1);
+    }
+    doms = d;
+    d = &doms[nr_doms++];
+    memset(d, 0, sizeof(*d));
+    d->domid = domid;
+
+    return d;
+}
+
+/* Drain Xen's buffers; returns whether sampling is still on. */
+static bool read_samples(xc_sample_t *buf, uint64_t *lost)
+{
+    bool running;
+    uint32_t nr, i;
+
+    do {
+        nr = READ_SAMPLES;
+        if ( xc_sampler_read(xch, buf, &nr, lost, &running) )
+        {
+            perror("xc_sampler_read");
+            exit(1);
+        }
+
+        for ( i = 0; i < nr; i++ )
+        {
+            const xc_sample_t *s = &buf[i];
+            unsigned int mode = s->mode < NR_MODES ? s->mode
+                                                   : XEN_SAMPLE_MODE_xen;
+
+            total++;
+            mode_count[mode]++;
+            find_domain(s->domid)->count[mode]++;
+            if ( mode == XEN_SAMPLE_MODE_xen )
+                add_xen_pc(s->symbol ?: s->pc);
+        }
+    } while ( nr == READ_SAMPLES );
+
+    return running;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_symbol(const void *a, const void *b)
+{
+    const struct symbol *x = a, *y = b;
+
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static int cmp_domain(const void *a, const void *b)
+{
+    const struct domain *x = a, *y = b;
+
+    return x->domid < y->domid ? -1 : x->domid > y->domid;
+}
+
+static double pct(uint64_t n, uint64_t of)
+{
+    return of ? 100.0 * n / of : 0;
+}
+
+static void print_symbols(unsigned int top)
+{
+    struct symbol *syms;
+    size_t nr = 0, i;
+    char name[XEN_SAMPLER_NAME_LEN];
+
+    if ( !nr_xen_pcs )
+        return;
+
+    qsort(xen_pcs, nr_xen_pcs, sizeof(*xen_pcs), cmp_u64);
+
+    syms = calloc(nr_xen_pcs, sizeof(*syms));
+    if ( !syms )
+    {
+        perror("calloc");
+        exit(1);
+    }
+
+    for ( i = 0; i < nr_xen_pcs; i++ )
+    {
+        if ( !nr || syms[nr - 1].addr != xen_pcs[i] )
+            syms[nr++].addr = xen_pcs[i];
+        syms[nr - 1].count++;
+    }
+
+    qsort(syms, nr, sizeof(*syms), cmp_symbol);
+
+    printf("\n%7s %7s %10s  %s\n", "%XEN", "%ALL", "SAMPLES", "FUNCTION");
+    for ( i = 0; i < nr && i < top; i++ )
+    {
+        if ( xc_sampler_symbol(xch, syms[i].addr, name, sizeof(name)) ||
+             !name[0] )
+            snprintf(name, sizeof(name), "%#"PRIx64, syms[i].addr);
+        printf("%6.2f%% %6.2f%% %10"PRIu64"  %s\n",
+               pct(syms[i].count, mode_count[XEN_SAMPLE_MODE_xen]),
+               pct(syms[i].count, total), syms[i].count, name);
+    }
+
+    free(syms);
+}
+
+static void print_domains(void)
+{
+    size_t i;
+
+    qsort(doms, nr_doms, sizeof(*doms), cmp_domain);
+
+    printf("\n%6s %10s %7s %7s %7s %7s\n",
+           "DOMID", "SAMPLES", "%ALL", "%XEN", "%KERNEL", "%USER");
+    for ( i = 0; i < nr_doms; i++ )
+    {
+        const struct domain *d = &doms[i];
+        uint64_t n = d->count[XEN_SAMPLE_MODE_xen] +
+                     d->count[XEN_SAMPLE_MODE_kernel] +
+                     d->count[XEN_SAMPLE_MODE_user];
+
+        if ( d->domid == DOMID_IDLE )
+            printf("%6s", "idle");
+        else
+            printf("%6u", d->domid);
+        printf(" %10"PRIu64" %6.2f%% %6.2f%% %6.2f%% %6.2f%%\n",
+               n, pct(n, total), pct(d->count[XEN_SAMPLE_MODE_xen], n),
+               pct(d->count[XEN_SAMPLE_MODE_kernel], n),
+               pct(d->count[XEN_SAMPLE_MODE_user], n));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int secs = 10, top = 30;
+    uint32_t event = 0, unit_mask = 0, period = 0, buf_samples = 0;
+    uint64_t lost = 0;
+    struct timespec start, now, delay = { 0, READ_INTERVAL * 1000000 };
+    xc_sample_t *buf;
+    bool stop = false;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "d:n:p:e:u:b:sh")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'd':
+            secs = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            top = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            period = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            event = strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            unit_mask = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            buf_samples = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            stop = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if ( optind != argc )
+        usage();
+
+    xch = xc_interface_open(0, 0, 0);
+    if ( !xch )
+    {
+        fprintf(stderr, "Error opening xc interface: %d (%s)\n",
+                errno, strerror(errno));
+        return 1;
+    }
+
+    if ( stop )
+    {
+        if ( xc_sampler_stop(xch) )
+        {
+            perror("xc_sampler_stop");
+            return 1;
+        }
+        return 0;
+    }
+
+    buf = calloc(READ_SAMPLES, sizeof(*buf));
+    if ( !buf )
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    signal(SIGINT, sigint);
+    signal(SIGTERM, sigint);
+
+    if ( xc_sampler_start(xch, event, unit_mask, period, buf_samples) )
+    {
+        if ( errno == EBUSY )
+            fprintf(stderr, "The PMU is in use (xenoprof, vPMU, NMI "
+                    "watchdog or another xen-sampler)\n");
+        else
+            perror("xc_sampler_start");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        nanosleep(&delay, NULL);
+        if ( !read_samples(buf, &lost) )
+        {
+            fprintf(stderr, "Sampling was stopped by someone else\n");
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ( !interrupted && (!secs || now.tv_sec - start.tv_sec < secs) );
+
+    if ( xc_sampler_stop(xch) )
+        perror("xc_sampler_stop");
+    read_samples(buf, &lost);
+
+    printf("%"PRIu64" samples, %"PRIu64" lost: %.2f%% Xen, "
+           "%.2f%% guest kernel, %.2f%% guest user\n", total, lost,
+           pct(mode_count[XEN_SAMPLE_MODE_xen], total),
+           pct(mode_count[XEN_SAMPLE_MODE_kernel], total),
+           pct(mode_count[XEN_SAMPLE_MODE_user], total));
+
+    print_symbols(top);
+    print_domains();
+
+    xc_interface_close(xch);
+    free(buf);
+    free(xen_pcs);
+    free(doms);
+
+    return 0;
+}
@@ -17,6 +17,71 @@
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
+#include <getopt.h>
+
+static void usage(const char *prog)
+{
+    printf("%s: [-r | -e | -d] [-v] [-t n]\n", prog);
+    printf("no args: print lock profile data\n");
+    printf("    -r : reset profile data\n");
+    printf("    -e : enable profiling\n");
+    printf("    -d : disable profiling\n");
+    printf("    -v : also print wait times and top call sites of locks\n");
+    printf("    -t n : print only the n locks waited for longest\n");
+}
+
+static int cmp_block_time(const void *a, const void *b)
+{
+    const xc_lockprof_data_t *x = a, *y = b;
+
+    return (x->block_time < y->block_time) - (x->block_time > y->block_time);
+}
+
+/* Upper bound of the wait histogram bucket below which fraction of waits */
+static double hist_percentile(const xc_lockprof_data_t *d, double fraction)
+{
+    uint64_t n = 0, want;
+    int b;
+
+    for ( b = 0; b < LOCKPROF_HIST_BUCKETS; b++ )
+        n += d->block_hist[b];
+    want = n * fraction;
+
+    for ( n = 0, b = 0; b < LOCKPROF_HIST_BUCKETS - 1; b++ )
+    {
+        n += d->block_hist[b];
+        if ( n > want )
+            break;
+    }
+
+    return (double)(2ULL << b) / 1E+03;
+}
+
+static void print_details(const xc_lockprof_data_t *d)
+{
+    int b, c;
+
+    if ( !d->block_cnt )
+        return;
+
+    printf("    wait: avg %.3fus, p50 <%.3fus, p99 <%.3fus, max",
+           (double)d->block_time / d->block_cnt / 1E+03,
+           hist_percentile(d, 0.5), hist_percentile(d, 0.99));
+    for ( b = LOCKPROF_HIST_BUCKETS - 1; b > 0 && !d->block_hist[b]; b-- )
+        ;
+    printf(" <%.3fus\n", (double)(2ULL << b) / 1E+03);
+
+    for ( c = 0; c < LOCKPROF_CALLERS; c++ )
+    {
+        const xc_lockprof_caller_t *caller = &d->callers[c];
+
+        if ( !caller->addr )
+            continue;
+        printf("    block:%12"PRId64"(%20.9fs) from %s\n",
+               caller->block_cnt, (double)caller->block_time / 1E+09,
+               caller->symbol[0] ? caller->symbol : "?");
+    }
+}
 
 int main(int argc, char *argv[])
 {
@@ -25,13 +90,39 @@ int main(int argc, char *argv[])
     uint64_t           time;
     double             l, b, sl, sb;
     char               name[100];
+    int                opt, reset = 0, enable = -1, verbose = 0, top = 0;
     DECLARE_HYPERCALL_BUFFER(xc_lockprof_data_t, data);
 
-    if ( (argc > 2) || ((argc == 2) && (strcmp(argv[1], "-r") != 0)) )
+    while ( (opt = getopt(argc, argv, "redvt:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'r':
+            reset = 1;
+            break;
+        case 'e':
+            enable = 1;
+            break;
+        case 'd':
+            enable = 0;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 't':
+            top = atoi(optarg);
+            if ( top > 0 )
+                break;
+            /* fall through */
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( optind != argc || (reset + (enable >= 0) > 1) )
     {
-        printf("%s: [-r]\n", argv[0]);
-        printf("no args: print lock profile data\n");
-        printf("    -r : reset profile data\n");
+        usage(argv[0]);
         return 1;
     }
 
@@ -42,7 +133,7 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    if ( argc > 1 )
+    if ( reset )
     {
         if ( xc_lockprof_reset(xc_handle) != 0 )
         {
@@ -53,6 +144,17 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    if ( enable >= 0 )
+    {
+        if ( xc_lockprof_enable(xc_handle, enable) != 0 )
+        {
+            fprintf(stderr, "Error %s profiling: %d (%s)\n",
+                    enable ? "enabling" : "disabling", errno, strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
     n = 0;
     if ( xc_lockprof_query_number(xc_handle, &n) != 0 )
     {
@@ -84,6 +186,9 @@ int main(int argc, char *argv[])
         i = n;
     }
 
+    if ( top )
+        qsort(data, i, sizeof(*data), cmp_block_time);
+
     sl = 0;
     sb = 0;
     for ( j = 0; j < i; j++ )
@@ -105,9 +210,13 @@ int main(int argc, char *argv[])
         b = (double)(data[j].block_time) / 1E+09;
         sl += l;
         sb += b;
+        if ( top && j >= top )
+            continue;
         printf("%-50s: lock:%12"PRId64"(%20.9fs), "
                "block:%12"PRId64"(%20.9fs)\n",
                name, data[j].lock_cnt, l, data[j].block_cnt, b);
+        if ( verbose )
+            print_details(&data[j]);
     }
     l = (double)time / 1E+09;
     printf("total profiling time: %20.9fs\n", l);
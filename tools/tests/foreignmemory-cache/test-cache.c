@@ -0,0 +1,279 @@
+/*
+ * test-cache.c: Check the foreign mapping cache against a fake privcmd.
+ *
+ * Every frame the cache asks to map is counted, so the test can tell it
+ * never touches guest frames beyond the ones requested.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "private.h"
+
+#define GUEST_PAGES 4096
+
+static unsigned int touched[GUEST_PAGES];  /* map attempts per gfn */
+static unsigned int nr_touched;
+static int absent[GUEST_PAGES];             /* paged out, say */
+static unsigned int nr_maps, nr_live;
+static int failures;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if ( !(cond) )                                                  \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+            failures++;                                                 \
+        }                                                               \
+    } while ( 0 )
+
+void xtl_log(struct xentoollog_logger *logger, xentoollog_level level,
+             int errnoval, const char *context, const char *format, ...)
+{
+}
+
+void *osdep_xenforeignmemory_map(xenforeignmemory_handle *fmem,
+                                 uint32_t dom, int prot,
+                                 size_t num,
+                                 const xen_pfn_t arr[num], int err[num])
+{
+    char *addr;
+    size_t i;
+
+    addr = mmap(NULL, num << PAGE_SHIFT, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( addr == MAP_FAILED )
+        return NULL;
+
+    for ( i = 0; i < num; i++ )
+    {
+        if ( arr[i] >= GUEST_PAGES )
+        {
+            err[i] = -EINVAL;
+            continue;
+        }
+        touched[arr[i]]++;
+        nr_touched++;
+        err[i] = absent[arr[i]] ? -ENOENT : 0;
+        if ( !err[i] )
+            memcpy(addr + (i << PAGE_SHIFT), &arr[i], sizeof(arr[i]));
+    }
+
+    nr_maps++;
+    nr_live++;
+
+    return addr;
+}
+
+int osdep_xenforeignmemory_unmap(xenforeignmemory_handle *fmem,
+                                 void *addr, size_t num)
+{
+    nr_live--;
+    return munmap(addr, num << PAGE_SHIFT);
+}
+
+void *xenforeignmemory_map(xenforeignmemory_handle *fmem,
+                           uint32_t dom, int prot,
+                           size_t num,
+                           const xen_pfn_t arr[/*num*/], int err[/*num*/])
+{
+    int errs[num];
+    void *addr = osdep_xenforeignmemory_map(fmem, dom, prot, num, arr, errs);
+    size_t i;
+
+    for ( i = 0; addr && i < num; i++ )
+    {
+        if ( errs[i] )
+        {
+            osdep_xenforeignmemory_unmap(fmem, addr, num);
+            errno = -errs[i];
+            return NULL;
+        }
+    }
+
+    return addr;
+}
+
+static xen_pfn_t frame_at(void *addr, size_t page)
+{
+    xen_pfn_t gfn;
+
+    memcpy(&gfn, (char *)addr + (page << PAGE_SHIFT), sizeof(gfn));
+    return gfn;
+}
+
+static void *map_run(xenforeignmemory_cache *cache, xen_pfn_t gfn,
+                     size_t pages)
+{
+    xen_pfn_t arr[pages];
+    size_t i;
+
+    for ( i = 0; i < pages; i++ )
+        arr[i] = gfn + i;
+
+    return xenforeignmemory_cache_map(cache, pages, arr);
+}
+
+/* Only the frames asked for are mapped, and covered requests are hits. */
+static void test_exact_runs(xenforeignmemory_handle *fmem)
+{
+    xenforeignmemory_cache *cache =
+        xenforeignmemory_cache_create(fmem, 1, PROT_READ, 0);
+    xenforeignmemory_cache_stats stats;
+    char *a, *b, *c, *d, *e;
+
+    a = map_run(cache, 100, 4);
+    CHECK(a && frame_at(a, 0) == 100 && frame_at(a, 3) == 103);
+    CHECK(nr_touched == 4 && touched[99] == 0 && touched[104] == 0);
+
+    b = map_run(cache, 101, 2);
+    CHECK(b == a + (1 << PAGE_SHIFT));
+    CHECK(nr_touched == 4);
+
+    /* Not covered by the cached run: only its own frames get mapped. */
+    c = map_run(cache, 99, 2);
+    CHECK(c && frame_at(c, 0) == 99 && frame_at(c, 1) == 100);
+    CHECK(nr_touched == 6 && touched[98] == 0 && touched[101] == 1);
+
+    /* A long run is found from anywhere inside it. */
+    d = map_run(cache, 1000, 1600);
+    e = map_run(cache, 2500, 10);
+    CHECK(d && e == d + (1500 << PAGE_SHIFT));
+    CHECK(frame_at(e, 9) == 2509);
+    CHECK(nr_touched == 6 + 1600);
+
+    xenforeignmemory_cache_get_stats(cache, &stats);
+    CHECK(stats.hits == 2 && stats.misses == 3);
+    CHECK(stats.entries == 3 && stats.pages_mapped == 4 + 2 + 1600);
+
+    CHECK(xenforeignmemory_cache_unmap(cache, a, 4) == 0);
+    CHECK(xenforeignmemory_cache_unmap(cache, b, 2) == 0);
+    CHECK(xenforeignmemory_cache_unmap(cache, c, 2) == 0);
+    CHECK(xenforeignmemory_cache_unmap(cache, e, 10) == 0);
+    CHECK(xenforeignmemory_cache_unmap(cache, d, 1600) == 0);
+    CHECK(xenforeignmemory_cache_unmap(cache, (void *)4096, 1) == -1 &&
+          errno == EINVAL);
+
+    xenforeignmemory_cache_destroy(cache);
+    memset(touched, 0, sizeof(touched));
+    nr_touched = 0;
+}
+
+/* A run with a missing frame fails and is not cached. */
+static void test_absent_frame(xenforeignmemory_handle *fmem)
+{
+    xenforeignmemory_cache *cache =
+        xenforeignmemory_cache_create(fmem, 1, PROT_READ, 0);
+    unsigned int maps = nr_maps;
+    char *a;
+
+    absent[2000] = 1;
+    a = map_run(cache, 1998, 4);
+    CHECK(!a && errno == ENOENT);
+
+    absent[2000] = 0;
+    a = map_run(cache, 1998, 4);
+    CHECK(a && frame_at(a, 2) == 2000);
+    CHECK(nr_maps == maps + 2);
+    CHECK(xenforeignmemory_cache_unmap(cache, a, 4) == 0);
+
+    xenforeignmemory_cache_destroy(cache);
+}
+
+/* Unused runs are dropped least recently used first, used ones never. */
+static void test_eviction(xenforeignmemory_handle *fmem)
+{
+    xenforeignmemory_cache *cache =
+        xenforeignmemory_cache_create(fmem, 1, PROT_READ, 16);
+    xenforeignmemory_cache_stats stats;
+    char *a, *b, *c;
+
+    a = map_run(cache, 0, 8);
+    b = map_run(cache, 8, 8);
+    CHECK(xenforeignmemory_cache_unmap(cache, a, 8) == 0);
+    CHECK(xenforeignmemory_cache_unmap(cache, b, 8) == 0);
+
+    c = map_run(cache, 16, 8);
+    xenforeignmemory_cache_get_stats(cache, &stats);
+    CHECK(stats.evictions == 1 && stats.pages_mapped == 16);
+
+    CHECK(map_run(cache, 8, 8) == b);
+    CHECK(xenforeignmemory_cache_unmap(cache, b, 8) == 0);
+    CHECK(xenforeignmemory_cache_unmap(cache, c, 8) == 0);
+
+    xenforeignmemory_cache_destroy(cache);
+}
+
+/* Invalidated runs stay valid for their users but are not handed out. */
+static void test_invalidate(xenforeignmemory_handle *fmem)
+{
+    xenforeignmemory_cache *cache =
+        xenforeignmemory_cache_create(fmem, 1, PROT_READ, 0);
+    xenforeignmemory_cache_stats stats;
+    xen_pfn_t scattered[2] = { 5, 9 };
+    char *a, *b, *c;
+
+    a = map_run(cache, 300, 4);
+    xenforeignmemory_cache_invalidate(cache, 301, 1);
+    b = map_run(cache, 300, 4);
+    CHECK(a && b && a != b && frame_at(a, 1) == 301);
+
+    CHECK(xenforeignmemory_cache_unmap(cache, a, 4) == 0);
+    CHECK(xenforeignmemory_cache_unmap(cache, b, 4) == 0);
+
+    c = xenforeignmemory_cache_map(cache, 2, scattered);
+    CHECK(c && frame_at(c, 0) == 5 && frame_at(c, 1) == 9);
+    CHECK(xenforeignmemory_cache_unmap(cache, c, 2) == 0);
+
+    xenforeignmemory_cache_get_stats(cache, &stats);
+    CHECK(stats.invalidations == 1 && stats.uncached == 1);
+    CHECK(stats.entries == 1 && stats.pages_mapped == 4);
+
+    xenforeignmemory_cache_destroy(cache);
+}
+
+int main(void)
+{
+    xenforeignmemory_handle fmem = { 0 };
+
+    test_exact_runs(&fmem);
+    test_absent_frame(&fmem);
+    test_eviction(&fmem);
+    test_invalidate(&fmem);
+
+    CHECK(nr_live == 0);
+
+    if ( failures )
+    {
+        printf("foreignmemory cache: %d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("foreignmemory cache: all checks passed\n");
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
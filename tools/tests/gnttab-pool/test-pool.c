@@ -0,0 +1,202 @@
+/*
+ * test-pool.c: Check the persistent grant pool against a fake grant device.
+ *
+ * Each mapping is a separate allocation, so a put that unmaps the wrong
+ * mapping shows up as a live mapping being freed under its user.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "private.h"
+
+#define MAX_MAPS 64
+
+struct fake_map {
+    uint32_t domid, ref;
+    int live;
+};
+
+static struct fake_map maps[MAX_MAPS];
+static unsigned int nr_maps, nr_live;
+static int failures;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if ( !(cond) )                                                  \
+        {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+            failures++;                                                 \
+        }                                                               \
+    } while ( 0 )
+
+void xtl_log(struct xentoollog_logger *logger, xentoollog_level level,
+             int errnoval, const char *context, const char *format, ...)
+{
+}
+
+void *osdep_gnttab_grant_map(xengnttab_handle *xgt,
+                             uint32_t count, int flags, int prot,
+                             uint32_t *domids, uint32_t *refs,
+                             uint32_t notify_offset,
+                             evtchn_port_t notify_port)
+{
+    struct fake_map *m;
+
+    if ( count != 1 || nr_maps == MAX_MAPS )
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    m = &maps[nr_maps++];
+    m->domid = domids[0];
+    m->ref = refs[0];
+    m->live = 1;
+    nr_live++;
+
+    return m;
+}
+
+int osdep_gnttab_unmap(xengnttab_handle *xgt, void *start_address,
+                       uint32_t count)
+{
+    struct fake_map *m = start_address;
+
+    if ( count != 1 || !m->live )
+    {
+        fprintf(stderr, "unmap of a mapping that is not live\n");
+        failures++;
+        return -1;
+    }
+
+    m->live = 0;
+    nr_live--;
+
+    return 0;
+}
+
+static int is_live(void *addr, uint32_t domid, uint32_t ref)
+{
+    struct fake_map *m = addr;
+
+    return m && m->live && m->domid == domid && m->ref == ref;
+}
+
+/* Two users of a grant mapped transiently each keep their own mapping. */
+static void test_concurrent_transient(xengnttab_handle *xgt)
+{
+    xengnttab_pool *pool = xengnttab_pool_create(xgt, 1, 0);
+    void *a, *b1, *b2;
+
+    a = xengnttab_pool_get(pool, 1, 10);
+    b1 = xengnttab_pool_get(pool, 1, 11);
+    b2 = xengnttab_pool_get(pool, 1, 11);
+    CHECK(is_live(a, 1, 10));
+    CHECK(is_live(b1, 1, 11));
+    CHECK(is_live(b2, 1, 11));
+    CHECK(b1 != b2);
+
+    /* Dropping the second use must leave the first one's mapping alone. */
+    CHECK(xengnttab_pool_put(pool, b2) == 0);
+    CHECK(!is_live(b2, 1, 11));
+    CHECK(is_live(b1, 1, 11));
+
+    CHECK(xengnttab_pool_put(pool, b1) == 0);
+    CHECK(!is_live(b1, 1, 11));
+
+    /* The pooled grant is shared by its users, and kept after them. */
+    CHECK(xengnttab_pool_get(pool, 1, 10) == a);
+    CHECK(xengnttab_pool_put(pool, a) == 0);
+    CHECK(xengnttab_pool_put(pool, a) == 0);
+    CHECK(is_live(a, 1, 10));
+
+    CHECK(xengnttab_pool_put(pool, a) == -1 && errno == ENOENT);
+    CHECK(xengnttab_pool_put(pool, b1) == -1 && errno == ENOENT);
+
+    xengnttab_pool_destroy(pool);
+    CHECK(!is_live(a, 1, 10));
+}
+
+/*
+ * A grant still in use when its domain is released is unmapped by its own
+ * put, not by the put of a mapping of the same grant made since.
+ */
+static void test_release_reget(xengnttab_handle *xgt)
+{
+    xengnttab_pool *pool = xengnttab_pool_create(xgt, 1, 0);
+    xengnttab_pool_stats stats;
+    void *old, *new, *other;
+
+    old = xengnttab_pool_get(pool, 2, 20);
+    CHECK(xengnttab_pool_release_domain(pool, 2) == 1);
+    CHECK(is_live(old, 2, 20));
+
+    new = xengnttab_pool_get(pool, 2, 20);
+    CHECK(is_live(new, 2, 20));
+    CHECK(new != old);
+
+    CHECK(xengnttab_pool_put(pool, old) == 0);
+    CHECK(!is_live(old, 2, 20));
+    CHECK(is_live(new, 2, 20));
+
+    /* The new mapping is still busy, so it must not be evicted. */
+    other = xengnttab_pool_get(pool, 2, 21);
+    CHECK(is_live(other, 2, 21));
+    CHECK(is_live(new, 2, 20));
+    CHECK(xengnttab_pool_put(pool, other) == 0);
+
+    CHECK(xengnttab_pool_put(pool, new) == 0);
+    CHECK(is_live(new, 2, 20));
+
+    xengnttab_pool_get_stats(pool, &stats);
+    CHECK(stats.persistent == 1);
+    CHECK(stats.mapped == 1);
+    CHECK(stats.evictions == 0);
+
+    xengnttab_pool_destroy(pool);
+    CHECK(!is_live(new, 2, 20));
+}
+
+int main(void)
+{
+    struct xengntdev_handle xgt = { 0 };
+
+    test_concurrent_transient(&xgt);
+    test_release_reget(&xgt);
+
+    CHECK(nr_live == 0);
+
+    if ( failures )
+    {
+        printf("gnttab pool: %d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("gnttab pool: all checks passed\n");
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
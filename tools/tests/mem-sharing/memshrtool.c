@@ -26,6 +26,14 @@ static int usage(const char* prog)
     printf("                          - Share two pages.\n");
     printf("  range <source-domid> <destination-domid> <first-gfn> <last-gfn>\n");
     printf("                          - Share pages between domains in a range.\n");
+    printf("  dedup <source-domid> <destination-domid> <first-gfn> <last-gfn>\n");
+    printf("                          - Share pages of equal contents between domains,\n");
+    printf("                            wherever they are in the range.\n");
+    printf("  fork <parent-domid> <domid>\n");
+    printf("                          - Make an empty domain a copy-on-write fork of\n");
+    printf("                            a paused parent.\n");
+    printf("  fork-reset <domid>      - Discard a fork's private pages and reload its\n");
+    printf("                            state from the parent.\n");
     printf("  unshare <domid> <gfn>   - Unshare a page by grabbing a writable map.\n");
     printf("  add-to-physmap <domid> <gfn> <source> <source-gfn> <source-handle>\n");
     printf("                          - Populate a page in a domain with a shared page.\n");
@@ -46,6 +54,106 @@ static int usage(const char* prog)
     } \
 } while(0)
 
+#define BATCH_SIZE 1024
+
+static int cmp_hash(const void *a, const void *b)
+{
+    const xen_mem_sharing_batch_entry_t *x = a, *y = b;
+
+    return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+/* Hash every page of [first_gfn, last_gfn] of domid, in batches. */
+static xen_mem_sharing_batch_entry_t *hash_range(xc_interface *xch,
+                                                 domid_t domid,
+                                                 uint64_t first_gfn,
+                                                 uint64_t last_gfn)
+{
+    unsigned long i, nr = last_gfn - first_gfn + 1;
+    xen_mem_sharing_batch_entry_t *e = calloc(nr, sizeof(*e));
+
+    if ( !e )
+        return NULL;
+
+    for ( i = 0; i < nr; i++ )
+        e[i].gfn = first_gfn + i;
+
+    for ( i = 0; i < nr; i += BATCH_SIZE )
+    {
+        unsigned int n = (nr - i < BATCH_SIZE) ? nr - i : BATCH_SIZE;
+
+        if ( xc_memshr_batch(xch, domid, e + i, n,
+                             XENMEM_SHARING_BATCH_HASH) < 0 )
+        {
+            free(e);
+            return NULL;
+        }
+    }
+
+    return e;
+}
+
+static int dedup(xc_interface *xch, domid_t sdomid, domid_t cdomid,
+                 uint64_t first_gfn, uint64_t last_gfn)
+{
+    unsigned long i, nr = last_gfn - first_gfn + 1, nr_src = 0;
+    unsigned long nr_share = 0, shared = 0;
+    xen_mem_sharing_batch_entry_t *src, *cli, *share, *match;
+    int rc = -1;
+
+    src = hash_range(xch, sdomid, first_gfn, last_gfn);
+    cli = hash_range(xch, cdomid, first_gfn, last_gfn);
+    share = calloc(nr, sizeof(*share));
+    if ( !src || !cli || !share )
+        goto out;
+
+    /* Pages that could not be hashed have no hash to match against. */
+    for ( i = 0; i < nr; i++ )
+        if ( !src[i].rc )
+            src[nr_src++] = src[i];
+
+    qsort(src, nr_src, sizeof(*src), cmp_hash);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( cli[i].rc )
+            continue;
+
+        match = bsearch(&cli[i], src, nr_src, sizeof(*src), cmp_hash);
+        if ( !match )
+            continue;
+
+        share[nr_share].gfn = match->gfn;
+        share[nr_share].client_gfn = cli[i].gfn;
+        share[nr_share].client_domain = cdomid;
+        nr_share++;
+    }
+
+    for ( i = 0; i < nr_share; i += BATCH_SIZE )
+    {
+        unsigned int n = (nr_share - i < BATCH_SIZE) ? nr_share - i
+                                                     : BATCH_SIZE;
+
+        if ( xc_memshr_batch(xch, sdomid, share + i, n,
+                             XENMEM_SHARING_BATCH_SHARE |
+                             XENMEM_SHARING_BATCH_VERIFY) < 0 )
+            goto out;
+    }
+
+    for ( i = 0; i < nr_share; i++ )
+        if ( !share[i].rc )
+            shared++;
+
+    printf("%lu candidates found, %lu pages shared\n", nr_share, shared);
+    rc = 0;
+
+ out:
+    free(share);
+    free(cli);
+    free(src);
+    return rc;
+}
+
 int main(int argc, const char** argv)
 {
     const char* cmd = NULL;
@@ -203,5 +311,44 @@ int main(int argc, const char** argv)
             return rc;
         }
     }
+    else if( !strcasecmp(cmd, "dedup") )
+    {
+        domid_t sdomid, cdomid;
+        uint64_t first_gfn, last_gfn;
+
+        if ( argc != 6 )
+            return usage(argv[0]);
+
+        sdomid = strtol(argv[2], NULL, 0);
+        cdomid = strtol(argv[3], NULL, 0);
+        first_gfn = strtoul(argv[4], NULL, 0);
+        last_gfn = strtoul(argv[5], NULL, 0);
+
+        if ( last_gfn < first_gfn )
+            return usage(argv[0]);
+
+        R(dedup(xch, sdomid, cdomid, first_gfn, last_gfn));
+    }
+    else if( !strcasecmp(cmd, "fork") )
+    {
+        domid_t pdomid, domid;
+
+        if ( argc != 4 )
+            return usage(argv[0]);
+
+        pdomid = strtol(argv[2], NULL, 0);
+        domid = strtol(argv[3], NULL, 0);
+        R(xc_memshr_fork(xch, pdomid, domid));
+    }
+    else if( !strcasecmp(cmd, "fork-reset") )
+    {
+        domid_t domid;
+
+        if ( argc != 3 )
+            return usage(argv[0]);
+
+        domid = strtol(argv[2], NULL, 0);
+        R(xc_memshr_fork_reset(xch, domid));
+    }
     return 0;
 }
@@ -0,0 +1,473 @@
+/*
+ * xen-access-bench.c
+ *
+ * Measure vm_event monitor throughput: how many synchronous events per
+ * second a trivial helper can answer, using either the shared ring or
+ * per-vCPU channels, and resuming either per event or in batches.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <poll.h>
+
+#include <xenctrl.h>
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
+
+#define ERROR(a, b...) fprintf(stderr, a "\n", ## b)
+#define PERROR(a, b...) fprintf(stderr, a ": %s\n", ## b, strerror(errno))
+
+enum bench_event {
+    BENCH_SINGLESTEP,
+    BENCH_CPUID,
+};
+
+typedef struct bench {
+    xc_interface *xch;
+    xenevtchn_handle *xce;
+    domid_t domain_id;
+    enum bench_event event;
+    bool channels;
+    bool batch;
+
+    /* Ring mode */
+    void *ring_page;
+    vm_event_back_ring_t back_ring;
+    int port;
+
+    /* Channel mode */
+    void *slots;
+    unsigned int nr_frames;
+    unsigned int nr_vcpus;
+    int *vcpu_port;             /* local port of each vCPU's channel */
+
+    uint64_t events;
+} bench_t;
+
+static int interrupted;
+
+static void close_handler(int sig)
+{
+    interrupted = sig;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct vm_event_slot *slot(bench_t *b, unsigned int vcpu)
+{
+    return (struct vm_event_slot *)((char *)b->slots +
+                                    (vcpu / VM_EVENT_SLOTS_PER_FRAME) *
+                                    XC_PAGE_SIZE) +
+           vcpu % VM_EVENT_SLOTS_PER_FRAME;
+}
+
+/* The cheapest correct answer to each kind of event. */
+static void make_response(const vm_event_request_t *req,
+                          vm_event_response_t *rsp)
+{
+    memset(rsp, 0, sizeof(*rsp));
+    rsp->version = VM_EVENT_INTERFACE_VERSION;
+    rsp->vcpu_id = req->vcpu_id;
+    rsp->flags = req->flags & VM_EVENT_FLAG_VCPU_PAUSED;
+    rsp->reason = req->reason;
+
+    if ( req->reason == VM_EVENT_REASON_CPUID )
+    {
+        rsp->data = req->data;
+        rsp->data.regs.x86.rip += req->u.cpuid.insn_length;
+        rsp->flags |= VM_EVENT_FLAG_SET_REGISTERS;
+    }
+}
+
+static int handle_ring(bench_t *b)
+{
+    vm_event_back_ring_t *back_ring = &b->back_ring;
+    vm_event_request_t req;
+    vm_event_response_t rsp;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(back_ring, back_ring->req_cons),
+               sizeof(req));
+        back_ring->req_cons++;
+        back_ring->sring->req_event = back_ring->req_cons + 1;
+
+        make_response(&req, &rsp);
+
+        memcpy(RING_GET_RESPONSE(back_ring, back_ring->rsp_prod_pvt), &rsp,
+               sizeof(rsp));
+        back_ring->rsp_prod_pvt++;
+        RING_PUSH_RESPONSES(back_ring);
+
+        b->events++;
+
+        /* Unbatched: resume each event on its own, as a naive helper would. */
+        if ( !b->batch && xenevtchn_notify(b->xce, b->port) )
+            return -1;
+    }
+
+    if ( b->batch && xenevtchn_notify(b->xce, b->port) )
+        return -1;
+
+    return 0;
+}
+
+/* Answer vcpu's slot if it holds a request.  Returns whether it did. */
+static bool answer_slot(bench_t *b, unsigned int vcpu)
+{
+    struct vm_event_slot *s = slot(b, vcpu);
+    vm_event_request_t req;
+
+    if ( s->state != VM_EVENT_SLOT_STATE_SUBMITTED )
+        return false;
+
+    xen_rmb();
+    req = s->u.req;
+    make_response(&req, &s->u.rsp);
+    xen_wmb();
+    s->state = VM_EVENT_SLOT_STATE_FINISHED;
+
+    b->events++;
+
+    return true;
+}
+
+static int handle_channels(bench_t *b, int port)
+{
+    unsigned int vcpu;
+    bool answered = false;
+
+    if ( !b->batch )
+    {
+        /* Only the notifying vCPU; resume it through its own channel. */
+        for ( vcpu = 0; vcpu < b->nr_vcpus; vcpu++ )
+            if ( b->vcpu_port[vcpu] == port )
+                break;
+
+        if ( vcpu < b->nr_vcpus && answer_slot(b, vcpu) &&
+             xenevtchn_notify(b->xce, port) )
+            return -1;
+
+        return 0;
+    }
+
+    /* Answer every pending slot, then resume them all with one hypercall. */
+    for ( vcpu = 0; vcpu < b->nr_vcpus; vcpu++ )
+        answered |= answer_slot(b, vcpu);
+
+    return answered ? xc_monitor_resume(b->xch, b->domain_id) : 0;
+}
+
+static int setup_ring(bench_t *b)
+{
+    uint32_t remote_port;
+
+    b->ring_page = xc_monitor_enable(b->xch, b->domain_id, &remote_port);
+    if ( !b->ring_page )
+    {
+        PERROR("Error enabling monitor ring");
+        return -1;
+    }
+
+    b->port = xenevtchn_bind_interdomain(b->xce, b->domain_id, remote_port);
+    if ( b->port < 0 )
+    {
+        PERROR("Failed to bind event channel");
+        return -1;
+    }
+
+    SHARED_RING_INIT((vm_event_sring_t *)b->ring_page);
+    BACK_RING_INIT(&b->back_ring, (vm_event_sring_t *)b->ring_page,
+                   XC_PAGE_SIZE);
+
+    return 0;
+}
+
+static int setup_channels(bench_t *b)
+{
+    xc_dominfo_t info;
+    unsigned int vcpu;
+
+    if ( xc_domain_getinfo(b->xch, b->domain_id, 1, &info) != 1 ||
+         info.domid != b->domain_id )
+    {
+        PERROR("Could not get domain info");
+        return -1;
+    }
+    b->nr_vcpus = info.max_vcpu_id + 1;
+
+    b->slots = xc_monitor_enable_channels(b->xch, b->domain_id,
+                                          &b->nr_frames);
+    if ( !b->slots )
+    {
+        PERROR("Error enabling monitor channels");
+        return -1;
+    }
+
+    b->vcpu_port = calloc(b->nr_vcpus, sizeof(*b->vcpu_port));
+    if ( !b->vcpu_port )
+        return -1;
+
+    for ( vcpu = 0; vcpu < b->nr_vcpus; vcpu++ )
+    {
+        if ( !slot(b, vcpu)->port )
+        {
+            b->vcpu_port[vcpu] = -1;
+            continue;
+        }
+
+        b->vcpu_port[vcpu] = xenevtchn_bind_interdomain(b->xce, b->domain_id,
+                                                        slot(b, vcpu)->port);
+        if ( b->vcpu_port[vcpu] < 0 )
+        {
+            PERROR("Failed to bind event channel of vcpu %u", vcpu);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int enable_event(bench_t *b, bool enable)
+{
+    switch ( b->event )
+    {
+    case BENCH_SINGLESTEP:
+        return xc_monitor_singlestep(b->xch, b->domain_id, enable);
+    case BENCH_CPUID:
+        return xc_monitor_cpuid(b->xch, b->domain_id, enable);
+    }
+
+    return -1;
+}
+
+static void teardown(bench_t *b)
+{
+    unsigned int vcpu;
+
+    enable_event(b, false);
+
+    if ( b->ring_page || b->slots )
+    {
+        /* Answer whatever is in flight so no vCPU stays paused. */
+        if ( b->ring_page )
+            handle_ring(b);
+        else
+        {
+            b->batch = true;
+            handle_channels(b, -1);
+        }
+        xc_monitor_disable(b->xch, b->domain_id);
+    }
+
+    if ( b->ring_page )
+    {
+        xenevtchn_unbind(b->xce, b->port);
+        munmap(b->ring_page, XC_PAGE_SIZE);
+    }
+
+    if ( b->slots )
+    {
+        for ( vcpu = 0; vcpu < b->nr_vcpus; vcpu++ )
+            if ( b->vcpu_port && b->vcpu_port[vcpu] >= 0 )
+                xenevtchn_unbind(b->xce, b->vcpu_port[vcpu]);
+        munmap(b->slots, b->nr_frames * XC_PAGE_SIZE);
+    }
+
+    free(b->vcpu_port);
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+            "Usage: %s [-c] [-b] [-t <seconds>] <domain_id> singlestep|cpuid\n"
+            "\n"
+            "Answers synchronous monitor events as fast as possible and reports\n"
+            "events per second.\n"
+            "\n"
+            "-c use per-vCPU channels instead of the shared ring\n"
+            "-b resume in batches rather than once per event\n"
+            "-t stop after this many seconds (default: run until interrupted)\n",
+            progname);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_t b = { .port = -1 };
+    struct sigaction act;
+    uint64_t start, last, now, last_events = 0;
+    unsigned int seconds = 0;
+    int opt, rc = 1;
+
+    while ( (opt = getopt(argc, argv, "cbt:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'c':
+            b.channels = true;
+            break;
+        case 'b':
+            b.batch = true;
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ( argc - optind != 2 )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    b.domain_id = atoi(argv[optind]);
+    if ( !strcmp(argv[optind + 1], "singlestep") )
+        b.event = BENCH_SINGLESTEP;
+    else if ( !strcmp(argv[optind + 1], "cpuid") )
+        b.event = BENCH_CPUID;
+    else
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    act.sa_handler = close_handler;
+    act.sa_flags = 0;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGHUP,  &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT,  &act, NULL);
+    sigaction(SIGALRM, &act, NULL);
+
+    b.xch = xc_interface_open(NULL, NULL, 0);
+    if ( !b.xch )
+    {
+        PERROR("Failed to open xc interface");
+        return 1;
+    }
+
+    b.xce = xenevtchn_open(NULL, 0);
+    if ( !b.xce )
+    {
+        PERROR("Failed to open event channel");
+        goto out_xch;
+    }
+
+    if ( (b.channels ? setup_channels(&b) : setup_ring(&b)) ||
+         enable_event(&b, true) )
+    {
+        ERROR("Failed to set up monitoring");
+        goto out;
+    }
+
+    printf("%s, %s resume\n", b.channels ? "per-vCPU channels" : "ring",
+           b.batch ? "batched" : "per-event");
+
+    start = last = now_ns();
+    if ( seconds )
+        alarm(seconds);
+
+    while ( !interrupted )
+    {
+        struct pollfd fd = { .fd = xenevtchn_fd(b.xce), .events = POLLIN };
+        int port;
+
+        if ( poll(&fd, 1, 100) == 1 )
+        {
+            /* Drain every pending port before doing any work. */
+            do {
+                port = xenevtchn_pending(b.xce);
+                if ( port < 0 || xenevtchn_unmask(b.xce, port) )
+                {
+                    PERROR("Failed to read event channel");
+                    goto out;
+                }
+
+                if ( b.channels && !b.batch &&
+                     handle_channels(&b, port) )
+                {
+                    PERROR("Failed to resume");
+                    goto out;
+                }
+            } while ( poll(&fd, 1, 0) == 1 );
+
+            if ( (!b.channels && handle_ring(&b)) ||
+                 (b.channels && b.batch && handle_channels(&b, port)) )
+            {
+                PERROR("Failed to resume");
+                goto out;
+            }
+        }
+
+        now = now_ns();
+        if ( now - last >= 1000000000ull )
+        {
+            printf("%10.0f events/s\n",
+                   (b.events - last_events) * 1e9 / (now - last));
+            fflush(stdout);
+            last = now;
+            last_events = b.events;
+        }
+    }
+
+    now = now_ns();
+    printf("total: %"PRIu64" events in %.2fs, %.0f events/s\n",
+           b.events, (now - start) / 1e9,
+           now > start ? b.events * 1e9 / (now - start) : 0.0);
+    rc = 0;
+
+ out:
+    teardown(&b);
+    xenevtchn_close(b.xce);
+ out_xch:
+    xc_interface_close(b.xch);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,217 @@
+/*
+ * test-stream.c: Check that sharded xenalyze --stream analysis gives the
+ * same output as the serial one.
+ *
+ * A synthetic trace is written both as one interleaved file and as one
+ * file per cpu, and analysed with different numbers of threads.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <xen/trace.h>
+#include "stream.h"
+
+#define TEST_CPUS       8
+#define TEST_DOMS       13
+#define TEST_VCPUS      3
+#define TEST_RECORDS    200000
+#define WINDOW          256     /* records per cpu window */
+#define CPU_HZ          2400000000LL
+
+struct window {
+    uint32_t buf[WINDOW * 4];
+    unsigned int words, nr;
+};
+
+static FILE *all, *percpu[TEST_CPUS];
+static struct window win[TEST_CPUS];
+static char dir[] = "/tmp/test-stream.XXXXXX";
+
+static void flush_window(int cpu)
+{
+    struct window *w = &win[cpu];
+    uint32_t cc[3] = {
+        TRC_TRACE_CPU_CHANGE | (2U << TRACE_EXTRA_SHIFT),
+        cpu,
+        w->words * sizeof(uint32_t),
+    };
+
+    if ( !w->nr )
+        return;
+
+    fwrite(cc, sizeof(cc), 1, all);
+    fwrite(w->buf, sizeof(uint32_t), w->words, all);
+    fwrite(cc, sizeof(cc), 1, percpu[cpu]);
+    fwrite(w->buf, sizeof(uint32_t), w->words, percpu[cpu]);
+    w->words = w->nr = 0;
+}
+
+static void record(int cpu, uint32_t event, uint64_t tsc, uint32_t d0)
+{
+    struct window *w = &win[cpu];
+
+    w->buf[w->words++] = event | (1U << TRACE_EXTRA_SHIFT) | (1U << 31);
+    w->buf[w->words++] = tsc;
+    w->buf[w->words++] = tsc >> 32;
+    w->buf[w->words++] = d0;
+
+    if ( ++w->nr == WINDOW )
+        flush_window(cpu);
+}
+
+static void make_trace(void)
+{
+    int state[TEST_DOMS][TEST_VCPUS];
+    uint64_t tsc = 1000000;
+    char name[64];
+    int i, cpu;
+
+    for ( i = 0; i < TEST_DOMS * TEST_VCPUS; i++ )
+        state[i / TEST_VCPUS][i % TEST_VCPUS] = 2; /* blocked */
+
+    snprintf(name, sizeof(name), "%s/all", dir);
+    all = fopen(name, "w");
+    for ( cpu = 0; cpu < TEST_CPUS; cpu++ )
+    {
+        snprintf(name, sizeof(name), "%s/cpu%d", dir, cpu);
+        percpu[cpu] = fopen(name, "w");
+        if ( !all || !percpu[cpu] )
+        {
+            perror("fopen");
+            exit(1);
+        }
+    }
+
+    srandom(1);
+    for ( i = 0; i < TEST_RECORDS; i++ )
+    {
+        int dom = random() % TEST_DOMS, vid = random() % TEST_VCPUS;
+        int old, new;
+
+        tsc += 1000 + random() % 100000;
+        cpu = random() % TEST_CPUS;
+
+        switch ( random() % 8 )
+        {
+        case 0: case 1: case 2:
+            record(cpu, TRC_HVM_VMEXIT64, tsc, 1);
+            break;
+        case 3:
+            if ( i % 1000 == 0 )
+                record(cpu, TRC_LOST_RECORDS, tsc, i % 7);
+            break;
+        default:
+            old = state[dom][vid];
+            new = old == 0 ? 1 + random() % 2 : old == 1 ? 0 : 1;
+            state[dom][vid] = new;
+            record(cpu, TRC_SCHED_RUNSTATE_CHANGE | (old << 8) | (new << 4),
+                   tsc, (dom << 16) | vid);
+            break;
+        }
+    }
+
+    for ( cpu = 0; cpu < TEST_CPUS; cpu++ )
+    {
+        flush_window(cpu);
+        fclose(percpu[cpu]);
+    }
+    fclose(all);
+}
+
+static char *analyze(int nr_files, char **files, int threads)
+{
+    struct stream_opts o = {
+        .cpu_hz = CPU_HZ,
+        .interval = CPU_HZ / 10,
+        .threads = threads,
+    };
+    char *buf;
+    size_t size;
+
+    o.out = open_memstream(&buf, &size);
+    if ( !o.out )
+    {
+        perror("open_memstream");
+        exit(1);
+    }
+
+    if ( stream_analyze(files, nr_files, &o) )
+        exit(1);
+    fclose(o.out);
+
+    return buf;
+}
+
+int main(int argc, char **argv)
+{
+    static const int threads[] = { 2, 3, 4, 16 };
+    char *files[TEST_CPUS + 1], *serial, *out;
+    int i, cpu, rc = 0;
+
+    if ( !mkdtemp(dir) )
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    make_trace();
+
+    files[0] = malloc(64);
+    snprintf(files[0], 64, "%s/all", dir);
+    for ( cpu = 0; cpu < TEST_CPUS; cpu++ )
+    {
+        files[cpu + 1] = malloc(64);
+        snprintf(files[cpu + 1], 64, "%s/cpu%d", dir, cpu);
+    }
+
+    serial = analyze(1, files, 1);
+    if ( !strstr(serial, "sched latency") )
+    {
+        printf("No scheduling latency in serial output:\n%s", serial);
+        rc = 1;
+    }
+
+    printf("%-40s", "Testing per-cpu files, 1 thread...");
+    out = analyze(TEST_CPUS, files + 1, 1);
+    printf("%s\n", strcmp(serial, out) ? (rc = 1, "failed") : "okay");
+    free(out);
+
+    for ( i = 0; i < sizeof(threads) / sizeof(threads[0]); i++ )
+    {
+        printf("Testing %2d threads...%19s", threads[i], "");
+        out = analyze(1, files, threads[i]);
+        if ( strcmp(serial, out) )
+            rc = 1;
+        free(out);
+        out = analyze(TEST_CPUS, files + 1, threads[i]);
+        printf("%s\n", strcmp(serial, out) ? (rc = 1, "failed") : "okay");
+        free(out);
+    }
+
+    if ( rc )
+        printf("Serial output:\n%s", serial);
+    free(serial);
+
+    for ( i = 0; i <= TEST_CPUS; i++ )
+    {
+        unlink(files[i]);
+        free(files[i]);
+    }
+    rmdir(dir);
+
+    return rc;
+}
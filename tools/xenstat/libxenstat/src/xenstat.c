@@ -61,6 +61,9 @@ static void xenstat_free_vbds(xenstat_node * node);
 static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
 static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
+static void xenstat_check_names(xenstat_handle * handle);
+static void xenstat_prune_names(xenstat_node * node);
+static void xenstat_uninit_names(xenstat_handle * handle);
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
 
 static xenstat_collector collectors[] = {
@@ -124,6 +127,7 @@ void xenstat_uninit(xenstat_handle * handle)
 	if (handle) {
 		for (i = 0; i < NUM_COLLECTORS; i++)
 			collectors[i].uninit(handle);
+		xenstat_uninit_names(handle);
 		xc_interface_close(handle->xc_handle);
 		xs_daemon_close(handle->xshandle);
 		free(handle->priv);
@@ -166,7 +170,7 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	xc_domaininfo_t domaininfo[DOMAIN_CHUNK_SIZE];
 	int new_domains;
 	unsigned int i;
-	int rc;
+	int rc, tmem;
 
 	/* Create the node */
 	node = (xenstat_node *) calloc(1, sizeof(xenstat_node));
@@ -193,6 +197,8 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	rc = xc_tmem_control(handle->xc_handle, -1,
                          XEN_SYSCTL_TMEM_OP_QUERY_FREEABLE_MB, -1, 0, 0, NULL);
 	node->freeable_mb = (rc < 0) ? 0 : rc;
+	/* Don't ask for the tmem stats of each domain if there is no tmem */
+	tmem = rc >= 0;
 	/* malloc(0) is not portable, so allocate a single domain.  This will
 	 * be resized below. */
 	node->domains = malloc(sizeof(xenstat_domain));
@@ -201,6 +207,9 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		return NULL;
 	}
 
+	/* Forget the names which changed since the last call */
+	xenstat_check_names(handle);
+
 	node->num_domains = 0;
 	do {
 		xenstat_domain *domain, *tmp;
@@ -260,13 +269,15 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 			domain->networks = NULL;
 			domain->num_vbds = 0;
 			domain->vbds = NULL;
-			domain_get_tmem_stats(handle,domain);
+			if (tmem)
+				domain_get_tmem_stats(handle,domain);
 
 			domain++;
 			node->num_domains++;
 		}
 	} while (new_domains == DOMAIN_CHUNK_SIZE);
 
+	xenstat_prune_names(node);
 
 	/* Run all the extra data collectors requested */
 	node->flags = 0;
@@ -480,8 +491,8 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 /*
  * VCPU functions
  */
-/* Collect information about VCPUs */
-static int xenstat_collect_vcpus(xenstat_node * node)
+/* Collect information about VCPUs, with one hypercall per VCPU */
+static int xenstat_collect_each_vcpu(xenstat_node * node)
 {
 	unsigned int i, vcpu, inc_index;
 
@@ -489,11 +500,9 @@ static int xenstat_collect_vcpus(xenstat_node * node)
 	for (i = 0; i < node->num_domains; i+=inc_index) {
 		inc_index = 1; /* default is to increment to next domain */
 
-		node->domains[i].vcpus = malloc(node->domains[i].num_vcpus
-						* sizeof(xenstat_vcpu));
-		if (node->domains[i].vcpus == NULL)
-			return 0;
-	
+		if (node->domains[i].vcpus_unchanged)
+			continue;
+
 		for (vcpu = 0; vcpu < node->domains[i].num_vcpus; vcpu++) {
 			/* FIXME: need to be using a more efficient mechanism*/
 			xc_vcpuinfo_t info;
@@ -523,6 +532,193 @@ static int xenstat_collect_vcpus(xenstat_node * node)
 	return 1;
 }
 
+/* Reuse the VCPU information of domains which have not run since the last
+ * refresh, as none of it can have changed.  Returns the number of domains
+ * still to be collected. */
+static unsigned int xenstat_reuse_vcpus(xenstat_node * node)
+{
+	xenstat_handle *handle = node->handle;
+	unsigned int i, j = 0, changed = 0;
+
+	for (i = 0; i < node->num_domains; i++) {
+		xenstat_domain *domain = &node->domains[i];
+		xenstat_last_vcpus *last;
+
+		while (j < handle->num_last_vcpus
+		       && handle->last_vcpus[j].id < domain->id)
+			j++;
+		if (j == handle->num_last_vcpus) {
+			changed++;
+			continue;
+		}
+
+		last = &handle->last_vcpus[j];
+		if (last->id != domain->id || last->state != domain->state
+		    || last->cpu_ns != domain->cpu_ns
+		    || last->num_vcpus != domain->num_vcpus) {
+			changed++;
+			continue;
+		}
+
+		memcpy(domain->vcpus, last->vcpus,
+		       domain->num_vcpus * sizeof(xenstat_vcpu));
+		domain->vcpus_unchanged = 1;
+	}
+
+	return changed;
+}
+
+static void xenstat_free_last_vcpus(xenstat_handle * handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < handle->num_last_vcpus; i++)
+		free(handle->last_vcpus[i].vcpus);
+	free(handle->last_vcpus);
+	handle->last_vcpus = NULL;
+	handle->num_last_vcpus = 0;
+}
+
+/* Remember the VCPU information of this refresh for the next one.  If
+ * memory is short, the next refresh simply collects everything. */
+static void xenstat_save_vcpus(xenstat_node * node)
+{
+	xenstat_handle *handle = node->handle;
+	xenstat_last_vcpus *last;
+	unsigned int i;
+
+	xenstat_free_last_vcpus(handle);
+
+	last = calloc(node->num_domains ? node->num_domains : 1,
+		      sizeof(*last));
+	if (last == NULL)
+		return;
+	handle->last_vcpus = last;
+
+	for (i = 0; i < node->num_domains; i++, last++) {
+		xenstat_domain *domain = &node->domains[i];
+
+		last->vcpus = malloc(domain->num_vcpus * sizeof(xenstat_vcpu));
+		if (last->vcpus == NULL) {
+			xenstat_free_last_vcpus(handle);
+			return;
+		}
+		memcpy(last->vcpus, domain->vcpus,
+		       domain->num_vcpus * sizeof(xenstat_vcpu));
+		last->id = domain->id;
+		last->state = domain->state;
+		last->cpu_ns = domain->cpu_ns;
+		last->num_vcpus = domain->num_vcpus;
+		handle->num_last_vcpus++;
+	}
+}
+
+/* Collect information about VCPUs, with one hypercall for all domains */
+static int xenstat_collect_vcpu_list(xenstat_node * node)
+{
+	xenstat_handle *handle = node->handle;
+	unsigned int i, j, total = 0, num = 0;
+	uint32_t next = DOMID_INVALID;
+	int n;
+
+	/* Start from the first domain that needs collecting */
+	for (i = 0; i < node->num_domains; i++) {
+		if (node->domains[i].vcpus_unchanged)
+			continue;
+		if (next == DOMID_INVALID)
+			next = node->domains[i].id;
+		total += node->domains[i].num_vcpus;
+	}
+
+	/* Get the VCPUs of all those domains at once, growing the buffer as
+	 * needed: only whole domains are returned. */
+	for (;;) {
+		if (handle->max_vcpuinfo < total + 64) {
+			xc_vcpuinfo_list_t *tmp;
+
+			tmp = realloc(handle->vcpuinfo,
+				      (total + 64) * sizeof(*tmp));
+			if (tmp == NULL)
+				return 0;
+			handle->vcpuinfo = tmp;
+			handle->max_vcpuinfo = total + 64;
+		}
+
+		n = xc_vcpu_getinfolist(handle->xc_handle, next,
+					handle->max_vcpuinfo - num,
+					handle->vcpuinfo + num, &next);
+		if (n < 0) {
+			if (errno == ENOMEM)
+				return 0;
+			/* Not available, e.g. denied by XSM */
+			handle->no_vcpuinfo_list = 1;
+			return xenstat_collect_each_vcpu(node);
+		}
+		num += n;
+		if (next == DOMID_INVALID)
+			break;
+		total = handle->max_vcpuinfo * 2;
+	}
+
+	/* Both lists are sorted by domain id */
+	for (i = 0, j = 0; i < node->num_domains; ) {
+		xenstat_domain *domain = &node->domains[i];
+
+		if (domain->vcpus_unchanged) {
+			i++;
+			continue;
+		}
+
+		while (j < num && handle->vcpuinfo[j].domid < domain->id)
+			j++;
+		if (j == num || handle->vcpuinfo[j].domid != domain->id) {
+			/* domain is gone - remove from list */
+			free(domain->name);
+			free(domain->vcpus);
+			xenstat_prune_domain(node, i);
+			continue;
+		}
+
+		for (; j < num && handle->vcpuinfo[j].domid == domain->id; j++) {
+			xc_vcpuinfo_list_t *info = &handle->vcpuinfo[j];
+
+			if (info->vcpu >= domain->num_vcpus)
+				continue;
+			domain->vcpus[info->vcpu].online = info->online;
+			domain->vcpus[info->vcpu].ns = info->cpu_time;
+		}
+		i++;
+	}
+
+	return 1;
+}
+
+/* Collect information about VCPUs */
+static int xenstat_collect_vcpus(xenstat_node * node)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < node->num_domains; i++) {
+		node->domains[i].vcpus = calloc(node->domains[i].num_vcpus,
+						sizeof(xenstat_vcpu));
+		if (node->domains[i].vcpus == NULL)
+			return 0;
+	}
+
+	if (xenstat_reuse_vcpus(node) == 0)
+		ret = 1;
+	else if (node->handle->no_vcpuinfo_list)
+		ret = xenstat_collect_each_vcpu(node);
+	else
+		ret = xenstat_collect_vcpu_list(node);
+
+	if (ret)
+		xenstat_save_vcpus(node);
+
+	return ret;
+}
+
 /* Free VCPU information */
 static void xenstat_free_vcpus(xenstat_node * node)
 {
@@ -531,9 +727,13 @@ static void xenstat_free_vcpus(xenstat_node * node)
 		free(node->domains[i].vcpus);
 }
 
-/* Free VCPU information in handle - nothing to do */
+/* Free VCPU information in handle */
 static void xenstat_uninit_vcpus(xenstat_handle * handle)
 {
+	free(handle->vcpuinfo);
+	handle->vcpuinfo = NULL;
+	handle->max_vcpuinfo = 0;
+	xenstat_free_last_vcpus(handle);
 }
 
 /* Get VCPU online status */
@@ -763,13 +963,133 @@ unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem)
 }
 
 
+/*
+ * Domain names are cached in the handle, and read again from xenstore only
+ * when a watch on them fires.
+ */
+#define NAME_WATCH_TOKEN "xenstat-name"
+
+static int xenstat_name_cmp(const void *key, const void *elem)
+{
+	unsigned int id = *(const unsigned int *)key;
+	const xenstat_name *name = elem;
+
+	return (id > name->id) - (id < name->id);
+}
+
+static xenstat_name *xenstat_find_name(xenstat_handle *handle,
+				       unsigned int domain_id)
+{
+	return bsearch(&domain_id, handle->names, handle->num_names,
+		       sizeof(xenstat_name), xenstat_name_cmp);
+}
+
+static void xenstat_drop_name(xenstat_handle *handle, xenstat_name *name)
+{
+	char path[80];
+
+	snprintf(path, sizeof(path),"/local/domain/%i/name", name->id);
+	xs_unwatch(handle->xshandle, path, NAME_WATCH_TOKEN);
+	free(name->name);
+}
+
+static void xenstat_uninit_names(xenstat_handle *handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < handle->num_names; i++)
+		xenstat_drop_name(handle, &handle->names[i]);
+	free(handle->names);
+	handle->names = NULL;
+	handle->num_names = 0;
+}
+
+/* Forget the names whose watches fired */
+static void xenstat_check_names(xenstat_handle *handle)
+{
+	xenstat_name *name;
+	unsigned int id;
+	char **vec;
+
+	if (handle->num_names == 0)
+		return;
+
+	while ((vec = xs_check_watch(handle->xshandle)) != NULL) {
+		if (sscanf(vec[XS_WATCH_PATH], "/local/domain/%u/name", &id) == 1
+		    && (name = xenstat_find_name(handle, id)) != NULL) {
+			free(name->name);
+			name->name = NULL;
+		}
+		free(vec);
+	}
+}
+
+/* Forget the names of domains which are not in the node */
+static void xenstat_prune_names(xenstat_node *node)
+{
+	xenstat_handle *handle = node->handle;
+	unsigned int i, j, k;
+
+	/* Both lists are sorted by domain id */
+	for (i = 0, j = 0, k = 0; i < handle->num_names; i++) {
+		while (j < node->num_domains &&
+		       node->domains[j].id < handle->names[i].id)
+			j++;
+		if (j < node->num_domains &&
+		    node->domains[j].id == handle->names[i].id)
+			handle->names[k++] = handle->names[i];
+		else
+			xenstat_drop_name(handle, &handle->names[i]);
+	}
+	handle->num_names = k;
+}
+
 static char *xenstat_get_domain_name(xenstat_handle *handle, unsigned int domain_id)
 {
 	char path[80];
+	xenstat_name *name;
 
 	snprintf(path, sizeof(path),"/local/domain/%i/name", domain_id);
 
-	return xs_read(handle->xshandle, XBT_NULL, path, NULL);
+	if (handle->no_name_cache)
+		return xs_read(handle->xshandle, XBT_NULL, path, NULL);
+
+	name = xenstat_find_name(handle, domain_id);
+	if (name == NULL) {
+		xenstat_name *tmp;
+		unsigned int i;
+
+		tmp = realloc(handle->names,
+			      (handle->num_names + 1) * sizeof(xenstat_name));
+		if (tmp == NULL)
+			return NULL;
+		handle->names = tmp;
+
+		for (i = handle->num_names; i > 0; i--)
+			if (tmp[i - 1].id < domain_id)
+				break;
+		memmove(&tmp[i + 1], &tmp[i],
+			(handle->num_names - i) * sizeof(xenstat_name));
+		handle->num_names++;
+		name = &tmp[i];
+		name->id = domain_id;
+		name->name = NULL;
+
+		if (!xs_watch(handle->xshandle, path, NAME_WATCH_TOKEN)) {
+			/* Read names every time instead */
+			xenstat_uninit_names(handle);
+			handle->no_name_cache = 1;
+			return xs_read(handle->xshandle, XBT_NULL, path, NULL);
+		}
+	}
+
+	if (name->name == NULL) {
+		name->name = xs_read(handle->xshandle, XBT_NULL, path, NULL);
+		if (name->name == NULL)
+			return NULL;
+	}
+
+	return strdup(name->name);
 }
 
 /* Remove specified entry from list of domains */
@@ -100,7 +100,8 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 	int ret;
 	char *tmp;
 	int i = 0, x = 0, col = 0;
-	regex_t r;
+	static regex_t r;
+	static int r_compiled;
 	regmatch_t matches[19];
 	int num = 19;
 
@@ -145,9 +146,13 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 	if (txComp != NULL)
 		*txComp = 0;
 
-	if ((ret = regcomp(&r, regex, REG_EXTENDED))) {
-		regfree(&r);
-		return ret;
+	/* Compiled once: this is called for each line of /proc/net/dev */
+	if (!r_compiled) {
+		if ((ret = regcomp(&r, regex, REG_EXTENDED))) {
+			regfree(&r);
+			return ret;
+		}
+		r_compiled = 1;
 	}
 
 	tmp = (char *)malloc( sizeof(char) );
@@ -231,7 +236,6 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 	}
 
 	free(tmp);
-	regfree(&r);
 
 	return 0;
 }
@@ -32,12 +32,35 @@
 #define SHORT_ASC_LEN 5                 /* length of 65535 */
 #define VERSION_SIZE (2 * SHORT_ASC_LEN + 1 + sizeof(xen_extraversion_t) + 1)
 
+/* A domain name read from xenstore, kept until its watch fires */
+typedef struct xenstat_name {
+	unsigned int id;
+	char *name;			/* NULL if it needs to be read again */
+} xenstat_name;
+
+/* The VCPUs of a domain as of the last refresh */
+typedef struct xenstat_last_vcpus {
+	unsigned int id;
+	unsigned int state;
+	unsigned long long cpu_ns;
+	unsigned int num_vcpus;
+	xenstat_vcpu *vcpus;		/* Array of length num_vcpus */
+} xenstat_last_vcpus;
+
 struct xenstat_handle {
 	xc_interface *xc_handle;
 	struct xs_handle *xshandle; /* xenstore handle */
 	int page_size;
 	void *priv;
 	char xen_version[VERSION_SIZE]; /* xen version running on this node */
+	xenstat_name *names;		/* Array sorted by id */
+	unsigned int num_names;
+	int no_name_cache;		/* Couldn't watch names in xenstore */
+	xc_vcpuinfo_list_t *vcpuinfo;	/* Buffer for the vcpus of all domains */
+	unsigned int max_vcpuinfo;
+	int no_vcpuinfo_list;		/* Fall back to one call per vcpu */
+	xenstat_last_vcpus *last_vcpus;	/* Array sorted by id */
+	unsigned int num_last_vcpus;
 };
 
 struct xenstat_node {
@@ -66,6 +89,7 @@ struct xenstat_domain {
 	unsigned long long cpu_ns;
 	unsigned int num_vcpus;		/* No. vcpus configured for domain */
 	xenstat_vcpu *vcpus;		/* Array of length num_vcpus */
+	int vcpus_unchanged;		/* Copied from the last refresh */
 	unsigned long long cur_mem;	/* Current memory reservation */
 	unsigned long long max_mem;	/* Total memory allowed */
 	unsigned int ssid;
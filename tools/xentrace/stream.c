@@ -0,0 +1,996 @@
+/*
+ * stream.c: Bounded-memory analysis of xentrace output as it is produced
+ *
+ * The main xenalyze engine seeks around a complete trace file and keeps
+ * state for everything it has ever seen.  This reads the trace once, front
+ * to back -- from a pipe out of xentrace, a file, or the per-cpu files
+ * written by xentrace --threads -- keeps only the records a few interval
+ * statistics need, and prints those statistics as each interval completes.
+ * Memory is bounded by the number of vcpus and by STREAM_MAX_PENDING, not
+ * by the length of the trace.
+ *
+ * Runstate accounting may be sharded by domain over several threads.  The
+ * main thread keeps the interval clock and the per-record counters, and
+ * sends each shard its domains' records followed by a mark at the end of
+ * every interval; each shard answers with its part of that interval's
+ * summary.  Summaries are sums (and a max), so the merged output does not
+ * depend on the number of shards.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <xen/trace.h>
+#include "stream.h"
+
+#define STREAM_MAX_CPUS     4096
+/* Records held back to put the windows of different cpus in order */
+#define STREAM_MAX_PENDING  (1 << 20)
+/* Records per hand-off from a reader thread, and hand-offs queued */
+#define STREAM_BLOCK        4096
+#define STREAM_QUEUE_MAX    16
+#define STREAM_VCPU_HASH    1024
+#define STREAM_MAX_SHARDS   64
+
+/* Not a Xen event: tells a shard that an interval ended at e->tsc */
+#define STREAM_EV_INTERVAL  (~0U)
+
+enum {
+    STREAM_RUNSTATE_RUNNING = 0,
+    STREAM_RUNSTATE_RUNNABLE,
+    STREAM_RUNSTATE_BLOCKED,
+    STREAM_RUNSTATE_OFFLINE,
+    STREAM_RUNSTATE_MAX
+};
+
+static const char *stream_runstate_name[STREAM_RUNSTATE_MAX] = {
+    [STREAM_RUNSTATE_RUNNING]  = "running",
+    [STREAM_RUNSTATE_RUNNABLE] = "runnable",
+    [STREAM_RUNSTATE_BLOCKED]  = "blocked",
+    [STREAM_RUNSTATE_OFFLINE]  = "offline",
+};
+
+/* The little we keep of an interesting record */
+struct stream_event {
+    tsc_t tsc;
+    unsigned long long seq;            /* ties broken in input order */
+    uint32_t event;
+    uint32_t d0;
+    uint16_t src;
+};
+
+struct stream_heap {
+    struct stream_event *e;
+    unsigned int nr, size;
+    unsigned long long seq;
+    tsc_t max_tsc;
+};
+
+struct stream_decoder {
+    tsc_t last_tsc[STREAM_MAX_CPUS];
+    unsigned char *buf;
+    unsigned int buf_size;
+};
+
+struct stream_vcpu {
+    struct stream_vcpu *next;
+    unsigned int dom, vid;
+    int state;                         /* -1 until first seen */
+    tsc_t acct_tsc;                    /* runstate time accounted up to */
+    tsc_t runnable_tsc;                /* when it became runnable, or 0 */
+};
+
+/* Blocks of records handed from one thread to another */
+struct stream_block {
+    struct stream_block *next;
+    unsigned int nr;
+    struct stream_event e[STREAM_BLOCK];
+};
+
+struct stream_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct stream_block *head, *tail;
+    unsigned int queued;
+    bool eof;
+};
+
+/* An interval's summary from one shard */
+struct stream_result {
+    struct stream_result *next;
+    struct stream_summary sum;
+};
+
+struct stream_shard {
+    struct stream_vcpu *vcpus[STREAM_VCPU_HASH];
+    struct stream_summary cur;
+    const struct stream_opts *o;
+    bool threaded;
+    pthread_t thread;
+    struct stream_queue q;
+    struct stream_block *fill;         /* being filled by the main thread */
+    /* Summaries of ended intervals, waiting to be merged. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct stream_result *results, **results_tail;
+};
+
+/* An ended interval waiting for the shards' parts of its summary */
+struct stream_pending {
+    struct stream_pending *next;
+    tsc_t start, end;
+    struct stream_summary sum;
+};
+
+struct stream_state {
+    const struct stream_opts *o;
+    bool started;
+    tsc_t first_tsc, last_tsc, interval_start;
+    struct stream_summary cur, total;
+    unsigned int nr_shards;
+    struct stream_shard *shards;
+    struct stream_pending *pending, **pending_tail;
+};
+
+/* A per-cpu file, read and decoded by a thread of its own */
+struct stream_src {
+    const char *name;
+    int fd;
+    uint16_t idx;
+    pthread_t thread;
+    struct stream_queue q;             /* decoded, waiting to be merged */
+    struct stream_block *fill;         /* being decoded into */
+    struct stream_block *cur;          /* being merged */
+    unsigned int pos;
+    struct stream_decoder dec;
+};
+
+static void *stream_alloc(size_t size)
+{
+    void *p = calloc(1, size);
+
+    if ( !p )
+    {
+        perror("calloc");
+        exit(1);
+    }
+
+    return p;
+}
+
+/* -- Reading and decoding -- */
+
+static ssize_t read_exact(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+
+    while ( done < size )
+    {
+        ssize_t r = read(fd, (char *)buf + done, size - done);
+
+        if ( r < 0 && errno == EINTR )
+            continue;
+        if ( r < 0 )
+            return r;
+        if ( r == 0 )
+            break;
+        done += r;
+    }
+
+    return done;
+}
+
+static bool stream_interesting(uint32_t event)
+{
+    switch ( event )
+    {
+    case TRC_LOST_RECORDS:
+    case TRC_HVM_VMEXIT:
+    case TRC_HVM_VMEXIT64:
+        return true;
+    }
+
+    /* The old and new runstates are encoded in bits 4-11. */
+    return (event & ~0xff0) == TRC_SCHED_RUNSTATE_CHANGE;
+}
+
+/*
+ * Read the next cpu window from fd and hand its interesting records to
+ * emit().  Returns false at the end of the input.
+ */
+static bool stream_read_window(int fd, const char *name,
+                               struct stream_decoder *dec, uint16_t src,
+                               void (*emit)(void *arg,
+                                            const struct stream_event *e),
+                               void *arg)
+{
+    struct {
+        uint32_t header;
+        int cpu;
+        unsigned window_size;
+    } cc;
+    const struct trace_record *rec;
+    unsigned char *p, *end;
+    ssize_t r;
+
+    r = read_exact(fd, &cc, sizeof(cc));
+    if ( r == 0 )
+        return false;
+    if ( r != sizeof(cc) ||
+         (cc.header & ((1U << TRACE_EXTRA_SHIFT) - 1)) != TRC_TRACE_CPU_CHANGE ||
+         cc.cpu < 0 || cc.cpu >= STREAM_MAX_CPUS )
+    {
+        fprintf(stderr, "%s: expected a cpu_change record, giving up\n", name);
+        exit(1);
+    }
+
+    if ( cc.window_size > dec->buf_size )
+    {
+        free(dec->buf);
+        dec->buf_size = cc.window_size;
+        dec->buf = malloc(dec->buf_size);
+        if ( !dec->buf )
+        {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    r = read_exact(fd, dec->buf, cc.window_size);
+    if ( r != cc.window_size )
+    {
+        fprintf(stderr, "%s: short window (%zd of %u bytes), stopping\n",
+                name, r, cc.window_size);
+        return false;
+    }
+
+    for ( p = dec->buf, end = p + cc.window_size;
+          p + sizeof(uint32_t) <= end;
+          p += sizeof(uint32_t) + (rec->cycle_flag ? sizeof(tsc_t) : 0) +
+               rec->extra_words * sizeof(uint32_t) )
+    {
+        struct stream_event e;
+        const uint32_t *data;
+
+        rec = (const struct trace_record *)p;
+
+        if ( rec->cycle_flag )
+        {
+            dec->last_tsc[cc.cpu] = ((tsc_t)rec->u.tsc.tsc_hi << 32) |
+                                    rec->u.tsc.tsc_lo;
+            data = rec->u.tsc.data;
+        }
+        else
+            data = rec->u.notsc.data;
+
+        if ( !stream_interesting(rec->event) )
+            continue;
+
+        e.tsc = dec->last_tsc[cc.cpu];
+        e.event = rec->event;
+        e.d0 = rec->extra_words ? data[0] : 0;
+        e.src = src;
+        emit(arg, &e);
+    }
+
+    return true;
+}
+
+/* -- Putting records in order -- */
+
+static bool stream_before(const struct stream_event *a,
+                          const struct stream_event *b)
+{
+    return a->tsc < b->tsc || (a->tsc == b->tsc && a->seq < b->seq);
+}
+
+static void heap_push(struct stream_heap *h, const struct stream_event *e)
+{
+    unsigned int i;
+
+    if ( h->nr == h->size )
+    {
+        h->size = h->size ? h->size * 2 : 1024;
+        h->e = realloc(h->e, h->size * sizeof(*h->e));
+        if ( !h->e )
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    for ( i = h->nr++; i; i = (i - 1) / 2 )
+    {
+        if ( !stream_before(e, &h->e[(i - 1) / 2]) )
+            break;
+        h->e[i] = h->e[(i - 1) / 2];
+    }
+    h->e[i] = *e;
+    h->e[i].seq = h->seq++;
+
+    if ( e->tsc > h->max_tsc )
+        h->max_tsc = e->tsc;
+}
+
+static void heap_pop(struct stream_heap *h, struct stream_event *e)
+{
+    struct stream_event last = h->e[--h->nr];
+    unsigned int i = 0, c;
+
+    *e = h->e[0];
+
+    while ( (c = 2 * i + 1) < h->nr )
+    {
+        if ( c + 1 < h->nr && stream_before(&h->e[c + 1], &h->e[c]) )
+            c++;
+        if ( !stream_before(&h->e[c], &last) )
+            break;
+        h->e[i] = h->e[c];
+        i = c;
+    }
+    h->e[i] = last;
+}
+
+/* -- Handing blocks of records from one thread to another -- */
+
+static void queue_init(struct stream_queue *q)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+static void queue_put(struct stream_queue *q, struct stream_block *b)
+{
+    pthread_mutex_lock(&q->lock);
+    while ( q->queued >= STREAM_QUEUE_MAX )
+        pthread_cond_wait(&q->cond, &q->lock);
+    b->next = NULL;
+    if ( q->tail )
+        q->tail->next = b;
+    else
+        q->head = b;
+    q->tail = b;
+    q->queued++;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_close(struct stream_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->eof = true;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Take the next block off q; NULL once it is closed and empty. */
+static struct stream_block *queue_get(struct stream_queue *q)
+{
+    struct stream_block *b;
+
+    pthread_mutex_lock(&q->lock);
+    while ( !q->head && !q->eof )
+        pthread_cond_wait(&q->cond, &q->lock);
+    b = q->head;
+    if ( b )
+    {
+        q->head = b->next;
+        if ( !q->head )
+            q->tail = NULL;
+        q->queued--;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return b;
+}
+
+/* -- Statistics -- */
+
+static struct stream_vcpu *stream_vcpu(struct stream_shard *sh,
+                                       unsigned int dom, unsigned int vid)
+{
+    struct stream_vcpu **bucket =
+        &sh->vcpus[((dom << 5) ^ vid) % STREAM_VCPU_HASH], *v;
+
+    for ( v = *bucket; v; v = v->next )
+        if ( v->dom == dom && v->vid == vid )
+            return v;
+
+    v = stream_alloc(sizeof(*v));
+    v->dom = dom;
+    v->vid = vid;
+    v->state = -1;
+    v->next = *bucket;
+    *bucket = v;
+
+    return v;
+}
+
+static unsigned long long cycles_to_us(const struct stream_opts *o,
+                                       tsc_t cycles)
+{
+    return cycles * 1000000ULL / o->cpu_hz;
+}
+
+static void stream_latency(struct stream_shard *sh, tsc_t cycles)
+{
+    unsigned long long us = cycles_to_us(sh->o, cycles);
+    unsigned int b = 0;
+
+    while ( us && b < STREAM_LATENCY_BUCKETS - 1 )
+    {
+        us >>= 1;
+        b++;
+    }
+
+    sh->cur.latency[b]++;
+    sh->cur.latency_count++;
+    if ( cycles > sh->cur.latency_max )
+        sh->cur.latency_max = cycles;
+}
+
+void stream_summary_add(struct stream_summary *dst,
+                        const struct stream_summary *src)
+{
+    int i;
+
+    dst->exits += src->exits;
+    dst->sched += src->sched;
+    dst->lost += src->lost;
+    for ( i = 0; i < STREAM_RUNSTATE_MAX; i++ )
+        dst->runstate_cycles[i] += src->runstate_cycles[i];
+    for ( i = 0; i < STREAM_LATENCY_BUCKETS; i++ )
+        dst->latency[i] += src->latency[i];
+    dst->latency_count += src->latency_count;
+    if ( src->latency_max > dst->latency_max )
+        dst->latency_max = src->latency_max;
+}
+
+/* Upper bound, in us, of the bucket holding the given fraction of samples */
+static unsigned long long latency_percentile(const struct stream_summary *sum,
+                                             double fraction)
+{
+    unsigned long long want = sum->latency_count * fraction, seen = 0;
+    int b;
+
+    for ( b = 0; b < STREAM_LATENCY_BUCKETS - 1; b++ )
+    {
+        seen += sum->latency[b];
+        if ( seen > want )
+            break;
+    }
+
+    return 1ULL << b;
+}
+
+static void stream_summary_print(const struct stream_state *s,
+                                 const char *what, tsc_t start, tsc_t end,
+                                 const struct stream_summary *sum)
+{
+    FILE *out = s->o->out;
+    double secs = (double)(end - start) / s->o->cpu_hz;
+    tsc_t vcpu_cycles = 0;
+    int i;
+
+    if ( secs <= 0 )
+        return;
+
+    fprintf(out, "%s %.3f-%.3fs: %.0f exits/s, %.0f runstate changes/s, "
+            "%llu records lost\n",
+            what, (double)(start - s->first_tsc) / s->o->cpu_hz,
+            (double)(end - s->first_tsc) / s->o->cpu_hz,
+            sum->exits / secs, sum->sched / secs, sum->lost);
+
+    for ( i = 0; i < STREAM_RUNSTATE_MAX; i++ )
+        vcpu_cycles += sum->runstate_cycles[i];
+    if ( vcpu_cycles )
+    {
+        fprintf(out, "  runstates:");
+        for ( i = 0; i < STREAM_RUNSTATE_MAX; i++ )
+            fprintf(out, " %s %.2f%%", stream_runstate_name[i],
+                    sum->runstate_cycles[i] * 100.0 / vcpu_cycles);
+        fprintf(out, "\n");
+    }
+
+    if ( sum->latency_count )
+        fprintf(out, "  sched latency: %llu waits, p50 <%lluus p90 <%lluus "
+                "p99 <%lluus max %lluus\n",
+                sum->latency_count, latency_percentile(sum, 0.5),
+                latency_percentile(sum, 0.9), latency_percentile(sum, 0.99),
+                cycles_to_us(s->o, sum->latency_max));
+}
+
+/* -- Per-vcpu accounting, done by the shard owning the vcpu's domain -- */
+
+static void shard_runstate_change(struct stream_shard *sh,
+                                  const struct stream_event *e)
+{
+    struct stream_vcpu *v = stream_vcpu(sh, e->d0 >> 16, e->d0 & 0xffff);
+    int new = (e->event >> 4) & 0xf, old = (e->event >> 8) & 0xf;
+    tsc_t tsc = e->tsc;
+
+    sh->cur.sched++;
+
+    if ( tsc < v->acct_tsc )
+        tsc = v->acct_tsc;
+
+    /* Trust the record over our idea of the state: records get lost. */
+    if ( v->state >= 0 && old < STREAM_RUNSTATE_MAX )
+        sh->cur.runstate_cycles[old] += tsc - v->acct_tsc;
+
+    if ( new == STREAM_RUNSTATE_RUNNING && old == STREAM_RUNSTATE_RUNNABLE &&
+         v->runnable_tsc )
+        stream_latency(sh, tsc - v->runnable_tsc);
+
+    v->runnable_tsc = (new == STREAM_RUNSTATE_RUNNABLE) ? tsc : 0;
+    v->state = (new < STREAM_RUNSTATE_MAX) ? new : -1;
+    v->acct_tsc = tsc;
+}
+
+/* Account every vcpu's time up to end, and hand over the interval's part. */
+static void shard_interval_end(struct stream_shard *sh, tsc_t end)
+{
+    struct stream_result *r = stream_alloc(sizeof(*r));
+    struct stream_vcpu *v;
+    int i;
+
+    for ( i = 0; i < STREAM_VCPU_HASH; i++ )
+        for ( v = sh->vcpus[i]; v; v = v->next )
+        {
+            if ( v->state < 0 || v->acct_tsc >= end )
+                continue;
+            sh->cur.runstate_cycles[v->state] += end - v->acct_tsc;
+            v->acct_tsc = end;
+        }
+
+    r->sum = sh->cur;
+    memset(&sh->cur, 0, sizeof(sh->cur));
+
+    pthread_mutex_lock(&sh->lock);
+    *sh->results_tail = r;
+    sh->results_tail = &r->next;
+    pthread_cond_broadcast(&sh->cond);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+static void shard_process(struct stream_shard *sh,
+                          const struct stream_event *e)
+{
+    if ( e->event == STREAM_EV_INTERVAL )
+        shard_interval_end(sh, e->tsc);
+    else
+        shard_runstate_change(sh, e);
+}
+
+static void *shard_thread(void *arg)
+{
+    struct stream_shard *sh = arg;
+    struct stream_block *b;
+    unsigned int i;
+
+    while ( (b = queue_get(&sh->q)) )
+    {
+        for ( i = 0; i < b->nr; i++ )
+            shard_process(sh, &b->e[i]);
+        free(b);
+    }
+
+    return NULL;
+}
+
+/* Pass a record to a shard, or just process it when not threaded. */
+static void shard_send(struct stream_shard *sh, const struct stream_event *e)
+{
+    if ( !sh->threaded )
+    {
+        shard_process(sh, e);
+        return;
+    }
+
+    if ( !sh->fill )
+        sh->fill = stream_alloc(sizeof(*sh->fill));
+
+    sh->fill->e[sh->fill->nr++] = *e;
+
+    /* Don't sit on an interval's end: it is waited for to print it. */
+    if ( sh->fill->nr == STREAM_BLOCK || e->event == STREAM_EV_INTERVAL )
+    {
+        queue_put(&sh->q, sh->fill);
+        sh->fill = NULL;
+    }
+}
+
+static void shard_init(struct stream_state *s, struct stream_shard *sh)
+{
+    sh->o = s->o;
+    sh->results_tail = &sh->results;
+    pthread_mutex_init(&sh->lock, NULL);
+    pthread_cond_init(&sh->cond, NULL);
+    queue_init(&sh->q);
+
+    sh->threaded = s->nr_shards > 1;
+    if ( !sh->threaded )
+        return;
+
+    errno = pthread_create(&sh->thread, NULL, shard_thread, sh);
+    if ( errno )
+    {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+static void shard_destroy(struct stream_shard *sh)
+{
+    struct stream_vcpu *v, *next;
+    int i;
+
+    if ( sh->threaded )
+    {
+        queue_close(&sh->q);
+        pthread_join(sh->thread, NULL);
+    }
+
+    for ( i = 0; i < STREAM_VCPU_HASH; i++ )
+        for ( v = sh->vcpus[i]; v; v = next )
+        {
+            next = v->next;
+            free(v);
+        }
+}
+
+/* -- The interval clock, and merging the shards' summaries -- */
+
+/*
+ * Merge and print, in order, every ended interval that all shards have
+ * handed their part of over for.
+ */
+static void stream_collect(struct stream_state *s, bool wait)
+{
+    struct stream_pending *p;
+    struct stream_result *r;
+    unsigned int i;
+    bool ready;
+
+    while ( (p = s->pending) )
+    {
+        for ( i = 0; i < s->nr_shards; i++ )
+        {
+            struct stream_shard *sh = &s->shards[i];
+
+            pthread_mutex_lock(&sh->lock);
+            while ( wait && !sh->results )
+                pthread_cond_wait(&sh->cond, &sh->lock);
+            ready = sh->results;
+            pthread_mutex_unlock(&sh->lock);
+
+            if ( !ready )
+                return;
+        }
+
+        for ( i = 0; i < s->nr_shards; i++ )
+        {
+            struct stream_shard *sh = &s->shards[i];
+
+            pthread_mutex_lock(&sh->lock);
+            r = sh->results;
+            sh->results = r->next;
+            if ( !sh->results )
+                sh->results_tail = &sh->results;
+            pthread_mutex_unlock(&sh->lock);
+
+            stream_summary_add(&p->sum, &r->sum);
+            free(r);
+        }
+
+        stream_summary_print(s, "interval", p->start, p->end, &p->sum);
+        fflush(s->o->out);
+        stream_summary_add(&s->total, &p->sum);
+
+        s->pending = p->next;
+        if ( !s->pending )
+            s->pending_tail = &s->pending;
+        free(p);
+    }
+}
+
+static void stream_interval_end(struct stream_state *s, tsc_t end)
+{
+    struct stream_pending *p = stream_alloc(sizeof(*p));
+    struct stream_event mark = {
+        .tsc = end,
+        .event = STREAM_EV_INTERVAL,
+    };
+    unsigned int i;
+
+    p->start = s->interval_start;
+    p->end = end;
+    p->sum = s->cur;
+    memset(&s->cur, 0, sizeof(s->cur));
+    *s->pending_tail = p;
+    s->pending_tail = &p->next;
+
+    for ( i = 0; i < s->nr_shards; i++ )
+        shard_send(&s->shards[i], &mark);
+
+    s->interval_start = end;
+
+    stream_collect(s, false);
+}
+
+static void stream_process(struct stream_state *s,
+                           const struct stream_event *e)
+{
+    struct stream_event ev = *e;
+
+    if ( !s->started )
+    {
+        s->first_tsc = s->interval_start = ev.tsc;
+        s->started = true;
+    }
+
+    /* Anything too late for its interval counts towards the current one. */
+    if ( ev.tsc < s->interval_start )
+        ev.tsc = s->interval_start;
+
+    while ( ev.tsc >= s->interval_start + s->o->interval )
+        stream_interval_end(s, s->interval_start + s->o->interval);
+
+    if ( ev.tsc > s->last_tsc )
+        s->last_tsc = ev.tsc;
+
+    switch ( ev.event )
+    {
+    case TRC_LOST_RECORDS:
+        s->cur.lost += ev.d0;
+        break;
+    case TRC_HVM_VMEXIT:
+    case TRC_HVM_VMEXIT64:
+        s->cur.exits++;
+        break;
+    default:
+        shard_send(&s->shards[(ev.d0 >> 16) % s->nr_shards], &ev);
+        break;
+    }
+}
+
+static void stream_finish(struct stream_state *s)
+{
+    if ( s->started )
+    {
+        stream_interval_end(s, s->last_tsc);
+        stream_collect(s, true);
+        stream_summary_print(s, "total", s->first_tsc, s->last_tsc,
+                             &s->total);
+    }
+    else
+        fprintf(s->o->out, "No records found.\n");
+}
+
+/* -- A single stream: windows of all cpus interleaved -- */
+
+static void stream_push(void *arg, const struct stream_event *e)
+{
+    heap_push(arg, e);
+}
+
+/*
+ * The windows of different cpus in one stream are only roughly in order, so
+ * hold records back until an interval's worth of later ones has been seen
+ * (or too many are pending) before processing them.
+ */
+static void stream_drain(struct stream_state *s, struct stream_heap *h,
+                         bool all)
+{
+    struct stream_event e;
+
+    while ( h->nr && (all || h->nr > STREAM_MAX_PENDING ||
+                      h->e[0].tsc + s->o->interval <= h->max_tsc) )
+    {
+        heap_pop(h, &e);
+        stream_process(s, &e);
+    }
+}
+
+static int stream_single(struct stream_state *s, const char *name)
+{
+    struct stream_decoder *dec = stream_alloc(sizeof(*dec));
+    struct stream_heap h = { 0 };
+    int fd = 0;
+
+    if ( strcmp(name, "-") && (fd = open(name, O_RDONLY)) < 0 )
+    {
+        perror(name);
+        free(dec);
+        return 1;
+    }
+
+    while ( stream_read_window(fd, name, dec, 0, stream_push, &h) )
+        stream_drain(s, &h, false);
+    stream_drain(s, &h, true);
+
+    if ( fd )
+        close(fd);
+    free(h.e);
+    free(dec->buf);
+    free(dec);
+
+    return 0;
+}
+
+/* -- Several per-cpu files, each read by its own thread -- */
+
+static void src_emit(void *arg, const struct stream_event *e)
+{
+    struct stream_src *src = arg;
+
+    if ( !src->fill )
+        src->fill = stream_alloc(sizeof(*src->fill));
+
+    src->fill->e[src->fill->nr++] = *e;
+
+    if ( src->fill->nr == STREAM_BLOCK )
+    {
+        queue_put(&src->q, src->fill);
+        src->fill = NULL;
+    }
+}
+
+static void *src_reader(void *arg)
+{
+    struct stream_src *src = arg;
+
+    while ( stream_read_window(src->fd, src->name, &src->dec, src->idx,
+                               src_emit, src) )
+        ;
+
+    if ( src->fill )
+        queue_put(&src->q, src->fill);
+    src->fill = NULL;
+
+    queue_close(&src->q);
+
+    return NULL;
+}
+
+/* Take the next decoded record of src; false once it is exhausted. */
+static bool src_next(struct stream_src *src, struct stream_event *e)
+{
+    if ( !src->cur || src->pos == src->cur->nr )
+    {
+        free(src->cur);
+        src->pos = 0;
+        src->cur = queue_get(&src->q);
+        if ( !src->cur )
+            return false;
+    }
+
+    *e = src->cur->e[src->pos++];
+
+    return true;
+}
+
+/*
+ * Each file is in time order on its own, so a merge on the head record of
+ * every file gives exact order without holding anything back.
+ */
+static int stream_multi(struct stream_state *s, char **files, int nr)
+{
+    struct stream_src *srcs = stream_alloc(nr * sizeof(*srcs));
+    struct stream_heap h = { 0 };
+    struct stream_event e;
+    int i;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct stream_src *src = &srcs[i];
+
+        src->name = files[i];
+        src->idx = i;
+        queue_init(&src->q);
+        src->fd = open(files[i], O_RDONLY);
+        if ( src->fd < 0 )
+        {
+            perror(files[i]);
+            exit(1);
+        }
+
+        errno = pthread_create(&src->thread, NULL, src_reader, src);
+        if ( errno )
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    for ( i = 0; i < nr; i++ )
+        if ( src_next(&srcs[i], &e) )
+            heap_push(&h, &e);
+
+    while ( h.nr )
+    {
+        heap_pop(&h, &e);
+        stream_process(s, &e);
+        if ( src_next(&srcs[e.src], &e) )
+            heap_push(&h, &e);
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        pthread_join(srcs[i].thread, NULL);
+        close(srcs[i].fd);
+        free(srcs[i].dec.buf);
+    }
+
+    free(h.e);
+    free(srcs);
+
+    return 0;
+}
+
+int stream_analyze(char **files, int nr_files, const struct stream_opts *o)
+{
+    struct stream_state *s = stream_alloc(sizeof(*s));
+    unsigned int i;
+    int rc;
+
+    if ( nr_files > UINT16_MAX )
+    {
+        fprintf(stderr, "Too many input files\n");
+        free(s);
+        return 1;
+    }
+
+    s->o = o;
+    s->pending_tail = &s->pending;
+    s->nr_shards = o->threads < 1 ? 1 :
+                   o->threads > STREAM_MAX_SHARDS ? STREAM_MAX_SHARDS :
+                   o->threads;
+    s->shards = stream_alloc(s->nr_shards * sizeof(*s->shards));
+    for ( i = 0; i < s->nr_shards; i++ )
+        shard_init(s, &s->shards[i]);
+
+    if ( nr_files == 1 )
+        rc = stream_single(s, files[0]);
+    else
+        rc = stream_multi(s, files, nr_files);
+
+    if ( !rc )
+        stream_finish(s);
+
+    for ( i = 0; i < s->nr_shards; i++ )
+        shard_destroy(&s->shards[i]);
+    free(s->shards);
+    free(s);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-set-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
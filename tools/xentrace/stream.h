@@ -0,0 +1,32 @@
+#ifndef __STREAM_H
+# define __STREAM_H
+
+#include <stdio.h>
+#include "analyze.h"
+
+/* Buckets of the scheduling latency histogram: [2^(n-1), 2^n) microseconds */
+#define STREAM_LATENCY_BUCKETS 32
+
+/* What the stream analysis accumulates over one interval (or all of them) */
+struct stream_summary {
+    unsigned long long exits;          /* HVM vmexits */
+    unsigned long long sched;          /* runstate changes */
+    unsigned long long lost;           /* records Xen reported lost */
+    tsc_t runstate_cycles[4];          /* vcpu time in each runstate */
+    unsigned long long latency[STREAM_LATENCY_BUCKETS];
+    unsigned long long latency_count;
+    tsc_t latency_max;
+};
+
+struct stream_opts {
+    long long cpu_hz;
+    tsc_t interval;                    /* in cycles */
+    int threads;                       /* shards of the per-vcpu state */
+    FILE *out;
+};
+
+void stream_summary_add(struct stream_summary *dst,
+                        const struct stream_summary *src);
+int stream_analyze(char **files, int nr_files, const struct stream_opts *o);
+
+#endif
@@ -32,6 +32,7 @@
 #include "analyze.h"
 #include "mread.h"
 #include "pv.h"
+#include "stream.h"
 #include <errno.h>
 #include <strings.h>
 #include <string.h>
@@ -69,6 +70,8 @@ struct {
     struct symbol_struct * symbols;
     char * symbol_file;
     char * trace_file;
+    char ** trace_files;        /* --stream may take several */
+    int nr_trace_files;
     int output_defined;
     off_t file_size;
     struct {
@@ -179,6 +182,7 @@ struct {
         summary:1,
         report_pcpu:1,
         tsc_loop_fatal:1,
+        stream:1,
         summary_info;
     long long cpu_qhz, cpu_hz;
     int scatterplot_interrupt_vector;
@@ -189,6 +193,7 @@ struct {
     int interrupt_eip_enumeration_vector;
     int default_guest_paging_levels;
     int sample_size, sample_max;
+    int threads;
     enum error_level tolerance; /* Tolerate up to this level of error */
     struct {
         tsc_t cycles;
@@ -252,6 +257,8 @@ struct {
     .summary = 0,
     .report_pcpu = 0,
     .tsc_loop_fatal = 0,
+    .stream = 0,
+    .threads = 1,
     .cpu_hz = DEFAULT_CPU_HZ,
     /* Pre-calculate a multiplier that makes the rest of the
      * calculations easier */
@@ -9977,6 +9984,8 @@ enum {
     OPT_PROGRESS,
     OPT_TOLERANCE,
     OPT_TSC_LOOP_FATAL,
+    OPT_STREAM,
+    OPT_THREADS,
     /* Specific letters */
     OPT_DUMP_ALL='a',
     OPT_INTERVAL_LENGTH='i',
@@ -10457,17 +10466,49 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.tsc_loop_fatal = 1;
         break;
 
+    case OPT_STREAM:
+        opt.stream = 1;
+        G.output_defined = 1;
+        break;
+
+    case OPT_THREADS:
+    {
+        char *inval;
+
+        opt.threads = (int)strtol(arg, &inval, 0);
+        if ( inval == arg || opt.threads < 1 )
+            argp_usage(state);
+    }
+    break;
+
     case ARGP_KEY_ARG:
     {
         /* FIXME - strcpy */
         if (state->arg_num == 0)
             G.trace_file = arg;
-        else
-            argp_usage(state);
+        G.trace_files = realloc(G.trace_files,
+                                (G.nr_trace_files + 1) * sizeof(char *));
+        if ( !G.trace_files )
+        {
+            perror("realloc");
+            exit(1);
+        }
+        G.trace_files[G.nr_trace_files++] = arg;
     }
     break;
     case ARGP_KEY_END:
     {
+        if ( G.nr_trace_files > 1 && !opt.stream )
+            argp_usage(state);
+
+        if ( opt.stream )
+        {
+            opt.interval.cycles = ( opt.interval.msec * opt.cpu_hz ) / 1000 ;
+            if ( !opt.interval.cycles )
+                argp_usage(state);
+            break;
+        }
+
         if(opt.interval_mode) {
             opt.interval.cycles = ( opt.interval.msec * opt.cpu_hz ) / 1000 ;
             interval_header();
@@ -10746,6 +10787,21 @@ const struct argp_option cmd_opts[] =  {
       .key = OPT_TSC_LOOP_FATAL,
       .doc = "Stop processing and exit if tsc skew tracking detects a dependency loop.", },
 
+    { .name = "stream",
+      .key = OPT_STREAM,
+      .doc = "Read the trace once, front to back, and print exit rates, "
+      "runstate times and scheduling latency every interval (-i, default "
+      "1s) in bounded memory.  The trace may be \"-\" to read xentrace "
+      "output from a pipe, or the per-cpu files of xentrace --threads.  "
+      "Other analyses are ignored.", },
+
+    { .name = "threads",
+      .key = OPT_THREADS,
+      .arg = "N",
+      .doc = "With --stream, share the per-vcpu accounting between N "
+      "threads by domain.  Output is the same for any N.  The full "
+      "analysis always runs in one thread.", },
+
     { .name = "tolerance",
       .key = OPT_TOLERANCE,
       .arg = "errlevel",
@@ -10758,7 +10814,7 @@ const struct argp_option cmd_opts[] =  {
 const struct argp parser_def = {
     .options = cmd_opts,
     .parser = cmd_parser,
-    .args_doc = "[trace file]",
+    .args_doc = "[trace file...]",
     .doc = "",
 };
 
@@ -10774,6 +10830,18 @@ int main(int argc, char *argv[]) {
     if (G.trace_file == NULL)
         exit(1);
 
+    if ( opt.stream )
+    {
+        struct stream_opts so = {
+            .cpu_hz = opt.cpu_hz,
+            .interval = opt.interval.cycles,
+            .threads = opt.threads,
+            .out = stdout,
+        };
+
+        return stream_analyze(G.trace_files, G.nr_trace_files, &so);
+    }
+
     if ( (G.fd = open(G.trace_file, O_RDONLY)) < 0) {
         perror("open");
         error(ERR_SYSTEM, NULL);
@@ -25,7 +25,11 @@
 #include <assert.h>
 #include <ctype.h>
 #include <poll.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 
 #include <xen/xen.h>
 #include <xen/trace.h>
@@ -34,6 +38,11 @@
 #include <xenevtchn.h>
 #include <xenctrl.h>
 
+/* *BSD has no O_LARGEFILE */
+#ifndef O_LARGEFILE
+#define O_LARGEFILE	0
+#endif
+
 #define PERROR(_m, _a...)                                       \
 do {                                                            \
     int __saved_errno = errno;                                  \
@@ -60,9 +69,11 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    unsigned int threads;     /* per-CPU consumer threads, 0 for none */
     uint8_t discard:1,
         disable_tracing:1,
-        start_disabled:1;
+        start_disabled:1,
+        merge:1;
 } settings_t;
 
 struct t_struct {
@@ -343,38 +354,42 @@ fail:
  * Outputs the trace buffer to a filestream, prepending the CPU and size
  * of the buffer write.
  */
-static void write_buffer(unsigned int cpu, unsigned char *start, int size,
-                         int total_size)
+static void check_disk_space(int fd, int size, int total_size)
 {
     struct statvfs stat;
-    size_t written = 0;
-    
-    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
-    {
-        unsigned long long freespace;
+    unsigned long long freespace;
 
-        /* Check that filesystem has enough space. */
-        if ( fstatvfs (outfd, &stat) )
-        {
-            fprintf(stderr, "Statfs failed!\n");
-            goto fail;
-        }
+    /* Check that filesystem has enough space. */
+    if ( fstatvfs (fd, &stat) )
+    {
+        fprintf(stderr, "Statfs failed!\n");
+        PERROR("Failed to write trace data");
+        exit(EXIT_FAILURE);
+    }
 
-        freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
 
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
+    if ( total_size )
+        freespace -= total_size;
+    else
+        freespace -= size;
 
-        freespace >>= 20; /* Convert to MB */
+    freespace >>= 20; /* Convert to MB */
 
-        if ( freespace <= opts.disk_rsvd )
-        {
-            fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
-            exit (EXIT_FAILURE);
-        }
+    if ( freespace <= opts.disk_rsvd )
+    {
+        fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
+        exit (EXIT_FAILURE);
     }
+}
+
+static void write_buffer(unsigned int cpu, unsigned char *start, int size,
+                         int total_size)
+{
+    size_t written = 0;
+    
+    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
+        check_disk_space(outfd, size, total_size);
 
     /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
      * windows may involve two writes, so only write the record on the
@@ -658,6 +673,444 @@ static void wait_for_event_or_timeout(unsigned long milliseconds)
 }
 
 
+/**
+ * consume_buffer - hand the unread window of one CPU's buffer to @write
+ *
+ * A window that wraps round the end of the buffer is handed over in two
+ * pieces; only the first carries the total window size.
+ */
+static void consume_buffer(unsigned int cpu, struct t_buf *meta,
+                           unsigned char *data, unsigned long data_size,
+                           void (*write)(unsigned int cpu,
+                                         unsigned char *start, int size,
+                                         int total_size))
+{
+    unsigned long start_offset, end_offset, window_size, cons, prod;
+
+    /* Read window information only once. */
+    cons = meta->cons;
+    prod = meta->prod;
+    xen_rmb(); /* read prod, then read item. */
+
+    if ( cons == prod )
+        return;
+
+    assert(cons < 2*data_size);
+    assert(prod < 2*data_size);
+
+    // NB: if (prod<cons), then (prod-cons)%data_size will not yield
+    // the correct answer because data_size is not a power of 2.
+    if ( prod < cons )
+        window_size = (prod + 2*data_size) - cons;
+    else
+        window_size = prod - cons;
+    assert(window_size > 0);
+    assert(window_size <= data_size);
+
+    start_offset = cons % data_size;
+    end_offset = prod % data_size;
+
+    if ( end_offset > start_offset )
+    {
+        /* If window does not wrap, write in one big chunk */
+        write(cpu, data + start_offset, window_size, window_size);
+    }
+    else
+    {
+        /* If wrapped, write in two chunks:
+         * - first, start to the end of the buffer
+         * - second, start of buffer to end of window
+         */
+        write(cpu, data + start_offset, data_size - start_offset,
+              window_size);
+        write(cpu, data, end_offset, 0);
+    }
+
+    xen_mb(); /* read buffer, then update cons. */
+    meta->cons = prod;
+}
+
+/*
+ * Per-CPU consumers (-j): each thread owns every nth CPU and writes that
+ * CPU's windows straight from the mapped buffer to its own file,
+ * <outfile>.<cpu>, so that neither the copy nor the single output fd is
+ * shared between CPUs.  The files are in the usual format and are
+ * combined with --merge.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long generation;    /* bumped on each VIRQ_TBUF or timeout */
+    bool stop;                   /* tracing is off: do a last pass, exit */
+
+    unsigned int num;
+    struct t_buf **meta;
+    unsigned char **data;
+    unsigned long data_size;
+
+    int *fd;                     /* per-CPU output files */
+    unsigned long long *bytes;   /* per-CPU bytes written */
+    unsigned long long *lost;    /* per-CPU records Xen reported lost */
+} consumers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Add up the TRC_LOST_RECORDS records in a run of whole records. */
+static void count_lost_records(unsigned int cpu, const unsigned char *p,
+                               int size)
+{
+    const unsigned char *end = p + size;
+
+    while ( p + sizeof(uint32_t) <= end )
+    {
+        const struct t_rec *rec = (const struct t_rec *)p;
+        const uint32_t *extra = rec->cycles_included
+                                ? rec->u.cycles.extra_u32
+                                : rec->u.nocycles.extra_u32;
+
+        if ( rec->event == TRC_LOST_RECORDS && rec->extra_u32 )
+            consumers.lost[cpu] += extra[0];
+
+        p = (const unsigned char *)(extra + rec->extra_u32);
+    }
+}
+
+static void write_cpu_buffer(unsigned int cpu, unsigned char *start, int size,
+                             int total_size)
+{
+    struct cpu_change_record rec;
+    struct iovec iov[2];
+    int iovcnt = 0;
+    ssize_t want = size, written;
+
+    if ( opts.disk_rsvd != 0 )
+        check_disk_space(consumers.fd[cpu], size, total_size);
+
+    /* As write_buffer(), a cpu change record leads each window. */
+    if ( total_size != 0 )
+    {
+        rec.header = CPU_CHANGE_HEADER;
+        rec.data.cpu = cpu;
+        rec.data.window_size = total_size;
+
+        iov[iovcnt].iov_base = &rec;
+        iov[iovcnt].iov_len = sizeof(rec);
+        iovcnt++;
+        want += sizeof(rec);
+    }
+
+    iov[iovcnt].iov_base = start;
+    iov[iovcnt].iov_len = size;
+    iovcnt++;
+
+    written = writev(consumers.fd[cpu], iov, iovcnt);
+    if ( written != want )
+    {
+        fprintf(stderr, "Write failed on cpu %u! (size %zd, returned %zd)\n",
+                cpu, want, written);
+        PERROR("Failed to write trace data");
+        exit(EXIT_FAILURE);
+    }
+
+    consumers.bytes[cpu] += size;
+    count_lost_records(cpu, start, size);
+}
+
+static void *consumer_thread(void *arg)
+{
+    unsigned int first = (unsigned long)arg, i;
+    unsigned long generation = 0;
+    bool last = false;
+
+    while ( 1 )
+    {
+        for ( i = first; i < consumers.num; i += opts.threads )
+            consume_buffer(i, consumers.meta[i], consumers.data[i],
+                           consumers.data_size, write_cpu_buffer);
+
+        if ( last )
+            break;
+
+        pthread_mutex_lock(&consumers.lock);
+        while ( generation == consumers.generation && !consumers.stop )
+            pthread_cond_wait(&consumers.cond, &consumers.lock);
+        generation = consumers.generation;
+        last = consumers.stop;
+        pthread_mutex_unlock(&consumers.lock);
+    }
+
+    return NULL;
+}
+
+static void kick_consumers(bool stop)
+{
+    pthread_mutex_lock(&consumers.lock);
+    consumers.generation++;
+    consumers.stop = stop;
+    pthread_cond_broadcast(&consumers.cond);
+    pthread_mutex_unlock(&consumers.lock);
+}
+
+/**
+ * run_consumers - collect trace data with per-CPU consumer threads
+ *
+ * The calling thread only waits for VIRQ_TBUF (or the poll timeout) and
+ * wakes the consumers; all copying is done by them.
+ */
+static void run_consumers(unsigned int num, struct t_buf **meta,
+                          unsigned char **data, unsigned long data_size)
+{
+    pthread_t *threads;
+    sigset_t set, old;
+    unsigned long long lost = 0;
+    unsigned int i;
+
+    if ( opts.threads > num )
+        opts.threads = num;
+
+    consumers.num = num;
+    consumers.meta = meta;
+    consumers.data = data;
+    consumers.data_size = data_size;
+    consumers.fd = calloc(num, sizeof(*consumers.fd));
+    consumers.bytes = calloc(num, sizeof(*consumers.bytes));
+    consumers.lost = calloc(num, sizeof(*consumers.lost));
+    threads = calloc(opts.threads, sizeof(*threads));
+    if ( !consumers.fd || !consumers.bytes || !consumers.lost || !threads )
+    {
+        PERROR("Failed to allocate consumer state");
+        exit(EXIT_FAILURE);
+    }
+
+    for ( i = 0; i < num; i++ )
+    {
+        char name[PATH_MAX];
+
+        snprintf(name, sizeof(name), "%s.%u", opts.outfile, i);
+        consumers.fd[i] = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                               0644);
+        if ( consumers.fd[i] < 0 )
+        {
+            PERROR("Could not open output file %s", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Leave the signals to this thread, so that poll() sees them. */
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    for ( i = 0; i < opts.threads; i++ )
+    {
+        errno = pthread_create(&threads[i], NULL, consumer_thread,
+                               (void *)(unsigned long)i);
+        if ( errno )
+        {
+            PERROR("Failed to create consumer thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    while ( !interrupted )
+    {
+        wait_for_event_or_timeout(opts.poll_sleep);
+        kick_consumers(false);
+    }
+
+    /* Disable tracing, then have the consumers read everything once more. */
+    if ( opts.disable_tracing )
+        disable_tbufs();
+    kick_consumers(true);
+
+    for ( i = 0; i < opts.threads; i++ )
+        pthread_join(threads[i], NULL);
+
+    for ( i = 0; i < num; i++ )
+    {
+        close(consumers.fd[i]);
+        if ( consumers.bytes[i] || consumers.lost[i] )
+            fprintf(stderr, "cpu %u: %llu bytes, %llu records lost\n",
+                    i, consumers.bytes[i], consumers.lost[i]);
+        lost += consumers.lost[i];
+    }
+    fprintf(stderr, "%llu records lost in total\n", lost);
+
+    free(threads);
+    free(consumers.lost);
+    free(consumers.bytes);
+    free(consumers.fd);
+}
+
+/*
+ * Merge the per-CPU files written by -j into one trace.  Windows are
+ * emitted in order of the first timestamp they carry, so that the result
+ * looks like the output of a single consumer.
+ */
+struct merge_src {
+    int fd;
+    struct cpu_change_record rec;
+    unsigned char *buf;
+    unsigned int buf_size;
+    uint64_t tsc;
+};
+
+static uint64_t window_first_tsc(const unsigned char *p, unsigned int size)
+{
+    const unsigned char *end = p + size;
+
+    while ( p + sizeof(uint32_t) <= end )
+    {
+        const struct t_rec *rec = (const struct t_rec *)p;
+
+        if ( rec->cycles_included )
+            return ((uint64_t)rec->u.cycles.cycles_hi << 32) |
+                   rec->u.cycles.cycles_lo;
+
+        p = (const unsigned char *)(rec->u.nocycles.extra_u32 +
+                                    rec->extra_u32);
+    }
+
+    return 0;
+}
+
+static ssize_t read_exact(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+
+    while ( done < size )
+    {
+        ssize_t rc = read(fd, (char *)buf + done, size - done);
+
+        if ( rc < 0 && errno == EINTR )
+            continue;
+        if ( rc <= 0 )
+            return rc < 0 ? rc : done;
+        done += rc;
+    }
+
+    return done;
+}
+
+/* Load the next window of @src; returns false at the end of its file. */
+static bool merge_next_window(struct merge_src *src, const char *name)
+{
+    ssize_t rc = read_exact(src->fd, &src->rec, sizeof(src->rec));
+
+    if ( rc == 0 )
+        return false;
+
+    if ( rc != sizeof(src->rec) || src->rec.header != CPU_CHANGE_HEADER )
+    {
+        fprintf(stderr, "%s: truncated or corrupt trace\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    if ( src->rec.data.window_size > src->buf_size )
+    {
+        src->buf_size = src->rec.data.window_size;
+        src->buf = realloc(src->buf, src->buf_size);
+        if ( !src->buf )
+        {
+            PERROR("Failed to allocate merge buffer");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if ( read_exact(src->fd, src->buf, src->rec.data.window_size) !=
+         src->rec.data.window_size )
+    {
+        fprintf(stderr, "%s: truncated trace\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    src->tsc = window_first_tsc(src->buf, src->rec.data.window_size);
+
+    return true;
+}
+
+static int merge_cpu_files(void)
+{
+    struct merge_src *src = NULL;
+    unsigned int nr = 0, i;
+    char name[PATH_MAX];
+
+    for ( ; ; nr++ )
+    {
+        int fd;
+
+        snprintf(name, sizeof(name), "%s.%u", opts.outfile, nr);
+        fd = open(name, O_RDONLY | O_LARGEFILE);
+        if ( fd < 0 )
+            break;
+
+        src = realloc(src, (nr + 1) * sizeof(*src));
+        if ( !src )
+        {
+            PERROR("Failed to allocate merge state");
+            exit(EXIT_FAILURE);
+        }
+        memset(&src[nr], 0, sizeof(*src));
+        src[nr].fd = fd;
+        if ( !merge_next_window(&src[nr], name) )
+        {
+            close(fd);
+            src[nr].fd = -1;
+        }
+    }
+
+    if ( nr == 0 )
+    {
+        fprintf(stderr, "No per-cpu files %s.<cpu> to merge\n", opts.outfile);
+        return EXIT_FAILURE;
+    }
+
+    for ( ; ; )
+    {
+        struct merge_src *next = NULL;
+
+        for ( i = 0; i < nr; i++ )
+        {
+            if ( src[i].fd < 0 )
+                continue;
+            if ( !next || src[i].tsc < next->tsc )
+                next = &src[i];
+        }
+
+        if ( !next )
+            break;
+
+        if ( write(outfd, &next->rec, sizeof(next->rec)) != sizeof(next->rec) ||
+             write(outfd, next->buf, next->rec.data.window_size) !=
+             next->rec.data.window_size )
+        {
+            PERROR("Failed to write merged trace");
+            return EXIT_FAILURE;
+        }
+
+        snprintf(name, sizeof(name), "%s.%u", opts.outfile,
+                 (unsigned int)(next - src));
+        if ( !merge_next_window(next, name) )
+        {
+            close(next->fd);
+            next->fd = -1;
+        }
+    }
+
+    for ( i = 0; i < nr; i++ )
+        free(src[i].buf);
+    free(src);
+    close(outfd);
+
+    return 0;
+}
+
 /**
  * monitor_tbufs - monitor the contents of tbufs and output to a file
  * @logfile:       the FILE * representing the file to log to
@@ -704,61 +1157,17 @@ static int monitor_tbufs(void)
         for ( i = 0; i < num; i++ )
             meta[i]->cons = meta[i]->prod;
 
+    if ( opts.threads )
+    {
+        run_consumers(num, meta, data, data_size);
+        goto out;
+    }
+
     /* now, scan buffers for events */
     while ( 1 )
     {
         for ( i = 0; i < num; i++ )
-        {
-            unsigned long start_offset, end_offset, window_size, cons, prod;
-                
-            /* Read window information only once. */
-            cons = meta[i]->cons;
-            prod = meta[i]->prod;
-            xen_rmb(); /* read prod, then read item. */
-
-            if ( cons == prod )
-                continue;
-           
-            assert(cons < 2*data_size);
-            assert(prod < 2*data_size);
-
-            // NB: if (prod<cons), then (prod-cons)%data_size will not yield
-            // the correct answer because data_size is not a power of 2.
-            if ( prod < cons )
-                window_size = (prod + 2*data_size) - cons;
-            else
-                window_size = prod - cons;
-            assert(window_size > 0);
-            assert(window_size <= data_size);
-
-            start_offset = cons % data_size;
-            end_offset = prod % data_size;
-
-            if ( end_offset > start_offset )
-            {
-                /* If window does not wrap, write in one big chunk */
-                write_buffer(i, data[i]+start_offset,
-                             window_size,
-                             window_size);
-            }
-            else
-            {
-                /* If wrapped, write in two chunks:
-                 * - first, start to the end of the buffer
-                 * - second, start of buffer to end of window
-                 */
-                write_buffer(i, data[i] + start_offset,
-                             data_size - start_offset,
-                             window_size);
-                write_buffer(i, data[i],
-                             end_offset,
-                             0);
-            }
-
-            xen_mb(); /* read buffer, then update cons. */
-            meta[i]->cons = prod;
-
-        }
+            consume_buffer(i, meta[i], data[i], data_size, write_buffer);
 
         if ( interrupted )
         {
@@ -780,6 +1189,7 @@ static int monitor_tbufs(void)
     if ( opts.memory_buffer )
         membuf_dump();
 
+ out:
     /* cleanup */
     free(meta);
     free(data);
@@ -835,6 +1245,12 @@ static void usage(void)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -j, --threads=n         Read the trace buffers with n threads, each writing\n" \
+"                          its CPUs' records to separate files named\n" \
+"                          <output file>.<cpu>.  Records lost by Xen are\n" \
+"                          reported per CPU on exit.\n" \
+"  -m, --merge             Don't trace: merge the files <output file>.<cpu>\n" \
+"                          written by --threads into <output file>.\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -1080,6 +1496,8 @@ static void parse_args(int argc, char **argv)
         { "reserve-disk-space", required_argument, 0, 'r' },
         { "time-interval",  required_argument, 0, 'T' },
         { "memory-buffer",  required_argument, 0, 'M' },
+        { "threads",        required_argument, 0, 'j' },
+        { "merge",          no_argument,       0, 'm' },
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
@@ -1088,7 +1506,7 @@ static void parse_args(int argc, char **argv)
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:j:mDxX?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -1137,6 +1555,14 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'j':
+            opts.threads = argtol(optarg, 0);
+            break;
+
+        case 'm':
+            opts.merge = 1;
+            break;
+
         default:
             usage();
         }
@@ -1147,12 +1573,13 @@ static void parse_args(int argc, char **argv)
         usage();
 
     opts.outfile = argv[optind];
-}
 
-/* *BSD has no O_LARGEFILE */
-#ifndef O_LARGEFILE
-#define O_LARGEFILE	0
-#endif
+    if ( opts.threads && opts.memory_buffer )
+    {
+        fprintf(stderr, "--threads and --memory-buffer are exclusive.\n");
+        exit(EXIT_FAILURE);
+    }
+}
 
 int main(int argc, char **argv)
 {
@@ -1170,6 +1597,19 @@ int main(int argc, char **argv)
 
     parse_args(argc, argv);
 
+    if ( opts.merge )
+    {
+        outfd = open(opts.outfile, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                     0644);
+        if ( outfd < 0 )
+        {
+            perror("Could not open output file");
+            exit(EXIT_FAILURE);
+        }
+
+        return merge_cpu_files();
+    }
+
     xc_handle = xc_interface_open(0,0,0);
     if ( !xc_handle ) 
     {
@@ -1189,7 +1629,8 @@ int main(int argc, char **argv)
     if ( opts.timeout != 0 ) 
         alarm(opts.timeout);
 
-    if ( opts.outfile )
+    /* With --threads, only the per-cpu files are written. */
+    if ( opts.outfile && !opts.threads )
         outfd = open(opts.outfile,
                      O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
                      0644);
@@ -1200,7 +1641,7 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }        
 
-    if ( isatty(outfd) )
+    if ( !opts.threads && isatty(outfd) )
     {
         fprintf(stderr, "Cannot output to a TTY, specify a log file.\n");
         exit(EXIT_FAILURE);
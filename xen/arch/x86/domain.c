@@ -15,6 +15,7 @@
 #include <xen/lib.h>
 #include <xen/errno.h>
 #include <xen/sched.h>
+#include <xen/sched-if.h>
 #include <xen/domain.h>
 #include <xen/smp.h>
 #include <xen/delay.h>
@@ -72,6 +73,7 @@ void (*dead_idle) (void) __read_mostly = default_dead_idle;
 
 static void paravirt_ctxt_switch_from(struct vcpu *v);
 static void paravirt_ctxt_switch_to(struct vcpu *v);
+static void relmem_parallel_free(struct domain *d);
 
 static void default_idle(void)
 {
@@ -731,6 +733,8 @@ void arch_domain_destroy(struct domain *d)
     cleanup_domain_irq_mapping(d);
 
     psr_domain_free(d);
+
+    relmem_parallel_free(d);
 }
 
 void arch_domain_shutdown(struct domain *d)
@@ -2305,6 +2309,202 @@ static int relinquish_memory(
     return ret;
 }
 
+/*
+ * Freeing a dying domain's memory is dominated by free_domheap_pages()
+ * scrubbing every page.  For large HVM guests spread that work over idle
+ * pCPUs: each worker tasklet pulls batches of pages off d->page_list and
+ * drops them, while the vCPU executing the destroy hypercall helps out
+ * between preemption checks.  Anything needing the ordered handling of
+ * relinquish_memory() is left for the serial passes which follow.
+ */
+static unsigned int __read_mostly opt_relmem_workers = 8;
+integer_param("relmem-workers", opt_relmem_workers);
+
+#define RELMEM_BATCH            256
+#define RELMEM_WORKER_BUDGET    (16 * RELMEM_BATCH)
+/* Below this many pages the serial passes are quick enough. */
+#define RELMEM_PARALLEL_MIN     (1U << 18)
+
+struct relmem_worker {
+    struct tasklet tasklet;
+    struct relmem_parallel *par;
+    unsigned int cpu;
+    unsigned long freed;
+    struct page_info *batch[RELMEM_BATCH];
+};
+
+struct relmem_parallel {
+    struct domain *domain;
+    atomic_t active;            /* Workers which haven't run dry yet. */
+    unsigned int nr_workers;
+    unsigned long start_pages;
+    /* nr_workers tasklets, followed by the hypercall vCPU's slot. */
+    struct relmem_worker *workers;
+};
+
+/*
+ * Take up to RELMEM_BATCH pages off d->page_list and free them.  Returns the
+ * number of pages taken, zero once the list is empty.
+ */
+static unsigned int relmem_free_batch(struct domain *d,
+                                      struct page_info **batch)
+{
+    struct page_info *page;
+    unsigned int i, nr = 0;
+
+    spin_lock(&d->page_alloc_lock);
+    while ( nr < RELMEM_BATCH && (page = page_list_remove_head(&d->page_list)) )
+    {
+        /* free_domheap_pages() expects to find the page on relmem_list. */
+        page_list_add_tail(page, &d->arch.relmem_list);
+        batch[nr++] = page;
+    }
+    spin_unlock(&d->page_alloc_lock);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        page = batch[i];
+
+        /* Typed pages stay on relmem_list for relinquish_memory(). */
+        if ( (page->u.inuse.type_info &
+              (PGT_pinned | PGT_partial | PGT_count_mask)) ||
+             unlikely(!get_page(page, d)) )
+            continue;
+
+        clear_superpage_mark(page);
+
+        if ( test_and_clear_bit(_PGC_allocated, &page->count_info) )
+            put_page(page);
+
+        put_page(page);
+    }
+
+    return nr;
+}
+
+static void relmem_worker_fn(unsigned long data)
+{
+    struct relmem_worker *w = (void *)data;
+    struct relmem_parallel *par = w->par;
+    unsigned int nr, done = 0;
+
+    do {
+        nr = relmem_free_batch(par->domain, w->batch);
+        w->freed += nr;
+        done += nr;
+    } while ( nr && done < RELMEM_WORKER_BUDGET &&
+              !softirq_pending(smp_processor_id()) );
+
+    /* Requeue rather than loop, so softirqs get a look in. */
+    if ( nr )
+        tasklet_schedule_on_cpu(&w->tasklet, w->cpu);
+    else
+        atomic_dec(&par->active);
+}
+
+static int relinquish_memory_parallel(struct domain *d)
+{
+    struct relmem_parallel *par = d->arch.relmem_par;
+    struct relmem_worker *self;
+    unsigned int cpu, i;
+
+    if ( !par )
+    {
+        if ( !is_hvm_domain(d) || !opt_relmem_workers ||
+             d->tot_pages < RELMEM_PARALLEL_MIN )
+            return 0;
+
+        par = xzalloc(struct relmem_parallel);
+        if ( par )
+            par->workers = xzalloc_array(struct relmem_worker,
+                                         opt_relmem_workers + 1);
+        if ( !par || !par->workers )
+        {
+            /* Not fatal: the serial passes will do all the work. */
+            xfree(par);
+            return 0;
+        }
+
+        par->domain = d;
+        par->start_pages = d->tot_pages;
+
+        for_each_online_cpu ( cpu )
+        {
+            struct relmem_worker *w;
+
+            if ( par->nr_workers == opt_relmem_workers )
+                break;
+            if ( cpu == smp_processor_id() ||
+                 !is_idle_vcpu(curr_on_cpu(cpu)) )
+                continue;
+
+            w = &par->workers[par->nr_workers++];
+            w->par = par;
+            w->cpu = cpu;
+            tasklet_init(&w->tasklet, relmem_worker_fn, (unsigned long)w);
+        }
+
+        atomic_set(&par->active, par->nr_workers);
+        d->arch.relmem_par = par;
+
+        for ( i = 0; i < par->nr_workers; i++ )
+            tasklet_schedule_on_cpu(&par->workers[i].tasklet,
+                                    par->workers[i].cpu);
+    }
+
+    self = &par->workers[par->nr_workers];
+    while ( (i = relmem_free_batch(d, self->batch)) != 0 )
+    {
+        self->freed += i;
+        if ( hypercall_preempt_check() )
+            return -ERESTART;
+    }
+
+    if ( atomic_read(&par->active) )
+        return -ERESTART;
+
+    /* par itself stays around for relmem_dump_progress() until destroy. */
+    for ( i = 0; i < par->nr_workers; i++ )
+        tasklet_kill(&par->workers[i].tasklet);
+
+    /* Hand whatever is left back to the serial passes. */
+    spin_lock(&d->page_alloc_lock);
+    page_list_splice(&d->arch.relmem_list, &d->page_list);
+    INIT_PAGE_LIST_HEAD(&d->arch.relmem_list);
+    spin_unlock(&d->page_alloc_lock);
+
+    return 0;
+}
+
+static void relmem_parallel_free(struct domain *d)
+{
+    struct relmem_parallel *par = d->arch.relmem_par;
+
+    if ( !par )
+        return;
+
+    d->arch.relmem_par = NULL;
+    xfree(par->workers);
+    xfree(par);
+}
+
+static void relmem_dump_progress(const struct domain *d)
+{
+    const struct relmem_parallel *par = d->arch.relmem_par;
+    unsigned long freed = 0;
+    unsigned int i;
+
+    if ( !par || d->arch.relmem != RELMEM_parallel )
+        return;
+
+    for ( i = 0; i <= par->nr_workers; i++ )
+        freed += par->workers[i].freed;
+
+    printk("    relinquish: %lu/%lu pages freed, %u/%u workers active\n",
+           freed, par->start_pages, atomic_read(&par->active),
+           par->nr_workers);
+}
+
 int domain_relinquish_resources(struct domain *d)
 {
     int ret;
@@ -2377,6 +2577,13 @@ int domain_relinquish_resources(struct domain *d)
         /* Fallthrough. Relinquish every page of memory. */
     case RELMEM_xen:
         ret = relinquish_memory(d, &d->xenpage_list, ~0UL);
+        if ( ret )
+            return ret;
+        d->arch.relmem = RELMEM_parallel;
+        /* fallthrough */
+
+    case RELMEM_parallel:
+        ret = relinquish_memory_parallel(d);
         if ( ret )
             return ret;
         d->arch.relmem = RELMEM_l4;
@@ -2421,6 +2628,7 @@ int domain_relinquish_resources(struct domain *d)
 void arch_dump_domain_info(struct domain *d)
 {
     paging_dump_domain_info(d);
+    relmem_dump_progress(d);
 }
 
 void arch_dump_vcpu_info(struct vcpu *v)
@@ -665,6 +665,12 @@ void hvm_domain_destroy(struct domain *d)
     struct list_head *ioport_list, *tmp;
     struct g2m_ioport *ioport;
 
+    if ( d->arch.hvm_domain.fork_parent )
+    {
+        domain_unpause(d->arch.hvm_domain.fork_parent);
+        put_domain(d->arch.hvm_domain.fork_parent);
+    }
+
     xfree(d->arch.hvm_domain.io_handler);
     d->arch.hvm_domain.io_handler = NULL;
 
@@ -20,6 +20,7 @@
  */
 #include <xen/lib.h>
 #include <xen/hypercall.h>
+#include <xen/lat_hist.h>
 
 #include <asm/hvm/support.h>
 
@@ -147,6 +148,7 @@ int hvm_hypercall(struct cpu_user_regs *regs)
     struct domain *currd = curr->domain;
     int mode = hvm_guest_x86_mode(curr);
     unsigned long eax = regs->eax;
+    s_time_t lat_start;
 
     switch ( mode )
     {
@@ -178,6 +180,7 @@ int hvm_hypercall(struct cpu_user_regs *regs)
         return HVM_HCALL_completed;
     }
 
+    lat_start = lat_hist_start();
     curr->hcall_preempted = false;
 
     if ( mode == 8 )
@@ -273,6 +276,8 @@ int hvm_hypercall(struct cpu_user_regs *regs)
 
     HVM_DBG_LOG(DBG_LEVEL_HCALL, "hcall%lu -> %lx", eax, regs->rax);
 
+    lat_hist_hypercall(curr, eax, lat_start);
+
     if ( curr->hcall_preempted )
         return HVM_HCALL_preempted;
 
@@ -25,6 +25,7 @@
 #include <xen/hypercall.h>
 #include <xen/domain_page.h>
 #include <xen/xenoprof.h>
+#include <xen/lat_hist.h>
 #include <asm/current.h>
 #include <asm/io.h>
 #include <asm/paging.h>
@@ -2415,6 +2416,7 @@ void svm_vmexit_handler(struct cpu_user_regs *regs)
     vintr_t intr;
     bool_t vcpu_guestmode = 0;
     struct vlapic *vlapic = vcpu_vlapic(v);
+    s_time_t lat_start = lat_hist_start();
 
     hvm_invalidate_regs_fields(regs);
 
@@ -2841,6 +2843,9 @@ void svm_vmexit_handler(struct cpu_user_regs *regs)
     }
 
   out:
+    lat_hist_vmexit(v, exit_reason == VMEXIT_NPF ? XEN_LAT_HIST_SVM_NPF
+                                                 : exit_reason, lat_start);
+
     if ( vcpu_guestmode || vlapic_hw_disabled(vlapic) )
         return;
 
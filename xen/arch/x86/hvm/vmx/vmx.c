@@ -24,6 +24,7 @@
 #include <xen/domain_page.h>
 #include <xen/hypercall.h>
 #include <xen/perfc.h>
+#include <xen/lat_hist.h>
 #include <asm/current.h>
 #include <asm/io.h>
 #include <asm/iocap.h>
@@ -3502,6 +3503,7 @@ void vmx_vmexit_handler(struct cpu_user_regs *regs)
     unsigned long exit_qualification, exit_reason, idtv_info, intr_info = 0;
     unsigned int vector = 0, mode;
     struct vcpu *v = current;
+    s_time_t lat_start = lat_hist_start();
 
     __vmread(GUEST_RIP,    &regs->rip);
     __vmread(GUEST_RSP,    &regs->rsp);
@@ -4151,6 +4153,8 @@ out:
         else
             domain_crash(v->domain);
     }
+
+    lat_hist_vmexit(v, (uint16_t)exit_reason, lat_start);
 }
 
 static void lbr_tsx_fixup(void)
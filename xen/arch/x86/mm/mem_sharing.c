@@ -30,6 +30,7 @@
 #include <xen/rcupdate.h>
 #include <xen/guest_access.h>
 #include <xen/vm_event.h>
+#include <xen/hvm/save.h>
 #include <asm/page.h>
 #include <asm/string.h>
 #include <asm/p2m.h>
@@ -1008,7 +1009,7 @@ err_out:
 }
 
 int mem_sharing_add_to_physmap(struct domain *sd, unsigned long sgfn, shr_handle_t sh,
-                            struct domain *cd, unsigned long cgfn) 
+                            struct domain *cd, unsigned long cgfn, bool fork)
 {
     struct page_info *spage;
     int ret = -EINVAL;
@@ -1043,6 +1044,13 @@ int mem_sharing_add_to_physmap(struct domain *sd, unsigned long sgfn, shr_handle
         goto err_unlock;
     }
 
+    /*
+     * A hole reports no access rights.  A fork has no mem_access listener
+     * set up for lazily populated entries, so give them the default.
+     */
+    if ( fork )
+        a = p2m->default_access;
+
     /* This is simpler than regular sharing */
     BUG_ON(!get_page_and_type(spage, dom_cow, PGT_shared_page));
     if ( (gfn_info = mem_sharing_gfn_alloc(spage, cd, cgfn)) == NULL )
@@ -1319,6 +1327,192 @@ static int range_share(struct domain *d, struct domain *cd,
     return rc;
 }
 
+/* FNV-1a over 64-bit words: cheap, and only ever used as a hint. */
+static uint64_t page_content_hash(const void *va)
+{
+    const uint64_t *p = va;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i++ )
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+static int batch_hash_gfn(struct domain *d, unsigned long gfn,
+                          uint64_t *hash)
+{
+    struct page_info *page;
+    p2m_type_t p2mt;
+    void *va;
+
+    /* Only a hint: don't populate PoD or page anything in to compute it. */
+    page = get_page_from_gfn(d, gfn, &p2mt, 0);
+    if ( !page )
+        return -EINVAL;
+
+    if ( !p2m_is_ram(p2mt) )
+    {
+        put_page(page);
+        return -EINVAL;
+    }
+
+    va = __map_domain_page(page);
+    *hash = page_content_hash(va);
+    unmap_domain_page(va);
+    put_page(page);
+
+    return 0;
+}
+
+/*
+ * Compare the contents of two nominated pages.  Should either be written
+ * to afterwards its handle gets invalidated, so share_pages() will fail.
+ */
+static int batch_compare_gfns(struct domain *d, unsigned long gfn,
+                              struct domain *cd, unsigned long cgfn)
+{
+    struct page_info *page, *cpage;
+    p2m_type_t p2mt;
+    const void *va, *cva;
+    int rc = -EINVAL;
+
+    page = get_page_from_gfn(d, gfn, &p2mt, 0);
+    if ( !page )
+        return rc;
+
+    cpage = get_page_from_gfn(cd, cgfn, &p2mt, 0);
+    if ( cpage )
+    {
+        va = __map_domain_page(page);
+        cva = __map_domain_page(cpage);
+        rc = memcmp(va, cva, PAGE_SIZE) ? XENMEM_SHARING_OP_CONTENT_MISMATCH
+                                        : 0;
+        unmap_domain_page(cva);
+        unmap_domain_page(va);
+        put_page(cpage);
+    }
+    put_page(page);
+
+    return rc;
+}
+
+/* Keep the client domain locked across consecutive entries naming it. */
+static int batch_get_client(struct domain *d, domid_t domid,
+                            struct domain **cd)
+{
+    int rc;
+
+    if ( *cd )
+    {
+        if ( (*cd)->domain_id == domid )
+            return 0;
+        rcu_unlock_domain(*cd);
+        *cd = NULL;
+    }
+
+    rc = rcu_lock_live_remote_domain_by_id(domid, cd);
+    if ( rc )
+        return rc;
+
+    rc = xsm_mem_sharing_op(XSM_DM_PRIV, d, *cd, XENMEM_sharing_op_share);
+    if ( !rc && !mem_sharing_enabled(*cd) )
+        rc = -EINVAL;
+
+    if ( rc )
+    {
+        rcu_unlock_domain(*cd);
+        *cd = NULL;
+    }
+
+    return rc;
+}
+
+static int batch_share_entry(struct domain *d, struct domain **cd,
+                             xen_mem_sharing_batch_entry_t *e,
+                             unsigned int flags)
+{
+    shr_handle_t sh, ch;
+    int rc;
+
+    rc = nominate_page(d, _gfn(e->gfn), 0, &sh);
+    if ( rc )
+        return rc;
+
+    e->handle = sh;
+    if ( !(flags & XENMEM_SHARING_BATCH_SHARE) )
+        return 0;
+
+    rc = batch_get_client(d, e->client_domain, cd);
+    if ( rc )
+        return rc;
+
+    rc = nominate_page(*cd, _gfn(e->client_gfn), 0, &ch);
+    if ( rc )
+        return rc;
+
+    if ( flags & XENMEM_SHARING_BATCH_VERIFY )
+    {
+        rc = batch_compare_gfns(d, e->gfn, *cd, e->client_gfn);
+        if ( rc )
+            return rc;
+    }
+
+    return share_pages(d, _gfn(e->gfn), sh, *cd, _gfn(e->client_gfn), ch);
+}
+
+static int batch_op(struct domain *d, struct mem_sharing_op_batch *batch)
+{
+    xen_mem_sharing_batch_entry_t e;
+    struct domain *cd = NULL;
+    unsigned int i;
+    int rc = 0;
+
+    for ( i = batch->opaque; i < batch->nr_entries; i++ )
+    {
+        /* Check for continuation, making progress at least once. */
+        if ( i > batch->opaque && hypercall_preempt_check() )
+        {
+            rc = 1;
+            break;
+        }
+
+        if ( copy_from_guest_offset(&e, batch->entries, i, 1) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        if ( e._pad )
+            e.rc = -EINVAL;
+        else if ( batch->flags & XENMEM_SHARING_BATCH_HASH )
+            e.rc = batch_hash_gfn(d, e.gfn, &e.hash);
+        else
+            e.rc = batch_share_entry(d, &cd, &e, batch->flags);
+
+        if ( __copy_to_guest_offset(batch->entries, i, &e, 1) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        /* Out of memory affects all remaining entries too. */
+        if ( e.rc == -ENOMEM )
+        {
+            rc = -ENOMEM;
+            break;
+        }
+    }
+
+    if ( cd )
+        rcu_unlock_domain(cd);
+
+    batch->opaque = i;
+
+    return rc;
+}
+
 int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
 {
     int rc;
@@ -1489,7 +1683,7 @@ int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
             sh      = mso.u.share.source_handle;
             cgfn    = mso.u.share.client_gfn;
 
-            rc = mem_sharing_add_to_physmap(d, sgfn, sh, cd, cgfn); 
+            rc = mem_sharing_add_to_physmap(d, sgfn, sh, cd, cgfn, false);
 
             rcu_unlock_domain(cd);
         }
@@ -1585,6 +1779,43 @@ int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
         }
         break;
 
+        case XENMEM_sharing_op_batch:
+        {
+            unsigned int flags = mso.u.batch.flags;
+
+            rc = -EINVAL;
+            if ( (flags & ~(XENMEM_SHARING_BATCH_SHARE |
+                            XENMEM_SHARING_BATCH_VERIFY |
+                            XENMEM_SHARING_BATCH_HASH)) ||
+                 ((flags & XENMEM_SHARING_BATCH_HASH) &&
+                  flags != XENMEM_SHARING_BATCH_HASH) ||
+                 ((flags & XENMEM_SHARING_BATCH_VERIFY) &&
+                  !(flags & XENMEM_SHARING_BATCH_SHARE)) )
+                goto out;
+
+            /* As for range sharing, opaque holds the continuation point. */
+            if ( mso.u.batch.opaque > mso.u.batch.nr_entries )
+                goto out;
+
+            if ( !mem_sharing_enabled(d) )
+                goto out;
+
+            rc = batch_op(d, &mso.u.batch);
+
+            if ( rc > 0 )
+            {
+                if ( __copy_to_guest(arg, &mso, 1) )
+                    rc = -EFAULT;
+                else
+                    rc = hypercall_create_continuation(__HYPERVISOR_memory_op,
+                                                       "lh", XENMEM_sharing_op,
+                                                       arg);
+            }
+            else
+                mso.u.batch.opaque = 0;
+        }
+        break;
+
         case XENMEM_sharing_op_debug_gfn:
             rc = debug_gfn(d, _gfn(mso.u.debug.u.gfn));
             break;
@@ -1606,6 +1837,325 @@ out:
     return rc;
 }
 
+/*
+ * VM forks.
+ *
+ * A fork starts out with an empty p2m and a copy of its parent's vcpu and
+ * HVM context.  Holes are filled from the parent the first time the fork
+ * touches them (see __get_gfn_type_access()): reads map the parent's page
+ * shared, writes get a private copy straight away rather than paying for a
+ * nominate followed immediately by an unshare.  Each fork holds a pause
+ * reference on its parent, so the parent's p2m only ever changes type from
+ * RAM to shared underneath us.
+ *
+ * Takes the p2m locks of d and its ancestors, so d's must not be held.
+ */
+int mem_sharing_fork_page(struct domain *d, gfn_t gfn, bool unsharing)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned long gfn_l = gfn_x(gfn);
+    struct domain *parent;
+    struct page_info *page;
+    shr_handle_t handle;
+    p2m_type_t p2mt;
+    p2m_access_t p2ma;
+    mfn_t mfn, new_mfn;
+    int rc;
+
+    if ( !mem_sharing_is_fork(d) || d->is_dying )
+        return -ENOENT;
+
+    ASSERT(!p2m_locked_by_me(p2m));
+
+    /* Find the closest ancestor that has something at gfn. */
+    for ( parent = d->arch.hvm_domain.fork_parent; parent;
+          parent = parent->arch.hvm_domain.fork_parent )
+    {
+        ASSERT(atomic_read(&parent->pause_count));
+        get_gfn_query(parent, gfn_l, &p2mt);
+        put_gfn(parent, gfn_l);
+        if ( !p2m_is_hole(p2mt) )
+            break;
+    }
+
+    if ( !parent )
+        return -ENOENT;
+
+    if ( !unsharing &&
+         !nominate_page(parent, gfn, 0, &handle) &&
+         !mem_sharing_add_to_physmap(parent, gfn_l, handle, d, gfn_l, true) )
+        return 0;
+
+    /*
+     * Writes, and pages that can't be shared (e.g. ones the parent's device
+     * model still has mapped), get a private copy.
+     */
+    mfn = get_gfn_query(parent, gfn_l, &p2mt);
+    if ( !mfn_valid(mfn) || !p2m_is_ram(p2mt) )
+    {
+        put_gfn(parent, gfn_l);
+        return -ENOENT;
+    }
+
+    page = alloc_domheap_page(d, 0);
+    if ( page == NULL )
+    {
+        put_gfn(parent, gfn_l);
+        return -ENOMEM;
+    }
+
+    new_mfn = page_to_mfn(page);
+    copy_domain_page(new_mfn, mfn);
+    put_gfn(parent, gfn_l);
+
+    /* Another vcpu may have populated the gfn while we were copying. */
+    p2m_lock(p2m);
+    p2m->get_entry(p2m, gfn_l, &p2mt, &p2ma, 0, NULL, NULL);
+    rc = p2m_is_hole(p2mt)
+         ? p2m_set_entry(p2m, gfn_l, new_mfn, PAGE_ORDER_4K, p2m_ram_rw,
+                         p2m->default_access)
+         : -EEXIST;
+    if ( !rc )
+        set_gpfn_from_mfn(mfn_x(new_mfn), gfn_l);
+    p2m_unlock(p2m);
+
+    if ( rc )
+    {
+        if ( test_and_clear_bit(_PGC_allocated, &page->count_info) )
+            put_page(page);
+        if ( rc == -EEXIST )
+            rc = 0;
+    }
+
+    return rc;
+}
+
+/* HVM params which are plain values, i.e. have no side effects when set. */
+static const unsigned int fork_params[] = {
+    HVM_PARAM_PAE_ENABLED,
+    HVM_PARAM_TIMER_MODE,
+    HVM_PARAM_HPET_ENABLED,
+    HVM_PARAM_VIRIDIAN,
+    HVM_PARAM_IDENT_PT,
+    HVM_PARAM_VM86_TSS_SIZED,
+    HVM_PARAM_STORE_PFN,
+    HVM_PARAM_CONSOLE_PFN,
+    HVM_PARAM_TRIPLE_FAULT_REASON,
+};
+
+static int fork_shared_info(struct domain *cd, struct domain *d, bool reset)
+{
+    unsigned long gfn = get_gpfn_from_mfn(virt_to_mfn(d->shared_info));
+    int rc = 0;
+
+    /* The guest hasn't mapped its shared info page anywhere. */
+    if ( !VALID_M2P(gfn) )
+        return 0;
+
+    if ( !reset )
+        rc = guest_physmap_add_page(cd, _gfn(gfn),
+                                    _mfn(virt_to_mfn(cd->shared_info)), 0);
+    if ( !rc )
+        copy_page(cd->shared_info, d->shared_info);
+
+    return rc;
+}
+
+static int fork_vcpu_info(struct vcpu *cv, struct vcpu *v)
+{
+    unsigned long gfn;
+    int rc;
+
+    if ( mfn_eq(v->vcpu_info_mfn, INVALID_MFN) )
+        return 0;
+
+    if ( mfn_eq(cv->vcpu_info_mfn, INVALID_MFN) )
+    {
+        /*
+         * Xen keeps a writable type reference on the vcpu_info page, which
+         * a shared page can't have, so populate it privately up front.
+         */
+        gfn = get_gpfn_from_mfn(mfn_x(v->vcpu_info_mfn));
+        rc = mem_sharing_fork_page(cv->domain, _gfn(gfn), true);
+        if ( !rc )
+            rc = map_vcpu_info(cv, gfn,
+                               (unsigned long)v->vcpu_info & ~PAGE_MASK);
+        if ( rc )
+            return rc;
+    }
+
+    copy_domain_page(cv->vcpu_info_mfn, v->vcpu_info_mfn);
+
+    return 0;
+}
+
+static int fork_hvm_context(struct domain *cd, struct domain *d)
+{
+    struct hvm_domain_context c = { .size = hvm_save_size(d) };
+    int rc;
+
+    if ( (c.data = xmalloc_bytes(c.size)) == NULL )
+        return -ENOMEM;
+
+    rc = hvm_save(d, &c);
+    if ( !rc )
+    {
+        c.size = c.cur;
+        c.cur = 0;
+        rc = hvm_load(cd, &c) ? -EINVAL : 0;
+    }
+
+    xfree(c.data);
+
+    return rc;
+}
+
+/* Make cd's vcpu and HVM state a copy of d's.  cd must be paused. */
+static int fork_settings(struct domain *cd, struct domain *d, bool reset)
+{
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < ARRAY_SIZE(fork_params); i++ )
+        cd->arch.hvm_domain.params[fork_params[i]] =
+            d->arch.hvm_domain.params[fork_params[i]];
+    cd->arch.x87_fip_width = d->arch.x87_fip_width;
+
+    rc = fork_shared_info(cd, d, reset);
+    if ( rc )
+        return rc;
+
+    /* Must precede the HVM context load, which brings the vcpus up. */
+    for ( i = 0; i < d->max_vcpus; i++ )
+    {
+        rc = fork_vcpu_info(cd->vcpu[i], d->vcpu[i]);
+        if ( rc )
+            return rc;
+    }
+
+    return fork_hvm_context(cd, d);
+}
+
+static int mem_sharing_fork(struct domain *d, struct domain *pd)
+{
+    struct domain *p;
+    unsigned int i;
+    int rc;
+
+    if ( d == pd || pd->is_dying || !is_hvm_domain(pd) || !hap_enabled(pd) )
+        return -EINVAL;
+
+    /*
+     * A parent forked from d, directly or not, would close a loop of
+     * fork_parent links, which mem_sharing_fork_page() walks to the end.
+     */
+    for ( p = pd->arch.hvm_domain.fork_parent; p;
+          p = p->arch.hvm_domain.fork_parent )
+        if ( p == d )
+            return -EINVAL;
+
+    if ( unlikely(need_iommu(d) || need_iommu(pd)) )
+        return -EXDEV;
+
+    /*
+     * The parent's memory must not change under its forks: the toolstack
+     * pauses it first, and each fork keeps it paused until it's destroyed.
+     */
+    if ( !pd->controller_pause_count )
+        return -EBUSY;
+
+    if ( mem_sharing_is_fork(d) || d->tot_pages )
+        return -EEXIST;
+
+    if ( d->max_vcpus != pd->max_vcpus )
+        return -EINVAL;
+
+    for ( i = 0; i < d->max_vcpus; i++ )
+        if ( !d->vcpu[i] || !pd->vcpu[i] )
+            return -EINVAL;
+
+    d->arch.hvm_domain.mem_sharing_enabled = 1;
+    pd->arch.hvm_domain.mem_sharing_enabled = 1;
+
+    /* Both dropped in hvm_domain_destroy(). */
+    get_knownalive_domain(pd);
+    domain_pause(pd);
+    d->arch.hvm_domain.fork_parent = pd;
+
+    domain_pause(d);
+    rc = fork_settings(d, pd, false);
+    domain_unpause(d);
+
+    /*
+     * Leave the fork in place on failure: it may already share pages with
+     * the parent.  The toolstack is expected to destroy it.
+     */
+    return rc;
+}
+
+/*
+ * Drop every page the fork has populated privately, then reload vcpu and
+ * HVM state from the parent.  Pages Xen holds a type reference on (the
+ * vcpu_info pages) are kept and refreshed in place.  Preemptible: the
+ * page list walk simply starts over on continuation.
+ */
+static int mem_sharing_fork_reset(struct domain *d)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    struct page_info *page, *tmp;
+    unsigned long count = 0;
+    int rc = 0;
+
+    if ( !mem_sharing_is_fork(d) )
+        return -EINVAL;
+
+    domain_pause(d);
+
+    p2m_lock(p2m);
+    spin_lock_recursive(&d->page_alloc_lock);
+
+    page_list_for_each_safe ( page, tmp, &d->page_list )
+    {
+        mfn_t mfn = page_to_mfn(page);
+        unsigned long gfn = get_gpfn_from_mfn(mfn_x(mfn));
+        p2m_type_t p2mt;
+        p2m_access_t p2ma;
+
+        if ( (page->u.inuse.type_info & PGT_count_mask) || !VALID_M2P(gfn) )
+            continue;
+
+        if ( !mfn_eq(p2m->get_entry(p2m, gfn, &p2mt, &p2ma, 0, NULL, NULL),
+                     mfn) ||
+             !p2m_is_sharable(p2mt) )
+            continue;
+
+        rc = p2m_set_entry(p2m, gfn, INVALID_MFN, PAGE_ORDER_4K, p2m_invalid,
+                           p2m->default_access);
+        if ( rc )
+            break;
+
+        set_gpfn_from_mfn(mfn_x(mfn), INVALID_M2P_ENTRY);
+        if ( test_and_clear_bit(_PGC_allocated, &page->count_info) )
+            put_page(page);
+
+        if ( !(++count & 0xfff) && hypercall_preempt_check() )
+        {
+            rc = -ERESTART;
+            break;
+        }
+    }
+
+    spin_unlock_recursive(&d->page_alloc_lock);
+    p2m_unlock(p2m);
+
+    if ( !rc )
+        rc = fork_settings(d, d->arch.hvm_domain.fork_parent, true);
+
+    domain_unpause(d);
+
+    return rc;
+}
+
 int mem_sharing_domctl(struct domain *d, xen_domctl_mem_sharing_op_t *mec)
 {
     int rc;
@@ -1626,6 +2176,33 @@ int mem_sharing_domctl(struct domain *d, xen_domctl_mem_sharing_op_t *mec)
         }
         break;
 
+        case XEN_DOMCTL_MEM_SHARING_FORK:
+        {
+            struct domain *pd;
+
+            rc = -EINVAL;
+            if ( mec->u.fork.pad[0] || mec->u.fork.pad[1] ||
+                 mec->u.fork.pad[2] )
+                break;
+
+            rc = rcu_lock_live_remote_domain_by_id(mec->u.fork.parent_domain,
+                                                   &pd);
+            if ( rc )
+                break;
+
+            rc = xsm_mem_sharing_op(XSM_DM_PRIV, pd, d,
+                                    XENMEM_sharing_op_share);
+            if ( !rc )
+                rc = mem_sharing_fork(d, pd);
+
+            rcu_unlock_domain(pd);
+        }
+        break;
+
+        case XEN_DOMCTL_MEM_SHARING_FORK_RESET:
+            rc = mem_sharing_fork_reset(d);
+            break;
+
         default:
             rc = -ENOSYS;
     }
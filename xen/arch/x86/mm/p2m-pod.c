@@ -60,6 +60,23 @@ static inline void unlock_page_alloc(struct p2m_domain *p2m)
  * Populate-on-demand functionality
  */
 
+static void p2m_pod_background_sweep(unsigned long data);
+
+void p2m_pod_init(struct p2m_domain *p2m)
+{
+    unsigned int i;
+
+    mm_lock_init(&p2m->pod.lock);
+    INIT_PAGE_LIST_HEAD(&p2m->pod.super);
+    INIT_PAGE_LIST_HEAD(&p2m->pod.single);
+
+    for ( i = 0; i < ARRAY_SIZE(p2m->pod.mrp.list); ++i )
+        p2m->pod.mrp.list[i] = gfn_x(INVALID_GFN);
+
+    tasklet_init(&p2m->pod.sweep_tasklet, p2m_pod_background_sweep,
+                 (unsigned long)p2m);
+}
+
 static int
 p2m_pod_cache_add(struct p2m_domain *p2m,
                   struct page_info *page,
@@ -381,6 +398,7 @@ int p2m_pod_empty_cache(struct domain *d)
     /* After this barrier no new PoD activities can happen. */
     BUG_ON(!d->is_dying);
     spin_barrier(&p2m->pod.lock.lock);
+    tasklet_kill(&p2m->pod.sweep_tasklet);
 
     lock_page_alloc(p2m);
 
@@ -773,14 +791,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     for ( i=0; i < SUPERPAGE_PAGES; i++ )
     {
         map = map_domain_page(_mfn(mfn_x(mfn0) + i));
-
-        for ( j=0; j<PAGE_SIZE/sizeof(*map); j++ )
-            if( *(map+j) != 0 )
-            {
-                reset = 1;
-                break;
-            }
-
+        reset = !page_is_zero(map);
         unmap_domain_page(map);
 
         if ( reset )
@@ -891,18 +902,18 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
     /* Now check each page for real */
     for ( i=0; i < count; i++ )
     {
+        bool zero;
+
         if(!map[i])
             continue;
 
-        for ( j=0; j<PAGE_SIZE/sizeof(*map[i]); j++ )
-            if( *(map[i]+j) != 0 )
-                break;
+        zero = page_is_zero(map[i]);
 
         unmap_domain_page(map[i]);
 
         /* See comment in p2m_pod_zero_check_superpage() re gnttab
          * check timing.  */
-        if ( j < PAGE_SIZE/sizeof(*map[i]) )
+        if ( !zero )
         {
             p2m_set_entry(p2m, gfns[i], mfns[i], PAGE_ORDER_4K,
                 types[i], p2m->default_access);
@@ -985,6 +996,122 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
 
 }
 
+/*
+ * Background sweeping.  Once the cache drops below POD_SWEEP_LOW pages while
+ * PoD entries remain outstanding, a tasklet walks the p2m downwards in 2M
+ * steps reclaiming zero pages until POD_SWEEP_HIGH pages are cached.  Unlike
+ * the emergency sweep it never shatters a superpage mapping: 2M mappings are
+ * only reclaimed whole, and 4k checks are confined to ranges which are
+ * already mapped with 4k pages.
+ */
+#define POD_SWEEP_LOW      (4 * SUPERPAGE_PAGES)
+#define POD_SWEEP_HIGH     (16 * SUPERPAGE_PAGES)
+#define POD_SWEEP_BUDGET   16 /* 2M ranges per tasklet run */
+#define POD_SWEEP_BACKOFF  MILLISECS(100)
+
+/* Reclaim zero 4k pages in the 2M range at gfn, if it is 4k mapped. */
+static void
+p2m_pod_sweep_singles(struct p2m_domain *p2m, unsigned long gfn)
+{
+    unsigned long gfns[POD_SWEEP_STRIDE], end = gfn + SUPERPAGE_PAGES;
+    unsigned int j = 0;
+
+    for ( ; gfn < end; gfn++ )
+    {
+        p2m_access_t a;
+        p2m_type_t t;
+        unsigned int cur_order;
+
+        (void)p2m->get_entry(p2m, gfn, &t, &a, 0, &cur_order, NULL);
+
+        /* Larger entries cover the whole range; leave them alone. */
+        if ( cur_order )
+            break;
+
+        if ( !p2m_is_ram(t) )
+            continue;
+
+        gfns[j++] = gfn;
+        if ( j == POD_SWEEP_STRIDE )
+        {
+            p2m_pod_zero_check(p2m, gfns, j);
+            j = 0;
+        }
+    }
+
+    if ( j )
+        p2m_pod_zero_check(p2m, gfns, j);
+}
+
+static void p2m_pod_background_sweep(unsigned long data)
+{
+    struct p2m_domain *p2m = (void *)data;
+    unsigned long gfn;
+    long before;
+    unsigned int n;
+    bool again = false;
+
+    p2m_lock(p2m);
+    pod_lock(p2m);
+
+    if ( unlikely(p2m->domain->is_dying) )
+        goto out;
+
+    for ( n = 0; n < POD_SWEEP_BUDGET; n++ )
+    {
+        if ( p2m->pod.count >= POD_SWEEP_HIGH ||
+             p2m->pod.entry_count <= p2m->pod.count )
+            goto out;
+
+        if ( p2m->pod.reclaim_super == 0 )
+        {
+            /* Start a new pass from the top of the guest's memory. */
+            if ( NOW() < p2m->pod.sweep_resume )
+                goto out;
+            p2m->pod.reclaim_super =
+                (p2m->pod.max_guest | (SUPERPAGE_PAGES - 1)) + 1;
+            p2m->pod.sweep_reclaimed = 0;
+        }
+
+        gfn = p2m->pod.reclaim_super -= SUPERPAGE_PAGES;
+
+        before = p2m->pod.count;
+        if ( p2m_pod_zero_check_superpage(p2m, gfn) == 0 )
+            p2m_pod_sweep_singles(p2m, gfn);
+        p2m->pod.sweep_reclaimed += p2m->pod.count - before;
+
+        /* Hold off the next pass if this one found nothing. */
+        if ( gfn == 0 && p2m->pod.sweep_reclaimed == 0 )
+            p2m->pod.sweep_resume = NOW() + POD_SWEEP_BACKOFF;
+    }
+
+    again = true;
+
+ out:
+    pod_unlock(p2m);
+    p2m_unlock(p2m);
+
+    /* Requeue rather than loop, to bound p2m lock hold times. */
+    if ( again )
+        tasklet_schedule(&p2m->pod.sweep_tasklet);
+}
+
+/* Must be called w/ pod lock held. */
+static void pod_kick_background_sweep(struct p2m_domain *p2m)
+{
+    ASSERT(pod_locked_by_me(p2m));
+
+    if ( p2m->pod.count >= POD_SWEEP_LOW ||
+         p2m->pod.entry_count <= p2m->pod.count )
+        return;
+
+    /* The last pass found nothing: don't rescan straight away. */
+    if ( p2m->pod.reclaim_super == 0 && NOW() < p2m->pod.sweep_resume )
+        return;
+
+    tasklet_schedule(&p2m->pod.sweep_tasklet);
+}
+
 static void pod_eager_reclaim(struct p2m_domain *p2m)
 {
     struct pod_mrp_list *mrp = &p2m->pod.mrp;
@@ -1089,6 +1216,9 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
     if ( p2m->pod.count == 0 )
         goto out_of_memory;
 
+    /* Refill the cache in the background before it runs dry again. */
+    pod_kick_background_sweep(p2m);
+
     /* Keep track of the highest gfn demand-populated by a guest fault */
     if ( gfn > p2m->pod.max_guest )
         p2m->pod.max_guest = gfn;
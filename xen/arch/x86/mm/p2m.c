@@ -58,15 +58,11 @@ DEFINE_PERCPU_RWLOCK_GLOBAL(p2m_percpu_rwlock);
 /* Init the datastructures for later use by the p2m code */
 static int p2m_initialise(struct domain *d, struct p2m_domain *p2m)
 {
-    unsigned int i;
     int ret = 0;
 
     mm_rwlock_init(&p2m->lock);
-    mm_lock_init(&p2m->pod.lock);
     INIT_LIST_HEAD(&p2m->np2m_list);
     INIT_PAGE_LIST_HEAD(&p2m->pages);
-    INIT_PAGE_LIST_HEAD(&p2m->pod.super);
-    INIT_PAGE_LIST_HEAD(&p2m->pod.single);
 
     p2m->domain = d;
     p2m->default_access = p2m_access_rwx;
@@ -74,8 +70,7 @@ static int p2m_initialise(struct domain *d, struct p2m_domain *p2m)
 
     p2m->np2m_base = P2M_BASE_EADDR;
 
-    for ( i = 0; i < ARRAY_SIZE(p2m->pod.mrp.list); ++i )
-        p2m->pod.mrp.list[i] = gfn_x(INVALID_GFN);
+    p2m_pod_init(p2m);
 
     if ( hap_enabled(d) && cpu_has_vmx )
         ret = ept_p2m_init(p2m);
@@ -110,6 +105,7 @@ free_p2m:
 
 static void p2m_free_one(struct p2m_domain *p2m)
 {
+    tasklet_kill(&p2m->pod.sweep_tasklet);
     if ( hap_enabled(p2m->domain) && cpu_has_vmx )
         ept_p2m_uninit(p2m);
     free_cpumask_var(p2m->dirty_cpumask);
@@ -439,6 +435,27 @@ mfn_t __get_gfn_type_access(struct p2m_domain *p2m, unsigned long gfn,
 
     mfn = p2m->get_entry(p2m, gfn, t, a, q, page_order, NULL);
 
+    /*
+     * A VM fork populates its holes from the parent on first access.  That
+     * takes the parent's p2m lock, and sharing ops take the two in domid
+     * order, so it must not run under ours: drop it, populate, and look
+     * again.  If the caller holds the lock as well, leave the hole be.
+     */
+    if ( (q & P2M_ALLOC) && p2m_is_hole(*t) && p2m_is_hostp2m(p2m) &&
+         mem_sharing_is_fork(p2m->domain) )
+    {
+        if ( locked )
+            gfn_unlock(p2m, gfn, 0);
+
+        if ( !p2m_locked_by_me(p2m) )
+            mem_sharing_fork_page(p2m->domain, _gfn(gfn), q & P2M_UNSHARE);
+
+        if ( locked )
+            gfn_lock(p2m, gfn, 0);
+
+        mfn = p2m->get_entry(p2m, gfn, t, a, q, page_order, NULL);
+    }
+
     if ( (q & P2M_UNSHARE) && p2m_is_shared(*t) )
     {
         ASSERT(p2m_is_hostp2m(p2m));
@@ -74,6 +74,42 @@ int compat_oprof_arch_counter(XEN_GUEST_HANDLE_PARAM(void) arg)
     return 0;
 }
 
+int xenoprof_arch_sampler_counter(unsigned int event, unsigned int unit_mask,
+                                  unsigned int count)
+{
+    if ( !event )
+    {
+        /* Unhalted core cycles */
+        switch ( boot_cpu_data.x86_vendor )
+        {
+        case X86_VENDOR_INTEL:
+            /* The P4 model numbers its events differently. */
+            if ( boot_cpu_data.x86 == 0xf )
+                return -EOPNOTSUPP;
+            event = 0x3c;
+            break;
+        case X86_VENDOR_AMD:
+            event = 0x76;
+            break;
+        default:
+            return -EOPNOTSUPP;
+        }
+        unit_mask = 0;
+    }
+
+    memset(counter_config, 0, sizeof(*counter_config) * OP_MAX_COUNTER);
+    memset(&ibs_config, 0, sizeof(ibs_config));
+
+    counter_config[0].count     = count;
+    counter_config[0].enabled   = 1;
+    counter_config[0].event     = event;
+    counter_config[0].kernel    = 1;
+    counter_config[0].user      = 1;
+    counter_config[0].unit_mask = unit_mask;
+
+    return 0;
+}
+
 int xenoprofile_get_mode(struct vcpu *curr, const struct cpu_user_regs *regs)
 {
     if ( !guest_mode(regs) )
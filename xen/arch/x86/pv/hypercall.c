@@ -21,6 +21,7 @@
 
 #include <xen/compiler.h>
 #include <xen/hypercall.h>
+#include <xen/lat_hist.h>
 #include <xen/trace.h>
 
 #define HYPERCALL(x)                                                \
@@ -91,6 +92,7 @@ void pv_hypercall(struct cpu_user_regs *regs)
 {
     struct vcpu *curr = current;
     unsigned long eax;
+    s_time_t lat_start;
 
     ASSERT(guest_kernel_mode(curr, regs));
 
@@ -106,6 +108,7 @@ void pv_hypercall(struct cpu_user_regs *regs)
         return;
     }
 
+    lat_start = lat_hist_start();
     curr->hcall_preempted = false;
 
     if ( !is_pv_32bit_vcpu(curr) )
@@ -212,6 +215,7 @@ void pv_hypercall(struct cpu_user_regs *regs)
     if ( curr->hcall_preempted )
         regs->rip -= 2;
 
+    lat_hist_hypercall(curr, eax, lat_start);
     perfc_incr(hypercalls);
 }
 
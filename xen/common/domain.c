@@ -41,6 +41,7 @@
 #include <xsm/xsm.h>
 #include <xen/trace.h>
 #include <xen/tmem.h>
+#include <xen/lat_hist.h>
 #include <asm/setup.h>
 
 /* Linux config option: propageted to domain0 */
@@ -142,7 +143,8 @@ struct vcpu *alloc_vcpu(
          !zalloc_cpumask_var(&v->cpu_hard_affinity_tmp) ||
          !zalloc_cpumask_var(&v->cpu_hard_affinity_saved) ||
          !zalloc_cpumask_var(&v->cpu_soft_affinity) ||
-         !zalloc_cpumask_var(&v->vcpu_dirty_cpumask) )
+         !zalloc_cpumask_var(&v->vcpu_dirty_cpumask) ||
+         lat_hist_init_vcpu(v) )
         goto fail_free;
 
     if ( is_idle_domain(d) )
@@ -172,6 +174,7 @@ struct vcpu *alloc_vcpu(
         free_cpumask_var(v->cpu_hard_affinity_saved);
         free_cpumask_var(v->cpu_soft_affinity);
         free_cpumask_var(v->vcpu_dirty_cpumask);
+        lat_hist_destroy_vcpu(v);
         free_vcpu_struct(v);
         return NULL;
     }
@@ -831,6 +834,7 @@ static void complete_domain_destroy(struct rcu_head *head)
             free_cpumask_var(v->cpu_hard_affinity_saved);
             free_cpumask_var(v->cpu_soft_affinity);
             free_cpumask_var(v->vcpu_dirty_cpumask);
+            lat_hist_destroy_vcpu(v);
             free_vcpu_struct(v);
         }
 
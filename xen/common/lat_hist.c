@@ -0,0 +1,265 @@
+/******************************************************************************
+ * common/lat_hist.c
+ *
+ * Log2 histograms of the time Xen spends handling hypercalls and vmexits.
+ *
+ * Cheap enough to leave on: an event costs two NOW()s and two increments
+ * of memory owned by the current pcpu or vcpu, with no locks or atomics.
+ * Host-wide histograms, per hypercall number and per exit reason, live in
+ * per-cpu memory; per-domain ones live with each vcpu.  Both are summed
+ * when read, so a read may miss increments which race with it, as may a
+ * reset.
+ *
+ * The counts of a pcpu are dropped when it is taken offline.
+ */
+
+#include <xen/lib.h>
+#include <xen/cpu.h>
+#include <xen/errno.h>
+#include <xen/guest_access.h>
+#include <xen/init.h>
+#include <xen/lat_hist.h>
+#include <xen/percpu.h>
+#include <xen/sched.h>
+#include <xen/spinlock.h>
+#include <xen/xmalloc.h>
+
+struct lat_hist_cpu {
+    uint64_t hypercall[XEN_LAT_HIST_HYPERCALLS][XEN_LAT_HIST_BUCKETS];
+    uint64_t exit[XEN_LAT_HIST_EXITS][XEN_LAT_HIST_BUCKETS];
+};
+
+bool __read_mostly lat_hist_enabled;
+boolean_param("lat-hist", lat_hist_enabled);
+
+static DEFINE_PER_CPU_READ_MOSTLY(struct lat_hist_cpu *, lat_hist);
+
+/* Serialises readers and resets against pcpus going away. */
+static DEFINE_SPINLOCK(lat_hist_lock);
+
+static unsigned int lat_hist_bucket(s_time_t ns)
+{
+    unsigned int b;
+
+    if ( ns <= 1 )
+        return 0;
+
+    b = flsl(ns) - 1;
+
+    return min(b, XEN_LAT_HIST_BUCKETS - 1U);
+}
+
+void lat_hist_record(struct vcpu *v, unsigned int kind, unsigned int nr,
+                     s_time_t start)
+{
+    struct lat_hist_cpu *c = this_cpu(lat_hist);
+    unsigned int b = lat_hist_bucket(NOW() - start);
+
+    if ( c )
+    {
+        if ( kind == XEN_LAT_HIST_HYPERCALL )
+            c->hypercall[nr][b]++;
+        else
+            c->exit[nr][b]++;
+    }
+
+    if ( v->lat_hist )
+        v->lat_hist->hist[kind][b]++;
+}
+
+int lat_hist_init_vcpu(struct vcpu *v)
+{
+    if ( is_idle_vcpu(v) )
+        return 0;
+
+    v->lat_hist = xzalloc(struct lat_hist_vcpu);
+
+    return v->lat_hist ? 0 : -ENOMEM;
+}
+
+void lat_hist_destroy_vcpu(struct vcpu *v)
+{
+    xfree(v->lat_hist);
+    v->lat_hist = NULL;
+}
+
+static void lat_hist_reset(void)
+{
+    struct domain *d;
+    struct vcpu *v;
+    unsigned int cpu;
+
+    spin_lock(&lat_hist_lock);
+    for_each_online_cpu ( cpu )
+        if ( per_cpu(lat_hist, cpu) )
+            memset(per_cpu(lat_hist, cpu), 0, sizeof(struct lat_hist_cpu));
+    spin_unlock(&lat_hist_lock);
+
+    rcu_read_lock(&domlist_read_lock);
+    for_each_domain ( d )
+        for_each_vcpu ( d, v )
+            if ( v->lat_hist )
+                memset(v->lat_hist, 0, sizeof(*v->lat_hist));
+    rcu_read_unlock(&domlist_read_lock);
+}
+
+static int lat_hist_query_xen(struct xen_sysctl_lat_hist_op *op)
+{
+    uint64_t sum[XEN_LAT_HIST_BUCKETS];
+    unsigned int i, b, cpu;
+    int rc = 0;
+
+    op->nr_hists = min_t(uint32_t, op->nr_hists,
+                         XEN_LAT_HIST_HYPERCALLS + XEN_LAT_HIST_EXITS);
+
+    spin_lock(&lat_hist_lock);
+
+    for ( i = 0; i < op->nr_hists && !rc; i++ )
+    {
+        memset(sum, 0, sizeof(sum));
+
+        for_each_online_cpu ( cpu )
+        {
+            const struct lat_hist_cpu *c = per_cpu(lat_hist, cpu);
+            const uint64_t *h;
+
+            if ( !c )
+                continue;
+
+            h = i < XEN_LAT_HIST_HYPERCALLS
+                ? c->hypercall[i] : c->exit[i - XEN_LAT_HIST_HYPERCALLS];
+            for ( b = 0; b < XEN_LAT_HIST_BUCKETS; b++ )
+                sum[b] += h[b];
+        }
+
+        if ( copy_to_guest_offset(op->hist, i * XEN_LAT_HIST_BUCKETS,
+                                  sum, XEN_LAT_HIST_BUCKETS) )
+            rc = -EFAULT;
+    }
+
+    spin_unlock(&lat_hist_lock);
+
+    op->nr_hists = XEN_LAT_HIST_HYPERCALLS + XEN_LAT_HIST_EXITS;
+
+    return rc;
+}
+
+static int lat_hist_query_domain(struct xen_sysctl_lat_hist_op *op)
+{
+    uint64_t sum[XEN_LAT_HIST_NR_KINDS][XEN_LAT_HIST_BUCKETS] = { };
+    struct domain *d = rcu_lock_domain_by_id(op->domid);
+    const struct vcpu *v;
+    unsigned int k, b;
+    int rc = 0;
+
+    if ( !d )
+        return -ESRCH;
+
+    for_each_vcpu ( d, v )
+        if ( v->lat_hist )
+            for ( k = 0; k < XEN_LAT_HIST_NR_KINDS; k++ )
+                for ( b = 0; b < XEN_LAT_HIST_BUCKETS; b++ )
+                    sum[k][b] += v->lat_hist->hist[k][b];
+
+    rcu_unlock_domain(d);
+
+    k = min_t(uint32_t, op->nr_hists, XEN_LAT_HIST_NR_KINDS);
+    if ( k && copy_to_guest(op->hist, &sum[0][0], k * XEN_LAT_HIST_BUCKETS) )
+        rc = -EFAULT;
+
+    op->nr_hists = XEN_LAT_HIST_NR_KINDS;
+
+    return rc;
+}
+
+int lat_hist_control(struct xen_sysctl_lat_hist_op *op)
+{
+    int rc = 0;
+
+    switch ( op->cmd )
+    {
+    case XEN_SYSCTL_LAT_HIST_query:
+        if ( guest_handle_is_null(op->hist) )
+            op->nr_hists = 0;
+        if ( op->domid == DOMID_XEN )
+            rc = lat_hist_query_xen(op);
+        else
+            rc = lat_hist_query_domain(op);
+        break;
+
+    case XEN_SYSCTL_LAT_HIST_reset:
+        lat_hist_reset();
+        break;
+
+    case XEN_SYSCTL_LAT_HIST_enable:
+        lat_hist_enabled = true;
+        break;
+
+    case XEN_SYSCTL_LAT_HIST_disable:
+        lat_hist_enabled = false;
+        break;
+
+    default:
+        rc = -EINVAL;
+        break;
+    }
+
+    op->enabled = lat_hist_enabled;
+
+    return rc;
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct lat_hist_cpu *c;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        /* Without it, the pcpu only counts towards domains' histograms. */
+        if ( !per_cpu(lat_hist, cpu) )
+            per_cpu(lat_hist, cpu) = xzalloc(struct lat_hist_cpu);
+        break;
+
+    case CPU_DEAD:
+    case CPU_UP_CANCELED:
+        spin_lock(&lat_hist_lock);
+        c = per_cpu(lat_hist, cpu);
+        per_cpu(lat_hist, cpu) = NULL;
+        spin_unlock(&lat_hist_lock);
+        xfree(c);
+        break;
+
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static int __init lat_hist_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&cpu_nfb);
+
+    return 0;
+}
+presmp_initcall(lat_hist_init);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,6 +1,8 @@
 #include <xen/lib.h>
+#include <xen/init.h>
 #include <xen/irq.h>
 #include <xen/smp.h>
+#include <xen/symbols.h>
 #include <xen/time.h>
 #include <xen/spinlock.h>
 #include <xen/guest_access.h>
@@ -86,23 +88,65 @@ void spin_debug_disable(void)
 
 #ifdef CONFIG_LOCK_PROFILE
 
+static bool __read_mostly lock_profile_enabled = true;
+boolean_param("lock-profile", lock_profile_enabled);
+
+/*
+ * Account a wait of the given length for the lock, from the given call site
+ * (if not NULL).  Callers normally hold the lock, which serialises updates.
+ *
+ * Only LOCKPROF_CALLERS call sites are tracked per lock: one not yet known
+ * replaces the one with the fewest waits and takes over its counts, which
+ * keeps the most contending ones while overestimating rare ones.
+ */
+static void lock_profile_block(struct lock_profile *prof, s_time_t wait,
+                               const void *pc)
+{
+    struct lock_profile_caller *c, *victim = &prof->callers[0];
+    unsigned int b = wait > 1 ? flsl(wait) - 1 : 0;
+
+    prof->time_block += wait;
+    prof->block_cnt++;
+    prof->block_hist[min(b, LOCKPROF_HIST_BUCKETS - 1U)]++;
+
+    if ( !pc )
+        return;
+
+    for ( c = prof->callers; c < prof->callers + LOCKPROF_CALLERS; c++ )
+    {
+        if ( c->pc == pc )
+            break;
+        if ( c->block_cnt < victim->block_cnt )
+            victim = c;
+    }
+    if ( c == prof->callers + LOCKPROF_CALLERS )
+    {
+        c = victim;
+        c->pc = pc;
+    }
+
+    c->time_block += wait;
+    c->block_cnt++;
+}
+
 #define LOCK_PROFILE_REL                                                     \
-    if (lock->profile)                                                       \
+    if ( lock->profile && lock->profile->time_locked )                       \
     {                                                                        \
         lock->profile->time_hold += NOW() - lock->profile->time_locked;      \
+        lock->profile->time_locked = 0;                                      \
         lock->profile->lock_cnt++;                                           \
     }
 #define LOCK_PROFILE_VAR    s_time_t block = 0
-#define LOCK_PROFILE_BLOCK  block = block ? : NOW();
-#define LOCK_PROFILE_GOT                                                     \
-    if (lock->profile)                                                       \
+#define LOCK_PROFILE_BLOCK                                                   \
+    if ( !block && lock_profile_enabled )                                    \
+        block = NOW();
+#define LOCK_PROFILE_GOT(caller)                                             \
+    if ( lock->profile && lock_profile_enabled )                             \
     {                                                                        \
         lock->profile->time_locked = NOW();                                  \
-        if (block)                                                           \
-        {                                                                    \
-            lock->profile->time_block += lock->profile->time_locked - block; \
-            lock->profile->block_cnt++;                                      \
-        }                                                                    \
+        if ( block )                                                         \
+            lock_profile_block(lock->profile,                                \
+                               lock->profile->time_locked - block, caller);  \
     }
 
 #else
@@ -110,7 +154,7 @@ void spin_debug_disable(void)
 #define LOCK_PROFILE_REL
 #define LOCK_PROFILE_VAR
 #define LOCK_PROFILE_BLOCK
-#define LOCK_PROFILE_GOT
+#define LOCK_PROFILE_GOT(caller)
 
 #endif
 
@@ -129,7 +173,9 @@ static always_inline u16 observe_head(spinlock_tickets_t *t)
     return read_atomic(&t->head);
 }
 
-void _spin_lock(spinlock_t *lock)
+/* caller is the call site of the spin_lock*() accounted for any wait. */
+static always_inline void spin_lock_common(spinlock_t *lock,
+                                           const void *caller)
 {
     spinlock_tickets_t tickets = SPINLOCK_TICKET_INC;
     LOCK_PROFILE_VAR;
@@ -142,16 +188,21 @@ void _spin_lock(spinlock_t *lock)
         LOCK_PROFILE_BLOCK;
         arch_lock_relax();
     }
-    LOCK_PROFILE_GOT;
+    LOCK_PROFILE_GOT(caller);
     preempt_disable();
     arch_lock_acquire_barrier();
 }
 
+void _spin_lock(spinlock_t *lock)
+{
+    spin_lock_common(lock, __builtin_return_address(0));
+}
+
 void _spin_lock_irq(spinlock_t *lock)
 {
     ASSERT(local_irq_is_enabled());
     local_irq_disable();
-    _spin_lock(lock);
+    spin_lock_common(lock, __builtin_return_address(0));
 }
 
 unsigned long _spin_lock_irqsave(spinlock_t *lock)
@@ -159,7 +210,7 @@ unsigned long _spin_lock_irqsave(spinlock_t *lock)
     unsigned long flags;
 
     local_irq_save(flags);
-    _spin_lock(lock);
+    spin_lock_common(lock, __builtin_return_address(0));
     return flags;
 }
 
@@ -212,7 +263,7 @@ int _spin_trylock(spinlock_t *lock)
                  old.head_tail, new.head_tail) != old.head_tail )
         return 0;
 #ifdef CONFIG_LOCK_PROFILE
-    if (lock->profile)
+    if ( lock->profile && lock_profile_enabled )
         lock->profile->time_locked = NOW();
 #endif
     preempt_disable();
@@ -227,7 +278,7 @@ void _spin_barrier(spinlock_t *lock)
 {
     spinlock_tickets_t sample;
 #ifdef CONFIG_LOCK_PROFILE
-    s_time_t block = NOW();
+    s_time_t block = lock_profile_enabled ? NOW() : 0;
 #endif
 
     check_barrier(&lock->debug);
@@ -238,11 +289,9 @@ void _spin_barrier(spinlock_t *lock)
         while ( observe_head(&lock->tickets) == sample.head )
             arch_lock_relax();
 #ifdef CONFIG_LOCK_PROFILE
-        if ( lock->profile )
-        {
-            lock->profile->time_block += NOW() - block;
-            lock->profile->block_cnt++;
-        }
+        /* Not holding the lock, so don't touch the call sites. */
+        if ( lock->profile && block )
+            lock_profile_block(lock->profile, NOW() - block, NULL);
 #endif
     }
     smp_mb();
@@ -277,7 +326,7 @@ void _spin_lock_recursive(spinlock_t *lock)
 
     if ( likely(lock->recurse_cpu != cpu) )
     {
-        _spin_lock(lock);
+        spin_lock_common(lock, __builtin_return_address(0));
         lock->recurse_cpu = cpu;
     }
 
@@ -330,6 +379,8 @@ static void spinlock_profile_iterate(lock_profile_subfunc *sub, void *par)
 static void spinlock_profile_print_elem(struct lock_profile *data,
     int32_t type, int32_t idx, void *par)
 {
+    unsigned int i;
+
     if ( type == LOCKPROF_TYPE_GLOBAL )
         printk("%s %s:\n", lock_profile_ancs[type].name, data->name);
     else
@@ -338,6 +389,22 @@ static void spinlock_profile_print_elem(struct lock_profile *data,
            data->lock_cnt, (u32)(data->time_hold >> 32), (u32)data->time_hold,
            data->block_cnt, (u32)(data->time_block >> 32),
            (u32)data->time_block);
+
+    if ( !data->block_cnt )
+        return;
+
+    printk("  waits by log2(ns):");
+    for ( i = 0; i < LOCKPROF_HIST_BUCKETS; i++ )
+        if ( data->block_hist[i] )
+            printk(" %u:%"PRIu64, i, data->block_hist[i]);
+    printk("\n");
+
+    for ( i = 0; i < LOCKPROF_CALLERS; i++ )
+        if ( data->callers[i].pc )
+            printk("  %12"PRIu64"(%08X:%08X) from %pS\n",
+                   data->callers[i].block_cnt,
+                   (u32)(data->callers[i].time_block >> 32),
+                   (u32)data->callers[i].time_block, data->callers[i].pc);
 }
 
 void spinlock_profile_printall(unsigned char key)
@@ -347,8 +414,8 @@ void spinlock_profile_printall(unsigned char key)
 
     diff = now - lock_profile_start;
     printk("Xen lock profile info SHOW  (now = %08X:%08X, "
-        "total = %08X:%08X)\n", (u32)(now>>32), (u32)now,
-        (u32)(diff>>32), (u32)diff);
+        "total = %08X:%08X)%s\n", (u32)(now>>32), (u32)now,
+        (u32)(diff>>32), (u32)diff, lock_profile_enabled ? "" : " disabled");
     spinlock_profile_iterate(spinlock_profile_print_elem, NULL);
 }
 
@@ -359,6 +426,8 @@ static void spinlock_profile_reset_elem(struct lock_profile *data,
     data->block_cnt = 0;
     data->time_hold = 0;
     data->time_block = 0;
+    memset(data->block_hist, 0, sizeof(data->block_hist));
+    memset(data->callers, 0, sizeof(data->callers));
 }
 
 void spinlock_profile_reset(unsigned char key)
@@ -382,12 +451,16 @@ static void spinlock_profile_ucopy_elem(struct lock_profile *data,
 {
     spinlock_profile_ucopy_t *p = par;
     xen_sysctl_lockprof_data_t elem;
+    char namebuf[KSYM_NAME_LEN + 1];
+    unsigned long size, offset;
+    unsigned int i;
 
     if ( p->rc )
         return;
 
     if ( p->pc->nr_elem < p->pc->max_elem )
     {
+        memset(&elem, 0, sizeof(elem));
         safe_strcpy(elem.name, data->name);
         elem.type = type;
         elem.idx = idx;
@@ -395,6 +468,24 @@ static void spinlock_profile_ucopy_elem(struct lock_profile *data,
         elem.block_cnt = data->block_cnt;
         elem.lock_time = data->time_hold;
         elem.block_time = data->time_block;
+        for ( i = 0; i < LOCKPROF_HIST_BUCKETS; i++ )
+            elem.block_hist[i] = data->block_hist[i];
+        for ( i = 0; i < LOCKPROF_CALLERS; i++ )
+        {
+            const struct lock_profile_caller *c = &data->callers[i];
+            const char *sym;
+
+            if ( !c->pc )
+                continue;
+            elem.callers[i].addr = (unsigned long)c->pc;
+            elem.callers[i].block_cnt = c->block_cnt;
+            elem.callers[i].block_time = c->time_block;
+            sym = symbols_lookup((unsigned long)c->pc, &size, &offset, namebuf);
+            if ( sym )
+                snprintf(elem.callers[i].symbol,
+                         sizeof(elem.callers[i].symbol), "%s+%#lx",
+                         sym, offset);
+        }
         if ( copy_to_guest_offset(p->pc->data, p->pc->nr_elem, &elem, 1) )
             p->rc = -EFAULT;
     }
@@ -422,11 +513,19 @@ int spinlock_profile_control(xen_sysctl_lockprof_op_t *pc)
         pc->time = NOW() - lock_profile_start;
         rc = par.rc;
         break;
+    case XEN_SYSCTL_LOCKPROF_enable:
+        lock_profile_enabled = true;
+        break;
+    case XEN_SYSCTL_LOCKPROF_disable:
+        lock_profile_enabled = false;
+        break;
     default:
         rc = -EINVAL;
         break;
     }
 
+    pc->enabled = lock_profile_enabled;
+
     return rc;
 }
 
@@ -28,6 +28,8 @@
 #include <xen/pmstat.h>
 #include <xen/livepatch.h>
 #include <xen/gcov.h>
+#include <xen/lat_hist.h>
+#include <xen/xenoprof.h>
 
 long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
 {
@@ -114,6 +116,65 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
     }
     break;
 
+    case XEN_SYSCTL_getvcpuinfolist:
+    {
+        struct xen_sysctl_getvcpuinfolist *vl = &op->u.getvcpuinfolist;
+        struct domain *d;
+        struct vcpu *v;
+        struct xen_sysctl_vcpuinfo info = { 0 };
+        struct vcpu_runstate_info runstate;
+        u32 num_vcpus = 0, n;
+
+        vl->next_domain = DOMID_INVALID;
+
+        rcu_read_lock(&domlist_read_lock);
+
+        for_each_domain ( d )
+        {
+            if ( d->domain_id < vl->first_domain )
+                continue;
+
+            if ( xsm_getdomaininfo(XSM_HOOK, d) )
+                continue;
+
+            n = 0;
+            for_each_vcpu ( d, v )
+                n++;
+            if ( n > vl->max_vcpus - num_vcpus )
+            {
+                vl->next_domain = d->domain_id;
+                break;
+            }
+
+            for_each_vcpu ( d, v )
+            {
+                vcpu_runstate_get(v, &runstate);
+
+                info.domid    = d->domain_id;
+                info.vcpu     = v->vcpu_id;
+                info.online   = !(v->pause_flags & VPF_down);
+                info.blocked  = !!(v->pause_flags & VPF_blocked);
+                info.running  = v->is_running;
+                info.cpu_time = runstate.time[RUNSTATE_running];
+                info.cpu      = v->processor;
+
+                if ( copy_to_guest_offset(vl->buffer, num_vcpus, &info, 1) )
+                {
+                    ret = -EFAULT;
+                    break;
+                }
+                num_vcpus++;
+            }
+            if ( ret )
+                break;
+        }
+
+        rcu_read_unlock(&domlist_read_lock);
+
+        vl->num_vcpus = num_vcpus;
+    }
+    break;
+
 #ifdef CONFIG_PERF_COUNTERS
     case XEN_SYSCTL_perfc_op:
         ret = perfc_control(&op->u.perfc_op);
@@ -125,6 +186,18 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
         ret = spinlock_profile_control(&op->u.lockprof_op);
         break;
 #endif
+
+#ifdef CONFIG_LAT_HIST
+    case XEN_SYSCTL_lat_hist_op:
+        ret = lat_hist_control(&op->u.lat_hist);
+        break;
+#endif
+
+#ifdef CONFIG_XENOPROF
+    case XEN_SYSCTL_sampler_op:
+        ret = xenoprof_sampler_control(&op->u.sampler);
+        break;
+#endif
     case XEN_SYSCTL_debug_keys:
     {
         char c;
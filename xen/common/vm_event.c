@@ -39,6 +39,29 @@
 #define vm_event_ring_lock(_ved)       spin_lock(&(_ved)->ring_lock)
 #define vm_event_ring_unlock(_ved)     spin_unlock(&(_ved)->ring_lock)
 
+/* Responses pulled off the ring per acquisition of the ring lock. */
+#define VM_EVENT_RESUME_BATCH 16
+
+typedef vm_event_response_t vm_event_rsp_batch_t[VM_EVENT_RESUME_BATCH];
+static DEFINE_PER_CPU(vm_event_rsp_batch_t, vm_event_rsp_batch);
+
+/* Per-vCPU channels, see struct vm_event_slot in public/vm_event.h. */
+struct vm_event_channels
+{
+    unsigned int nr_frames;
+    struct page_info **pg;
+    void **va;
+    /* Xen's copy of the slot ports; the helper can scribble on the slots. */
+    evtchn_port_t *ports;
+};
+
+static struct vm_event_slot *vm_event_slot(const struct vm_event_channels *ch,
+                                           unsigned int vcpu_id)
+{
+    return (struct vm_event_slot *)ch->va[vcpu_id / VM_EVENT_SLOTS_PER_FRAME] +
+           vcpu_id % VM_EVENT_SLOTS_PER_FRAME;
+}
+
 static int vm_event_enable(
     struct domain *d,
     xen_domctl_vm_event_op_t *vec,
@@ -53,7 +76,7 @@ static int vm_event_enable(
     /* Only one helper at a time. If the helper crashed,
      * the ring is in an undefined state and so is the guest.
      */
-    if ( ved->ring_page )
+    if ( ved->ring_page || ved->channels )
         return -EBUSY;
 
     /* The parameter defaults to zero, and it should be
@@ -107,6 +130,108 @@ static int vm_event_enable(
     return rc;
 }
 
+static void vm_event_channels_free(struct vm_event_channels *ch)
+{
+    xfree(ch->ports);
+    xfree(ch->va);
+    xfree(ch->pg);
+    xfree(ch);
+}
+
+static int vm_event_channels_enable(
+    struct domain *d,
+    xen_domctl_vm_event_op_t *vec,
+    struct vm_event_domain *ved,
+    int pause_flag,
+    xen_event_channel_notification_t notification_fn)
+{
+    struct vm_event_channels *ch;
+    unsigned int i = 0, nr_frames = DIV_ROUND_UP(d->max_vcpus,
+                                                 VM_EVENT_SLOTS_PER_FRAME);
+    int rc;
+
+    if ( ved->ring_page || ved->channels )
+        return -EBUSY;
+
+    if ( vec->nr_frames < nr_frames )
+    {
+        vec->nr_frames = nr_frames;
+        return -ENOSPC;
+    }
+
+    ch = xzalloc(struct vm_event_channels);
+    if ( !ch )
+        return -ENOMEM;
+
+    ch->pg = xzalloc_array(struct page_info *, nr_frames);
+    ch->va = xzalloc_array(void *, nr_frames);
+    ch->ports = xzalloc_array(evtchn_port_t, d->max_vcpus);
+    if ( !ch->pg || !ch->va || !ch->ports )
+    {
+        vm_event_channels_free(ch);
+        return -ENOMEM;
+    }
+
+    vm_event_ring_lock_init(ved);
+    vm_event_ring_lock(ved);
+
+    rc = vm_event_init_domain(d);
+    if ( rc < 0 )
+        goto err;
+
+    for ( ; ch->nr_frames < nr_frames; ch->nr_frames++ )
+    {
+        rc = prepare_ring_for_helper(d, vec->gfn + ch->nr_frames,
+                                     &ch->pg[ch->nr_frames],
+                                     &ch->va[ch->nr_frames]);
+        if ( rc < 0 )
+            goto err;
+
+        clear_page(ch->va[ch->nr_frames]);
+    }
+
+    /* One Xen-bound channel per vCPU, notifying on behalf of that vCPU. */
+    for ( ; i < d->max_vcpus; i++ )
+    {
+        if ( !d->vcpu[i] )
+            continue;
+
+        rc = alloc_unbound_xen_event_channel(d, i, current->domain->domain_id,
+                                             notification_fn);
+        if ( rc < 0 )
+            goto err;
+
+        ch->ports[i] = rc;
+        vm_event_slot(ch, i)->port = rc;
+    }
+
+    vec->port = ch->ports[0];
+    vec->nr_frames = nr_frames;
+
+    ved->blocked = 0;
+    ved->pause_flag = pause_flag;
+    init_waitqueue_head(&ved->wq);
+
+    /* Publish the channels only once they are fully set up. */
+    smp_wmb();
+    ved->channels = ch;
+
+    vm_event_ring_unlock(ved);
+    return 0;
+
+ err:
+    while ( i-- )
+        if ( ch->ports[i] )
+            free_xen_event_channel(d, ch->ports[i]);
+    while ( ch->nr_frames-- )
+        destroy_ring_for_helper(&ch->va[ch->nr_frames],
+                                ch->pg[ch->nr_frames]);
+    vm_event_ring_unlock(ved);
+    vm_event_channels_free(ch);
+
+    return rc;
+}
+
 static unsigned int vm_event_ring_available(struct vm_event_domain *ved)
 {
     int avail_req = RING_FREE_REQUESTS(&ved->front_ring);
@@ -187,8 +312,47 @@ void vm_event_wake(struct domain *d, struct vm_event_domain *ved)
         vm_event_wake_blocked(d, ved);
 }
 
+static int vm_event_channels_disable(struct domain *d,
+                                     struct vm_event_domain *ved)
+{
+    struct vm_event_channels *ch = ved->channels;
+    unsigned int i;
+
+    vm_event_ring_lock(ved);
+
+    if ( !list_empty(&ved->wq.list) )
+    {
+        vm_event_ring_unlock(ved);
+        return -EBUSY;
+    }
+
+    /*
+     * Closing the ports waits out any notification in flight, after which
+     * only the (domctl-serialised) RESUME path could still look at slots.
+     */
+    for ( i = 0; i < d->max_vcpus; i++ )
+        if ( ch->ports[i] )
+            free_xen_event_channel(d, ch->ports[i]);
+
+    ved->channels = NULL;
+
+    for ( i = 0; i < ch->nr_frames; i++ )
+        destroy_ring_for_helper(&ch->va[i], ch->pg[i]);
+
+    vm_event_cleanup_domain(d);
+
+    vm_event_ring_unlock(ved);
+
+    vm_event_channels_free(ch);
+
+    return 0;
+}
+
 static int vm_event_disable(struct domain *d, struct vm_event_domain *ved)
 {
+    if ( ved->channels )
+        return vm_event_channels_disable(d, ved);
+
     if ( ved->ring_page )
     {
         struct vcpu *v;
@@ -251,6 +415,26 @@ void vm_event_mark_and_pause(struct vcpu *v, struct vm_event_domain *ved)
     }
 }
 
+/*
+ * Claiming gave the vCPU its own slot, which is IDLE; no lock is needed as
+ * nobody else writes to a slot in that state.
+ */
+static void vm_event_channels_put_request(struct domain *d,
+                                          struct vm_event_channels *ch,
+                                          vm_event_request_t *req)
+{
+    struct vm_event_slot *slot;
+
+    ASSERT(req->vcpu_id < d->max_vcpus);
+
+    slot = vm_event_slot(ch, req->vcpu_id);
+    slot->u.req = *req;
+    smp_wmb();
+    write_atomic(&slot->state, VM_EVENT_SLOT_STATE_SUBMITTED);
+
+    notify_via_xen_event_channel(d, ch->ports[req->vcpu_id]);
+}
+
 /*
  * This must be preceded by a call to claim_slot(), and is guaranteed to
  * succeed.  As a side-effect however, the vCPU may be paused if the ring is
@@ -279,6 +463,12 @@ void vm_event_put_request(struct domain *d,
 
     req->version = VM_EVENT_INTERFACE_VERSION;
 
+    if ( ved->channels )
+    {
+        vm_event_channels_put_request(d, ved->channels, req);
+        return;
+    }
+
     vm_event_ring_lock(ved);
 
     /* Due to the reservations, this step must succeed. */
@@ -311,52 +501,165 @@ void vm_event_put_request(struct domain *d,
     notify_via_xen_event_channel(d, ved->xen_port);
 }
 
-int vm_event_get_response(struct domain *d, struct vm_event_domain *ved,
-                          vm_event_response_t *rsp)
+/*
+ * Copy up to nr responses off the ring under a single acquisition of the
+ * ring lock, and return how many were copied.
+ */
+static unsigned int vm_event_get_responses(struct domain *d,
+                                           struct vm_event_domain *ved,
+                                           vm_event_response_t *rsp,
+                                           unsigned int nr)
 {
     vm_event_front_ring_t *front_ring;
     RING_IDX rsp_cons;
+    unsigned int i;
 
     vm_event_ring_lock(ved);
 
     front_ring = &ved->front_ring;
     rsp_cons = front_ring->rsp_cons;
 
-    if ( !RING_HAS_UNCONSUMED_RESPONSES(front_ring) )
+    for ( i = 0; i < nr && RING_HAS_UNCONSUMED_RESPONSES(front_ring); i++ )
     {
-        vm_event_ring_unlock(ved);
-        return 0;
+        /* Copy response */
+        memcpy(&rsp[i], RING_GET_RESPONSE(front_ring, rsp_cons),
+               sizeof(*rsp));
+        front_ring->rsp_cons = ++rsp_cons;
     }
 
-    /* Copy response */
-    memcpy(rsp, RING_GET_RESPONSE(front_ring, rsp_cons), sizeof(*rsp));
-    rsp_cons++;
-
-    /* Update ring */
-    front_ring->rsp_cons = rsp_cons;
-    front_ring->sring->rsp_event = rsp_cons + 1;
+    if ( i )
+    {
+        /* Update ring */
+        front_ring->sring->rsp_event = rsp_cons + 1;
 
-    /* Kick any waiters -- since we've just consumed an event,
-     * there may be additional space available in the ring. */
-    vm_event_wake(d, ved);
+        /* Kick any waiters -- since we've just consumed events,
+         * there may be additional space available in the ring. */
+        vm_event_wake(d, ved);
+    }
 
     vm_event_ring_unlock(ved);
 
-    return 1;
+    return i;
 }
 
 /*
- * Pull all responses from the given ring and unpause the corresponding vCPU
- * if required. Based on the response type, here we can also call custom
- * handlers.
+ * Unpause the vCPU a response is for, if required. Based on the response
+ * type, here we can also call custom handlers.
  *
- * Note: responses are handled the same way regardless of which ring they
- * arrive on.
+ * Note: responses are handled the same way regardless of which ring or
+ * channel they arrive on.
  */
-void vm_event_resume(struct domain *d, struct vm_event_domain *ved)
+static void vm_event_handle_response(struct domain *d,
+                                     vm_event_response_t *rsp)
 {
+    struct vcpu *v;
+
+    if ( rsp->version != VM_EVENT_INTERFACE_VERSION )
+    {
+        printk(XENLOG_G_WARNING "vm_event interface version mismatch\n");
+        return;
+    }
+
+    /* Validate the vcpu_id in the response. */
+    if ( (rsp->vcpu_id >= d->max_vcpus) || !d->vcpu[rsp->vcpu_id] )
+        return;
+
+    v = d->vcpu[rsp->vcpu_id];
+
+    /*
+     * In some cases the response type needs extra handling, so here
+     * we call the appropriate handlers.
+     */
+
+    /* Check flags which apply only when the vCPU is paused */
+    if ( atomic_read(&v->vm_event_pause_count) )
+    {
+#ifdef CONFIG_HAS_MEM_PAGING
+        if ( rsp->reason == VM_EVENT_REASON_MEM_PAGING )
+            p2m_mem_paging_resume(d, rsp);
+#endif
+
+        /*
+         * Check emulation flags in the arch-specific handler only, as it
+         * has to set arch-specific flags when supported, and to avoid
+         * bitmask overhead when it isn't supported.
+         */
+        vm_event_emulate_check(v, rsp);
+
+        /*
+         * Check in arch-specific handler to avoid bitmask overhead when
+         * not supported.
+         */
+        vm_event_register_write_resume(v, rsp);
+
+        /*
+         * Check in arch-specific handler to avoid bitmask overhead when
+         * not supported.
+         */
+        vm_event_toggle_singlestep(d, v, rsp);
+
+        /* Check for altp2m switch */
+        if ( rsp->flags & VM_EVENT_FLAG_ALTERNATE_P2M )
+            p2m_altp2m_check(v, rsp->altp2m_idx);
+
+        if ( rsp->flags & VM_EVENT_FLAG_SET_REGISTERS )
+            vm_event_set_registers(v, rsp);
+
+        if ( rsp->flags & VM_EVENT_FLAG_GET_NEXT_INTERRUPT )
+            vm_event_monitor_next_interrupt(v);
+
+        if ( rsp->flags & VM_EVENT_FLAG_VCPU_PAUSED )
+            vm_event_vcpu_unpause(v);
+    }
+}
+
+/*
+ * Hand a FINISHED slot back to its vCPU and act on the response in it.  Both
+ * the slot's own event channel and XEN_VM_EVENT_RESUME end up here, possibly
+ * concurrently, so the slot is claimed with a cmpxchg.
+ */
+static void vm_event_channels_resume(struct domain *d,
+                                     struct vm_event_domain *ved,
+                                     struct vcpu *v)
+{
+    struct vm_event_channels *ch = ACCESS_ONCE(ved->channels);
+    struct vm_event_slot *slot;
     vm_event_response_t rsp;
 
+    if ( !ch )
+        return;
+
+    slot = vm_event_slot(ch, v->vcpu_id);
+    if ( read_atomic(&slot->state) != VM_EVENT_SLOT_STATE_FINISHED )
+        return;
+
+    smp_rmb();
+    rsp = slot->u.rsp;
+
+    if ( cmpxchg(&slot->state, VM_EVENT_SLOT_STATE_FINISHED,
+                 VM_EVENT_SLOT_STATE_IDLE) != VM_EVENT_SLOT_STATE_FINISHED )
+        return;
+
+    /* The slot belongs to exactly one vCPU, whatever the helper wrote. */
+    rsp.vcpu_id = v->vcpu_id;
+    vm_event_handle_response(d, &rsp);
+
+    /* Pairs with the barrier in prepare_to_wait() of a vCPU wanting a slot. */
+    smp_mb();
+    if ( !list_empty(&ved->wq.list) )
+        wake_up_all(&ved->wq);
+}
+
+/*
+ * Pull all responses from the given ring, or all finished slots if the
+ * domain uses per-vCPU channels, and act on them.
+ */
+void vm_event_resume(struct domain *d, struct vm_event_domain *ved)
+{
+    vm_event_response_t *rsp = this_cpu(vm_event_rsp_batch);
+    unsigned int i, nr;
+    struct vcpu *v;
+
     /*
      * vm_event_resume() runs in either XEN_DOMCTL_VM_EVENT_OP_*, or
      * EVTCHN_send context from the introspection consumer. Both contexts
@@ -367,73 +670,26 @@ void vm_event_resume(struct domain *d, struct vm_event_domain *ved)
      */
     ASSERT(d != current->domain);
 
-    /* Pull all responses off the ring. */
-    while ( vm_event_get_response(d, ved, &rsp) )
+    if ( ved->channels )
     {
-        struct vcpu *v;
-
-        if ( rsp.version != VM_EVENT_INTERFACE_VERSION )
-        {
-            printk(XENLOG_G_WARNING "vm_event interface version mismatch\n");
-            continue;
-        }
-
-        /* Validate the vcpu_id in the response. */
-        if ( (rsp.vcpu_id >= d->max_vcpus) || !d->vcpu[rsp.vcpu_id] )
-            continue;
-
-        v = d->vcpu[rsp.vcpu_id];
-
-        /*
-         * In some cases the response type needs extra handling, so here
-         * we call the appropriate handlers.
-         */
-
-        /* Check flags which apply only when the vCPU is paused */
-        if ( atomic_read(&v->vm_event_pause_count) )
-        {
-#ifdef CONFIG_HAS_MEM_PAGING
-            if ( rsp.reason == VM_EVENT_REASON_MEM_PAGING )
-                p2m_mem_paging_resume(d, &rsp);
-#endif
-
-            /*
-             * Check emulation flags in the arch-specific handler only, as it
-             * has to set arch-specific flags when supported, and to avoid
-             * bitmask overhead when it isn't supported.
-             */
-            vm_event_emulate_check(v, &rsp);
-
-            /*
-             * Check in arch-specific handler to avoid bitmask overhead when
-             * not supported.
-             */
-            vm_event_register_write_resume(v, &rsp);
-
-            /*
-             * Check in arch-specific handler to avoid bitmask overhead when
-             * not supported.
-             */
-            vm_event_toggle_singlestep(d, v, &rsp);
-
-            /* Check for altp2m switch */
-            if ( rsp.flags & VM_EVENT_FLAG_ALTERNATE_P2M )
-                p2m_altp2m_check(v, rsp.altp2m_idx);
-
-            if ( rsp.flags & VM_EVENT_FLAG_SET_REGISTERS )
-                vm_event_set_registers(v, &rsp);
-
-            if ( rsp.flags & VM_EVENT_FLAG_GET_NEXT_INTERRUPT )
-                vm_event_monitor_next_interrupt(v);
-
-            if ( rsp.flags & VM_EVENT_FLAG_VCPU_PAUSED )
-                vm_event_vcpu_unpause(v);
-        }
+        for_each_vcpu ( d, v )
+            vm_event_channels_resume(d, ved, v);
+        return;
     }
+
+    /* Pull all responses off the ring, a batch at a time. */
+    while ( (nr = vm_event_get_responses(d, ved, rsp,
+                                         VM_EVENT_RESUME_BATCH)) != 0 )
+        for ( i = 0; i < nr; i++ )
+            vm_event_handle_response(d, &rsp[i]);
 }
 
 void vm_event_cancel_slot(struct domain *d, struct vm_event_domain *ved)
 {
+    /* A claimed channel slot stays IDLE, there is nothing to give back. */
+    if ( ved->channels )
+        return;
+
     vm_event_ring_lock(ved);
     vm_event_release_slot(d, ved);
     vm_event_ring_unlock(ved);
@@ -480,9 +736,36 @@ static int vm_event_wait_slot(struct vm_event_domain *ved)
     return rc;
 }
 
+/*
+ * A vCPU may only use its own slot, and only once the helper has answered
+ * the previous request in it.  There is no slot for foreign producers.
+ */
+static int vm_event_channels_grab_slot(struct domain *d,
+                                       struct vm_event_domain *ved)
+{
+    struct vm_event_channels *ch = ACCESS_ONCE(ved->channels);
+
+    if ( !ch )
+        return -ENOSYS;
+
+    if ( current->domain != d )
+        return -EBUSY;
+
+    return read_atomic(&vm_event_slot(ch, current->vcpu_id)->state) ==
+           VM_EVENT_SLOT_STATE_IDLE ? 0 : -EBUSY;
+}
+
+static int vm_event_channels_wait_try_grab(struct domain *d,
+                                           struct vm_event_domain *ved,
+                                           int *rc)
+{
+    *rc = vm_event_channels_grab_slot(d, ved);
+    return *rc;
+}
+
 bool_t vm_event_check_ring(struct vm_event_domain *ved)
 {
-    return (ved->ring_page != NULL);
+    return (ved->ring_page != NULL || ved->channels != NULL);
 }
 
 /*
@@ -500,6 +783,19 @@ bool_t vm_event_check_ring(struct vm_event_domain *ved)
 int __vm_event_claim_slot(struct domain *d, struct vm_event_domain *ved,
                           bool_t allow_sleep)
 {
+    if ( ved->channels )
+    {
+        int rc = -EBUSY;
+
+        if ( (current->domain == d) && allow_sleep )
+            wait_event(ved->wq,
+                       vm_event_channels_wait_try_grab(d, ved, &rc) != -EBUSY);
+        else
+            rc = vm_event_channels_grab_slot(d, ved);
+
+        return rc;
+    }
+
     if ( (current->domain == d) && allow_sleep )
         return vm_event_wait_slot(ved);
     else
@@ -518,8 +814,13 @@ static void mem_paging_notification(struct vcpu *v, unsigned int port)
 /* Registered with Xen-bound event channel for incoming notifications. */
 static void monitor_notification(struct vcpu *v, unsigned int port)
 {
-    if ( likely(v->domain->vm_event->monitor.ring_page != NULL) )
-        vm_event_resume(v->domain, &v->domain->vm_event->monitor);
+    struct vm_event_domain *ved = &v->domain->vm_event->monitor;
+
+    /* A channel port only ever carries responses for its own vCPU. */
+    if ( ved->channels )
+        vm_event_channels_resume(v->domain, ved, v);
+    else if ( likely(ved->ring_page != NULL) )
+        vm_event_resume(v->domain, ved);
 }
 
 #ifdef CONFIG_HAS_MEM_SHARING
@@ -548,7 +849,7 @@ void vm_event_cleanup(struct domain *d)
         (void)vm_event_disable(d, &d->vm_event->paging);
     }
 #endif
-    if ( d->vm_event->monitor.ring_page )
+    if ( vm_event_check_ring(&d->vm_event->monitor) )
     {
         destroy_waitqueue_head(&d->vm_event->monitor.wq);
         (void)vm_event_disable(d, &d->vm_event->monitor);
@@ -676,8 +977,17 @@ int vm_event_domctl(struct domain *d, xen_domctl_vm_event_op_t *vec,
                                  monitor_notification);
             break;
 
+        case XEN_VM_EVENT_ENABLE_CHANNELS:
+            /* domain_pause() not required here, see XSA-99 */
+            rc = arch_monitor_init_domain(d);
+            if ( rc )
+                break;
+            rc = vm_event_channels_enable(d, vec, ved, _VPF_mem_access,
+                                          monitor_notification);
+            break;
+
         case XEN_VM_EVENT_DISABLE:
-            if ( ved->ring_page )
+            if ( vm_event_check_ring(ved) )
             {
                 domain_pause(d);
                 rc = vm_event_disable(d, ved);
@@ -687,7 +997,7 @@ int vm_event_domctl(struct domain *d, xen_domctl_vm_event_op_t *vec,
             break;
 
         case XEN_VM_EVENT_RESUME:
-            if ( ved->ring_page )
+            if ( vm_event_check_ring(ved) )
                 vm_event_resume(d, ved);
             else
                 rc = -ENODEV;
@@ -18,6 +18,8 @@
 #include <xen/paging.h>
 #include <xsm/xsm.h>
 #include <xen/hypercall.h>
+#include <xen/symbols.h>
+#include <public/sysctl.h>
 
 /* Limit amount of pages used for shared buffer (per domain) */
 #define MAX_OPROF_SHARED_PAGES 32
@@ -534,6 +536,250 @@ int xenoprof_add_trace(struct vcpu *vcpu, uint64_t pc, int mode)
     return xenoprof_add_sample(d, buf, pc, mode, 0);
 }
 
+/*
+ * The sampler profiles without a profiling domain: the NMIs record samples
+ * in per-pcpu buffers, which XEN_SYSCTL_sampler_op reads.
+ */
+#define SAMPLER_PERIOD          2000000     /* ~1kHz with 2GHz cycles */
+#define SAMPLER_MIN_PERIOD      10000
+#define SAMPLER_SAMPLES         16384
+#define SAMPLER_MAX_SAMPLES     (1U << 20)
+
+struct sampler_entry {
+    uint64_t pc;
+    domid_t domid;
+    uint16_t vcpu;
+    uint8_t mode;
+};
+
+struct sampler_buf {
+    unsigned int size;                  /* power of 2 */
+    unsigned int prod, cons;            /* free running */
+    uint64_t lost;
+    struct sampler_entry entry[];
+};
+
+static DEFINE_PER_CPU(struct sampler_buf *, sampler_buf);
+static cpumask_t sampler_cpus;          /* with a buffer */
+
+/* NMI context: only this pcpu produces into its buffer. */
+static void sampler_log(const struct vcpu *v, uint64_t pc, int mode)
+{
+    struct sampler_buf *b = this_cpu(sampler_buf);
+    struct sampler_entry *e;
+
+    if ( !b )
+        return;
+
+    if ( b->prod - read_atomic(&b->cons) >= b->size )
+    {
+        b->lost++;
+        return;
+    }
+
+    e = &b->entry[b->prod & (b->size - 1)];
+    e->pc = pc;
+    e->domid = v->domain->domain_id;
+    e->vcpu = v->vcpu_id;
+    e->mode = mode;
+    smp_wmb(); /* Entry before producer index. */
+    write_atomic(&b->prod, b->prod + 1);
+}
+
+static void sampler_free(void)
+{
+    unsigned int cpu;
+
+    for_each_cpu ( cpu, &sampler_cpus )
+    {
+        xfree(per_cpu(sampler_buf, cpu));
+        per_cpu(sampler_buf, cpu) = NULL;
+    }
+    cpumask_clear(&sampler_cpus);
+}
+
+static int sampler_start(const struct xen_sysctl_sampler_op *op)
+{
+    unsigned int cpu, size = op->buf_samples ?: SAMPLER_SAMPLES;
+    unsigned int period = op->period ?: SAMPLER_PERIOD;
+    char cpu_type[XENOPROF_CPU_TYPE_SIZE];
+    int num_events, ret;
+
+    if ( xenoprof_state != XENOPROF_IDLE )
+        return -EBUSY;
+
+    if ( period < SAMPLER_MIN_PERIOD || size > SAMPLER_MAX_SAMPLES )
+        return -EINVAL;
+
+    if ( (ret = xenoprof_arch_init(&num_events, cpu_type)) != 0 )
+        return ret;
+
+    size = 1U << fls(size - 1);
+
+    sampler_free();
+    for_each_online_cpu ( cpu )
+    {
+        struct sampler_buf *b =
+            xzalloc_bytes(sizeof(*b) + size * sizeof(b->entry[0]));
+
+        if ( !b )
+        {
+            sampler_free();
+            return -ENOMEM;
+        }
+        b->size = size;
+        per_cpu(sampler_buf, cpu) = b;
+        cpumask_set_cpu(cpu, &sampler_cpus);
+    }
+
+    if ( !acquire_pmu_ownership(PMU_OWNER_XENOPROF) )
+    {
+        ret = -EBUSY;
+        goto free;
+    }
+
+    ret = xenoprof_arch_sampler_counter(op->event, op->unit_mask, period);
+    if ( !ret )
+        ret = xenoprof_arch_reserve_counters();
+    if ( ret )
+        goto release;
+
+    if ( (ret = xenoprof_arch_setup_events()) != 0 ||
+         (ret = xenoprof_arch_enable_virq()) != 0 )
+        goto counters;
+
+    xenoprof_state = XENOPROF_SAMPLING;
+    if ( (ret = xenoprof_arch_start()) == 0 )
+        return 0;
+
+    xenoprof_state = XENOPROF_IDLE;
+    xenoprof_arch_disable_virq();
+ counters:
+    xenoprof_arch_release_counters();
+ release:
+    release_pmu_ownership(PMU_OWNER_XENOPROF);
+ free:
+    sampler_free();
+    return ret;
+}
+
+static void sampler_stop(void)
+{
+    if ( xenoprof_state != XENOPROF_SAMPLING )
+        return;
+
+    xenoprof_arch_stop();
+    xenoprof_arch_disable_virq();
+    xenoprof_arch_release_counters();
+    release_pmu_ownership(PMU_OWNER_XENOPROF);
+    xenoprof_state = XENOPROF_IDLE;
+}
+
+static int sampler_read(struct xen_sysctl_sampler_op *op)
+{
+    xen_sysctl_sample_t batch[16];
+    char namebuf[KSYM_NAME_LEN + 1];
+    unsigned long size, offset;
+    unsigned int cpu, n = 0, copied = 0;
+    bool empty = true;
+    int rc = 0;
+
+    op->lost = 0;
+
+    for_each_cpu ( cpu, &sampler_cpus )
+    {
+        struct sampler_buf *b = per_cpu(sampler_buf, cpu);
+
+        op->lost += b->lost;
+
+        while ( !rc && copied + n < op->nr_samples &&
+                b->cons != read_atomic(&b->prod) )
+        {
+            const struct sampler_entry *e;
+            xen_sysctl_sample_t *s = &batch[n++];
+
+            smp_rmb(); /* Producer index before entry. */
+            e = &b->entry[b->cons & (b->size - 1)];
+
+            s->pc = e->pc;
+            s->symbol = 0;
+            s->domid = e->domid;
+            s->vcpu = e->vcpu;
+            s->cpu = cpu;
+            s->mode = e->mode;
+            s->pad = 0;
+            if ( e->mode == XEN_SAMPLE_MODE_xen &&
+                 symbols_lookup(e->pc, &size, &offset, namebuf) )
+                s->symbol = e->pc - offset;
+
+            smp_mb(); /* Entry read before its slot is given back. */
+            write_atomic(&b->cons, b->cons + 1);
+
+            if ( n == ARRAY_SIZE(batch) )
+            {
+                if ( copy_to_guest_offset(op->samples, copied, batch, n) )
+                    rc = -EFAULT;
+                copied += n;
+                n = 0;
+            }
+        }
+
+        if ( b->cons != read_atomic(&b->prod) )
+            empty = false;
+    }
+
+    if ( !rc && n && copy_to_guest_offset(op->samples, copied, batch, n) )
+        rc = -EFAULT;
+    copied += n;
+
+    op->nr_samples = copied;
+
+    if ( empty && xenoprof_state != XENOPROF_SAMPLING )
+        sampler_free();
+
+    return rc;
+}
+
+int xenoprof_sampler_control(struct xen_sysctl_sampler_op *op)
+{
+    char namebuf[KSYM_NAME_LEN + 1];
+    unsigned long size, offset;
+    int rc = 0;
+
+    spin_lock(&xenoprof_lock);
+
+    switch ( op->cmd )
+    {
+    case XEN_SYSCTL_SAMPLER_start:
+        rc = sampler_start(op);
+        break;
+
+    case XEN_SYSCTL_SAMPLER_stop:
+        sampler_stop();
+        break;
+
+    case XEN_SYSCTL_SAMPLER_read:
+        rc = sampler_read(op);
+        break;
+
+    case XEN_SYSCTL_SAMPLER_symbol:
+        op->name[0] = '\0';
+        if ( symbols_lookup(op->addr, &size, &offset, namebuf) )
+            safe_strcpy(op->name, namebuf);
+        break;
+
+    default:
+        rc = -EINVAL;
+        break;
+    }
+
+    op->running = xenoprof_state == XENOPROF_SAMPLING;
+
+    spin_unlock(&xenoprof_lock);
+
+    return rc;
+}
+
 void xenoprof_log_event(struct vcpu *vcpu, const struct cpu_user_regs *regs,
                         uint64_t pc, int mode, int event)
 {
@@ -541,6 +787,12 @@ void xenoprof_log_event(struct vcpu *vcpu, const struct cpu_user_regs *regs,
     struct xenoprof_vcpu *v;
     xenoprof_buf_t *buf;
 
+    if ( xenoprof_state == XENOPROF_SAMPLING )
+    {
+        sampler_log(vcpu, pc, mode);
+        return;
+    }
+
     total_samples++;
 
     /* Ignore samples of un-monitored domains. */
@@ -694,6 +946,13 @@ ret_t do_xenoprof_op(int op, XEN_GUEST_HANDLE_PARAM(void) arg)
         return ret;
 
     spin_lock(&xenoprof_lock);
+
+    /* The PMU is in use by XEN_SYSCTL_sampler_op. */
+    if ( xenoprof_state == XENOPROF_SAMPLING )
+    {
+        spin_unlock(&xenoprof_lock);
+        return -EBUSY;
+    }
     
     switch ( op )
     {
@@ -30,6 +30,8 @@
 #include <xen/hypercall.h> /* for do_console_io */
 #include <xen/early_printk.h>
 #include <xen/warning.h>
+#include <xen/cpu.h>
+#include <xen/xmalloc.h>
 
 /* console: comma-separated list of console outputs. */
 static char __initdata opt_console[30] = OPT_CONSOLE_STR;
@@ -81,9 +83,14 @@ static char *__read_mostly conring = _conring;
 static uint32_t __read_mostly conring_size = _CONRING_SIZE;
 static uint32_t conringc, conringp;
 
+/* printk_buffer: size of the per-cpu printk buffers (0 to disable them). */
+static uint32_t __read_mostly opt_printk_buffer = 16384;
+size_param("printk_buffer", opt_printk_buffer);
+
 static int __read_mostly sercon_handle = -1;
 
 static DEFINE_SPINLOCK(console_lock);
+static void console_flush_buffers(void);
 
 /*
  * To control the amount of printing, thresholds are added.
@@ -451,6 +458,7 @@ static long guest_console_write(XEN_GUEST_HANDLE_PARAM(char) buffer, int count)
         {
             /* Use direct console output as it could be interactive */
             spin_lock_irq(&console_lock);
+            console_flush_buffers();
 
             sercon_puts(kbuf);
             video_puts(kbuf);
@@ -557,7 +565,7 @@ long do_console_io(int cmd, int count, XEN_GUEST_HANDLE_PARAM(char) buffer)
 
 static bool_t console_locks_busted;
 
-static void __putstr(const char *str)
+static void console_puts(const char *str)
 {
     ASSERT(spin_is_locked(&console_lock));
 
@@ -565,11 +573,199 @@ static void __putstr(const char *str)
     video_puts(str);
 
     conring_puts(str);
+}
+
+static void __putstr(const char *str)
+{
+    console_puts(str);
 
     if ( !console_locks_busted )
         tasklet_schedule(&notify_dom0_con_ring_tasklet);
 }
 
+/*
+ * Once booted, printk() formats its output into a buffer of the current
+ * pcpu, without taking console_lock, and CONSOLE_SOFTIRQ merges the
+ * buffers of all pcpus into the console in the order of the records'
+ * sequence numbers.  Output is synchronous again, with the buffers
+ * flushed first, while the console is synchronous (panics, sync_console,
+ * console_start_log_everything()), for nested printk()s, and for records
+ * which do not fit.
+ */
+#define PRINTK_REC_MAX 4096
+
+struct printk_rec {
+    uint32_t seq;
+    uint32_t len;                      /* of the text which follows */
+};
+
+struct printk_buf {
+    char *data;
+    unsigned int size;                 /* power of 2 */
+    unsigned int prod, cons;           /* free running */
+    bool_t busy;                       /* in vprintk_common() */
+    char fmt[1024];
+};
+
+/* Where vprintk_common() sends its output */
+struct printk_sink {
+    struct printk_buf *pb;             /* NULL: the console, under lock */
+    unsigned int pos;                  /* end of the record so far */
+};
+
+static DEFINE_PER_CPU_READ_MOSTLY(struct printk_buf *, printk_buf);
+static cpumask_t printk_buf_cpus;      /* protected by console_lock */
+static bool_t __read_mostly printk_async;
+static atomic_t printk_seq;
+
+static void printk_buf_copy_in(struct printk_buf *pb, unsigned int pos,
+                               const void *src, unsigned int len)
+{
+    unsigned int idx = pos & (pb->size - 1);
+    unsigned int n = min(len, pb->size - idx);
+
+    memcpy(&pb->data[idx], src, n);
+    memcpy(pb->data, src + n, len - n);
+}
+
+static void printk_buf_copy_out(const struct printk_buf *pb, unsigned int pos,
+                                void *dst, unsigned int len)
+{
+    unsigned int idx = pos & (pb->size - 1);
+    unsigned int n = min(len, pb->size - idx);
+
+    memcpy(dst, &pb->data[idx], n);
+    memcpy(dst + n, pb->data, len - n);
+}
+
+/* Move buffered records to the console, oldest first. */
+static void console_flush_buffers(void)
+{
+    static char text[PRINTK_REC_MAX + 1];
+    struct printk_buf *pb, *oldest;
+    struct printk_rec rec, oldest_rec;
+    unsigned int cpu;
+    bool_t flushed = 0;
+
+    ASSERT(spin_is_locked(&console_lock));
+
+    for ( ; ; )
+    {
+        oldest = NULL;
+
+        for_each_cpu ( cpu, &printk_buf_cpus )
+        {
+            pb = per_cpu(printk_buf, cpu);
+            if ( pb->cons == read_atomic(&pb->prod) )
+                continue;
+            smp_rmb(); /* Record after producer index. */
+            printk_buf_copy_out(pb, pb->cons, &rec, sizeof(rec));
+            if ( !oldest || (int32_t)(rec.seq - oldest_rec.seq) < 0 )
+            {
+                oldest = pb;
+                oldest_rec = rec;
+            }
+        }
+
+        if ( !oldest )
+            break;
+
+        printk_buf_copy_out(oldest, oldest->cons + sizeof(rec), text,
+                            oldest_rec.len);
+        text[oldest_rec.len] = '\0';
+        smp_mb(); /* Record read before space is given back. */
+        write_atomic(&oldest->cons,
+                     oldest->cons + sizeof(rec) + oldest_rec.len);
+
+        console_puts(text);
+        flushed = 1;
+    }
+
+    if ( flushed && !console_locks_busted )
+        tasklet_schedule(&notify_dom0_con_ring_tasklet);
+}
+
+static void console_softirq(void)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&console_lock, flags);
+    console_flush_buffers();
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/* Claim this pcpu's buffer, if printk() may be asynchronous. */
+static struct printk_buf *printk_buf_get(void)
+{
+    struct printk_buf *pb = this_cpu(printk_buf);
+
+    ASSERT(!local_irq_is_enabled());
+
+    if ( !pb || !printk_async || pb->busy ||
+         atomic_read(&print_everything) || console_locks_busted )
+        return NULL;
+
+    pb->busy = 1;
+
+    return pb;
+}
+
+/* Start a record for the output of @text, if it is sure to fit. */
+static bool_t printk_buf_reserve(struct printk_buf *pb, const char *prefix,
+                                 const char *text, struct printk_sink *sink)
+{
+    unsigned int lines = 1, need;
+    const char *p;
+
+    for ( p = text; (p = strchr(p, '\n')) != NULL; p++ )
+        lines++;
+
+    /* Each line may get the prefix and a timestamp of up to 31 chars. */
+    need = strlen(text) + lines * (strlen(prefix) + 32);
+    if ( need > PRINTK_REC_MAX ||
+         pb->size - (pb->prod - read_atomic(&pb->cons)) <
+         sizeof(struct printk_rec) + need )
+        return 0;
+
+    sink->pb = pb;
+    sink->pos = pb->prod + sizeof(struct printk_rec);
+
+    return 1;
+}
+
+static void printk_buf_commit(struct printk_sink *sink)
+{
+    struct printk_buf *pb = sink->pb;
+    struct printk_rec rec = {
+        .len = sink->pos - pb->prod - sizeof(rec),
+    };
+
+    if ( !rec.len )
+        return;
+
+    rec.seq = atomic_inc_return(&printk_seq);
+    printk_buf_copy_in(pb, pb->prod, &rec, sizeof(rec));
+    smp_wmb(); /* Record before producer index. */
+    write_atomic(&pb->prod, sink->pos);
+
+    raise_softirq(CONSOLE_SOFTIRQ);
+}
+
+static void printk_puts(struct printk_sink *sink, const char *str)
+{
+    unsigned int len;
+
+    if ( !sink || !sink->pb )
+    {
+        __putstr(str);
+        return;
+    }
+
+    len = strlen(str);
+    printk_buf_copy_in(sink->pb, sink->pos, str, len);
+    sink->pos += len;
+}
+
 static int printk_prefix_check(char *p, char **pp)
 {
     int loglvl = -1;
@@ -625,13 +821,13 @@ static void __init parse_console_timestamps(char *s)
         opt_con_timestamp_mode = TSM_NONE;
 }
 
-static void printk_start_of_line(const char *prefix)
+static void printk_start_of_line(struct printk_sink *sink, const char *prefix)
 {
     struct tm tm;
     char tstr[32];
     uint64_t sec, nsec;
 
-    __putstr(prefix);
+    printk_puts(sink, prefix);
 
     switch ( opt_con_timestamp_mode )
     {
@@ -666,7 +862,7 @@ static void printk_start_of_line(const char *prefix)
         return;
     }
 
-    __putstr(tstr);
+    printk_puts(sink, tstr);
 }
 
 static void vprintk_common(const char *prefix, const char *fmt, va_list args)
@@ -675,16 +871,33 @@ static void vprintk_common(const char *prefix, const char *fmt, va_list args)
         bool_t continued, do_print;
     }            *state;
     static DEFINE_PER_CPU(struct vps, state);
-    static char   buf[1024];
-    char         *p, *q;
+    static char   sync_buf[1024];
+    char         *buf, *p, *q;
+    struct printk_buf *pb;
+    struct printk_sink sink = { };
     unsigned long flags;
 
-    /* console_lock can be acquired recursively from __printk_ratelimit(). */
     local_irq_save(flags);
-    spin_lock_recursive(&console_lock);
     state = &this_cpu(state);
 
-    (void)vsnprintf(buf, sizeof(buf), fmt, args);
+    pb = printk_buf_get();
+    if ( pb )
+    {
+        buf = pb->fmt;
+        (void)vsnprintf(buf, sizeof(pb->fmt), fmt, args);
+        printk_buf_reserve(pb, prefix, buf, &sink);
+    }
+    else
+        buf = sync_buf;
+
+    if ( !sink.pb )
+    {
+        /* console_lock can be acquired recursively from __printk_ratelimit(). */
+        spin_lock_recursive(&console_lock);
+        console_flush_buffers();
+        if ( !pb )
+            (void)vsnprintf(buf, sizeof(sync_buf), fmt, args);
+    }
 
     p = buf;
 
@@ -696,9 +909,9 @@ static void vprintk_common(const char *prefix, const char *fmt, va_list args)
         if ( state->do_print )
         {
             if ( !state->continued )
-                printk_start_of_line(prefix);
-            __putstr(p);
-            __putstr("\n");
+                printk_start_of_line(&sink, prefix);
+            printk_puts(&sink, p);
+            printk_puts(&sink, "\n");
         }
         state->continued = 0;
         p = q + 1;
@@ -711,13 +924,20 @@ static void vprintk_common(const char *prefix, const char *fmt, va_list args)
         if ( state->do_print )
         {
             if ( !state->continued )
-                printk_start_of_line(prefix);
-            __putstr(p);
+                printk_start_of_line(&sink, prefix);
+            printk_puts(&sink, p);
         }
         state->continued = 1;
     }
 
-    spin_unlock_recursive(&console_lock);
+    if ( sink.pb )
+        printk_buf_commit(&sink);
+    else
+        spin_unlock_recursive(&console_lock);
+
+    if ( pb )
+        pb->busy = 0;
+
     local_irq_restore(flags);
 }
 
@@ -869,7 +1089,79 @@ void __init console_endboot(void)
 
     /* Serial input is directed to DOM0 by default. */
     switch_serial_input();
+
+    /* From now on, printk() output goes through the per-cpu buffers. */
+    printk_async = 1;
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct printk_buf *pb = per_cpu(printk_buf, cpu);
+    unsigned long flags;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        if ( pb )
+            break;
+        /* Without a buffer, the pcpu's printk()s are synchronous. */
+        pb = xzalloc(struct printk_buf);
+        if ( !pb )
+            break;
+        pb->size = 1U << fls(max(opt_printk_buffer, 2U * PRINTK_REC_MAX) - 1);
+        pb->data = xmalloc_bytes(pb->size);
+        if ( !pb->data )
+        {
+            xfree(pb);
+            break;
+        }
+        spin_lock_irqsave(&console_lock, flags);
+        per_cpu(printk_buf, cpu) = pb;
+        cpumask_set_cpu(cpu, &printk_buf_cpus);
+        spin_unlock_irqrestore(&console_lock, flags);
+        break;
+
+    case CPU_DEAD:
+    case CPU_UP_CANCELED:
+        if ( !pb )
+            break;
+        spin_lock_irqsave(&console_lock, flags);
+        console_flush_buffers();
+        cpumask_clear_cpu(cpu, &printk_buf_cpus);
+        per_cpu(printk_buf, cpu) = NULL;
+        spin_unlock_irqrestore(&console_lock, flags);
+        xfree(pb->data);
+        xfree(pb);
+        break;
+
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static int __init printk_buf_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    open_softirq(CONSOLE_SOFTIRQ, console_softirq);
+
+    if ( !opt_printk_buffer )
+        return 0;
+
+    cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&cpu_nfb);
+
+    return 0;
 }
+presmp_initcall(printk_buf_init);
 
 int __init console_has(const char *device)
 {
@@ -971,7 +1263,8 @@ int __printk_ratelimit(int ratelimit_ms, int ratelimit_burst)
             snprintf(lost_str, sizeof(lost_str), "%d", lost);
             /* console_lock may already be acquired by printk(). */
             spin_lock_recursive(&console_lock);
-            printk_start_of_line("(XEN) ");
+            console_flush_buffers();
+            printk_start_of_line(NULL, "(XEN) ");
             __putstr("printk: ");
             __putstr(lost_str);
             __putstr(" messages suppressed.\n");
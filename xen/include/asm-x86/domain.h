@@ -238,6 +238,7 @@ struct paging_vcpu {
 #define INVALID_ALTP2M  0xffff
 #define MAX_EPTP        (PAGE_SIZE / sizeof(uint64_t))
 struct p2m_domain;
+struct relmem_parallel;
 struct time_scale {
     int shift;
     u32 mul_frac;
@@ -304,12 +305,15 @@ struct arch_domain
         RELMEM_not_started,
         RELMEM_shared,
         RELMEM_xen,
+        RELMEM_parallel,
         RELMEM_l4,
         RELMEM_l3,
         RELMEM_l2,
         RELMEM_done,
     } relmem;
     struct page_list_head relmem_list;
+    /* Tasklet workers freeing pages during RELMEM_parallel. */
+    struct relmem_parallel *relmem_par;
 
     const struct arch_csw {
         void (*from)(struct vcpu *);
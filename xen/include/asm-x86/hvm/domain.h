@@ -168,6 +168,8 @@ struct hvm_domain {
 
     bool_t                 hap_enabled;
     bool_t                 mem_sharing_enabled;
+    /* VM fork: domain whose memory this one lazily populates from. */
+    struct domain         *fork_parent;
     bool_t                 qemu_mapcache_invalidate;
     bool_t                 is_s3_suspended;
 
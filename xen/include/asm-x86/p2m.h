@@ -27,6 +27,7 @@
 #define _XEN_ASM_X86_P2M_H
 
 #include <xen/paging.h>
+#include <xen/tasklet.h>
 #include <xen/p2m-common.h>
 #include <xen/mem_access.h>
 #include <asm/mem_sharing.h>
@@ -319,6 +320,17 @@ struct p2m_domain {
         unsigned long    reclaim_single; /* Last gpfn of a scan */
         unsigned long    max_guest;    /* gpfn of max guest demand-populate */
 
+        /*
+         * Background sweeping, topping up the cache ahead of demand.
+         * reclaim_super is the 2M aligned gpfn last looked at (0 when no
+         * pass is in progress); a pass which reclaims nothing holds off
+         * the next one until sweep_resume.
+         */
+        struct tasklet   sweep_tasklet;
+        unsigned long    reclaim_super;
+        unsigned long    sweep_reclaimed; /* # of pages reclaimed this pass */
+        s_time_t         sweep_resume;
+
         /*
          * Tracking of the most recently populated PoD pages, for eager
          * reclamation.
@@ -638,6 +650,9 @@ int p2m_add_foreign(struct domain *tdom, unsigned long fgfn,
  * Populate-on-demand
  */
 
+/* Initialise the populate-on-demand state of a p2m */
+void p2m_pod_init(struct p2m_domain *p2m);
+
 /* Dump PoD information about the domain */
 void p2m_pod_dump_data(struct domain *d);
 
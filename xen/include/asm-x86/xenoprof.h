@@ -44,6 +44,8 @@ int xenoprof_arch_init(int *num_events, char *cpu_type);
 int xenoprof_arch_counter(XEN_GUEST_HANDLE_PARAM(void) arg);
 int compat_oprof_arch_counter(XEN_GUEST_HANDLE_PARAM(void) arg);
 int xenoprof_arch_ibs_counter(XEN_GUEST_HANDLE_PARAM(void) arg);
+int xenoprof_arch_sampler_counter(unsigned int event, unsigned int unit_mask,
+                                  unsigned int count);
 
 struct vcpu;
 struct cpu_user_regs;
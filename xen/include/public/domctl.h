@@ -37,7 +37,7 @@
 #include "hvm/save.h"
 #include "memory.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000d
+#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000e
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -810,6 +810,17 @@ struct xen_domctl_gdbsx_domstatus {
 #define XEN_VM_EVENT_ENABLE               0
 #define XEN_VM_EVENT_DISABLE              1
 #define XEN_VM_EVENT_RESUME               2
+/*
+ * Monitor only: set up per-vCPU channels (see struct vm_event_slot in
+ * public/vm_event.h) instead of the ring.  The helper populates nr_frames
+ * frames at gfn in the target's physmap and maps them; Xen takes them over
+ * the same way it does the ring page, after which the helper removes them
+ * from the physmap again.  If nr_frames is too small for d->max_vcpus the
+ * call fails with ENOSPC and nr_frames is set to the number required.
+ * DISABLE tears the channels down; RESUME processes every FINISHED slot in
+ * one go, which is the batched alternative to notifying each slot's port.
+ */
+#define XEN_VM_EVENT_ENABLE_CHANNELS      3
 
 /*
  * Domain memory paging
@@ -873,6 +884,9 @@ struct xen_domctl_vm_event_op {
     uint32_t       mode;         /* XEN_DOMCTL_VM_EVENT_OP_* */
 
     uint32_t port;              /* OUT: event channel for ring */
+
+    uint32_t nr_frames;         /* IN/OUT: ENABLE_CHANNELS slot frames */
+    uint64_aligned_t gfn;       /* IN: ENABLE_CHANNELS first slot frame */
 };
 typedef struct xen_domctl_vm_event_op xen_domctl_vm_event_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_vm_event_op_t);
@@ -881,14 +895,32 @@ DEFINE_XEN_GUEST_HANDLE(xen_domctl_vm_event_op_t);
  * Memory sharing operations
  */
 /* XEN_DOMCTL_mem_sharing_op.
- * The CONTROL sub-domctl is used for bringup/teardown. */
+ * The CONTROL sub-domctl is used for bringup/teardown.
+ *
+ * FORK turns the target domain into a copy-on-write clone of
+ * parent_domain.  The target must be a freshly created HVM domain with no
+ * memory and the same number of vcpus as the parent, and the parent must
+ * be paused by the toolstack for as long as the fork exists.  vcpu and HVM
+ * context are copied immediately; guest memory is populated lazily from
+ * the parent on first access (shared for reads, copied for writes).
+ *
+ * FORK_RESET discards every page the fork has populated privately and
+ * reloads the vcpu and HVM context from the parent, returning the fork to
+ * the state it had right after FORK.  Pages still shared with the parent
+ * are kept. */
 #define XEN_DOMCTL_MEM_SHARING_CONTROL          0
+#define XEN_DOMCTL_MEM_SHARING_FORK             1
+#define XEN_DOMCTL_MEM_SHARING_FORK_RESET       2
 
 struct xen_domctl_mem_sharing_op {
     uint8_t op; /* XEN_DOMCTL_MEM_SHARING_* */
 
     union {
         uint8_t enable;                   /* CONTROL */
+        struct {
+            domid_t parent_domain;        /* IN: parent's domain id */
+            uint16_t pad[3];              /* Must be zero */
+        } fork;                           /* FORK */
     } u;
 };
 typedef struct xen_domctl_mem_sharing_op xen_domctl_mem_sharing_op_t;
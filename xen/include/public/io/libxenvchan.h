@@ -57,6 +57,26 @@ struct ring_shared {
 #define VCHAN_NOTIFY_WRITE 0x1
 #define VCHAN_NOTIFY_READ 0x2
 
+/*
+ * Ring resize handshake.  These bits share srv_notify with the notification
+ * bits above, and like them are only changed with atomic operations.
+ *
+ * The server offers new rings by granting a page holding a struct
+ * vchan_resize, storing its grant reference in the grants[] slot following
+ * those of the current rings, and setting VCHAN_RESIZE_PENDING.  Each writer
+ * waits for its current ring to drain, then moves to the new ring (keeping
+ * the same prod/cons indexes) and says so with VCHAN_RESIZE_LEFT or
+ * VCHAN_RESIZE_RIGHT.  A reader which sees its peer's bit knows no data is
+ * left in the old ring and moves too.  Once the client uses both new rings it
+ * sets VCHAN_RESIZE_ACK; the server then rewrites the orders and grants
+ * above to describe the new rings and clears all of these bits.
+ */
+#define VCHAN_RESIZE_CAPABLE 0x04 /* client: supports ring resize */
+#define VCHAN_RESIZE_PENDING 0x08 /* server: new rings are offered */
+#define VCHAN_RESIZE_RIGHT 0x10   /* server: writing to the new right ring */
+#define VCHAN_RESIZE_LEFT 0x20    /* client: writing to the new left ring */
+#define VCHAN_RESIZE_ACK 0x40     /* client: using both new rings */
+
 /**
  * vchan_interface: primary shared data structure
  */
@@ -99,3 +119,12 @@ struct vchan_interface {
 	uint32_t grants[0];
 };
 
+/**
+ * vchan_resize: new rings offered while VCHAN_RESIZE_PENDING is set.
+ * Both orders are at least 12; the grant list is ordered left, right.
+ */
+struct vchan_resize {
+	uint16_t left_order, right_order;
+	uint32_t grants[0];
+};
+
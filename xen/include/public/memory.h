@@ -480,9 +480,11 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_access_op_t);
 #define XENMEM_sharing_op_add_physmap       6
 #define XENMEM_sharing_op_audit             7
 #define XENMEM_sharing_op_range_share       8
+#define XENMEM_sharing_op_batch             9
 
 #define XENMEM_SHARING_OP_S_HANDLE_INVALID  (-10)
 #define XENMEM_SHARING_OP_C_HANDLE_INVALID  (-9)
+#define XENMEM_SHARING_OP_CONTENT_MISMATCH  (-8)
 
 /* The following allows sharing of grant refs. This is useful
  * for sharing utilities sitting as "filters" in IO backends
@@ -497,6 +499,37 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_access_op_t);
 #define XENMEM_SHARING_OP_FIELD_GET_GREF(field)        \
     ((field) & (~XENMEM_SHARING_OP_FIELD_IS_GREF_FLAG))
 
+/*
+ * XENMEM_sharing_op_batch operates on an array of gfns of the domain named
+ * in the op, reporting the outcome for each in the entry's rc field.  The
+ * op itself only fails for errors affecting the whole batch.
+ *
+ * Without flags each gfn is nominated, and its handle returned.
+ * With XENMEM_SHARING_BATCH_SHARE each gfn is additionally shared with
+ * client_gfn of client_domain, nominating the latter as needed; adding
+ * XENMEM_SHARING_BATCH_VERIFY compares the contents of the two pages first,
+ * failing mismatching entries with XENMEM_SHARING_OP_CONTENT_MISMATCH.
+ * XENMEM_SHARING_BATCH_HASH instead only computes a hash of each gfn's
+ * contents, as a hint for finding sharing candidates without mapping guest
+ * memory; it changes no state, fails gfns that are not populated RAM with
+ * -EINVAL, and can't be combined with other flags.
+ */
+#define XENMEM_SHARING_BATCH_SHARE          (1U << 0)
+#define XENMEM_SHARING_BATCH_VERIFY         (1U << 1)
+#define XENMEM_SHARING_BATCH_HASH           (1U << 2)
+
+struct xen_mem_sharing_batch_entry {
+    uint64_aligned_t gfn;           /* IN: the gfn of the source page */
+    uint64_aligned_t client_gfn;    /* IN: the client gfn (SHARE) */
+    uint64_aligned_t handle;        /* OUT: handle of the source page */
+    uint64_aligned_t hash;          /* OUT: content hash (HASH) */
+    domid_t  client_domain;         /* IN: the client domain id (SHARE) */
+    uint16_t _pad;                  /* Must be set to 0 */
+    int32_t  rc;                    /* OUT: 0 or negative error code */
+};
+typedef struct xen_mem_sharing_batch_entry xen_mem_sharing_batch_entry_t;
+DEFINE_XEN_GUEST_HANDLE(xen_mem_sharing_batch_entry_t);
+
 struct xen_mem_sharing_op {
     uint8_t     op;     /* XENMEM_sharing_op_* */
     domid_t     domain;
@@ -523,6 +556,12 @@ struct xen_mem_sharing_op {
             domid_t client_domain;           /* IN: the client domain id */
             uint16_t _pad[3];                /* Must be set to 0 */
         } range;
+        struct mem_sharing_op_batch {         /* OP_BATCH */
+            XEN_GUEST_HANDLE_64(xen_mem_sharing_batch_entry_t) entries;
+            uint32_t nr_entries;             /* IN: number of entries */
+            uint32_t flags;                  /* IN: XENMEM_SHARING_BATCH_* */
+            uint64_aligned_t opaque;         /* Must be set to 0 */
+        } batch;
         struct mem_sharing_op_debug {     /* OP_DEBUG_xxx */
             union {
                 uint64_aligned_t gfn;      /* IN: gfn to debug          */
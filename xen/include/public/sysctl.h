@@ -36,7 +36,7 @@
 #include "physdev.h"
 #include "tmem.h"
 
-#define XEN_SYSCTL_INTERFACE_VERSION 0x0000000F
+#define XEN_SYSCTL_INTERFACE_VERSION 0x00000010
 
 /*
  * Read console content from Xen buffer ring.
@@ -163,6 +163,37 @@ struct xen_sysctl_getdomaininfolist {
 typedef struct xen_sysctl_getdomaininfolist xen_sysctl_getdomaininfolist_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_getdomaininfolist_t);
 
+/*
+ * XEN_SYSCTL_getvcpuinfolist
+ * What XEN_DOMCTL_getvcpuinfo returns, for all vcpus of many domains at
+ * once.  Only whole domains are returned: next_domain is the first domain
+ * whose vcpus did not fit in the buffer, or DOMID_INVALID if none are left.
+ */
+struct xen_sysctl_vcpuinfo {
+    domid_t  domid;
+    uint16_t vcpu;
+    uint8_t  online;                  /* currently online (not hotplugged)? */
+    uint8_t  blocked;                 /* blocked waiting for an event? */
+    uint8_t  running;                 /* currently scheduled on its CPU? */
+    uint8_t  pad;
+    uint32_t cpu;                     /* current mapping   */
+    uint32_t pad2;
+    uint64_aligned_t cpu_time;        /* total cpu time consumed (ns) */
+};
+typedef struct xen_sysctl_vcpuinfo xen_sysctl_vcpuinfo_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_vcpuinfo_t);
+struct xen_sysctl_getvcpuinfolist {
+    /* IN variables. */
+    domid_t               first_domain;
+    uint32_t              max_vcpus;
+    XEN_GUEST_HANDLE_64(xen_sysctl_vcpuinfo_t) buffer;
+    /* OUT variables. */
+    uint32_t              num_vcpus;
+    domid_t               next_domain;
+};
+typedef struct xen_sysctl_getvcpuinfolist xen_sysctl_getvcpuinfolist_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_getvcpuinfolist_t);
+
 /* Inject debug keys into Xen. */
 /* XEN_SYSCTL_debug_keys */
 struct xen_sysctl_debug_keys {
@@ -436,10 +467,22 @@ struct xen_sysctl_page_offline_op {
 /* Sub-operations: */
 #define XEN_SYSCTL_LOCKPROF_reset 1   /* Reset all profile data to zero. */
 #define XEN_SYSCTL_LOCKPROF_query 2   /* Get lock profile information. */
+#define XEN_SYSCTL_LOCKPROF_enable 3  /* Start profiling. */
+#define XEN_SYSCTL_LOCKPROF_disable 4 /* Stop profiling. */
 /* Record-type: */
 #define LOCKPROF_TYPE_GLOBAL      0   /* global lock, idx meaningless */
 #define LOCKPROF_TYPE_PERDOM      1   /* per-domain lock, idx is domid */
 #define LOCKPROF_TYPE_N           2   /* number of types */
+/* Bucket n of the wait histogram counts waits of [2^n, 2^(n+1)) nsecs. */
+#define LOCKPROF_HIST_BUCKETS     32
+#define LOCKPROF_CALLERS          4   /* call sites reported per lock */
+struct xen_sysctl_lockprof_caller {
+    uint64_aligned_t addr;         /* return address of the lock call */
+    uint64_aligned_t block_cnt;    /* # of wait for lock from there */
+    uint64_aligned_t block_time;   /* nsecs waited for lock from there */
+    char     symbol[48];   /* "function+0xoffset", if known */
+};
+typedef struct xen_sysctl_lockprof_caller xen_sysctl_lockprof_caller_t;
 struct xen_sysctl_lockprof_data {
     char     name[40];     /* lock name (may include up to 2 %d specifiers) */
     int32_t  type;         /* LOCKPROF_TYPE_??? */
@@ -448,6 +491,13 @@ struct xen_sysctl_lockprof_data {
     uint64_aligned_t block_cnt;    /* # of wait for lock */
     uint64_aligned_t lock_time;    /* nsecs lock held */
     uint64_aligned_t block_time;   /* nsecs waited for lock */
+    uint64_aligned_t block_hist[LOCKPROF_HIST_BUCKETS];
+    /*
+     * The call sites which waited most often, unused ones with addr 0.
+     * Counts are upper bounds: a new call site replaces the one with the
+     * fewest waits and takes over its counts.
+     */
+    xen_sysctl_lockprof_caller_t callers[LOCKPROF_CALLERS];
 };
 typedef struct xen_sysctl_lockprof_data xen_sysctl_lockprof_data_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lockprof_data_t);
@@ -457,6 +507,8 @@ struct xen_sysctl_lockprof_op {
     uint32_t       max_elem;          /* size of output buffer */
     /* OUT variables (query only). */
     uint32_t       nr_elem;           /* number of elements available */
+    uint8_t        enabled;           /* profiling is enabled (all cmds) */
+    uint8_t        pad[3];
     uint64_aligned_t time;            /* nsecs of profile measurement */
     /* profile information (or NULL) */
     XEN_GUEST_HANDLE_64(xen_sysctl_lockprof_data_t) data;
@@ -1095,6 +1147,103 @@ struct xen_sysctl_livepatch_op {
 typedef struct xen_sysctl_livepatch_op xen_sysctl_livepatch_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_livepatch_op_t);
 
+/*
+ * XEN_SYSCTL_lat_hist_op
+ *
+ * Log2 histograms of the time Xen spends handling hypercalls and HVM
+ * vmexits.  Bucket n counts events handled in [2^n, 2^(n+1)) ns; bucket 0
+ * also counts anything quicker, and the last bucket anything slower.
+ *
+ * Histograms are kept host-wide per hypercall number and per exit reason,
+ * and per domain for all of its hypercalls and all of its exits.  Exit
+ * reasons are the vendor's: the VMX basic exit reason or the SVM exit code,
+ * with SVM's nested page fault exit (0x400) reported as XEN_LAT_HIST_SVM_NPF.
+ */
+#define XEN_LAT_HIST_BUCKETS        32
+#define XEN_LAT_HIST_HYPERCALLS     64
+#define XEN_LAT_HIST_EXITS          144
+#define XEN_LAT_HIST_SVM_NPF        (XEN_LAT_HIST_EXITS - 1)
+
+/* The histograms of a domain, indexed by the kind of event. */
+#define XEN_LAT_HIST_HYPERCALL      0
+#define XEN_LAT_HIST_VMEXIT         1
+#define XEN_LAT_HIST_NR_KINDS       2
+
+#define XEN_SYSCTL_LAT_HIST_query   0   /* Get histograms. */
+#define XEN_SYSCTL_LAT_HIST_reset   1   /* Zero all histograms. */
+#define XEN_SYSCTL_LAT_HIST_enable  2   /* Start recording. */
+#define XEN_SYSCTL_LAT_HIST_disable 3   /* Stop recording. */
+struct xen_sysctl_lat_hist_op {
+    uint32_t cmd;                   /* IN: XEN_SYSCTL_LAT_HIST_* */
+    uint8_t  enabled;               /* OUT: recording is on */
+    uint8_t  pad;
+    domid_t  domid;                 /* IN: query: a domain, or DOMID_XEN */
+    uint32_t nr_hists;              /* IN: room in hist, in histograms */
+                                    /* OUT: histograms available */
+    uint32_t pad2;
+    /*
+     * OUT: for DOMID_XEN, XEN_LAT_HIST_HYPERCALLS per-hypercall histograms
+     * followed by XEN_LAT_HIST_EXITS per-exit-reason ones; for a domain,
+     * XEN_LAT_HIST_NR_KINDS histograms.  Each is XEN_LAT_HIST_BUCKETS
+     * counts.  May be NULL to only query nr_hists.
+     */
+    XEN_GUEST_HANDLE_64(uint64) hist;
+};
+typedef struct xen_sysctl_lat_hist_op xen_sysctl_lat_hist_op_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_lat_hist_op_t);
+
+/*
+ * XEN_SYSCTL_sampler_op
+ *
+ * Statistical profiling of Xen and its guests.  A performance counter
+ * raises an NMI every @period events, which records the interrupted pcpu,
+ * vcpu and instruction pointer in a buffer of the pcpu.  The PMU is shared
+ * with xenoprof and the vPMU, so neither can be used while sampling.
+ *
+ * Samples not read when sampling is restarted are dropped.  Once stopped,
+ * the buffers are freed by the first read which finds them empty.
+ */
+#define XEN_SYSCTL_SAMPLER_start    0   /* Start sampling. */
+#define XEN_SYSCTL_SAMPLER_stop     1   /* Stop sampling. */
+#define XEN_SYSCTL_SAMPLER_read     2   /* Move samples to @samples. */
+#define XEN_SYSCTL_SAMPLER_symbol   3   /* Name the Xen symbol at @addr. */
+
+#define XEN_SAMPLE_MODE_user        0
+#define XEN_SAMPLE_MODE_kernel      1
+#define XEN_SAMPLE_MODE_xen         2
+
+#define XEN_SAMPLER_NAME_LEN        64
+
+struct xen_sysctl_sample {
+    uint64_aligned_t pc;            /* Instruction pointer */
+    uint64_aligned_t symbol;        /* Xen mode: start of pc's symbol */
+    domid_t  domid;                 /* DOMID_IDLE for the idle vcpus */
+    uint16_t vcpu;
+    uint16_t cpu;
+    uint8_t  mode;                  /* XEN_SAMPLE_MODE_* */
+    uint8_t  pad;
+};
+typedef struct xen_sysctl_sample xen_sysctl_sample_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_sample_t);
+
+struct xen_sysctl_sampler_op {
+    uint32_t cmd;                   /* IN: XEN_SYSCTL_SAMPLER_* */
+    uint32_t event;                 /* IN: start: PMU event, 0 for cycles */
+    uint32_t unit_mask;             /* IN: start: PMU event unit mask */
+    uint32_t period;                /* IN: start: events per sample, or 0 */
+    uint32_t buf_samples;           /* IN: start: samples per pcpu, or 0 */
+    uint32_t nr_samples;            /* IN: read: room in @samples */
+                                    /* OUT: read: samples copied */
+    uint8_t  running;               /* OUT: sampling is on */
+    uint8_t  pad[7];
+    uint64_aligned_t lost;          /* OUT: read: samples dropped so far */
+    uint64_aligned_t addr;          /* IN: symbol */
+    char     name[XEN_SAMPLER_NAME_LEN]; /* OUT: symbol: "" if none */
+    XEN_GUEST_HANDLE_64(xen_sysctl_sample_t) samples; /* IN: read */
+};
+typedef struct xen_sysctl_sampler_op xen_sysctl_sampler_op_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_sampler_op_t);
+
 struct xen_sysctl {
     uint32_t cmd;
 #define XEN_SYSCTL_readconsole                    1
@@ -1123,6 +1272,9 @@ struct xen_sysctl {
 #define XEN_SYSCTL_get_cpu_levelling_caps        25
 #define XEN_SYSCTL_get_cpu_featureset            26
 #define XEN_SYSCTL_livepatch_op                  27
+#define XEN_SYSCTL_lat_hist_op                   28
+#define XEN_SYSCTL_getvcpuinfolist               29
+#define XEN_SYSCTL_sampler_op                    30
     uint32_t interface_version; /* XEN_SYSCTL_INTERFACE_VERSION */
     union {
         struct xen_sysctl_readconsole       readconsole;
@@ -1151,6 +1303,9 @@ struct xen_sysctl {
         struct xen_sysctl_cpu_levelling_caps cpu_levelling_caps;
         struct xen_sysctl_cpu_featureset    cpu_featureset;
         struct xen_sysctl_livepatch_op      livepatch;
+        struct xen_sysctl_lat_hist_op       lat_hist;
+        struct xen_sysctl_getvcpuinfolist   getvcpuinfolist;
+        struct xen_sysctl_sampler_op        sampler;
         uint8_t                             pad[128];
     } u;
 };
@@ -362,6 +362,36 @@ typedef struct vm_event_st {
 
 DEFINE_RING_TYPES(vm_event, vm_event_request_t, vm_event_response_t);
 
+/*
+ * Per-vCPU channels (monitor only, see XEN_VM_EVENT_ENABLE_CHANNELS).
+ *
+ * Each vCPU owns one slot and one event channel, so vCPUs raising events
+ * never contend on a shared ring.  A vCPU writes its request into its slot,
+ * moves the slot to SUBMITTED and notifies the slot's port.  The helper
+ * writes the response over the request, moves the slot to FINISHED and
+ * either notifies the slot's port, which handles that slot only, or issues
+ * XEN_VM_EVENT_RESUME, which handles every FINISHED slot at once.  Every
+ * request must be answered, including ones without VM_EVENT_FLAG_VCPU_PAUSED,
+ * as the vCPU cannot raise another event until its slot is IDLE again.
+ *
+ * Slots are packed into 4k frames and never straddle a frame boundary; slot
+ * i lives in frame i / VM_EVENT_SLOTS_PER_FRAME.
+ */
+#define VM_EVENT_SLOT_STATE_IDLE         0
+#define VM_EVENT_SLOT_STATE_SUBMITTED    1
+#define VM_EVENT_SLOT_STATE_FINISHED     2
+
+struct vm_event_slot {
+    uint32_t state;     /* VM_EVENT_SLOT_STATE_* */
+    uint32_t port;      /* Set by Xen: event channel for this slot */
+    union {
+        vm_event_request_t req;
+        vm_event_response_t rsp;
+    } u;
+};
+
+#define VM_EVENT_SLOTS_PER_FRAME (4096 / sizeof(struct vm_event_slot))
+
 #endif /* defined(__XEN__) || defined(__XEN_TOOLS__) */
 #endif /* _XEN_PUBLIC_VM_EVENT_H */
 
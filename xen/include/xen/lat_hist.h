@@ -0,0 +1,67 @@
+/******************************************************************************
+ * lat_hist.h
+ *
+ * Histograms of the time spent handling hypercalls and vmexits.
+ */
+
+#ifndef __XEN_LAT_HIST_H__
+#define __XEN_LAT_HIST_H__
+
+#include <xen/lib.h>
+#include <xen/time.h>
+#include <public/sysctl.h>
+
+struct vcpu;
+
+#ifdef CONFIG_LAT_HIST
+
+struct lat_hist_vcpu {
+    uint64_t hist[XEN_LAT_HIST_NR_KINDS][XEN_LAT_HIST_BUCKETS];
+};
+
+extern bool lat_hist_enabled;
+
+/* Start timing an event; 0 when not recording. */
+static inline s_time_t lat_hist_start(void)
+{
+    return unlikely(lat_hist_enabled) ? NOW() : 0;
+}
+
+void lat_hist_record(struct vcpu *v, unsigned int kind, unsigned int nr,
+                     s_time_t start);
+
+static inline void lat_hist_hypercall(struct vcpu *v, unsigned long nr,
+                                      s_time_t start)
+{
+    if ( unlikely(start) )
+        lat_hist_record(v, XEN_LAT_HIST_HYPERCALL,
+                        min_t(unsigned long, nr, XEN_LAT_HIST_HYPERCALLS - 1),
+                        start);
+}
+
+static inline void lat_hist_vmexit(struct vcpu *v, unsigned long reason,
+                                   s_time_t start)
+{
+    if ( unlikely(start) )
+        lat_hist_record(v, XEN_LAT_HIST_VMEXIT,
+                        min_t(unsigned long, reason, XEN_LAT_HIST_EXITS - 1),
+                        start);
+}
+
+int lat_hist_init_vcpu(struct vcpu *v);
+void lat_hist_destroy_vcpu(struct vcpu *v);
+int lat_hist_control(struct xen_sysctl_lat_hist_op *op);
+
+#else
+
+static inline s_time_t lat_hist_start(void) { return 0; }
+static inline void lat_hist_hypercall(struct vcpu *v, unsigned long nr,
+                                      s_time_t start) {}
+static inline void lat_hist_vmexit(struct vcpu *v, unsigned long reason,
+                                   s_time_t start) {}
+static inline int lat_hist_init_vcpu(struct vcpu *v) { return 0; }
+static inline void lat_hist_destroy_vcpu(struct vcpu *v) {}
+
+#endif /* CONFIG_LAT_HIST */
+
+#endif /* __XEN_LAT_HIST_H__ */
@@ -542,6 +542,7 @@ static inline unsigned int get_order_from_pages(unsigned long nr_pages)
 }
 
 void scrub_one_page(struct page_info *);
+bool page_is_zero(const void *va);
 
 #ifndef arch_free_heap_page
 #define arch_free_heap_page(d, pg)                      \
@@ -263,6 +263,11 @@ struct vcpu
 
     struct evtchn_fifo_vcpu *evtchn_fifo;
 
+#ifdef CONFIG_LAT_HIST
+    /* Time spent handling this vcpu's hypercalls and vmexits. */
+    struct lat_hist_vcpu *lat_hist;
+#endif
+
     struct arch_vcpu arch;
 };
 
@@ -271,6 +276,8 @@ struct vcpu
 #define domain_unlock(d) spin_unlock_recursive(&(d)->domain_lock)
 
 /* VM event */
+struct vm_event_channels;
+
 struct vm_event_domain
 {
     /* ring lock */
@@ -293,6 +300,8 @@ struct vm_event_domain
     unsigned int blocked;
     /* The last vcpu woken up */
     unsigned int last_vcpu_wake_up;
+    /* per-vCPU channels, used instead of the ring when set up */
+    struct vm_event_channels *channels;
 };
 
 struct vm_event_per_domain
@@ -8,6 +8,7 @@ enum {
     NEW_TLBFLUSH_CLOCK_PERIOD_SOFTIRQ,
     RCU_SOFTIRQ,
     TASKLET_SOFTIRQ,
+    CONSOLE_SOFTIRQ,
     NR_COMMON_SOFTIRQS
 };
 
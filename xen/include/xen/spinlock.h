@@ -60,6 +60,12 @@ struct lock_debug { };
 
 struct spinlock;
 
+struct lock_profile_caller {
+    const void          *pc;         /* return address of the lock call */
+    u64                 block_cnt;   /* # of wait for lock from there */
+    s64                 time_block;  /* cumulated wait time from there */
+};
+
 struct lock_profile {
     struct lock_profile *next;       /* forward link */
     char                *name;       /* lock name */
@@ -68,7 +74,9 @@ struct lock_profile {
     u64                 block_cnt;   /* # of complete wait for lock */
     s64                 time_hold;   /* cumulated lock time */
     s64                 time_block;  /* cumulated wait time */
-    s64                 time_locked; /* system time of last locking */
+    s64                 time_locked; /* system time of last locking, or 0 */
+    u64                 block_hist[LOCKPROF_HIST_BUCKETS]; /* wait times */
+    struct lock_profile_caller callers[LOCKPROF_CALLERS];
 };
 
 struct lock_profile_qhead {
@@ -29,6 +29,7 @@
 #define XENOPROF_COUNTERS_RESERVED 2
 #define XENOPROF_READY             3
 #define XENOPROF_PROFILING         4
+#define XENOPROF_SAMPLING          5    /* XEN_SYSCTL_sampler_op */
 
 #ifndef CONFIG_COMPAT
 typedef struct xenoprof_buf xenoprof_buf_t;
@@ -83,6 +84,9 @@ int xenoprof_add_trace(struct vcpu *, uint64_t pc, int mode);
 void xenoprof_log_event(struct vcpu *, const struct cpu_user_regs *,
                         uint64_t pc, int mode, int event);
 
+struct xen_sysctl_sampler_op;
+int xenoprof_sampler_control(struct xen_sysctl_sampler_op *op);
+
 #else
 static inline int acquire_pmu_ownership(int pmu_ownership)
 {
@@ -760,6 +760,7 @@ static int flask_sysctl(int cmd)
     /* These have individual XSM hooks */
     case XEN_SYSCTL_readconsole:
     case XEN_SYSCTL_getdomaininfolist:
+    case XEN_SYSCTL_getvcpuinfolist:
     case XEN_SYSCTL_page_offline_op:
     case XEN_SYSCTL_scheduler_op:
 #ifdef CONFIG_X86
@@ -774,6 +775,8 @@ static int flask_sysctl(int cmd)
         return domain_has_xen(current->domain, XEN__GETSCHEDULER);
 
     case XEN_SYSCTL_perfc_op:
+    case XEN_SYSCTL_lat_hist_op:
+    case XEN_SYSCTL_sampler_op:
         return domain_has_xen(current->domain, XEN__PERFCONTROL);
 
     case XEN_SYSCTL_debug_keys: